@@ -0,0 +1,1205 @@
+#include "archive.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/rand.h>
+#include <zdict.h>
+#include <zstd.h>
+
+#include "bench.h"
+#include "bufout.h"
+#include "pool.h"
+#include "seal.h"
+#include "wal.h"
+
+#define PACK_MAGIC "TFSPAK1"
+#define PACK_DICT 0x1
+#define PACK_SEALED 0x2
+#define PACK_DEPTH 64
+#define SAMPLE_BUDGET (100 * ARCHIVE_DICT_SIZE)
+#define STREAM_BUF (128 * 1024)
+#define SEAL_SEGMENT (256 * 1024)
+#define SEAL_BATCH 16           /* segments sealed together while packing */
+
+enum { ENTRY_FILE, ENTRY_DIR, ENTRY_SYMLINK };
+enum { CODEC_STORED, CODEC_ZSTD, CODEC_ZSTD_DICT };
+
+struct pack_header {
+    char magic[8];
+    uint32_t flags;
+    uint32_t dict_len;
+    uint64_t count;
+    uint64_t toc_off, toc_len;
+    uint64_t raw_bytes;
+};
+
+/*
+ * Follows the header in sealed packs. The region after it -- dictionary,
+ * entry data, table of contents and a pack_tail -- is sealed in seg_size
+ * segments, whose tags follow the region. The pack key is derived from
+ * the header and this block less the fields only known at the end
+ * (toc_off, toc_len, raw_bytes, region_len), so altering the rest fails
+ * every segment. Those are checked against the sealed tail instead;
+ * region_len is bound by the last-segment flag.
+ */
+struct pack_seal {
+    uint32_t cipher, seg_size;
+    uint8_t salt[SEAL_SALT];
+    uint64_t region_off, region_len;
+};
+
+/* Ends the sealed region, after the table of contents. */
+struct pack_tail {
+    uint64_t toc_off, raw_bytes;
+};
+
+/* Table of contents entry, followed by path_len bytes of relative path. */
+struct pack_entry {
+    uint64_t off, csize, size;
+    int64_t mtime_ns;
+    uint32_t mode, crc;     /* crc32c of the uncompressed data */
+    uint16_t path_len;
+    uint8_t type, codec;
+    uint32_t reserved;
+};
+
+struct item {
+    uint32_t path;          /* offset into the path arena */
+    uint8_t type;
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime_ns;
+};
+
+struct tree {
+    struct item *items;
+    size_t n, cap;
+    char *arena;
+    size_t len, acap;
+};
+
+static int push_item(struct tree *t, const char *path, const struct stat *st)
+{
+    size_t len = strlen(path) + 1;
+
+    if (len > UINT16_MAX)
+        return -1;
+    if (t->n == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 1024;
+        struct item *p = realloc(t->items, cap * sizeof(*p));
+
+        if (!p)
+            return -1;
+        t->items = p;
+        t->cap = cap;
+    }
+    if (t->len + len > t->acap) {
+        size_t cap = t->acap ? t->acap * 2 : 65536;
+        char *p;
+
+        while (cap < t->len + len)
+            cap *= 2;
+        p = realloc(t->arena, cap);
+        if (!p)
+            return -1;
+        t->arena = p;
+        t->acap = cap;
+    }
+    memcpy(t->arena + t->len, path, len);
+    t->items[t->n].path = (uint32_t)t->len;
+    t->items[t->n].type = S_ISDIR(st->st_mode) ? ENTRY_DIR
+                        : S_ISLNK(st->st_mode) ? ENTRY_SYMLINK : ENTRY_FILE;
+    t->items[t->n].mode = st->st_mode & 07777;
+    t->items[t->n].size = st->st_size;
+    t->items[t->n].mtime_ns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    t->len += len;
+    t->n++;
+    return 0;
+}
+
+/* Preorder, so a directory always comes before what it holds. */
+static int collect(struct tree *t, int dirfd, const char *prefix, int depth)
+{
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+    char path[4096];
+    int rc = 0;
+
+    if (!d) {
+        close(dirfd);
+        return -1;
+    }
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+            continue;
+        if ((size_t)snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "",
+                             de->d_name) >= sizeof(path))
+            continue;
+        rc = push_item(t, path, &st);
+        if (rc == 0 && S_ISDIR(st.st_mode) && depth < PACK_DEPTH) {
+            int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (fd >= 0)
+                rc = collect(t, fd, path, depth + 1);
+        }
+    }
+    closedir(d);
+    return rc;
+}
+
+static void free_tree(struct tree *t)
+{
+    free(t->items);
+    free(t->arena);
+}
+
+static ssize_t read_at(int dirfd, const char *path, void *buf, size_t n)
+{
+    int fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    size_t got = 0;
+
+    if (fd < 0)
+        return -1;
+    while (got < n) {
+        ssize_t r = read(fd, (char *)buf + got, n - got);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        got += r;
+    }
+    close(fd);
+    return got;
+}
+
+struct samples {
+    char *buf;
+    size_t len, cap;
+    size_t *sizes;
+    unsigned n, ncap;
+};
+
+static int add_sample(struct samples *s, int dirfd, const char *path, size_t size)
+{
+    ssize_t r;
+
+    if (size == 0 || s->len + size > SAMPLE_BUDGET)
+        return 0;
+    if (s->n == s->ncap) {
+        unsigned cap = s->ncap ? s->ncap * 2 : 1024;
+        size_t *p = realloc(s->sizes, cap * sizeof(*p));
+
+        if (!p)
+            return -1;
+        s->sizes = p;
+        s->ncap = cap;
+    }
+    if (!s->buf && !(s->buf = malloc(s->cap = SAMPLE_BUDGET)))
+        return -1;
+    r = read_at(dirfd, path, s->buf + s->len, size);
+    if (r > 0) {
+        s->sizes[s->n++] = r;
+        s->len += r;
+    }
+    return 0;
+}
+
+/* Take an even spread of the small files until the sample budget is spent. */
+static void sample_tree(struct samples *s, int dirfd, const struct tree *t)
+{
+    uint64_t small = 0, stride;
+    size_t i;
+
+    for (i = 0; i < t->n; i++)
+        if (t->items[i].type == ENTRY_FILE && t->items[i].size <= ARCHIVE_SMALL)
+            small += t->items[i].size;
+    stride = small > SAMPLE_BUDGET - s->len ? small / (SAMPLE_BUDGET - s->len + 1) + 1 : 1;
+    for (i = 0; i < t->n; i++) {
+        const struct item *it = &t->items[i];
+
+        if (it->type != ENTRY_FILE || it->size > ARCHIVE_SMALL || i % stride)
+            continue;
+        add_sample(s, dirfd, t->arena + it->path, it->size);
+    }
+}
+
+static void *train(const char *dir, const struct tree *t, const struct archive_opts *o,
+                   size_t *len)
+{
+    struct samples s;
+    void *dict = NULL;
+    size_t i, r;
+    int fd;
+
+    memset(&s, 0, sizeof(s));
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        sample_tree(&s, fd, t);
+        close(fd);
+    }
+    /* Prefix scope: top up from the sibling folders. */
+    for (i = 0; i < o->nsample_dirs && s.len < SAMPLE_BUDGET / 2; i++) {
+        struct tree other;
+
+        memset(&other, 0, sizeof(other));
+        fd = open(o->sample_dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (collect(&other, dup(fd), "", 0) == 0)
+            sample_tree(&s, fd, &other);
+        close(fd);
+        free_tree(&other);
+    }
+    /* zstd needs a handful of samples to find anything worth keeping. */
+    if (s.n >= 16 && (dict = malloc(ARCHIVE_DICT_SIZE))) {
+        r = ZDICT_trainFromBuffer(dict, ARCHIVE_DICT_SIZE, s.buf, s.sizes, s.n);
+        if (ZDICT_isError(r)) {
+            free(dict);
+            dict = NULL;
+        } else {
+            *len = r;
+        }
+    }
+    free(s.buf);
+    free(s.sizes);
+    return dict;
+}
+
+struct seal_job {
+    struct seal s;
+    uint8_t *region, *tags;
+    uint8_t *opened;        /* unsealing: segments already done */
+    uint64_t len, nseg, first;
+    uint64_t base;          /* region offset that region points at */
+    uint32_t seg;
+    int enc, failed;
+};
+
+/* The key context, with the fields only known once the pack is written zeroed. */
+static int seal_job_init(struct seal_job *j, const struct pack_header *h,
+                         const struct pack_seal *ps, const uint8_t *key)
+{
+    uint8_t context[sizeof(*h) + sizeof(*ps)];
+    struct pack_header hc = *h;
+    struct pack_seal pc = *ps;
+
+    hc.toc_off = hc.toc_len = hc.raw_bytes = 0;
+    pc.region_len = 0;
+    memcpy(context, &hc, sizeof(hc));
+    memcpy(context + sizeof(hc), &pc, sizeof(pc));
+    j->seg = ps->seg_size;
+    j->len = ps->region_len;
+    /* An empty region still gets one segment, so the header is checked. */
+    j->nseg = j->len ? (j->len + j->seg - 1) / j->seg : 1;
+    return seal_init(&j->s, ps->cipher, key, context, sizeof(context));
+}
+
+static void seal_job_one(size_t i, void *arg)
+{
+    struct seal_job *j = arg;
+    uint64_t k = j->first + i, off = k * j->seg;
+    int last = k + 1 == j->nseg, rc;
+    size_t len = last ? j->len - off : j->seg;
+    uint8_t *p = j->region + (off - j->base);
+
+    if (j->opened && j->opened[k])
+        return;
+    rc = j->enc ? seal_segment(&j->s, k, last, p, len, j->tags + k * SEAL_TAG)
+                : unseal_segment(&j->s, k, last, p, len, j->tags + k * SEAL_TAG);
+    if (rc != 0)
+        __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+    else if (j->opened)
+        j->opened[k] = 1;
+}
+
+/*
+ * Where the region of a pack goes: straight to the file, or, when sealing,
+ * through a buffer of SEAL_BATCH segments that are sealed across the pool
+ * before they are written, so no plaintext reaches the disk.
+ */
+struct packout {
+    struct bufout *w;
+    struct seal_job *j;     /* NULL when not sealing */
+    uint8_t *buf;
+    size_t len;
+    uint64_t done;          /* segments sealed and written */
+};
+
+static int seal_batch(struct packout *po, size_t n)
+{
+    struct seal_job *j = po->j;
+    uint8_t *tags = realloc(j->tags, (po->done + n) * SEAL_TAG);
+
+    if (!tags)
+        return -1;
+    j->tags = tags;
+    j->region = po->buf;
+    j->first = po->done;
+    j->base = po->done * j->seg;
+    pool_for_batched(n, 0, 1, seal_job_one, j);
+    if (j->failed)
+        return -1;
+    po->done += n;
+    return 0;
+}
+
+static int pack_write(struct packout *po, const void *p, size_t n)
+{
+    const uint8_t *c = p;
+    size_t cap;
+
+    if (!po->j)
+        return bufout_write(po->w, p, n);
+    cap = (size_t)SEAL_BATCH * po->j->seg;
+    while (n > 0) {
+        size_t take;
+
+        /* Sealed only once more follows, so the final segment is known as such. */
+        if (po->len == cap) {
+            if (seal_batch(po, SEAL_BATCH) != 0 || bufout_write(po->w, po->buf, cap) != 0)
+                return -1;
+            po->len = 0;
+        }
+        take = n < cap - po->len ? n : cap - po->len;
+        memcpy(po->buf + po->len, c, take);
+        po->len += take;
+        c += take;
+        n -= take;
+    }
+    return 0;
+}
+
+/* Seal what is left, the last segment flagged as such, then append every tag. */
+static int pack_finish(struct packout *po)
+{
+    struct seal_job *j = po->j;
+    size_t n;
+
+    if (!j)
+        return bufout_flush(po->w);
+    n = po->len ? (po->len + j->seg - 1) / j->seg : 1;
+    j->len = po->done * j->seg + po->len;
+    j->nseg = po->done + n;
+    if (seal_batch(po, n) != 0 || bufout_write(po->w, po->buf, po->len) != 0 ||
+        bufout_write(po->w, j->tags, j->nseg * SEAL_TAG) != 0)
+        return -1;
+    return bufout_flush(po->w);
+}
+
+static int stream_file(ZSTD_CCtx *cctx, int level, int dirfd, const struct item *it,
+                       const char *path, struct packout *po, char *in, char *out,
+                       struct pack_entry *e)
+{
+    size_t got = 0;
+    int fd = openat(dirfd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, it->size);
+    for (;;) {
+        ssize_t r = read(fd, in, STREAM_BUF);
+        ZSTD_inBuffer ib;
+        int last;
+        size_t left;
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            break;
+        last = r == 0;
+        e->crc = crc32c(e->crc, in, r);
+        got += r;
+        ib.src = in;
+        ib.size = r;
+        ib.pos = 0;
+        do {
+            ZSTD_outBuffer ob = { out, STREAM_BUF, 0 };
+
+            left = ZSTD_compressStream2(cctx, &ob, &ib, last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left) || pack_write(po, out, ob.pos) != 0) {
+                close(fd);
+                return -1;
+            }
+            e->csize += ob.pos;
+        } while (last ? left != 0 : ib.pos < ib.size);
+        if (last)
+            break;
+    }
+    close(fd);
+    return got == it->size ? 0 : -1;
+}
+
+int archive_pack(const char *dir, const char *pack_path, const struct archive_opts *o,
+                 struct archive_stats *st)
+{
+    char tmp[4200], *in = NULL, *out = NULL;
+    struct pack_header h;
+    struct pack_entry *toc = NULL;
+    struct tree t;
+    struct bufout *w = NULL;
+    struct packout po;
+    struct seal_job j;
+    struct timespec t0;
+    ZSTD_CCtx *cctx = NULL;
+    ZSTD_CDict *cdict = NULL;
+    void *dict = NULL;
+    size_t dict_len = 0, i, outcap = ZSTD_compressBound(ARCHIVE_SMALL);
+    struct pack_seal ps;
+    uint64_t pos, hdr = sizeof(h) + (o->key ? sizeof(ps) : 0);
+    int level = o->level ? o->level : ZSTD_CLEVEL_DEFAULT;
+    int dirfd, fd = -1, rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    memset(&t, 0, sizeof(t));
+    memset(&po, 0, sizeof(po));
+    memset(&j, 0, sizeof(j));
+    tmp[0] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        return -1;
+    if (collect(&t, dup(dirfd), "", 0) != 0)
+        goto out;
+    if (o->dict) {
+        struct timespec d0;
+
+        clock_gettime(CLOCK_MONOTONIC, &d0);
+        dict = train(dir, &t, o, &dict_len);
+        if (dict && !(cdict = ZSTD_createCDict(dict, dict_len, level)))
+            goto out;
+        st->train_ms = bench_ms_since(&d0);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", pack_path);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    toc = calloc(t.n ? t.n : 1, sizeof(*toc));
+    w = malloc(sizeof(*w));
+    in = malloc(STREAM_BUF > ARCHIVE_SMALL ? STREAM_BUF : ARCHIVE_SMALL);
+    out = malloc(outcap > STREAM_BUF ? outcap : STREAM_BUF);
+    cctx = ZSTD_createCCtx();
+    if (fd < 0 || !toc || !w || !in || !out || !cctx)
+        goto out;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PACK_MAGIC, 8);
+    h.flags = cdict ? PACK_DICT : 0;
+    h.dict_len = cdict ? (uint32_t)dict_len : 0;
+    h.count = t.n;
+    memset(&ps, 0, sizeof(ps));
+    bufout_init(w, fd);
+    po.w = w;
+    if (o->key) {
+        h.flags |= PACK_SEALED;
+        ps.cipher = o->cipher ? o->cipher : seal_default_cipher();
+        ps.seg_size = SEAL_SEGMENT;
+        ps.region_off = hdr;
+        if (RAND_bytes(ps.salt, sizeof(ps.salt)) != 1 || seal_job_init(&j, &h, &ps, o->key) != 0 ||
+            !(po.buf = malloc((size_t)SEAL_BATCH * SEAL_SEGMENT)))
+            goto out;
+        j.enc = 1;
+        j.nseg = UINT64_MAX;    /* until pack_finish, no segment is the last */
+        po.j = &j;
+    }
+    if (bufout_write(w, &h, sizeof(h)) != 0 ||
+        (o->key && bufout_write(w, &ps, sizeof(ps)) != 0) ||
+        (cdict && pack_write(&po, dict, dict_len) != 0))
+        goto out;
+    pos = hdr + h.dict_len;
+
+    for (i = 0; i < t.n; i++) {
+        const struct item *it = &t.items[i];
+        const char *path = t.arena + it->path;
+        struct pack_entry *e = &toc[i];
+
+        e->off = pos;
+        e->size = it->size;
+        e->mtime_ns = it->mtime_ns;
+        e->mode = it->mode;
+        e->type = it->type;
+        e->path_len = (uint16_t)strlen(path);
+        if (it->type == ENTRY_SYMLINK) {
+            ssize_t r = readlinkat(dirfd, path, in, ARCHIVE_SMALL);
+
+            if (r < 0 || pack_write(&po, in, r) != 0)
+                goto out;
+            e->size = e->csize = r;
+            e->crc = crc32c(0, in, r);
+        } else if (it->type == ENTRY_FILE && it->size <= ARCHIVE_SMALL) {
+            ssize_t r = read_at(dirfd, path, in, it->size);
+            size_t c;
+
+            if (r != (ssize_t)it->size)
+                goto out;
+            e->crc = crc32c(0, in, r);
+            c = cdict ? ZSTD_compress_usingCDict(cctx, out, outcap, in, r, cdict)
+                      : ZSTD_compressCCtx(cctx, out, outcap, in, r, level);
+            if (!ZSTD_isError(c) && c < (size_t)r) {
+                e->codec = cdict ? CODEC_ZSTD_DICT : CODEC_ZSTD;
+                e->csize = c;
+                if (pack_write(&po, out, c) != 0)
+                    goto out;
+            } else {
+                e->csize = r;
+                if (pack_write(&po, in, r) != 0)
+                    goto out;
+            }
+        } else if (it->type == ENTRY_FILE) {
+            e->codec = CODEC_ZSTD;
+            if (stream_file(cctx, level, dirfd, it, path, &po, in, out, e) != 0)
+                goto out;
+        }
+        pos += e->csize;
+        if (it->type == ENTRY_FILE) {
+            st->files++;
+            st->bytes += e->size;
+        }
+    }
+
+    h.toc_off = pos;
+    for (i = 0; i < t.n; i++) {
+        if (pack_write(&po, &toc[i], sizeof(toc[i])) != 0 ||
+            pack_write(&po, t.arena + t.items[i].path, toc[i].path_len) != 0)
+            goto out;
+        pos += sizeof(toc[i]) + toc[i].path_len;
+    }
+    h.toc_len = pos - h.toc_off;
+    h.raw_bytes = st->bytes;
+    if (o->key) {
+        struct pack_tail tail = { h.toc_off, h.raw_bytes };
+
+        if (pack_write(&po, &tail, sizeof(tail)) != 0)
+            goto out;
+        pos += sizeof(tail);
+        ps.region_len = pos - hdr;
+    }
+    if (pack_finish(&po) != 0)
+        goto out;
+    pos += o->key ? j.nseg * SEAL_TAG : 0;
+    if (o->key && pwrite(fd, &ps, sizeof(ps), sizeof(h)) != sizeof(ps))
+        goto out;
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fdatasync(fd) != 0)
+        goto out;
+    if (close(fd) != 0 || rename(tmp, pack_path) != 0) {
+        fd = -1;
+        goto out;
+    }
+    fd = -1;
+    st->packed = pos;
+    st->dict_len = h.dict_len;
+    rc = 0;
+out:
+    if (rc != 0 && tmp[0])
+        unlink(tmp);
+    free(toc);
+    free(in);
+    free(out);
+    free(w);
+    free(po.buf);
+    free(j.tags);
+    seal_wipe(&j.s);
+    free(dict);
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeCDict(cdict);
+    if (fd >= 0)
+        close(fd);
+    close(dirfd);
+    free_tree(&t);
+    st->ms = bench_ms_since(&t0);
+    return rc;
+}
+
+static int write_out(int fd, const void *p, size_t n)
+{
+    const char *c = p;
+
+    while (n > 0) {
+        ssize_t r = write(fd, c, n);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        c += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/* Decompress one entry, checking its checksum; out_fd < 0 to only check. */
+static int unpack_entry(const char *base, const struct pack_entry *e, ZSTD_DCtx *dctx,
+                        const ZSTD_DDict *ddict, char *buf, int out_fd)
+{
+    const char *src = base + e->off;
+    uint32_t crc = 0;
+
+    if (e->codec == CODEC_STORED) {
+        crc = crc32c(0, src, e->csize);
+        if (out_fd >= 0 && write_out(out_fd, src, e->csize) != 0)
+            return -1;
+    } else if (e->size <= ARCHIVE_SMALL) {
+        size_t r = e->codec == CODEC_ZSTD_DICT
+                 ? ZSTD_decompress_usingDDict(dctx, buf, ARCHIVE_SMALL, src, e->csize, ddict)
+                 : ZSTD_decompressDCtx(dctx, buf, ARCHIVE_SMALL, src, e->csize);
+
+        if (ZSTD_isError(r) || r != e->size)
+            return -1;
+        crc = crc32c(0, buf, r);
+        if (out_fd >= 0 && write_out(out_fd, buf, r) != 0)
+            return -1;
+    } else {
+        ZSTD_inBuffer ib = { src, e->csize, 0 };
+        uint64_t total = 0;
+        size_t r = 1;
+
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+        while (r != 0) {
+            ZSTD_outBuffer ob = { buf, STREAM_BUF, 0 };
+
+            r = ZSTD_decompressStream(dctx, &ob, &ib);
+            if (ZSTD_isError(r) || (ob.pos == 0 && ib.pos == ib.size && r != 0))
+                return -1;
+            crc = crc32c(crc, buf, ob.pos);
+            total += ob.pos;
+            if (out_fd >= 0 && write_out(out_fd, buf, ob.pos) != 0)
+                return -1;
+        }
+        if (total != e->size)
+            return -1;
+    }
+    return crc == e->crc ? 0 : -1;
+}
+
+/* A pack mapped privately, so sealed segments can be opened in place. */
+struct pack {
+    char *p;
+    size_t len;
+    struct pack_header h;
+    uint64_t dict_off;
+    int sealed;
+    struct seal_job j;
+};
+
+/* Open the sealed segments covering [off, off + len), in parallel. */
+static int pack_need(struct pack *pk, uint64_t off, uint64_t len)
+{
+    uint64_t first, last;
+
+    if (!pk->sealed || len == 0)
+        return 0;
+    off -= pk->dict_off;
+    first = off / pk->j.seg;
+    last = (off + len - 1) / pk->j.seg;
+    if (last >= pk->j.nseg)
+        last = pk->j.nseg - 1;
+    if (first > last)
+        return 0;
+    pk->j.first = first;
+    pool_for_batched(last - first + 1, 0, 1, seal_job_one, &pk->j);
+    if (pk->j.failed) {
+        fprintf(stderr, "archive: a sealed segment failed authentication\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int pack_map(struct pack *pk, const char *pack_path, const uint8_t *key)
+{
+    struct pack_seal ps;
+    struct pack_tail tail;
+    struct stat sb;
+    uint64_t end;
+    int fd;
+
+    memset(pk, 0, sizeof(*pk));
+    fd = open(pack_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(pk->h)) {
+        close(fd);
+        return -1;
+    }
+    pk->len = sb.st_size;
+    pk->p = mmap(NULL, pk->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pk->p == MAP_FAILED) {
+        pk->p = NULL;
+        return -1;
+    }
+    memcpy(&pk->h, pk->p, sizeof(pk->h));
+    if (memcmp(pk->h.magic, PACK_MAGIC, 8))
+        return -1;
+    pk->dict_off = sizeof(pk->h);
+    end = pk->len;
+    if (pk->h.flags & PACK_SEALED) {
+        if (pk->len < sizeof(pk->h) + sizeof(ps))
+            return -1;
+        memcpy(&ps, pk->p + sizeof(pk->h), sizeof(ps));
+        pk->dict_off += sizeof(ps);
+        if (!key) {
+            fprintf(stderr, "archive: %s is sealed and there is no key\n", pack_path);
+            return -1;
+        }
+        if (ps.seg_size == 0 || ps.region_off != pk->dict_off ||
+            seal_job_init(&pk->j, &pk->h, &ps, key) != 0 ||
+            ps.region_len > pk->len || pk->j.nseg > (pk->len - ps.region_len) / SEAL_TAG ||
+            ps.region_off + ps.region_len + pk->j.nseg * SEAL_TAG != pk->len)
+            return -1;
+        pk->sealed = 1;
+        pk->j.region = (uint8_t *)pk->p + ps.region_off;
+        pk->j.tags = pk->j.region + ps.region_len;
+        pk->j.opened = calloc(pk->j.nseg, 1);
+        if (!pk->j.opened)
+            return -1;
+        end = ps.region_off + ps.region_len;
+        if (ps.region_len < sizeof(tail) ||
+            pack_need(pk, end - sizeof(tail), sizeof(tail)) != 0)
+            return -1;
+        end -= sizeof(tail);
+        memcpy(&tail, pk->p + end, sizeof(tail));
+        if (tail.toc_off != pk->h.toc_off || tail.raw_bytes != pk->h.raw_bytes)
+            return -1;
+    }
+    if (pk->h.toc_off > end || pk->h.toc_len != end - pk->h.toc_off ||
+        pk->dict_off + pk->h.dict_len > pk->h.toc_off)
+        return -1;
+    return 0;
+}
+
+static void pack_unmap(struct pack *pk)
+{
+    if (pk->p)
+        munmap(pk->p, pk->len);
+    free(pk->j.opened);
+    seal_wipe(&pk->j.s);
+}
+
+/*
+ * A stored path must stay below the unpack directory: not empty, not
+ * absolute, and no component that is exactly "." or "..". Names that
+ * merely contain dots ("..data", "a..b") are fine.
+ */
+static int path_ok(const char *path)
+{
+    const char *c = path;
+
+    if (!*path || *path == '/')
+        return 0;
+    for (;;) {
+        size_t len = strcspn(c, "/");
+
+        if ((len == 1 && c[0] == '.') || (len == 2 && c[0] == '.' && c[1] == '.'))
+            return 0;
+        if (!c[len])
+            return 1;
+        c += len + 1;
+    }
+}
+
+/* Read the table of contents entry at *cur into e and path; -1 if malformed. */
+static int toc_next(const struct pack *pk, const char **cur, struct pack_entry *e,
+                    char *path)
+{
+    const char *end = pk->p + pk->h.toc_off + pk->h.toc_len;
+
+    if (*cur + sizeof(*e) > end)
+        return -1;
+    memcpy(e, *cur, sizeof(*e));
+    if (*cur + sizeof(*e) + e->path_len > end || e->off < pk->dict_off + pk->h.dict_len ||
+        e->off + e->csize > pk->h.toc_off)
+        return -1;
+    memcpy(path, *cur + sizeof(*e), e->path_len);
+    path[e->path_len] = '\0';
+    *cur += sizeof(*e) + e->path_len;
+    return path_ok(path) ? 0 : -1;
+}
+
+/*
+ * Open the directory holding path, one component at a time and without
+ * following symlinks, so an entry cannot be written through a symlinked
+ * parent. Returns dirfd itself for top-level names; *leaf is the last
+ * component.
+ */
+static int open_parent(int dirfd, char *path, const char **leaf)
+{
+    char *c = path, *slash;
+    int fd = dirfd;
+
+    while ((slash = strchr(c, '/')) != NULL) {
+        int next;
+
+        *slash = '\0';
+        next = openat(fd, c, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        *slash = '/';
+        if (fd != dirfd)
+            close(fd);
+        if (next < 0)
+            return -1;
+        fd = next;
+        c = slash + 1;
+    }
+    *leaf = c;
+    return fd;
+}
+
+int archive_unpack(const char *pack_path, const char *dir, const uint8_t *key,
+                   struct archive_stats *st)
+{
+    struct pack pk;
+    struct timespec t0;
+    ZSTD_DCtx *dctx = NULL;
+    ZSTD_DDict *ddict = NULL;
+    const char *p, *toc;
+    char *buf = NULL, path[UINT16_MAX + 1];
+    uint64_t i;
+    int dirfd = -1, rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (pack_map(&pk, pack_path, key) != 0)
+        goto out;
+    p = pk.p;
+    madvise(pk.p, pk.len, MADV_SEQUENTIAL);
+    /* Everything is read, so open the whole region up front across the pool. */
+    if (pk.sealed && pack_need(&pk, pk.dict_off, pk.j.len ? pk.j.len : 1) != 0)
+        goto out;
+    if (dir) {
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+            goto out;
+        dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd < 0)
+            goto out;
+    }
+    dctx = ZSTD_createDCtx();
+    buf = malloc(STREAM_BUF > ARCHIVE_SMALL ? STREAM_BUF : ARCHIVE_SMALL);
+    if (!dctx || !buf)
+        goto out;
+    if ((pk.h.flags & PACK_DICT) &&
+        !(ddict = ZSTD_createDDict(p + pk.dict_off, pk.h.dict_len)))
+        goto out;
+
+    toc = p + pk.h.toc_off;
+    for (i = 0; i < pk.h.count; i++) {
+        struct pack_entry e;
+        const char *leaf = path;
+        int out_fd = -1, parent = dirfd, ok = 1;
+
+        if (toc_next(&pk, &toc, &e, path) != 0)
+            goto out;
+        if (dirfd >= 0 && (parent = open_parent(dirfd, path, &leaf)) < 0) {
+            fprintf(stderr, "archive: cannot reach the directory of %s\n", path);
+            goto out;
+        }
+        if (e.type == ENTRY_DIR) {
+            ok = dirfd < 0 || mkdirat(parent, leaf, e.mode | 0700) == 0 || errno == EEXIST;
+        } else if (e.type == ENTRY_SYMLINK) {
+            char target[ARCHIVE_SMALL + 1];
+
+            ok = e.csize <= ARCHIVE_SMALL && crc32c(0, p + e.off, e.csize) == e.crc;
+            if (ok) {
+                memcpy(target, p + e.off, e.csize);
+                target[e.csize] = '\0';
+                ok = dirfd < 0 || symlinkat(target, parent, leaf) == 0 || errno == EEXIST;
+            }
+        } else if (dirfd >= 0) {
+            out_fd = openat(parent, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                            O_CLOEXEC, e.mode);
+            ok = out_fd >= 0;
+        }
+        if (parent != dirfd)
+            close(parent);
+        if (!ok)
+            goto out;
+        if (e.type != ENTRY_FILE)
+            continue;
+        ok = unpack_entry(p, &e, dctx, ddict, buf, out_fd) == 0;
+        if (out_fd >= 0) {
+            struct timespec ts[2] = {
+                { 0, UTIME_NOW },
+                { e.mtime_ns / 1000000000LL, e.mtime_ns % 1000000000LL },
+            };
+
+            futimens(out_fd, ts);
+            if (close(out_fd) != 0)
+                ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "archive: %s is damaged in %s\n", path, pack_path);
+            goto out;
+        }
+        st->files++;
+        st->bytes += e.size;
+    }
+    st->packed = pk.len;
+    st->dict_len = pk.h.dict_len;
+    rc = 0;
+out:
+    free(buf);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeDDict(ddict);
+    if (dirfd >= 0)
+        close(dirfd);
+    pack_unmap(&pk);
+    st->ms = bench_ms_since(&t0);
+    return rc;
+}
+
+int archive_extract(const char *pack_path, const char *path, const uint8_t *key, int out_fd)
+{
+    struct pack pk;
+    struct pack_entry e;
+    ZSTD_DCtx *dctx = NULL;
+    ZSTD_DDict *ddict = NULL;
+    const char *toc;
+    char *buf = NULL, name[UINT16_MAX + 1];
+    uint64_t i;
+    int rc = -1;
+
+    if (pack_map(&pk, pack_path, key) != 0 ||
+        pack_need(&pk, pk.h.toc_off, pk.h.toc_len) != 0)
+        goto out;
+    toc = pk.p + pk.h.toc_off;
+    for (i = 0; i < pk.h.count; i++) {
+        if (toc_next(&pk, &toc, &e, name) != 0)
+            goto out;
+        if (!strcmp(name, path))
+            break;
+    }
+    if (i == pk.h.count || e.type == ENTRY_DIR) {
+        fprintf(stderr, "archive: no file %s in %s\n", path, pack_path);
+        goto out;
+    }
+    if (pack_need(&pk, e.off, e.csize) != 0)
+        goto out;
+    if (e.type == ENTRY_SYMLINK) {
+        if (crc32c(0, pk.p + e.off, e.csize) == e.crc &&
+            write_out(out_fd, pk.p + e.off, e.csize) == 0)
+            rc = 0;
+        goto out;
+    }
+    dctx = ZSTD_createDCtx();
+    buf = malloc(STREAM_BUF > ARCHIVE_SMALL ? STREAM_BUF : ARCHIVE_SMALL);
+    if (!dctx || !buf)
+        goto out;
+    if (e.codec == CODEC_ZSTD_DICT &&
+        (pack_need(&pk, pk.dict_off, pk.h.dict_len) != 0 ||
+         !(ddict = ZSTD_createDDict(pk.p + pk.dict_off, pk.h.dict_len))))
+        goto out;
+    rc = unpack_entry(pk.p, &e, dctx, ddict, buf, out_fd);
+    if (rc != 0)
+        fprintf(stderr, "archive: %s is damaged in %s\n", path, pack_path);
+out:
+    free(buf);
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeDDict(ddict);
+    pack_unmap(&pk);
+    return rc;
+}
+
+int archive_sealed(const char *pack_path)
+{
+    struct pack_header h;
+    int fd = open(pack_path, O_RDONLY | O_CLOEXEC);
+    ssize_t r;
+
+    if (fd < 0)
+        return -1;
+    r = pread(fd, &h, sizeof(h), 0);
+    close(fd);
+    if (r != sizeof(h) || memcmp(h.magic, PACK_MAGIC, 8))
+        return -1;
+    return (h.flags & PACK_SEALED) != 0;
+}
+
+/* A corpus shaped like ticket attachments: event dumps, configs, log tails. */
+static int make_corpus(const char *root, long files)
+{
+    static const char *const levels[] = { "INFO", "WARN", "ERROR", "DEBUG" };
+    static const char *const hosts[] = { "edge-01", "edge-02", "vpn-gw", "db-primary",
+                                         "db-replica", "auth" };
+    uint64_t seed = 7;
+    char path[512], body[8192];
+    long i;
+
+    for (i = 0; i < files; i++) {
+        size_t len = 0;
+        int k, fd, lines;
+
+        if (i % 500 == 0) {
+            snprintf(path, sizeof(path), "%s/batch%03ld", root, i / 500);
+            if (mkdir(path, 0755) != 0 && errno != EEXIST)
+                return -1;
+        }
+        switch (i % 3) {
+        case 0:
+            snprintf(path, sizeof(path), "%s/batch%03ld/event-%06ld.json", root, i / 500, i);
+            len = snprintf(body, sizeof(body),
+                           "{\n  \"event_id\": \"%08llx-%04llx\",\n  \"timestamp\": "
+                           "\"2024-03-%02llu T%02llu:%02llu:%02llu Z\",\n  \"source\": "
+                           "\"%s\",\n  \"severity\": \"%s\",\n  \"user\": {\"id\": %llu, "
+                           "\"name\": \"user%llu\", \"groups\": [\"staff\", \"vpn\"]},\n"
+                           "  \"request\": {\"method\": \"POST\", \"path\": \"/api/v2/"
+                           "sessions/%llu\", \"status\": %llu, \"latency_ms\": %llu},\n"
+                           "  \"tags\": [\"prod\", \"eu-west\", \"ticket\"]\n}\n",
+                           (unsigned long long)bench_rnd(&seed),
+                           (unsigned long long)bench_rnd(&seed) & 0xffff,
+                           (unsigned long long)bench_rnd(&seed) % 28 + 1,
+                           (unsigned long long)bench_rnd(&seed) % 24,
+                           (unsigned long long)bench_rnd(&seed) % 60,
+                           (unsigned long long)bench_rnd(&seed) % 60,
+                           hosts[bench_rnd(&seed) % 6],
+                           levels[bench_rnd(&seed) % 4],
+                           (unsigned long long)bench_rnd(&seed) % 100000,
+                           (unsigned long long)bench_rnd(&seed) % 1000,
+                           (unsigned long long)bench_rnd(&seed),
+                           (unsigned long long)(bench_rnd(&seed) % 2 ? 200 : 503),
+                           (unsigned long long)bench_rnd(&seed) % 900);
+            break;
+        case 1:
+            snprintf(path, sizeof(path), "%s/batch%03ld/app-%06ld.conf", root, i / 500, i);
+            len = snprintf(body, sizeof(body),
+                           "[server]\nlisten = 0.0.0.0:%llu\nworkers = %llu\n"
+                           "timeout = %llus\nlog_level = %s\n\n[database]\nhost = %s\n"
+                           "port = 5432\npool_size = %llu\nssl = true\n\n[cache]\n"
+                           "enabled = %s\nttl = %llu\nmax_entries = %llu\n\n[auth]\n"
+                           "provider = ldap\nbase_dn = ou=people,dc=example,dc=com\n"
+                           "refresh = %llum\n",
+                           (unsigned long long)bench_rnd(&seed) % 60000 + 1024,
+                           (unsigned long long)bench_rnd(&seed) % 64 + 1,
+                           (unsigned long long)bench_rnd(&seed) % 120,
+                           levels[bench_rnd(&seed) % 4],
+                           hosts[bench_rnd(&seed) % 6],
+                           (unsigned long long)bench_rnd(&seed) % 100,
+                           bench_rnd(&seed) % 2 ? "true" : "false",
+                           (unsigned long long)bench_rnd(&seed) % 3600,
+                           (unsigned long long)bench_rnd(&seed) % 100000,
+                           (unsigned long long)bench_rnd(&seed) % 60);
+            break;
+        default:
+            snprintf(path, sizeof(path), "%s/batch%03ld/tail-%06ld.log", root, i / 500, i);
+            lines = 8 + bench_rnd(&seed) % 24;
+            for (k = 0; k < lines && len < sizeof(body) - 256; k++)
+                len += snprintf(body + len, sizeof(body) - len,
+                                "2024-03-%02llu %02llu:%02llu:%02llu.%03llu %-5s [%s] "
+                                "worker-%llu handled request id=%llu in %llu ms\n",
+                                (unsigned long long)bench_rnd(&seed) % 28 + 1,
+                                (unsigned long long)bench_rnd(&seed) % 24,
+                                (unsigned long long)bench_rnd(&seed) % 60,
+                                (unsigned long long)bench_rnd(&seed) % 60,
+                                (unsigned long long)bench_rnd(&seed) % 1000,
+                                levels[bench_rnd(&seed) % 4],
+                                hosts[bench_rnd(&seed) % 6],
+                                (unsigned long long)bench_rnd(&seed) % 16,
+                                (unsigned long long)bench_rnd(&seed),
+                                (unsigned long long)bench_rnd(&seed) % 500);
+            break;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || write_out(fd, body, len) != 0) {
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void remove_tree(int dirfd)
+{
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        int fd;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (unlinkat(dirfd, de->d_name, 0) == 0)
+            continue;
+        fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            remove_tree(fd);
+            unlinkat(dirfd, de->d_name, AT_REMOVEDIR);
+        }
+    }
+    closedir(d);
+}
+
+int archive_remove(const char *dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    remove_tree(fd);
+    return rmdir(dir);
+}
+
+/*
+ * bench pack [files]: per-file zstd against a trained dictionary, then the
+ * dictionary pack sealed with each cipher
+ */
+int archive_bench(int argc, char *argv[])
+{
+    static const char *const names[] = { "per-file", "dictionary", "aes-gcm", "chacha" };
+    long files = argc > 0 ? strtol(argv[0], NULL, 10) : 30000;
+    char root[256], pack[300];
+    uint8_t key[SEAL_KEY];
+    struct archive_opts o;
+    struct archive_stats ps, us;
+    int mode;
+
+    if (files <= 0)
+        files = 30000;
+    if (bench_tmpdir(root, sizeof(root), "pack") != 0)
+        return 1;
+    if (make_corpus(root, files) != 0) {
+        printf("could not build the corpus\n");
+        bench_rmtree(root);
+        return 1;
+    }
+    snprintf(pack, sizeof(pack), "%s.tfp", root);
+    RAND_bytes(key, sizeof(key));
+    for (mode = 0; mode < 4; mode++) {
+        memset(&o, 0, sizeof(o));
+        o.dict = mode > 0;
+        if (mode >= 2) {
+            o.key = key;
+            o.cipher = mode == 2 ? SEAL_AES_GCM : SEAL_CHACHA20_POLY1305;
+        }
+        if (archive_pack(root, pack, &o, &ps) != 0 ||
+            archive_unpack(pack, NULL, o.key, &us) != 0) {
+            printf("pack failed\n");
+            break;
+        }
+        printf("%-10s %llu files, %.1f MB -> %.2f MB, ratio %.2f; pack %.0f MB/s "
+               "(%.0f MB/s after %.0f ms training), unpack %.0f MB/s\n",
+               names[mode], (unsigned long long)ps.files,
+               ps.bytes / 1048576.0, ps.packed / 1048576.0,
+               (double)ps.bytes / ps.packed, ps.bytes / 1048576.0 / (ps.ms / 1e3),
+               ps.bytes / 1048576.0 / ((ps.ms - ps.train_ms) / 1e3), ps.train_ms,
+               us.bytes / 1048576.0 / (us.ms / 1e3));
+    }
+    unlink(pack);
+    bench_rmtree(root);
+    return 0;
+}
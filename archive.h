@@ -0,0 +1,61 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Archive packs: one file holding a ticket folder, each entry compressed
+ * on its own with zstd so any file can be pulled out without the rest.
+ *
+ *   header | dictionary | entry data... | table of contents
+ *
+ * Small files compress poorly alone, so a pack may carry a zstd
+ * dictionary trained from a sample of the small files (the ticket's own,
+ * or its prefix's); it is stored once in the header and used for every
+ * entry up to ARCHIVE_SMALL bytes. Larger files are streamed without it.
+ *
+ * A sealed pack encrypts everything after the header in fixed segments
+ * (see seal.h), each with its own tag, so packing and unpacking seal and
+ * open segments across the thread pool, and extracting one file opens
+ * only the segments holding the table of contents and that file.
+ */
+
+#define ARCHIVE_SMALL (64 * 1024)
+#define ARCHIVE_DICT_SIZE (112 * 1024)
+
+struct archive_opts {
+    int level;              /* zstd level, 0 for the default */
+    int dict;               /* train and use a dictionary */
+    const char *const *sample_dirs;     /* extra folders to train from */
+    size_t nsample_dirs;
+    const uint8_t *key;     /* seal the pack with this master key */
+    int cipher;             /* SEAL_*, 0 for the fastest on this CPU */
+};
+
+struct archive_stats {
+    uint64_t files, bytes, packed;
+    uint32_t dict_len;
+    double train_ms, ms;
+};
+
+int archive_pack(const char *dir, const char *pack_path, const struct archive_opts *o,
+                 struct archive_stats *st);
+/*
+ * Unpack into dir, or with dir NULL only check every entry's checksum.
+ * key is needed for sealed packs and ignored otherwise.
+ */
+int archive_unpack(const char *pack_path, const char *dir, const uint8_t *key,
+                   struct archive_stats *st);
+/* Write one file (or a symlink's target) from the pack to out_fd. */
+int archive_extract(const char *pack_path, const char *path, const uint8_t *key,
+                    int out_fd);
+/* 1 if the pack is sealed, 0 if not, -1 if it is not a pack. */
+int archive_sealed(const char *pack_path);
+
+/* Remove an archived folder and everything under it. */
+int archive_remove(const char *dir);
+
+int archive_bench(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,120 @@
+#include "bench.h"
+
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "cdc.h"
+#include "cmd.h"
+#include "hooks.h"
+#include "index.h"
+#include "iosched.h"
+#include "merkle.h"
+#include "meta.h"
+#include "prefetch.h"
+#include "report.h"
+#include "seal.h"
+#include "selfbench.h"
+#include "tags.h"
+#include "ticketfs.h"
+#include "timelog.h"
+#include "views.h"
+
+static const struct command benches[] = {
+    { "sched", iosched_bench },
+    { "tags", tags_bench },
+    { "meta", meta_bench },
+    { "index", index_bench },
+    { "readers", index_stress_bench },
+    { "wal-torture", index_torture },
+    { "merkle", merkle_bench },
+    { "cdc", cdc_bench },
+    { "pack", archive_bench },
+    { "seal", seal_bench },
+    { "prefetch", prefetch_bench },
+    { "time", timelog_bench },
+    { "report", report_bench },
+    { "views", views_bench },
+    { "lib", tfs_bench },
+    { "hooks", hooks_bench },
+    { "selfbench", selfbench_main },
+};
+
+int bench_tmpdir(char *dir, size_t n, const char *tag)
+{
+    const char *tmp = getenv("TMPDIR");
+
+    if (!tmp || !*tmp)
+        tmp = "/tmp";
+    if ((size_t)snprintf(dir, n, "%s/tfs-%s-XXXXXX", tmp, tag) >= n) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "bench: %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    if (type == FTW_DP)
+        return rmdir(path) != 0 && errno != ENOENT;
+    return unlink(path) != 0 && errno != ENOENT;
+}
+
+int bench_rmtree(const char *dir)
+{
+    if (nftw(dir, remove_entry, 32, FTW_DEPTH | FTW_PHYS) != 0) {
+        fprintf(stderr, "bench: could not remove %s\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+double bench_ms_since(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t bench_rnd(uint64_t *seed)
+{
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *seed >> 33;
+}
+
+int bench_main(int argc, char *argv[])
+{
+    size_t i, n = sizeof(benches) / sizeof(benches[0]);
+
+    if (argc < 1) {
+        printf("Usage: bench ");
+        for (i = 0; i < n; i++)
+            printf("%s%s", i ? "|" : "", benches[i].name);
+        printf(" [args]\n");
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+        if (!strcmp(argv[0], benches[i].name))
+            return benches[i].fn(argc - 1, argv + 1);
+    printf("Unknown benchmark: %s\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * What the `bench` subcommands share: one table of benchmarks, a scratch
+ * directory under $TMPDIR (default /tmp) that is removed again afterwards,
+ * and a clock. The tests in tests/ use the same scratch directories.
+ */
+
+/* Create <tmp>/tfs-<tag>-XXXXXX and put its path in dir. */
+int bench_tmpdir(char *dir, size_t n, const char *tag);
+/* Remove dir and everything below it; symlinks are removed, not followed. */
+int bench_rmtree(const char *dir);
+double bench_ms_since(const struct timespec *t0);
+/* CLOCK_MONOTONIC in nanoseconds. */
+uint64_t bench_now_ns(void);
+/* The next 31 bits of a seeded sequence, for synthetic benchmark data. */
+uint64_t bench_rnd(uint64_t *seed);
+
+/* bench <name> [args] */
+int bench_main(int argc, char *argv[]);
+
+#endif
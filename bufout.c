@@ -0,0 +1,98 @@
+#include "bufout.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void bufout_init(struct bufout *w, int fd)
+{
+    w->fd = fd;
+    w->err = 0;
+    w->len = 0;
+}
+
+static int write_all(struct bufout *w, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t got = write(w->fd, p, n);
+
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            w->err = errno;
+            return -1;
+        }
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+int bufout_flush(struct bufout *w)
+{
+    int rc;
+
+    if (w->err)
+        return -1;
+    rc = write_all(w, w->buf, w->len);
+    w->len = 0;
+    return rc;
+}
+
+int bufout_write(struct bufout *w, const void *data, size_t n)
+{
+    if (w->err)
+        return -1;
+    if (w->len + n > sizeof(w->buf)) {
+        if (bufout_flush(w) != 0)
+            return -1;
+        if (n > sizeof(w->buf))
+            return write_all(w, data, n);
+    }
+    memcpy(w->buf + w->len, data, n);
+    w->len += n;
+    return 0;
+}
+
+int bufout_puts(struct bufout *w, const char *s)
+{
+    return bufout_write(w, s, strlen(s));
+}
+
+int bufout_putc(struct bufout *w, char c)
+{
+    if (w->len == sizeof(w->buf) && bufout_flush(w) != 0)
+        return -1;
+    w->buf[w->len++] = c;
+    return 0;
+}
+
+int bufout_printf(struct bufout *w, const char *fmt, ...)
+{
+    char tmp[1024];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    if (sizeof(w->buf) - w->len < sizeof(tmp) && bufout_flush(w) != 0) {
+        va_end(ap);
+        return -1;
+    }
+    n = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    if ((size_t)n < sizeof(w->buf) - w->len) {
+        w->len += n;
+        return 0;
+    }
+    /* Longer than the free space: format again into a scratch buffer. */
+    va_start(ap, fmt);
+    n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return -1;
+    return bufout_write(w, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
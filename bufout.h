@@ -0,0 +1,25 @@
+#ifndef BUFOUT_H
+#define BUFOUT_H
+
+#include <stddef.h>
+
+/* Buffered writer over a raw fd for commands that stream many lines. */
+
+#define BUFOUT_SIZE (64 * 1024)
+
+struct bufout {
+    int fd;
+    int err;
+    size_t len;
+    char buf[BUFOUT_SIZE];
+};
+
+void bufout_init(struct bufout *w, int fd);
+int bufout_write(struct bufout *w, const void *data, size_t n);
+int bufout_puts(struct bufout *w, const char *s);
+int bufout_putc(struct bufout *w, char c);
+int bufout_printf(struct bufout *w, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int bufout_flush(struct bufout *w);
+
+#endif
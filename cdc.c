@@ -0,0 +1,176 @@
+#include "cdc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include "bench.h"
+
+/*
+ * Two more mask bits than log2(CDC_AVG) before the average, two fewer
+ * after. Bit 63 stays clear so two bytes can be rolled per step: the
+ * shifted-out bit is never tested.
+ */
+#define MASK_S (((1ULL << 18) - 1) << 44)
+#define MASK_L (((1ULL << 14) - 1) << 48)
+
+static uint64_t gear[256], gear_ls[256];
+static int gear_ready;
+
+static void gear_init(void)
+{
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+        gear_ls[i] = gear[i] << 1;
+    }
+    __atomic_store_n(&gear_ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Two bytes per iteration: fp = (fp << 2) + (gear[a] << 1) + gear[b].
+ * The loop-carried chain is one shift and one add per two bytes; the
+ * hash after the first byte is only tested, and both tests share one
+ * rarely taken branch.
+ */
+#define ROLL(mask)                                                      \
+    for (; i + 2 <= end; i += 2) {                                      \
+        uint64_t a = gear_ls[p[i]];                                     \
+        uint64_t h1 = (fp << 2) + a;                                    \
+                                                                        \
+        fp = (fp << 2) + (a + gear[p[i + 1]]);                          \
+        if (__builtin_expect(!(h1 & ((mask) << 1)) || !(fp & (mask)), 0)) \
+            return !(h1 & ((mask) << 1)) ? i + 1 : i + 2;               \
+    }
+
+size_t cdc_next(const uint8_t *p, size_t n)
+{
+    size_t i = CDC_MIN, end, normal = CDC_AVG;
+    uint64_t fp = 0;
+
+    if (!__atomic_load_n(&gear_ready, __ATOMIC_ACQUIRE))
+        gear_init();
+    if (n <= CDC_MIN)
+        return n;
+    if (n > CDC_MAX)
+        n = CDC_MAX;
+    if (normal > n)
+        normal = n;
+    end = normal;
+    ROLL(MASK_S)
+    end = n;
+    ROLL(MASK_L)
+    return n;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Chunk boundaries as offsets; returns how many. */
+static size_t cut(const uint8_t *p, size_t n, uint64_t *ends)
+{
+    size_t off = 0, k = 0;
+
+    while (off < n) {
+        off += cdc_next(p + off, n - off);
+        ends[k++] = off;
+    }
+    return k;
+}
+
+/* Cheap per-chunk fingerprint for the overlap count; not the store's hash. */
+static uint64_t fingerprint(const uint8_t *p, size_t n)
+{
+    uint64_t h = 1469598103934665603ULL;
+    size_t i;
+
+    for (i = 0; i < n; i += 8) {
+        uint64_t w = 0;
+
+        memcpy(&w, p + i, n - i < 8 ? n - i : 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    return h ^ n;
+}
+
+/* bench cdc [MB]: chunking and hashing throughput, boundary stability */
+int cdc_bench(int argc, char *argv[])
+{
+    size_t mb = argc > 0 ? strtoull(argv[0], NULL, 10) : 512, n, k, k2, i, j, shared;
+    uint64_t *ends, *fa, *fb, seed = 42;
+    uint8_t *buf, *buf2, md[EVP_MAX_MD_SIZE];
+    struct timespec t0;
+    EVP_MD_CTX *ctx;
+    double t;
+
+    if (mb == 0)
+        mb = 512;
+    n = mb << 20;
+    buf = malloc(n + 4096);
+    buf2 = malloc(n + 4096);
+    ends = malloc((n / CDC_MIN + 2) * sizeof(*ends));
+    ctx = EVP_MD_CTX_new();
+    if (!buf || !buf2 || !ends || !ctx)
+        return 1;
+    /* Log-like input: random text with repeated lines. */
+    for (i = 0; i < n; i += 8) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        memcpy(buf + i, &seed, 8);
+    }
+    for (i = 0; i + 256 < n; i += 4096)
+        memcpy(buf + i, "2024-01-01T00:00:00 INFO request served in 12 ms ", 48);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    k = cut(buf, n, ends);
+    t = bench_ms_since(&t0) * 1e6;
+    printf("%zu MB: %zu chunks, average %zu bytes, chunked at %.2f GB/s\n", mb, k,
+           n / k, n / t);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0, j = 0; i < k; j = ends[i++]) {
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        EVP_DigestUpdate(ctx, buf + j, ends[i] - j);
+        EVP_DigestFinal_ex(ctx, md, NULL);
+    }
+    printf("SHA-256 of the chunks at %.2f GB/s\n", n / (bench_ms_since(&t0) * 1e6));
+
+    /* A new version: a few edits and one insertion. */
+    fa = malloc(k * sizeof(*fa));
+    for (i = 0, j = 0; i < k; j = ends[i++])
+        fa[i] = fingerprint(buf + j, ends[i] - j);
+    memcpy(buf2, buf, n / 2);
+    memcpy(buf2 + n / 2, "inserted line\n", 14);
+    memcpy(buf2 + n / 2 + 14, buf + n / 2, n - n / 2);
+    for (i = 1; i < 8; i++)
+        buf2[i * (n / 8)] ^= 0x5a;
+    k2 = cut(buf2, n + 14, ends);
+    fb = malloc(k2 * sizeof(*fb));
+    for (i = 0, j = 0; i < k2; j = ends[i++])
+        fb[i] = fingerprint(buf2 + j, ends[i] - j);
+    qsort(fa, k, sizeof(*fa), cmp_u64);
+    for (i = 0, shared = 0; i < k2; i++)
+        shared += bsearch(&fb[i], fa, k, sizeof(*fa), cmp_u64) != NULL;
+    printf("after 8 edits: %zu of %zu chunks reused (%.2f%%)\n", shared, k2,
+           100.0 * shared / k2);
+
+    free(fa);
+    free(fb);
+    free(ends);
+    free(buf);
+    free(buf2);
+    EVP_MD_CTX_free(ctx);
+    return 0;
+}
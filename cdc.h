@@ -0,0 +1,24 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Content-defined chunking with a FastCDC-style gear hash. Cut points
+ * depend only on the bytes just before them, so an insertion or edit
+ * shifts the boundaries of the chunks around it and no others. Sizes are
+ * normalised around CDC_AVG: a stricter mask before it, a looser one
+ * after, nothing is hashed before CDC_MIN and no chunk exceeds CDC_MAX.
+ */
+
+#define CDC_MIN (16 * 1024)
+#define CDC_AVG (64 * 1024)
+#define CDC_MAX (256 * 1024)
+
+/* Length of the chunk starting at p; n is what remains of the input. */
+size_t cdc_next(const uint8_t *p, size_t n);
+
+int cdc_bench(int argc, char *argv[]);
+
+#endif
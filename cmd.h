@@ -0,0 +1,36 @@
+#ifndef CMD_H
+#define CMD_H
+
+#include <stdint.h>
+
+/*
+ * Subcommand dispatch. commands.def lists the commands as
+ * CMD(name, handler); tools/cmdhash.c reads it and writes cmdtab.h, a
+ * perfect hash from command name to position in that list. Telling a
+ * command from a ticket name then takes one hash, one table load and one
+ * strcmp however many commands there are. After editing the list:
+ *
+ *   cc -O2 -o cmdhash tools/cmdhash.c && ./cmdhash commands.def > cmdtab.h
+ */
+
+struct command {
+    const char *name;
+    int (*fn)(int argc, char *argv[]);
+};
+
+/* FNV-1a with a seed and a final mix; the generator searches for the seed. */
+static inline uint32_t cmd_hash(const char *s, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+#endif
@@ -0,0 +1,17 @@
+/* Generated by tools/cmdhash.c from commands.def; do not edit. */
+#ifndef CMDTAB_H
+#define CMDTAB_H
+
+#define CMDTAB_COUNT 27
+#define CMDTAB_SIZE 64
+#define CMDTAB_SEED 548u
+
+/* Slot -> position in commands.def, or -1. */
+static const signed char cmdtab_slots[CMDTAB_SIZE] = {
+    -1, 3, -1, -1, -1, -1, 18, -1, 8, -1, -1, 15, -1, -1, -1, -1,
+    -1, -1, -1, 1, -1, -1, -1, -1, -1, 24, 10, 13, 0, -1, 5, -1,
+    19, -1, -1, 6, 14, 20, -1, 7, 25, 17, 16, -1, 9, -1, 26, 11,
+    21, 22, -1, -1, -1, -1, 12, -1, 2, 4, -1, 23, -1, -1, -1, -1,
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int mkdir_p(const char *path)
+{
+    char tmp[4096];
+    char *p;
+
+    if (snprintf(tmp, sizeof(tmp), "%s", path) >= (int)sizeof(tmp))
+        return -1;
+    for (p = tmp + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static const char *home_dir(void)
+{
+    const char *home = getenv("USERPROFILE");
+
+    if (!home || !*home)
+        home = getenv("HOME");
+    return home && *home ? home : ".";
+}
+
+static int config_file(const char *name, char *out, size_t n)
+{
+    char dir[4096];
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+
+    if (xdg && *xdg)
+        snprintf(dir, sizeof(dir), "%s/FolderManager", xdg);
+    else
+        snprintf(dir, sizeof(dir), "%s/.config/FolderManager", home_dir());
+    if (mkdir_p(dir) != 0)
+        return -1;
+    if (snprintf(out, n, "%s/%s", dir, name) >= (int)n)
+        return -1;
+    return 0;
+}
+
+int config_path(char *out, size_t n)
+{
+    return config_file("config.txt", out, n);
+}
+
+int config_key_path(char *out, size_t n)
+{
+    const char *env = getenv("TFS_ARCHIVE_KEY");
+
+    if (env && *env)
+        return snprintf(out, n, "%s", env) >= (int)n ? -1 : 0;
+    return config_file("archive.key", out, n);
+}
+
+static void chomp(char *s)
+{
+    size_t len = strlen(s);
+
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r'))
+        s[--len] = '\0';
+}
+
+int config_save_base(const char *base)
+{
+    char path[4096], tmp[4200];
+    FILE *f;
+
+    if (config_path(path, sizeof(path)) != 0)
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "%s\n", base);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* The first line of config.txt; empty when there is none. */
+static int configured_base(char *line, size_t n)
+{
+    char path[4096];
+    FILE *f;
+
+    line[0] = '\0';
+    if (config_path(path, sizeof(path)) != 0)
+        return -1;
+    f = fopen(path, "r");
+    if (f) {
+        if (!fgets(line, (int)n, f))
+            line[0] = '\0';
+        fclose(f);
+        chomp(line);
+    }
+    return 0;
+}
+
+int config_read_base(char *base, size_t n)
+{
+    char line[4096];
+
+    if (configured_base(line, sizeof(line)) != 0)
+        return -1;
+    if (!line[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+    snprintf(base, n, "%s", line);
+    return mkdir_p(base);
+}
+
+int config_load_base(char *base, size_t n)
+{
+    char line[4096];
+
+    if (configured_base(line, sizeof(line)) != 0)
+        return -1;
+    if (line[0]) {
+        snprintf(base, n, "%s", line);
+        return mkdir_p(base);
+    }
+
+    snprintf(line, sizeof(line), "%s/Projects", home_dir());
+    printf("Base directory [%s]: ", line);
+    fflush(stdout);
+    {
+        char answer[4096];
+
+        if (fgets(answer, sizeof(answer), stdin)) {
+            chomp(answer);
+            if (answer[0])
+                snprintf(line, sizeof(line), "%s", answer);
+        }
+    }
+    snprintf(base, n, "%s", line);
+    if (mkdir_p(base) != 0)
+        return -1;
+    return config_save_base(base);
+}
+
+int config_state_dir(const char *base, char *out, size_t n)
+{
+    if (snprintf(out, n, "%s/.tfs", base) >= (int)n)
+        return -1;
+    return mkdir_p(out);
+}
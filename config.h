@@ -0,0 +1,21 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/* Steps 3 and 4: locate config.txt and read (or ask for) the base directory. */
+int config_path(char *out, size_t n);
+int config_load_base(char *base, size_t n);
+/* The configured base only; -1 instead of asking when there is none. */
+int config_read_base(char *base, size_t n);
+int config_save_base(const char *base);
+/*
+ * The archive master key: $TFS_ARCHIVE_KEY, else archive.key next to
+ * config.txt. Never under the base, which mirror copies wholesale.
+ */
+int config_key_path(char *out, size_t n);
+
+/* Per-base state (indexes, logs) lives in <base>/.tfs so it moves with it. */
+int config_state_dir(const char *base, char *out, size_t n);
+
+#endif
@@ -0,0 +1,540 @@
+#include "delta.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "bench.h"
+#include "bufout.h"
+#include "cdc.h"
+
+#define RECIPE_MAGIC "TFSRCP1"
+#define DELTA_HASH 32
+
+/* A pack record is this header followed by len bytes of chunk data. */
+struct pack_record {
+    uint8_t hash[DELTA_HASH];
+    uint32_t len;
+    uint32_t reserved;
+};
+
+/* One index entry per chunk in the pack. */
+struct chunk_ref {
+    uint8_t hash[DELTA_HASH];
+    uint64_t off;           /* of the data, past the record header */
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct extent {
+    uint64_t off;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct recipe_header {
+    char magic[8];
+    uint64_t size;
+    uint64_t count;
+    int64_t stored;
+};
+
+/*
+ * The chunk table, <state>/chunks/table: an open-addressed hash of the
+ * index (slot = index entry + 1, 0 for empty) kept on disk and mapped, so
+ * a put looks up its chunks without reading and hashing the whole index.
+ * count is how many index entries the table covers, or TABLE_DIRTY while
+ * a put is changing it; a table that does not match the index is rebuilt.
+ */
+#define TABLE_MAGIC "TFSCHT1"
+#define TABLE_DIRTY UINT64_MAX
+
+struct table_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t slots;
+    uint64_t reserved;
+};
+
+struct store {
+    int lock_fd, pack_fd, index_fd, table_fd;
+    char dir[4200];
+    uint64_t pack_len;
+    const struct chunk_ref *base;   /* the index as found on open, mapped */
+    size_t nbase, base_len;
+    struct chunk_ref *added;        /* appended by this put */
+    size_t nadded, cap;
+    struct table_header *th;        /* the mapped table */
+    uint32_t *table;
+    size_t mask;
+};
+
+static size_t slot_of(const struct store *s, const uint8_t *hash)
+{
+    uint64_t h;
+
+    memcpy(&h, hash, sizeof(h));
+    return h & s->mask;
+}
+
+static size_t store_count(const struct store *s)
+{
+    return s->nbase + s->nadded;
+}
+
+static const struct chunk_ref *ref_at(const struct store *s, size_t i)
+{
+    return i < s->nbase ? &s->base[i] : &s->added[i - s->nbase];
+}
+
+static void place(struct store *s, size_t i)
+{
+    size_t k = slot_of(s, ref_at(s, i)->hash);
+
+    while (s->table[k])
+        k = (k + 1) & s->mask;
+    s->table[k] = (uint32_t)i + 1;
+}
+
+static void table_unmap(struct store *s)
+{
+    if (s->th)
+        munmap(s->th, sizeof(*s->th) + (s->mask + 1) * sizeof(*s->table));
+    s->th = NULL;
+    s->table = NULL;
+}
+
+/* Write a fresh table for every entry, at most half full, and map it. */
+static int rebuild(struct store *s, uint64_t count)
+{
+    char path[4300], tmp[4300];
+    size_t slots = 1024, len, i;
+    void *p;
+    int fd;
+
+    while (slots < store_count(s) * 2 + 2)
+        slots *= 2;
+    len = sizeof(*s->th) + slots * sizeof(*s->table);
+    snprintf(path, sizeof(path), "%s/table", s->dir);
+    snprintf(tmp, sizeof(tmp), "%s/table.tmp", s->dir);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    p = ftruncate(fd, len) == 0 ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                : MAP_FAILED;
+    if (p == MAP_FAILED || rename(tmp, path) != 0) {
+        if (p != MAP_FAILED)
+            munmap(p, len);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    table_unmap(s);
+    if (s->table_fd >= 0)
+        close(s->table_fd);
+    s->table_fd = fd;
+    s->th = p;
+    s->table = (uint32_t *)(s->th + 1);
+    s->mask = slots - 1;
+    for (i = 0; i < store_count(s); i++)
+        place(s, i);
+    memcpy(s->th->magic, TABLE_MAGIC, 8);
+    s->th->slots = slots;
+    s->th->count = count;
+    return 0;
+}
+
+/* Map the table if it covers exactly the index, else rebuild it. */
+static int table_open(struct store *s)
+{
+    struct table_header h;
+    struct stat st;
+    char path[4300];
+    void *p;
+
+    snprintf(path, sizeof(path), "%s/table", s->dir);
+    s->table_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (s->table_fd >= 0 && fstat(s->table_fd, &st) == 0 &&
+        pread(s->table_fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, TABLE_MAGIC, 8) &&
+        h.count == s->nbase && h.slots >= 1024 && !(h.slots & (h.slots - 1)) &&
+        h.slots < (1ULL << 32) && h.slots >= 2 * h.count &&
+        (uint64_t)st.st_size == sizeof(h) + h.slots * sizeof(*s->table)) {
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->table_fd, 0);
+        if (p != MAP_FAILED) {
+            s->th = p;
+            s->table = (uint32_t *)(s->th + 1);
+            s->mask = h.slots - 1;
+            return 0;
+        }
+    }
+    return rebuild(s, s->nbase);
+}
+
+static const struct chunk_ref *lookup(const struct store *s, const uint8_t *hash)
+{
+    size_t k = slot_of(s, hash);
+
+    for (; s->table[k]; k = (k + 1) & s->mask) {
+        /* A slot from an unfinished put may name an entry that never landed. */
+        if (s->table[k] > store_count(s))
+            continue;
+        if (!memcmp(ref_at(s, s->table[k] - 1)->hash, hash, DELTA_HASH))
+            return ref_at(s, s->table[k] - 1);
+    }
+    return NULL;
+}
+
+static int insert(struct store *s, const struct chunk_ref *r)
+{
+    if (s->nadded == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        struct chunk_ref *p = realloc(s->added, cap * sizeof(*p));
+
+        if (!p)
+            return -1;
+        s->added = p;
+        s->cap = cap;
+    }
+    s->th->count = TABLE_DIRTY;
+    s->added[s->nadded++] = *r;
+    if (store_count(s) * 2 > s->mask + 1)
+        return rebuild(s, TABLE_DIRTY);
+    place(s, store_count(s) - 1);
+    return 0;
+}
+
+static void store_close(struct store *s)
+{
+    table_unmap(s);
+    if (s->base)
+        munmap((void *)s->base, s->base_len);
+    if (s->table_fd >= 0)
+        close(s->table_fd);
+    if (s->pack_fd >= 0)
+        close(s->pack_fd);
+    if (s->index_fd >= 0)
+        close(s->index_fd);
+    if (s->lock_fd >= 0) {
+        flock(s->lock_fd, LOCK_UN);
+        close(s->lock_fd);
+    }
+    free(s->added);
+}
+
+/* Open the chunk store for writing; one writer at a time. */
+static int store_open(struct store *s, const char *state_dir)
+{
+    char path[4300];
+    struct stat st;
+    size_t n;
+
+    memset(s, 0, sizeof(*s));
+    s->lock_fd = s->pack_fd = s->index_fd = s->table_fd = -1;
+    snprintf(s->dir, sizeof(s->dir), "%s/chunks", state_dir);
+    if (mkdir(s->dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s/.lock", s->dir);
+    s->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->lock_fd < 0 || flock(s->lock_fd, LOCK_EX) != 0)
+        goto fail;
+    snprintf(path, sizeof(path), "%s/pack", s->dir);
+    s->pack_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/index", s->dir);
+    s->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->pack_fd < 0 || s->index_fd < 0 || fstat(s->index_fd, &st) != 0)
+        goto fail;
+    n = st.st_size / sizeof(struct chunk_ref);
+    if (n > 0) {
+        s->base_len = n * sizeof(struct chunk_ref);
+        s->base = mmap(NULL, s->base_len, PROT_READ, MAP_SHARED, s->index_fd, 0);
+        if (s->base == MAP_FAILED) {
+            s->base = NULL;
+            goto fail;
+        }
+    }
+    if (fstat(s->pack_fd, &st) != 0)
+        goto fail;
+    /* Entries are in pack order: drop the tail the pack does not hold. */
+    while (n > 0 && s->base[n - 1].off + s->base[n - 1].len > (uint64_t)st.st_size)
+        n--;
+    s->nbase = n;
+    s->pack_len = n ? s->base[n - 1].off + s->base[n - 1].len : 0;
+    if (ftruncate(s->pack_fd, s->pack_len) != 0 ||
+        ftruncate(s->index_fd, n * sizeof(struct chunk_ref)) != 0 || table_open(s) != 0)
+        goto fail;
+    return 0;
+fail:
+    store_close(s);
+    return -1;
+}
+
+static void recipe_path(const char *state_dir, uint32_t ord, const char *name,
+                        char *out, size_t n)
+{
+    snprintf(out, n, "%s/delta/%u%s%s", state_dir, ord, name ? "/" : "", name ? name : "");
+}
+
+static int write_file(const char *path, const void *a, size_t na, const void *b, size_t nb)
+{
+    char tmp[4500];
+    struct bufout w;
+    int fd, rc;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    bufout_init(&w, fd);
+    bufout_write(&w, a, na);
+    bufout_write(&w, b, nb);
+    rc = bufout_flush(&w);
+    if (rc == 0)
+        rc = fdatasync(fd);
+    if (close(fd) != 0)
+        rc = -1;
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0)
+        unlink(tmp);
+    return rc;
+}
+
+int delta_put(const char *state_dir, uint32_t ord, const char *path, const char *name,
+              struct delta_stats *st)
+{
+    char dir[4200], rpath[4400];
+    struct recipe_header h;
+    struct extent *ext = NULL;
+    struct bufout *pack = NULL, *index = NULL;
+    struct store s;
+    struct timespec t0;
+    struct stat sb;
+    uint8_t md[EVP_MAX_MD_SIZE];
+    const uint8_t *p = NULL;
+    size_t off, n = 0, first_new;
+    EVP_MD_CTX *ctx = NULL;
+    int fd, rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    if (!name[0] || strchr(name, '/') || name[0] == '.') {
+        fprintf(stderr, "delta: bad name %s\n", name);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    if (sb.st_size > 0) {
+        p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise((void *)p, sb.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    if (store_open(&s, state_dir) != 0)
+        goto out_unmap;
+    first_new = s.nbase;
+
+    ext = malloc((sb.st_size / CDC_MIN + 2) * sizeof(*ext));
+    pack = malloc(sizeof(*pack));
+    index = malloc(sizeof(*index));
+    ctx = EVP_MD_CTX_new();
+    if (!ext || !pack || !index || !ctx || lseek(s.pack_fd, s.pack_len, SEEK_SET) < 0)
+        goto out;
+    bufout_init(pack, s.pack_fd);
+    for (off = 0; off < (size_t)sb.st_size; n++) {
+        struct timespec c0;
+        size_t len;
+        const struct chunk_ref *r;
+
+        clock_gettime(CLOCK_MONOTONIC, &c0);
+        len = cdc_next(p + off, sb.st_size - off);
+        st->chunk_ms += bench_ms_since(&c0);
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        EVP_DigestUpdate(ctx, p + off, len);
+        EVP_DigestFinal_ex(ctx, md, NULL);
+        r = lookup(&s, md);
+        if (!r) {
+            struct pack_record rec;
+            struct chunk_ref ref;
+
+            memset(&rec, 0, sizeof(rec));
+            memcpy(rec.hash, md, DELTA_HASH);
+            rec.len = (uint32_t)len;
+            memset(&ref, 0, sizeof(ref));
+            memcpy(ref.hash, md, DELTA_HASH);
+            ref.off = s.pack_len + sizeof(rec);
+            ref.len = (uint32_t)len;
+            if (bufout_write(pack, &rec, sizeof(rec)) != 0 ||
+                bufout_write(pack, p + off, len) != 0 || insert(&s, &ref) != 0)
+                goto out;
+            s.pack_len = ref.off + len;
+            r = ref_at(&s, store_count(&s) - 1);
+            st->new_chunks++;
+            st->new_bytes += len;
+        }
+        ext[n].off = r->off;
+        ext[n].len = r->len;
+        ext[n].reserved = 0;
+        off += len;
+    }
+    st->bytes = sb.st_size;
+    st->chunks = n;
+
+    /* Pack, then index, then recipe: each only refers to what is durable. */
+    if (bufout_flush(pack) != 0 || fdatasync(s.pack_fd) != 0)
+        goto out;
+    bufout_init(index, s.index_fd);
+    if (lseek(s.index_fd, first_new * sizeof(struct chunk_ref), SEEK_SET) < 0 ||
+        bufout_write(index, s.added, s.nadded * sizeof(struct chunk_ref)) != 0 ||
+        bufout_flush(index) != 0 || fdatasync(s.index_fd) != 0)
+        goto out;
+    s.th->count = store_count(&s);
+    snprintf(dir, sizeof(dir), "%s/delta", state_dir);
+    mkdir(dir, 0755);
+    recipe_path(state_dir, ord, NULL, dir, sizeof(dir));
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        goto out;
+    recipe_path(state_dir, ord, name, rpath, sizeof(rpath));
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RECIPE_MAGIC, 8);
+    h.size = sb.st_size;
+    h.count = n;
+    h.stored = time(NULL);
+    rc = write_file(rpath, &h, sizeof(h), ext, n * sizeof(*ext));
+out:
+    EVP_MD_CTX_free(ctx);
+    free(ext);
+    free(pack);
+    free(index);
+    store_close(&s);
+out_unmap:
+    if (p)
+        munmap((void *)p, sb.st_size);
+    st->total_ms = bench_ms_since(&t0);
+    return rc;
+}
+
+static int read_recipe(const char *path, struct recipe_header *h, struct extent **ext)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    size_t n;
+
+    *ext = NULL;
+    if (fd < 0)
+        return -1;
+    if (read(fd, h, sizeof(*h)) != sizeof(*h) || memcmp(h->magic, RECIPE_MAGIC, 8) ||
+        h->count > (1ULL << 32)) {
+        close(fd);
+        return -1;
+    }
+    n = h->count * sizeof(**ext);
+    *ext = malloc(n ? n : 1);
+    if (!*ext || read(fd, *ext, n) != (ssize_t)n) {
+        free(*ext);
+        *ext = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int delta_get(const char *state_dir, uint32_t ord, const char *name, int out_fd)
+{
+    char path[4400], *buf = NULL;
+    struct recipe_header h;
+    struct extent *ext;
+    uint64_t i;
+    int pack, rc = 0;
+
+    if (strchr(name, '/'))
+        return -1;
+    recipe_path(state_dir, ord, name, path, sizeof(path));
+    if (read_recipe(path, &h, &ext) != 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/chunks/pack", state_dir);
+    pack = open(path, O_RDONLY | O_CLOEXEC);
+    if (pack < 0) {
+        free(ext);
+        return -1;
+    }
+    for (i = 0; rc == 0 && i < h.count; i++) {
+        loff_t off = ext[i].off;
+        size_t left = ext[i].len;
+
+        while (left > 0) {
+            ssize_t r = buf ? -1 : copy_file_range(pack, &off, out_fd, NULL, left, 0);
+
+            /* Pipes, terminals and other filesystems take the slow path. */
+            if (r < 0 && (buf || errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                          errno == EOPNOTSUPP || errno == EBADF)) {
+                if (!buf && !(buf = malloc(CDC_MAX))) {
+                    rc = -1;
+                    break;
+                }
+                r = pread(pack, buf, left, off);
+                if (r > 0 && write(out_fd, buf, r) != r)
+                    r = -1;
+                if (r > 0)
+                    off += r;
+            }
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR)
+                    continue;
+                rc = -1;
+                break;
+            }
+            left -= r;
+        }
+    }
+    free(buf);
+    free(ext);
+    close(pack);
+    return rc;
+}
+
+int delta_list(const char *state_dir, uint32_t ord, FILE *out)
+{
+    char dir[4200], path[4500], when[32];
+    struct recipe_header h;
+    struct extent *ext;
+    struct dirent *de;
+    DIR *d;
+
+    recipe_path(state_dir, ord, NULL, dir, sizeof(dir));
+    d = opendir(dir);
+    if (!d)
+        return 0;
+    while ((de = readdir(d)) != NULL) {
+        time_t t;
+
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (read_recipe(path, &h, &ext) != 0)
+            continue;
+        t = h.stored;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+        fprintf(out, "%-32s %14llu bytes %8llu chunks  %s\n", de->d_name,
+                (unsigned long long)h.size, (unsigned long long)h.count, when);
+        free(ext);
+    }
+    closedir(d);
+    return 0;
+}
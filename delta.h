@@ -0,0 +1,34 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Deduplicating store for attachments that arrive again and again in
+ * slightly different versions. Files are cut into content-defined chunks
+ * (cdc.h); each distinct chunk, keyed by SHA-256, is appended once to a
+ * global pack under <state>/chunks and a file is kept as a recipe of pack
+ * extents under <state>/delta/<ord>/<name>. Reads recompose the file from
+ * the pack with copy_file_range.
+ *
+ * The pack is synced before the index and the index before the recipe,
+ * so a crash loses at most the file being stored; index entries pointing
+ * past the end of the pack are dropped on open. Lookups go through a
+ * hash table of the index kept mapped in <state>/chunks/table, so a put
+ * costs its own chunks rather than a pass over every chunk stored; a
+ * table left behind by a failed put is rebuilt from the index.
+ */
+
+struct delta_stats {
+    uint64_t bytes, chunks;
+    uint64_t new_bytes, new_chunks;
+    double chunk_ms, total_ms;
+};
+
+int delta_put(const char *state_dir, uint32_t ord, const char *path, const char *name,
+              struct delta_stats *st);
+int delta_get(const char *state_dir, uint32_t ord, const char *name, int out_fd);
+int delta_list(const char *state_dir, uint32_t ord, FILE *out);
+
+#endif
@@ -0,0 +1,289 @@
+#include "efset.h"
+
+#include <string.h>
+
+struct ef_header {
+    uint64_t n, u;
+    uint64_t l;
+    uint64_t high_bits;
+    uint64_t ns1, ns0;
+};
+
+static uint32_t low_bits_for(uint64_t n, uint64_t u)
+{
+    uint32_t l = 0;
+
+    if (n == 0)
+        return 0;
+    while (l < 63 && (u / n) >> (l + 1))
+        l++;
+    return l;
+}
+
+static uint64_t words(uint64_t bits)
+{
+    return (bits + 63) / 64;
+}
+
+static void layout(uint64_t n, uint64_t u, uint32_t *l, uint64_t *high_bits,
+                   uint64_t *ns1, uint64_t *ns0)
+{
+    uint64_t zeros;
+
+    *l = low_bits_for(n, u);
+    zeros = (u >> *l) + 1;
+    *high_bits = n + zeros;
+    *ns1 = (n + EF_SAMPLE - 1) / EF_SAMPLE;
+    *ns0 = (zeros + EF_SAMPLE - 1) / EF_SAMPLE;
+}
+
+size_t ef_size(uint64_t n, uint64_t u)
+{
+    uint64_t high_bits, ns1, ns0;
+    uint32_t l;
+
+    layout(n, u, &l, &high_bits, &ns1, &ns0);
+    return sizeof(struct ef_header) +
+           8 * (words(n * l) + words(high_bits) + ns1 + ns0);
+}
+
+static void bind(struct efset *s, const struct ef_header *h)
+{
+    const uint64_t *p = (const uint64_t *)(h + 1);
+
+    s->n = h->n;
+    s->u = h->u;
+    s->l = (uint32_t)h->l;
+    s->high_bits = h->high_bits;
+    s->ns1 = h->ns1;
+    s->ns0 = h->ns0;
+    s->low = p;
+    p += words(s->n * s->l);
+    s->high = p;
+    p += words(s->high_bits);
+    s->s1 = p;
+    p += s->ns1;
+    s->s0 = p;
+}
+
+int ef_build(const uint64_t *values, uint64_t n, void *buf, size_t len)
+{
+    struct ef_header *h = buf;
+    uint64_t *low, *high, *s1, *s0;
+    uint64_t u = n ? values[n - 1] + 1 : 0;
+    uint64_t i, pos, ones = 0, zeros = 0;
+    uint32_t l;
+    struct efset s;
+
+    if (len < ef_size(n, u))
+        return -1;
+    memset(buf, 0, ef_size(n, u));
+    h->n = n;
+    h->u = u;
+    layout(n, u, &l, &h->high_bits, &h->ns1, &h->ns0);
+    h->l = l;
+    bind(&s, h);
+    low = (uint64_t *)s.low;
+    high = (uint64_t *)s.high;
+    s1 = (uint64_t *)s.s1;
+    s0 = (uint64_t *)s.s0;
+
+    for (i = 0; i < n; i++) {
+        uint64_t v = values[i];
+
+        if (i > 0 && v <= values[i - 1])
+            return -1;
+        if (l) {
+            uint64_t bit = i * l, lv = v & ((1ULL << l) - 1);
+
+            low[bit / 64] |= lv << (bit % 64);
+            if (bit % 64 + l > 64)
+                low[bit / 64 + 1] |= lv >> (64 - bit % 64);
+        }
+        pos = (v >> l) + i;
+        high[pos / 64] |= 1ULL << (pos % 64);
+    }
+
+    for (pos = 0; pos < h->high_bits; pos++) {
+        if ((high[pos / 64] >> (pos % 64)) & 1) {
+            if (ones % EF_SAMPLE == 0)
+                s1[ones / EF_SAMPLE] = pos;
+            ones++;
+        } else {
+            if (zeros % EF_SAMPLE == 0 && zeros / EF_SAMPLE < h->ns0)
+                s0[zeros / EF_SAMPLE] = pos;
+            zeros++;
+        }
+    }
+    return 0;
+}
+
+int ef_view(struct efset *s, const void *buf, size_t len)
+{
+    const struct ef_header *h = buf;
+
+    if (len < sizeof(*h) || ((uintptr_t)buf & 7) != 0)
+        return -1;
+    if (h->l > 63 || len < ef_size(h->n, h->u))
+        return -1;
+    bind(s, h);
+    return 0;
+}
+
+/* Position of the k-th (0-based) set bit of w. */
+static uint32_t select_in_word(uint64_t w, uint32_t k)
+{
+#if defined(__BMI2__)
+    return __builtin_ctzll(__builtin_ia32_pdep_di(1ULL << k, w));
+#else
+    uint32_t base = 0;
+
+    for (;;) {
+        uint32_t c = __builtin_popcount((uint32_t)w);
+
+        if (k < c)
+            break;
+        k -= c;
+        w >>= 32;
+        base += 32;
+    }
+    while (k--)
+        w &= w - 1;
+    return base + __builtin_ctzll(w);
+#endif
+}
+
+/* Position of the i-th one in the high bitvector. */
+static uint64_t select1(const struct efset *s, uint64_t i)
+{
+    uint64_t pos = s->s1[i / EF_SAMPLE];
+    uint64_t k = i % EF_SAMPLE, wi = pos / 64;
+    uint64_t w = s->high[wi] & (~0ULL << (pos % 64));
+
+    for (;;) {
+        uint32_t c = __builtin_popcountll(w);
+
+        if (k < c)
+            return wi * 64 + select_in_word(w, (uint32_t)k);
+        k -= c;
+        w = s->high[++wi];
+    }
+}
+
+/* Position of the i-th zero in the high bitvector. */
+static uint64_t select0(const struct efset *s, uint64_t i)
+{
+    uint64_t pos = s->s0[i / EF_SAMPLE];
+    uint64_t k = i % EF_SAMPLE, wi = pos / 64;
+    uint64_t w = ~s->high[wi] & (~0ULL << (pos % 64));
+
+    for (;;) {
+        uint32_t c = __builtin_popcountll(w);
+
+        if (k < c)
+            return wi * 64 + select_in_word(w, (uint32_t)k);
+        k -= c;
+        w = ~s->high[++wi];
+    }
+}
+
+static uint64_t low_at(const struct efset *s, uint64_t i)
+{
+    uint64_t bit = i * s->l, v;
+
+    if (s->l == 0)
+        return 0;
+    v = s->low[bit / 64] >> (bit % 64);
+    if (bit % 64 + s->l > 64)
+        v |= s->low[bit / 64 + 1] << (64 - bit % 64);
+    return v & ((1ULL << s->l) - 1);
+}
+
+uint64_t ef_select(const struct efset *s, uint64_t i)
+{
+    if (i >= s->n)
+        return EF_NONE;
+    return ((select1(s, i) - i) << s->l) | low_at(s, i);
+}
+
+uint64_t ef_lower_bound(const struct efset *s, uint64_t x, uint64_t *value)
+{
+    uint64_t hx, pos, i;
+
+    if (x >= s->u) {
+        if (value)
+            *value = EF_NONE;
+        return s->n;
+    }
+    hx = x >> s->l;
+    /* Values with high part hx start right after the hx-th zero. */
+    pos = hx == 0 ? 0 : select0(s, hx - 1) + 1;
+    i = pos - hx;
+    for (; i < s->n; pos++) {
+        uint64_t v;
+
+        if (!((s->high[pos / 64] >> (pos % 64)) & 1)) {
+            /* Bucket exhausted: the next value is the answer. */
+            hx++;
+            continue;
+        }
+        v = (hx << s->l) | low_at(s, i);
+        if (v >= x) {
+            if (value)
+                *value = v;
+            return i;
+        }
+        i++;
+    }
+    if (value)
+        *value = EF_NONE;
+    return s->n;
+}
+
+uint64_t ef_rank(const struct efset *s, uint64_t x)
+{
+    return ef_lower_bound(s, x, NULL);
+}
+
+int ef_contains(const struct efset *s, uint64_t x)
+{
+    uint64_t v;
+
+    ef_lower_bound(s, x, &v);
+    return v == x;
+}
+
+uint64_t ef_successor(const struct efset *s, uint64_t x)
+{
+    uint64_t v;
+
+    if (x == UINT64_MAX)
+        return EF_NONE;
+    ef_lower_bound(s, x + 1, &v);
+    return v;
+}
+
+void ef_iter_init(struct ef_iter *it, const struct efset *s)
+{
+    it->s = s;
+    it->i = 0;
+    it->pos = 0;
+}
+
+int ef_iter_next(struct ef_iter *it, uint64_t *value)
+{
+    const struct efset *s = it->s;
+    uint64_t w;
+
+    if (it->i >= s->n)
+        return 0;
+    /* Skip to the next set bit at or after pos. */
+    w = s->high[it->pos / 64] & (~0ULL << (it->pos % 64));
+    while (!w)
+        w = s->high[(it->pos = (it->pos / 64 + 1) * 64) / 64];
+    it->pos = (it->pos / 64) * 64 + __builtin_ctzll(w);
+    *value = ((it->pos - it->i) << s->l) | low_at(s, it->i);
+    it->i++;
+    it->pos++;
+    return 1;
+}
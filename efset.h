@@ -0,0 +1,57 @@
+#ifndef EFSET_H
+#define EFSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Elias-Fano encoding of a sorted set of integers. The low l bits of each
+ * value are packed into a flat array; the high parts are stored in unary
+ * as a bitvector with one set bit per value, sampled every EF_SAMPLE ones
+ * and zeros so select stays a short scan. A dense set costs about
+ * 2 + log2(u/n) bits per value.
+ *
+ * An encoded set is one position-independent blob (ef_build) that can be
+ * read in place from a mapped file (ef_view).
+ */
+
+#define EF_SAMPLE 256
+#define EF_NONE UINT64_MAX
+
+struct efset {
+    uint64_t n;             /* number of values */
+    uint64_t u;             /* all values < u */
+    uint32_t l;             /* low bits per value */
+    uint64_t high_bits;     /* length of the high bitvector */
+    const uint64_t *low;
+    const uint64_t *high;
+    const uint64_t *s1;     /* position of every EF_SAMPLE-th one */
+    const uint64_t *s0;     /* position of every EF_SAMPLE-th zero */
+    uint64_t ns1, ns0;
+};
+
+/* Bytes needed to encode n values below u. */
+size_t ef_size(uint64_t n, uint64_t u);
+/* Encode strictly increasing values into buf (8-byte aligned, ef_size bytes). */
+int ef_build(const uint64_t *values, uint64_t n, void *buf, size_t len);
+int ef_view(struct efset *s, const void *buf, size_t len);
+
+struct ef_iter {
+    const struct efset *s;
+    uint64_t i;             /* next value index */
+    uint64_t pos;           /* position in the high bitvector */
+};
+
+uint64_t ef_select(const struct efset *s, uint64_t i);
+/* Sequential decode in ascending order; returns 0 when exhausted. */
+void ef_iter_init(struct ef_iter *it, const struct efset *s);
+int ef_iter_next(struct ef_iter *it, uint64_t *value);
+/* Index of the first value >= x (n if none); *value receives it. */
+uint64_t ef_lower_bound(const struct efset *s, uint64_t x, uint64_t *value);
+/* Number of values < x. */
+uint64_t ef_rank(const struct efset *s, uint64_t x);
+int ef_contains(const struct efset *s, uint64_t x);
+/* Smallest value > x, or EF_NONE. */
+uint64_t ef_successor(const struct efset *s, uint64_t x);
+
+#endif
@@ -0,0 +1,542 @@
+#include "fsck.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "index.h"
+#include "journal.h"
+#include "list.h"
+#include "meta.h"
+#include "pool.h"
+#include "tags.h"
+#include "ticket.h"
+
+struct folder {
+    char prefix[INDEX_PREFIX_MAX];
+    uint64_t number;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t btime;          /* 0 when the filesystem does not report it */
+    uint32_t width;         /* digits in the name */
+    uint32_t name;          /* offset into the name arena */
+    uint32_t ok;            /* stat succeeded and it is a directory */
+};
+
+struct indexed {
+    char prefix[INDEX_PREFIX_MAX];
+    uint64_t number;
+    uint32_t width;
+    uint32_t ord;           /* registry ordinal, or TICKET_NONE */
+};
+
+struct scan {
+    int basefd;
+    const struct ordmap *reg;
+    char *names;
+    size_t names_len, names_cap;
+    struct folder *f;
+    size_t nf, capf;
+    struct indexed *ix;
+    size_t nix, capix;
+};
+
+enum { ISSUE_MISSING, ISSUE_EXTRA, ISSUE_RENAMED, ISSUE_STALE };
+
+struct issue {
+    int kind;
+    size_t folder;          /* extra, renamed (new), stale */
+    size_t indexed;         /* missing, renamed (old), stale */
+    const char *why;
+};
+
+static int add_folder(struct scan *s, const char *name, const char *prefix,
+                      uint64_t number, int width)
+{
+    size_t len = strlen(name) + 1;
+
+    if (s->nf == s->capf) {
+        size_t cap = s->capf ? s->capf * 2 : 4096;
+        struct folder *f = realloc(s->f, cap * sizeof(*f));
+
+        if (!f)
+            return -1;
+        s->f = f;
+        s->capf = cap;
+    }
+    if (s->names_len + len > s->names_cap) {
+        size_t cap = s->names_cap ? s->names_cap * 2 : 65536;
+        char *p = realloc(s->names, cap);
+
+        if (!p)
+            return -1;
+        s->names = p;
+        s->names_cap = cap;
+    }
+    memcpy(s->names + s->names_len, name, len);
+    memset(&s->f[s->nf], 0, sizeof(s->f[s->nf]));
+    snprintf(s->f[s->nf].prefix, INDEX_PREFIX_MAX, "%s", prefix);
+    s->f[s->nf].number = number;
+    s->f[s->nf].width = (uint32_t)width;
+    s->f[s->nf].name = (uint32_t)s->names_len;
+    s->names_len += len;
+    s->nf++;
+    return 0;
+}
+
+static void stat_folder(size_t i, void *arg)
+{
+    struct scan *s = arg;
+    struct folder *f = &s->f[i];
+    struct statx stx;
+
+    if (statx(s->basefd, s->names + f->name, AT_SYMLINK_NOFOLLOW,
+              STATX_TYPE | STATX_INO | STATX_MTIME | STATX_BTIME, &stx) == 0 &&
+        S_ISDIR(stx.stx_mode)) {
+        f->ino = stx.stx_ino;
+        f->mtime = stx.stx_mtime.tv_sec;
+        if (stx.stx_mask & STATX_BTIME)
+            f->btime = stx.stx_btime.tv_sec;
+        f->ok = 1;
+    }
+}
+
+static int add_indexed(const char *prefix, uint64_t number, uint32_t width, void *arg)
+{
+    struct scan *s = arg;
+    char name[TICKET_NAME_MAX + 1];
+
+    if (s->nix == s->capix) {
+        size_t cap = s->capix ? s->capix * 2 : 4096;
+        struct indexed *p = realloc(s->ix, cap * sizeof(*p));
+
+        if (!p)
+            return -1;
+        s->ix = p;
+        s->capix = cap;
+    }
+    memset(s->ix[s->nix].prefix, 0, INDEX_PREFIX_MAX);
+    snprintf(s->ix[s->nix].prefix, INDEX_PREFIX_MAX, "%s", prefix);
+    s->ix[s->nix].number = number;
+    s->ix[s->nix].width = width;
+    snprintf(name, sizeof(name), "%s%0*llu", prefix, (int)width, (unsigned long long)number);
+    s->ix[s->nix].ord = ordmap_lookup(s->reg, name);
+    s->nix++;
+    return 0;
+}
+
+static int cmp_folder_prefix(const void *a, const void *b, void *arg)
+{
+    const struct folder *f = arg;
+
+    return strcmp(f[*(const size_t *)a].prefix, f[*(const size_t *)b].prefix);
+}
+
+/* Index order by comparison, for when the prefixes do not fit in the keys. */
+static int cmp_folders(const void *a, const void *b, void *arg)
+{
+    const struct folder *x = (const struct folder *)arg + *(const size_t *)a;
+    const struct folder *y = (const struct folder *)arg + *(const size_t *)b;
+    int c = strcmp(x->prefix, y->prefix);
+
+    if (c)
+        return c;
+    if (x->number != y->number)
+        return x->number < y->number ? -1 : 1;
+    return x->width < y->width ? -1 : x->width > y->width;
+}
+
+/* Put the folders in index order: prefix (strcmp), number, then width. */
+static int sort_folders(struct scan *s, size_t **order)
+{
+    struct list_entry *e;
+    size_t i, j;
+    uint64_t rank = 0;
+
+    *order = malloc((s->nf ? s->nf : 1) * sizeof(**order));
+    if (!*order)
+        return -1;
+    for (i = 0; i < s->nf; i++)
+        (*order)[i] = i;
+    /* Rank the prefixes by sorting the folders on them. */
+    qsort_r(*order, s->nf, sizeof(**order), cmp_folder_prefix, s->f);
+    for (i = 1; i < s->nf; i++)
+        rank += strcmp(s->f[(*order)[i - 1]].prefix, s->f[(*order)[i]].prefix) != 0;
+    if (rank >= LIST_PREFIX_MAX) {
+        qsort_r(*order, s->nf, sizeof(**order), cmp_folders, s->f);
+        return 0;
+    }
+    e = malloc((s->nf ? s->nf : 1) * sizeof(*e));
+    if (!e)
+        return -1;
+    for (i = 0, rank = 0; i < s->nf; i++) {
+        if (i > 0 && strcmp(s->f[(*order)[i - 1]].prefix, s->f[(*order)[i]].prefix))
+            rank++;
+        e[i].key = (rank << LIST_NUMBER_BITS) | s->f[(*order)[i]].number;
+        e[i].name = (uint32_t)(*order)[i];
+    }
+    if (list_radix_sort(e, s->nf) != 0) {
+        free(e);
+        return -1;
+    }
+    /* INC2 and INC0000002 share a key; order such runs by width. */
+    for (i = 1; i < s->nf; i++) {
+        struct list_entry t = e[i];
+
+        for (j = i; j > 0 && e[j - 1].key == t.key &&
+                    s->f[e[j - 1].name].width > s->f[t.name].width; j--)
+            e[j] = e[j - 1];
+        e[j] = t;
+    }
+    for (i = 0; i < s->nf; i++)
+        (*order)[i] = e[i].name;
+    free(e);
+    return 0;
+}
+
+static int push_issue(struct issue **v, size_t *n, size_t *cap, int kind,
+                      size_t folder, size_t indexed, const char *why)
+{
+    if (*n == *cap) {
+        size_t c = *cap ? *cap * 2 : 256;
+        struct issue *p = realloc(*v, c * sizeof(*p));
+
+        if (!p)
+            return -1;
+        *v = p;
+        *cap = c;
+    }
+    (*v)[*n].kind = kind;
+    (*v)[*n].folder = folder;
+    (*v)[*n].indexed = indexed;
+    (*v)[*n].why = why;
+    (*n)++;
+    return 0;
+}
+
+static void indexed_name(const struct indexed *x, char *out, size_t n)
+{
+    snprintf(out, n, "%s%0*llu", x->prefix, (int)x->width, (unsigned long long)x->number);
+}
+
+struct retag {
+    const char *state_dir;
+    uint32_t from, to;
+};
+
+static int retag_one(const char *tag, void *arg)
+{
+    struct retag *r = arg;
+    struct rbitmap b;
+    int has;
+
+    if (tags_load(r->state_dir, tag, &b) != 0)
+        return 0;
+    has = rb_contains(&b, r->from);
+    rb_free(&b);
+    if (has)
+        tags_move(r->state_dir, tag, r->from, r->to);
+    return 0;
+}
+
+static int archived(const struct meta *meta, uint32_t ord)
+{
+    return ord != TICKET_NONE && ord < meta->count && meta->state[ord] == TICKET_ARCHIVED;
+}
+
+static int repair(struct scan *s, const char *base, const char *state_dir,
+                  struct ordmap *names, struct meta *meta, const struct issue *v,
+                  size_t n, uint64_t *repaired)
+{
+    struct index_writer w;
+    char name[TICKET_NAME_MAX + 1], path[8192];
+    int64_t now = time(NULL);
+    size_t i;
+
+    if (index_writer_open(&w, state_dir) != 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        const struct folder *f = v[i].kind != ISSUE_MISSING ? &s->f[v[i].folder] : NULL;
+        const char *fname = f ? s->names + f->name : NULL;
+        uint32_t ord, old = TICKET_NONE;
+        int rc = 0;
+
+        switch (v[i].kind) {
+        case ISSUE_MISSING:
+            indexed_name(&s->ix[v[i].indexed], name, sizeof(name));
+            ord = s->ix[v[i].indexed].ord;
+            /* Archived tickets stay indexed; never drop one here. */
+            if (archived(meta, ord))
+                continue;
+            rc = index_remove(&w, name);
+            if (rc == 0 && ord != TICKET_NONE) {
+                int64_t size = ord < meta->count ? meta->size[ord] : 0;
+
+                rc = meta_set_state(meta, ord, TICKET_DELETED, now);
+                if (rc == 0)
+                    journal_append(state_dir, JOURNAL_DELETE, ord, now, -size);
+            }
+            break;
+        case ISSUE_RENAMED:
+            indexed_name(&s->ix[v[i].indexed], name, sizeof(name));
+            old = s->ix[v[i].indexed].ord;
+            rc = index_remove(&w, name);
+            /* fall through */
+        case ISSUE_EXTRA:
+            if (rc == 0)
+                rc = index_add(&w, fname);
+            ord = ordmap_add(names, fname);
+            if (rc == 0 && ord != TICKET_NONE) {
+                snprintf(path, sizeof(path), "%s/%s", base, fname);
+                rc = meta_rescan(meta, ord, path);
+                if (v[i].kind == ISSUE_RENAMED && old != TICKET_NONE && rc == 0) {
+                    struct retag r = { state_dir, old, ord };
+
+                    meta->ctime[ord] = meta->ctime[old];
+                    meta->base[ord] = meta->base[old];
+                    meta->state[old] = TICKET_DELETED;
+                    tags_foreach(state_dir, retag_one, &r);
+                }
+            }
+            break;
+        case ISSUE_STALE:
+            ord = ordmap_lookup(names, fname);
+            snprintf(path, sizeof(path), "%s/%s", base, fname);
+            if (ord == TICKET_NONE)
+                ord = ordmap_add(names, fname);
+            if (ord != TICKET_NONE)
+                rc = meta_rescan(meta, ord, path);
+            break;
+        }
+        if (rc == 0)
+            (*repaired)++;
+    }
+    index_writer_close(&w);
+    return 0;
+}
+
+/*
+ * Pair missing tickets with extra folders that carry their old inode,
+ * looking the extras up by inode in an open-addressed table. Inode numbers
+ * are reused once a folder is removed, so a folder born after the ticket
+ * was recorded is not the same folder.
+ */
+static int pair_renames(const struct scan *s, const struct meta *meta, struct issue *v,
+                        size_t n)
+{
+    size_t *slot, mask = 15, i, h;
+
+    while (mask + 1 < 2 * n)
+        mask = mask * 2 + 1;
+    slot = calloc(mask + 1, sizeof(*slot));     /* issue index + 1, 0 when empty */
+    if (!slot)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (v[i].kind != ISSUE_EXTRA)
+            continue;
+        for (h = s->f[v[i].folder].ino * 0x9e3779b97f4a7c15ULL >> 32 & mask; slot[h];
+             h = (h + 1) & mask)
+            ;
+        slot[h] = i + 1;
+    }
+    for (i = 0; i < n; i++) {
+        uint32_t ord;
+
+        if (v[i].kind != ISSUE_MISSING)
+            continue;
+        ord = s->ix[v[i].indexed].ord;
+        if (ord == TICKET_NONE || ord >= meta->count || !meta->ino[ord])
+            continue;
+        for (h = meta->ino[ord] * 0x9e3779b97f4a7c15ULL >> 32 & mask; slot[h];
+             h = (h + 1) & mask) {
+            struct issue *x = &v[slot[h] - 1];
+            const struct folder *f = &s->f[x->folder];
+
+            if (x->kind == ISSUE_EXTRA && f->ino == meta->ino[ord] &&
+                (!f->btime || f->btime <= meta->ctime[ord])) {
+                v[i].kind = ISSUE_RENAMED;
+                v[i].folder = x->folder;
+                x->kind = -1;
+                break;
+            }
+        }
+    }
+    free(slot);
+    return 0;
+}
+
+int fsck_run(const char *base, const char *state_dir, const struct fsck_opts *o,
+             struct fsck_report *r, FILE *out)
+{
+    struct scan s;
+    struct ordmap names;
+    struct meta meta;
+    struct tindex ix;
+    struct issue *issues = NULL;
+    struct timespec t0;
+    struct dirent *de;
+    size_t *order = NULL, nissues = 0, capissues = 0, i, j;
+    int have_meta, have_index, rc = -1;
+    DIR *d;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(r, 0, sizeof(*r));
+    memset(&s, 0, sizeof(s));
+    s.basefd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s.basefd < 0)
+        return -1;
+    if (ordmap_open(&names, state_dir) != 0) {
+        close(s.basefd);
+        return -1;
+    }
+    have_meta = meta_open(&meta, state_dir) == 0;
+    have_index = index_open(&ix, state_dir) == 0;
+    s.reg = &names;
+
+    /* Scan: list, stat in parallel, sort; index read without locks. */
+    d = fdopendir(dup(s.basefd));
+    if (!d)
+        goto out;
+    while ((de = readdir(d)) != NULL) {
+        char prefix[INDEX_PREFIX_MAX];
+        uint64_t number;
+        int width;
+
+        if (de->d_name[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+            continue;
+        memset(prefix, 0, sizeof(prefix));
+        if (ticket_parse(de->d_name, prefix, sizeof(prefix), &number, &width) != 0 ||
+            number >= (1ULL << LIST_NUMBER_BITS))
+            continue;
+        if (add_folder(&s, de->d_name, prefix, number, width) != 0) {
+            closedir(d);
+            goto out;
+        }
+    }
+    closedir(d);
+    pool_for(s.nf, o->threads, stat_folder, &s);
+    if (sort_folders(&s, &order) != 0)
+        goto out;
+    if (have_index && index_foreach(&ix, add_indexed, &s) != 0)
+        goto out;
+    r->folders = s.nf;
+    r->indexed = s.nix;
+
+    /* Merge-join the two sorted sequences. */
+    for (i = 0, j = 0; i < s.nf || j < s.nix;) {
+        const struct folder *f = i < s.nf ? &s.f[order[i]] : NULL;
+        const struct indexed *x = j < s.nix ? &s.ix[j] : NULL;
+        int c;
+
+        if (f && !f->ok) {
+            i++;
+            continue;
+        }
+        if (!f)
+            c = 1;
+        else if (!x)
+            c = -1;
+        else if ((c = strcmp(f->prefix, x->prefix)) == 0) {
+            c = f->number < x->number ? -1 : f->number > x->number;
+            if (c == 0)
+                c = f->width < x->width ? -1 : f->width > x->width;
+        }
+
+        if (c < 0) {
+            if (push_issue(&issues, &nissues, &capissues, ISSUE_EXTRA, order[i], 0, NULL))
+                goto out;
+            i++;
+        } else if (c > 0) {
+            /* Archived tickets live in packs, not folders. */
+            if (!have_meta || !archived(&meta, x->ord)) {
+                if (push_issue(&issues, &nissues, &capissues, ISSUE_MISSING, 0, j, NULL))
+                    goto out;
+            }
+            j++;
+        } else {
+            uint32_t ord = ordmap_lookup(&names, s.names + f->name);
+            const char *why = NULL;
+
+            if (ord == TICKET_NONE)
+                why = "not in the registry";
+            else if (!have_meta || ord >= meta.count || meta.ctime[ord] == 0)
+                why = "no metadata row";
+            else if (meta.state[ord] == TICKET_DELETED || meta.state[ord] == TICKET_UNKNOWN)
+                why = "metadata says deleted";
+            else if (meta.ino[ord] && meta.ino[ord] != f->ino)
+                why = "folder was replaced";
+            else if (meta.mtime[ord] < f->mtime)
+                why = "changed since last scan";
+            if (why && push_issue(&issues, &nissues, &capissues, ISSUE_STALE,
+                                  order[i], j, why))
+                goto out;
+            i++;
+            j++;
+        }
+    }
+
+    if (have_meta && pair_renames(&s, &meta, issues, nissues) != 0)
+        goto out;
+    r->scan_ms = bench_ms_since(&t0);
+
+    for (i = 0; i < nissues; i++) {
+        char name[TICKET_NAME_MAX + 1];
+
+        switch (issues[i].kind) {
+        case ISSUE_MISSING:
+            r->missing++;
+            indexed_name(&s.ix[issues[i].indexed], name, sizeof(name));
+            if (!o->quiet)
+                fprintf(out, "missing  %s\n", name);
+            break;
+        case ISSUE_EXTRA:
+            r->extra++;
+            if (!o->quiet)
+                fprintf(out, "extra    %s\n", s.names + s.f[issues[i].folder].name);
+            break;
+        case ISSUE_RENAMED:
+            r->renamed++;
+            indexed_name(&s.ix[issues[i].indexed], name, sizeof(name));
+            if (!o->quiet)
+                fprintf(out, "renamed  %s -> %s\n", name,
+                        s.names + s.f[issues[i].folder].name);
+            break;
+        case ISSUE_STALE:
+            r->stale++;
+            if (!o->quiet)
+                fprintf(out, "stale    %s (%s)\n", s.names + s.f[issues[i].folder].name,
+                        issues[i].why);
+            break;
+        }
+    }
+
+    /* Compact away the pairs folded into renames before repairing. */
+    for (i = 0, j = 0; i < nissues; i++)
+        if (issues[i].kind >= 0)
+            issues[j++] = issues[i];
+    nissues = j;
+    if (o->repair && nissues > 0 && have_meta &&
+        repair(&s, base, state_dir, &names, &meta, issues, nissues, &r->repaired) != 0)
+        goto out;
+    r->total_ms = bench_ms_since(&t0);
+    rc = 0;
+
+out:
+    free(issues);
+    free(order);
+    free(s.f);
+    free(s.ix);
+    free(s.names);
+    close(s.basefd);
+    if (have_index)
+        index_close(&ix);
+    if (have_meta)
+        meta_close(&meta);
+    ordmap_close(&names);
+    return rc;
+}
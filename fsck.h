@@ -0,0 +1,35 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * fsck: reconcile the ticket index and metadata with the folders under the
+ * base. The base is listed once and stat'ed in parallel, sorted into index
+ * order and merge-joined against the index. The scan reads the index like
+ * any other reader; the writer lock is taken only to apply repairs.
+ *
+ *   missing  indexed, but no folder
+ *   extra    folder, but not indexed
+ *   renamed  a missing ticket whose recorded inode is now an extra folder
+ *   stale    both present, but the metadata row is wrong or out of date
+ */
+
+struct fsck_opts {
+    int repair;
+    int threads;            /* 0 for one per CPU */
+    int quiet;              /* totals only */
+};
+
+struct fsck_report {
+    uint64_t folders, indexed;
+    uint64_t missing, extra, renamed, stale;
+    uint64_t repaired;
+    double scan_ms, total_ms;
+};
+
+int fsck_run(const char *base, const char *state_dir, const struct fsck_opts *o,
+             struct fsck_report *r, FILE *out);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Ticket lifecycle hooks. Plugins are shared objects in <state>/plugins
+ * exporting a struct hook_plugin named tfs_plugin. Their callbacks run on
+ * a small bounded pool, one job per plugin and event, so a batch of
+ * creates does not wait on them. A watchdog thread checks the workers a
+ * few times per timeout; a callback still running after the timeout is
+ * reported and left behind: its worker is replaced, and since the thread
+ * may still be inside the plugin, the plugin is never unloaded.
+ *
+ * Executable hooks in <state>/hooks (on-create, on-open, on-archive) get
+ * the ticket name and folder as arguments and TFS_EVENT, TFS_TICKET,
+ * TFS_PATH and TFS_BASE in the environment. They are started by a helper
+ * process forked once by hooks_init, instead of by forking the caller per
+ * event, so a batch does not copy its own page tables for every hook; the
+ * helper runs several at once and kills any that overrun the timeout.
+ */
+
+#define HOOKS_ABI 1
+#define HOOKS_THREADS 4
+#define HOOKS_MAX_THREADS 16    /* including replacements for stuck workers */
+#define HOOKS_QUEUE 256
+#define HOOKS_MAX_CHILDREN 16   /* exec hooks running at once */
+#define HOOKS_TIMEOUT_MS 5000
+
+enum { HOOK_CREATE, HOOK_OPEN, HOOK_ARCHIVE, HOOK_NTYPES };
+
+struct hook_event {
+    int type;
+    uint32_t ord;
+    int64_t time;
+    const char *ticket, *path, *base;
+};
+
+/* What a plugin exports as tfs_plugin; any callback may be NULL. */
+struct hook_plugin {
+    uint32_t abi;           /* HOOKS_ABI */
+    const char *name;
+    void (*on_create)(const struct hook_event *ev);
+    void (*on_open)(const struct hook_event *ev);
+    void (*on_archive)(const struct hook_event *ev);
+};
+
+struct hook_pool;
+
+struct hooks {
+    char base[4096], dir[4200];     /* dir: <state>/hooks */
+    const struct hook_plugin **plugins;
+    size_t nplugins;
+    struct hook_pool *pool;         /* started with the first plugin */
+    uint32_t timeout_ms;
+    uint8_t exec[HOOK_NTYPES];      /* which executable hooks exist */
+    int helper_fd;
+    pid_t helper;
+};
+
+/* Load the plugins and, if there are executable hooks, fork the helper. */
+int hooks_init(struct hooks *h, const char *base, const char *state_dir);
+/* Register a plugin linked into the program rather than loaded from a file. */
+int hooks_add(struct hooks *h, const struct hook_plugin *p);
+/*
+ * Queue everything hooked on this event. Waits for room in the queue for
+ * at most the timeout, and drops the event for a plugin after that.
+ */
+void hooks_fire(struct hooks *h, int type, uint32_t ord, const char *ticket,
+                const char *path);
+/* Wait up to the timeout for queued work, then stop the pool and the helper. */
+void hooks_shutdown(struct hooks *h);
+
+const char *hooks_type_name(int type);
+
+int hooks_bench(int argc, char *argv[]);
+
+#endif
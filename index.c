@@ -0,0 +1,1325 @@
+#include "index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define INDEX_MAGIC "TFSIDX2"
+
+struct index_header {
+    char magic[8];
+    uint64_t generation;
+    uint32_t nprefixes;
+    uint32_t reserved;
+    uint64_t total;
+};
+
+static int key_cmp(uint64_t n1, uint32_t w1, uint64_t n2, uint32_t w2)
+{
+    if (n1 != n2)
+        return n1 < n2 ? -1 : 1;
+    return w1 < w2 ? -1 : w1 > w2;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    const struct index_entry *x = a, *y = b;
+    int c = strcmp(x->prefix, y->prefix);
+
+    if (c)
+        return c;
+    return key_cmp(x->number, x->width, y->number, y->width);
+}
+
+static uint32_t digits(uint64_t v)
+{
+    uint32_t d = 1;
+
+    while (v >= 10) {
+        v /= 10;
+        d++;
+    }
+    return d;
+}
+
+/* Digits of number when zero-padded to width. */
+static uint32_t padded(uint32_t width, uint64_t number)
+{
+    uint32_t d = digits(number);
+
+    return d > width ? d : width;
+}
+
+/*
+ * The pad width under which most of a prefix's names print as they are.
+ * A name with leading zeros fits only its own length; one without fits
+ * every width up to its length. Ties go to the wider width.
+ */
+static uint32_t common_width(const struct index_entry *e, size_t n)
+{
+    uint64_t plain[21], zeros[21], fit, best_fit = 0;
+    uint32_t w, d, best = 0;
+    size_t i;
+
+    memset(plain, 0, sizeof(plain));
+    memset(zeros, 0, sizeof(zeros));
+    for (i = 0; i < n; i++) {
+        d = e[i].width;
+        if (d > 20)
+            continue;
+        if (d == digits(e[i].number))
+            plain[d]++;
+        else
+            zeros[d]++;
+    }
+    for (w = 0; w <= 20; w++) {
+        fit = zeros[w];
+        for (d = w; d <= 20; d++)
+            fit += plain[d];
+        if (fit >= best_fit) {
+            best_fit = fit;
+            best = w;
+        }
+    }
+    return best;
+}
+
+static uint64_t align8(uint64_t v)
+{
+    return (v + 7) & ~7ULL;
+}
+
+int index_write(const char *path, struct index_entry *e, size_t n,
+                uint64_t generation)
+{
+    struct index_header h;
+    struct index_prefix *dir = NULL;
+    struct index_exception *exc = NULL;
+    uint64_t *numbers = NULL;
+    void *blob = NULL;
+    char tmp[4200];
+    size_t i, j, k, m, nexc, np = 0, maxrun = 0;
+    uint64_t off, last;
+    int fd = -1, rc = -1;
+
+    /* A width below the number's own digit count means "unpadded". */
+    for (i = 0; i < n; i++)
+        e[i].width = padded(e[i].width, e[i].number);
+    qsort(e, n, sizeof(*e), cmp_entry);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && !cmp_entry(&e[j - 1], &e[i]))
+            continue;
+        e[j++] = e[i];
+    }
+    n = j;
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && !strcmp(e[j].prefix, e[i].prefix); j++)
+            ;
+        if (j - i > maxrun)
+            maxrun = j - i;
+        np++;
+    }
+
+    dir = calloc(np ? np : 1, sizeof(*dir));
+    numbers = malloc((maxrun ? maxrun : 1) * sizeof(*numbers));
+    exc = malloc((maxrun ? maxrun : 1) * sizeof(*exc));
+    if (!dir || !numbers || !exc)
+        goto out;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.generation = generation;
+    h.nprefixes = (uint32_t)np;
+    h.total = n;
+
+    off = align8(sizeof(h) + np * sizeof(*dir));
+    for (i = 0, k = 0; i < n; i = j, k++) {
+        for (j = i; j < n && !strcmp(e[j].prefix, e[i].prefix); j++)
+            ;
+        memcpy(dir[k].prefix, e[i].prefix, INDEX_PREFIX_MAX);
+        dir[k].width = common_width(&e[i], j - i);
+        last = 0;
+        for (m = i; m < j; m++) {
+            if (e[m].width == padded(dir[k].width, e[m].number)) {
+                dir[k].count++;
+                last = e[m].number;
+            } else {
+                dir[k].exc_count++;
+            }
+        }
+        dir[k].ef_offset = off;
+        dir[k].ef_len = ef_size(dir[k].count, dir[k].count ? last + 1 : 0);
+        off = align8(off + dir[k].ef_len);
+        dir[k].exc_offset = off;
+        off += dir[k].exc_count * sizeof(*exc);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        goto out;
+    if (ftruncate(fd, off) != 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        pwrite(fd, dir, np * sizeof(*dir), sizeof(h)) != (ssize_t)(np * sizeof(*dir)))
+        goto out;
+
+    for (i = 0, k = 0; i < n; i = j, k++) {
+        size_t nnum = 0;
+
+        nexc = 0;
+        for (j = i; j < n && !strcmp(e[j].prefix, e[i].prefix); j++) {
+            if (e[j].width == padded(dir[k].width, e[j].number)) {
+                numbers[nnum++] = e[j].number;
+            } else {
+                exc[nexc].number = e[j].number;
+                exc[nexc].width = e[j].width;
+                exc[nexc].reserved = 0;
+                nexc++;
+            }
+        }
+        free(blob);
+        blob = malloc(dir[k].ef_len);
+        if (!blob || ef_build(numbers, nnum, blob, dir[k].ef_len) != 0)
+            goto out;
+        if (pwrite(fd, blob, dir[k].ef_len, dir[k].ef_offset) != (ssize_t)dir[k].ef_len)
+            goto out;
+        if (nexc && pwrite(fd, exc, nexc * sizeof(*exc), dir[k].exc_offset) !=
+                        (ssize_t)(nexc * sizeof(*exc)))
+            goto out;
+    }
+    if (fsync(fd) != 0 || rename(tmp, path) != 0)
+        goto out;
+    rc = 0;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        if (rc != 0)
+            unlink(tmp);
+    }
+    free(blob);
+    free(dir);
+    free(numbers);
+    free(exc);
+    return rc;
+}
+
+static struct index_shared *map_shared(const char *state_dir, int writable)
+{
+    char path[4200];
+    void *p;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/index.gen", state_dir);
+    fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (writable && ftruncate(fd, sizeof(struct index_shared)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(struct index_shared),
+             writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* ---- log deltas ---- */
+
+static int delta_cmp(const struct index_delta *d, const char *prefix,
+                     uint64_t number, uint32_t width)
+{
+    int c = strncmp(d->prefix, prefix, INDEX_PREFIX_MAX);
+
+    if (c)
+        return c;
+    return key_cmp(d->number, d->width, number, width);
+}
+
+/* Index of the first delta >= (prefix, number, width). */
+static size_t delta_lower(const struct tindex *ix, const char *prefix,
+                          uint64_t number, uint32_t width)
+{
+    size_t lo = 0, hi = ix->ndelta;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (delta_cmp(&ix->delta[mid], prefix, number, width) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static const struct index_delta *delta_find(const struct tindex *ix, const char *prefix,
+                                            uint64_t number, uint32_t width)
+{
+    size_t i = delta_lower(ix, prefix, number, width);
+
+    if (i < ix->ndelta && delta_cmp(&ix->delta[i], prefix, number, width) == 0)
+        return &ix->delta[i];
+    return NULL;
+}
+
+static int delta_apply(struct tindex *ix, const char *name, int present)
+{
+    char prefix[INDEX_PREFIX_MAX];
+    uint64_t number;
+    size_t i;
+    int width;
+
+    memset(prefix, 0, sizeof(prefix));
+    if (ticket_parse(name, prefix, sizeof(prefix), &number, &width) != 0)
+        return 0;
+    i = delta_lower(ix, prefix, number, (uint32_t)width);
+    if (i < ix->ndelta && delta_cmp(&ix->delta[i], prefix, number, (uint32_t)width) == 0) {
+        ix->delta[i].present = (uint32_t)present;
+        return 0;
+    }
+    if (ix->ndelta == ix->delta_cap) {
+        size_t cap = ix->delta_cap ? ix->delta_cap * 2 : 64;
+        struct index_delta *d = realloc(ix->delta, cap * sizeof(*d));
+
+        if (!d)
+            return -1;
+        ix->delta = d;
+        ix->delta_cap = cap;
+    }
+    memmove(&ix->delta[i + 1], &ix->delta[i], (ix->ndelta - i) * sizeof(*ix->delta));
+    memcpy(ix->delta[i].prefix, prefix, INDEX_PREFIX_MAX);
+    ix->delta[i].number = number;
+    ix->delta[i].width = (uint32_t)width;
+    ix->delta[i].present = (uint32_t)present;
+    ix->ndelta++;
+    return 0;
+}
+
+static int replay_record(uint8_t type, const void *data, size_t len, void *arg)
+{
+    char name[TICKET_NAME_MAX + 1];
+
+    if (len == 0 || len > TICKET_NAME_MAX)
+        return 0;
+    memcpy(name, data, len);
+    name[len] = '\0';
+    if (type == INDEX_OP_ADD)
+        return delta_apply(arg, name, 1);
+    if (type == INDEX_OP_REMOVE)
+        return delta_apply(arg, name, 0);
+    return 0;
+}
+
+static void wal_path(const char *image, char *out, size_t n)
+{
+    snprintf(out, n, "%s.wal", image);
+}
+
+/* Attach the log if it belongs to the mapped image, then replay up to limit. */
+static int catch_up(struct tindex *ix, uint64_t limit)
+{
+    if (ix->wal_fd < 0) {
+        char path[4200];
+        uint64_t base;
+
+        wal_path(ix->path, path, sizeof(path));
+        ix->wal_fd = wal_open_read(path, &base);
+        if (ix->wal_fd >= 0 && base != ix->generation) {
+            /* A log for another image: already folded in, or not yet ours. */
+            close(ix->wal_fd);
+            ix->wal_fd = -1;
+        }
+        if (ix->wal_fd < 0) {
+            /* Look again only once the writer reports a longer log. */
+            if (limit)
+                ix->wal_pos = limit;
+            return 0;
+        }
+        ix->wal_pos = WAL_HEADER;
+        ix->wal_seq = 0;
+    }
+    if (limit && limit <= ix->wal_pos)
+        return 0;
+    return wal_replay(ix->wal_fd, &ix->wal_pos, &ix->wal_seq, limit,
+                      replay_record, ix) > 0;
+}
+
+/* ---- writer ---- */
+
+static int reset_wal(struct index_writer *w, uint64_t generation)
+{
+    char path[4200], tmp[4300];
+
+    wal_path(w->view.path, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    wal_close(&w->wal);
+    if (wal_create(tmp, generation) != 0 || rename(tmp, path) != 0)
+        return -1;
+    return wal_open(&w->wal, path);
+}
+
+int index_writer_open(struct index_writer *w, const char *state_dir)
+{
+    char lock[4300], path[4200];
+
+    memset(w, 0, sizeof(*w));
+    w->wal.fd = -1;
+    w->view.wal_fd = -1;
+    w->compact_after = INDEX_COMPACT_RECORDS;
+    snprintf(w->state_dir, sizeof(w->state_dir), "%s", state_dir);
+    snprintf(lock, sizeof(lock), "%s/index.lock", state_dir);
+    w->lock_fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (w->lock_fd < 0)
+        return -1;
+    if (flock(w->lock_fd, LOCK_EX) != 0 || !(w->shared = map_shared(state_dir, 1)))
+        goto fail;
+
+    snprintf(path, sizeof(path), "%s/index", state_dir);
+    if (index_map(&w->view, path) != 0) {
+        if (errno != ENOENT || index_write(path, NULL, 0, w->shared->generation + 1) != 0 ||
+            index_map(&w->view, path) != 0)
+            goto fail;
+    }
+    /* Recover: keep the log only if it belongs to this image, minus any torn tail. */
+    wal_path(path, lock, sizeof(lock));
+    if (wal_open(&w->wal, lock) != 0 || w->wal.base != w->view.generation) {
+        if (reset_wal(w, w->view.generation) != 0)
+            goto fail;
+    }
+    catch_up(&w->view, w->wal.len);
+    __atomic_store_n(&w->shared->wal_len, w->wal.len, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->shared->generation, w->view.generation, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    index_writer_close(w);
+    return -1;
+}
+
+void index_writer_close(struct index_writer *w)
+{
+    wal_close(&w->wal);
+    index_close(&w->view);
+    if (w->shared)
+        munmap(w->shared, sizeof(*w->shared));
+    if (w->lock_fd >= 0) {
+        flock(w->lock_fd, LOCK_UN);
+        close(w->lock_fd);
+    }
+    w->shared = NULL;
+    w->lock_fd = -1;
+}
+
+int index_publish(struct index_writer *w, struct index_entry *e, size_t n)
+{
+    uint64_t gen = __atomic_load_n(&w->shared->generation, __ATOMIC_ACQUIRE) + 1;
+    char path[4200], wal[4300], tmp[4400];
+
+    snprintf(path, sizeof(path), "%s/index", w->state_dir);
+    wal_path(path, wal, sizeof(wal));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", wal);
+    /*
+     * New empty log first, then the image, then the log rename. A crash in
+     * between leaves an old log whose base no longer matches, which both
+     * readers and the next writer ignore, since the image already has it.
+     */
+    if (wal_create(tmp, gen) != 0 || index_write(path, e, n, gen) != 0 ||
+        rename(tmp, wal) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    wal_close(&w->wal);
+    if (wal_open(&w->wal, wal) != 0)
+        return -1;
+    index_close(&w->view);
+    if (index_map(&w->view, path) != 0)
+        return -1;
+    w->view.wal_fd = -1;
+    catch_up(&w->view, w->wal.len);
+    /* The image is durable and in place before anyone is told about it. */
+    __atomic_store_n(&w->shared->wal_len, w->wal.len, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->shared->generation, gen, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int log_change(struct index_writer *w, const char *name, int op)
+{
+    char prefix[INDEX_PREFIX_MAX];
+    uint64_t number;
+    size_t len = strlen(name);
+    int width;
+
+    if (ticket_parse(name, prefix, sizeof(prefix), &number, &width) != 0 ||
+        len > TICKET_NAME_MAX)
+        return -1;
+    if (wal_append(&w->wal, (uint8_t)op, name, (uint16_t)len) != 0 || wal_sync(&w->wal) != 0)
+        return -1;
+    __atomic_store_n(&w->shared->wal_len, w->wal.len, __ATOMIC_RELEASE);
+    catch_up(&w->view, w->wal.len);
+    if (w->wal.records >= w->compact_after)
+        return index_compact(w);
+    return 0;
+}
+
+int index_add(struct index_writer *w, const char *name)
+{
+    if (index_contains(&w->view, name))
+        return 0;
+    return log_change(w, name, INDEX_OP_ADD);
+}
+
+int index_remove(struct index_writer *w, const char *name)
+{
+    if (!index_contains(&w->view, name))
+        return 0;
+    return log_change(w, name, INDEX_OP_REMOVE);
+}
+
+struct collect {
+    struct index_entry *e;
+    size_t n, cap;
+};
+
+static int collect_entry(const char *prefix, uint64_t number, uint32_t width, void *arg)
+{
+    struct collect *c = arg;
+
+    if (c->n == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 4096;
+        struct index_entry *e = realloc(c->e, cap * sizeof(*e));
+
+        if (!e)
+            return -1;
+        c->e = e;
+        c->cap = cap;
+    }
+    memset(c->e[c->n].prefix, 0, INDEX_PREFIX_MAX);
+    snprintf(c->e[c->n].prefix, INDEX_PREFIX_MAX, "%s", prefix);
+    c->e[c->n].number = number;
+    c->e[c->n].width = width;
+    c->n++;
+    return 0;
+}
+
+int index_compact(struct index_writer *w)
+{
+    struct collect c;
+    int rc;
+
+    memset(&c, 0, sizeof(c));
+    if (index_foreach(&w->view, collect_entry, &c) != 0) {
+        free(c.e);
+        return -1;
+    }
+    rc = index_publish(w, c.e, c.n);
+    free(c.e);
+    return rc;
+}
+
+int index_build(const char *state_dir, const struct ordmap *names,
+                const struct meta *meta)
+{
+    struct index_writer w;
+    struct index_entry *e;
+    char path[4200];
+    size_t n = 0;
+    uint32_t ord;
+    int rc;
+
+    e = malloc((names->count ? names->count : 1) * sizeof(*e));
+    if (!e)
+        return -1;
+    for (ord = 0; ord < names->count; ord++) {
+        int width;
+
+        if (meta && ord < meta->count && meta->state[ord] == TICKET_DELETED)
+            continue;
+        memset(e[n].prefix, 0, sizeof(e[n].prefix));
+        if (ticket_parse(names->names[ord], e[n].prefix, sizeof(e[n].prefix),
+                         &e[n].number, &width) != 0)
+            continue;
+        e[n].width = (uint32_t)width;
+        n++;
+    }
+    /* An image this build cannot read (an older format) is replaced whole. */
+    snprintf(path, sizeof(path), "%s/index", state_dir);
+    if (index_map(&w.view, path) == 0)
+        index_close(&w.view);
+    else if (errno == EINVAL)
+        unlink(path);
+    rc = index_writer_open(&w, state_dir);
+    if (rc == 0) {
+        rc = index_publish(&w, e, n);
+        index_writer_close(&w);
+    }
+    free(e);
+    return rc;
+}
+
+/* ---- readers ---- */
+
+int index_map(struct tindex *ix, const char *path)
+{
+    const struct index_header *h;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    memset(ix, 0, sizeof(*ix));
+    ix->wal_fd = -1;
+    snprintf(ix->path, sizeof(ix->path), "%s", path);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    ix->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ix->map == MAP_FAILED) {
+        ix->map = NULL;
+        return -1;
+    }
+    ix->len = st.st_size;
+    h = ix->map;
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        sizeof(*h) + (uint64_t)h->nprefixes * sizeof(*ix->dir) > ix->len)
+        goto corrupt;
+    ix->generation = h->generation;
+    ix->nprefixes = h->nprefixes;
+    ix->dir = (const struct index_prefix *)(h + 1);
+    ix->sets = calloc(ix->nprefixes ? ix->nprefixes : 1, sizeof(*ix->sets));
+    if (!ix->sets)
+        goto corrupt;
+    for (i = 0; i < ix->nprefixes; i++) {
+        const struct index_prefix *d = &ix->dir[i];
+
+        if (d->ef_offset + d->ef_len > ix->len ||
+            ef_view(&ix->sets[i], (char *)ix->map + d->ef_offset, d->ef_len) != 0 ||
+            ix->sets[i].n != d->count ||
+            d->exc_offset % 8 || d->exc_offset > ix->len ||
+            d->exc_count > (ix->len - d->exc_offset) / sizeof(struct index_exception))
+            goto corrupt;
+    }
+    return 0;
+
+corrupt:
+    index_close(ix);
+    errno = EINVAL;
+    return -1;
+}
+
+int index_open(struct tindex *ix, const char *state_dir)
+{
+    const struct index_shared *shared = map_shared(state_dir, 0);
+    char path[4200];
+
+    snprintf(path, sizeof(path), "%s/index", state_dir);
+    if (index_map(ix, path) != 0) {
+        if (shared)
+            munmap((void *)shared, sizeof(*shared));
+        return -1;
+    }
+    ix->shared = shared;
+    catch_up(ix, shared && shared->generation == ix->generation ?
+                 __atomic_load_n(&shared->wal_len, __ATOMIC_ACQUIRE) : 0);
+    return 0;
+}
+
+void index_close(struct tindex *ix)
+{
+    if (ix->map)
+        munmap(ix->map, ix->len);
+    if (ix->shared)
+        munmap((void *)ix->shared, sizeof(*ix->shared));
+    if (ix->wal_fd >= 0)
+        close(ix->wal_fd);
+    free(ix->sets);
+    free(ix->delta);
+    memset(ix, 0, sizeof(*ix));
+    ix->wal_fd = -1;
+}
+
+int index_refresh(struct tindex *ix)
+{
+    const struct index_shared *shared = ix->shared;
+    struct tindex fresh;
+    uint64_t gen, wal_len;
+
+    if (!shared)
+        return 0;
+    gen = __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+    if (gen == ix->generation) {
+        wal_len = __atomic_load_n(&shared->wal_len, __ATOMIC_ACQUIRE);
+        if (wal_len <= ix->wal_pos)
+            return 0;
+        return catch_up(ix, wal_len);
+    }
+    if (index_map(&fresh, ix->path) != 0)
+        return -1;
+    ix->shared = NULL;
+    index_close(ix);
+    *ix = fresh;
+    ix->shared = shared;
+    if (__atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE) == ix->generation)
+        catch_up(ix, __atomic_load_n(&shared->wal_len, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+const struct index_prefix *index_find_prefix(const struct tindex *ix,
+                                             const char *prefix, uint32_t *slot)
+{
+    uint32_t i;
+
+    for (i = 0; i < ix->nprefixes; i++) {
+        if (!strncmp(ix->dir[i].prefix, prefix, INDEX_PREFIX_MAX)) {
+            if (slot)
+                *slot = i;
+            return &ix->dir[i];
+        }
+    }
+    return NULL;
+}
+
+static const struct index_exception *exceptions(const struct tindex *ix, uint32_t slot)
+{
+    return (const struct index_exception *)((const char *)ix->map + ix->dir[slot].exc_offset);
+}
+
+/* Index of the first exception of slot >= (number, width). */
+static size_t exc_lower(const struct tindex *ix, uint32_t slot, uint64_t number,
+                        uint32_t width)
+{
+    const struct index_exception *x = exceptions(ix, slot);
+    size_t lo = 0, hi = ix->dir[slot].exc_count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (key_cmp(x[mid].number, x[mid].width, number, width) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int image_contains(const struct tindex *ix, uint32_t slot, uint64_t number,
+                          uint32_t width)
+{
+    const struct index_exception *x = exceptions(ix, slot);
+    size_t i;
+
+    if (width == padded(ix->dir[slot].width, number))
+        return ef_contains(&ix->sets[slot], number);
+    i = exc_lower(ix, slot, number, width);
+    return i < ix->dir[slot].exc_count && x[i].number == number && x[i].width == width;
+}
+
+static int removed(const struct tindex *ix, const char *prefix, uint64_t number,
+                   uint32_t width)
+{
+    const struct index_delta *d = delta_find(ix, prefix, number, width);
+
+    return d && !d->present;
+}
+
+int index_contains(const struct tindex *ix, const char *name)
+{
+    char prefix[INDEX_PREFIX_MAX];
+    const struct index_delta *d;
+    uint64_t number;
+    uint32_t slot;
+    int width;
+
+    memset(prefix, 0, sizeof(prefix));
+    if (ticket_parse(name, prefix, sizeof(prefix), &number, &width) != 0)
+        return 0;
+    if ((d = delta_find(ix, prefix, number, (uint32_t)width)) != NULL)
+        return d->present != 0;
+    if (!index_find_prefix(ix, prefix, &slot))
+        return 0;
+    return image_contains(ix, slot, number, (uint32_t)width);
+}
+
+int index_next(const struct tindex *ix, const char *name, char *out, size_t n)
+{
+    char prefix[INDEX_PREFIX_MAX];
+    const struct index_delta *d;
+    uint64_t number, best = EF_NONE;
+    uint32_t slot, width, best_w = 0;
+    size_t i;
+    int w;
+
+    memset(prefix, 0, sizeof(prefix));
+    if (ticket_parse(name, prefix, sizeof(prefix), &number, &w) != 0)
+        return -1;
+    width = (uint32_t)w;
+    if (index_find_prefix(ix, prefix, &slot)) {
+        const struct index_exception *x = exceptions(ix, slot);
+        uint32_t pw = ix->dir[slot].width;
+        uint64_t v = number;
+
+        /* The set holds one name per number; a wider one sorts after ours. */
+        if (!(padded(pw, v) > width && ef_contains(&ix->sets[slot], v)))
+            v = ef_successor(&ix->sets[slot], v);
+        /* Skip image members the log has since removed. */
+        while (v != EF_NONE && removed(ix, prefix, v, padded(pw, v)))
+            v = ef_successor(&ix->sets[slot], v);
+        if (v != EF_NONE) {
+            best = v;
+            best_w = padded(pw, v);
+        }
+        for (i = exc_lower(ix, slot, number, width + 1); i < ix->dir[slot].exc_count; i++) {
+            if (best != EF_NONE && key_cmp(x[i].number, x[i].width, best, best_w) >= 0)
+                break;
+            if (!removed(ix, prefix, x[i].number, x[i].width)) {
+                best = x[i].number;
+                best_w = x[i].width;
+                break;
+            }
+        }
+    }
+    for (i = delta_lower(ix, prefix, number, width + 1); i < ix->ndelta; i++) {
+        d = &ix->delta[i];
+        if (strncmp(d->prefix, prefix, INDEX_PREFIX_MAX) ||
+            (best != EF_NONE && key_cmp(d->number, d->width, best, best_w) >= 0))
+            break;
+        if (d->present) {
+            best = d->number;
+            best_w = d->width;
+            break;
+        }
+    }
+    if (best == EF_NONE)
+        return -1;
+    snprintf(out, n, "%s%0*llu", prefix, (int)best_w, (unsigned long long)best);
+    return 0;
+}
+
+static int cmp_prefix(const void *a, const void *b)
+{
+    return strncmp(*(const char *const *)a, *(const char *const *)b, INDEX_PREFIX_MAX);
+}
+
+int index_foreach(const struct tindex *ix,
+                  int (*fn)(const char *prefix, uint64_t number, uint32_t width,
+                            void *arg),
+                  void *arg)
+{
+    const char **prefixes;
+    size_t np = 0, i, j, k;
+    int rc = 0;
+
+    prefixes = malloc((ix->nprefixes + ix->ndelta + 1) * sizeof(*prefixes));
+    if (!prefixes)
+        return -1;
+    for (i = 0; i < ix->nprefixes; i++)
+        prefixes[np++] = ix->dir[i].prefix;
+    for (i = 0; i < ix->ndelta; i++)
+        if (i == 0 || strncmp(ix->delta[i].prefix, ix->delta[i - 1].prefix, INDEX_PREFIX_MAX))
+            prefixes[np++] = ix->delta[i].prefix;
+    qsort(prefixes, np, sizeof(*prefixes), cmp_prefix);
+
+    for (i = 0; i < np && rc == 0; i = j) {
+        const char *prefix = prefixes[i];
+        const struct index_exception *x = NULL;
+        struct ef_iter it;
+        uint64_t v = EF_NONE, num;
+        uint32_t slot, pw = 0, wid;
+        size_t e = 0, nexc = 0;
+        int more = 0, from_set;
+
+        for (j = i + 1; j < np && !strncmp(prefixes[j], prefix, INDEX_PREFIX_MAX); j++)
+            ;
+        if (index_find_prefix(ix, prefix, &slot)) {
+            ef_iter_init(&it, &ix->sets[slot]);
+            more = ef_iter_next(&it, &v);
+            pw = ix->dir[slot].width;
+            x = exceptions(ix, slot);
+            nexc = ix->dir[slot].exc_count;
+        }
+        k = delta_lower(ix, prefix, 0, 0);
+        /* Merge the set, its exceptions and the log's net changes. */
+        while (rc == 0) {
+            const struct index_delta *d = NULL;
+
+            if (k < ix->ndelta && !strncmp(ix->delta[k].prefix, prefix, INDEX_PREFIX_MAX))
+                d = &ix->delta[k];
+            from_set = more && (e == nexc ||
+                                key_cmp(v, padded(pw, v), x[e].number, x[e].width) < 0);
+            if (from_set) {
+                num = v;
+                wid = padded(pw, v);
+            } else if (e < nexc) {
+                num = x[e].number;
+                wid = x[e].width;
+            } else if (d) {
+                num = EF_NONE;
+                wid = 0;
+            } else {
+                break;
+            }
+            if (d && (num == EF_NONE || key_cmp(d->number, d->width, num, wid) <= 0)) {
+                if (num != EF_NONE && d->number == num && d->width == wid) {
+                    if (from_set)
+                        more = ef_iter_next(&it, &v);
+                    else
+                        e++;
+                }
+                if (d->present)
+                    rc = fn(prefix, d->number, d->width, arg);
+                k++;
+            } else {
+                rc = fn(prefix, num, wid, arg);
+                if (from_set)
+                    more = ef_iter_next(&it, &v);
+                else
+                    e++;
+            }
+        }
+    }
+    free(prefixes);
+    return rc;
+}
+
+/* Benchmark: 5M nearly dense INC numbers, image size and query latency. */
+
+int index_bench(int argc, char *argv[])
+{
+    size_t n = argc > 0 ? strtoull(argv[0], NULL, 10) : 5000000, i;
+    char dir[256], path[300];
+    struct index_entry *e;
+    struct timespec t0;
+    struct tindex ix;
+    uint64_t x = 0, seed = 42, sink = 0;
+    uint32_t slot = 0;
+    double t;
+    int q, queries = 1000000;
+
+    if (n == 0)
+        n = 5000000;
+    e = calloc(n, sizeof(*e));
+    if (!e)
+        return 1;
+    for (i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        x += 1 + ((seed >> 60) == 0);   /* ~6% gaps */
+        strcpy(e[i].prefix, "INC");
+        e[i].number = x;
+        e[i].width = 7;
+    }
+    if (bench_tmpdir(dir, sizeof(dir), "index") != 0)
+        return 1;
+    snprintf(path, sizeof(path), "%s/index", dir);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (index_write(path, e, n, 1) != 0 || index_map(&ix, path) != 0) {
+        printf("index build failed\n");
+        bench_rmtree(dir);
+        return 1;
+    }
+    t = bench_ms_since(&t0) * 1e6;
+    printf("%zu tickets: image %.2f MB (%.2f bits/ticket), built in %.0f ms\n",
+           n, ix.len / 1048576.0, ix.len * 8.0 / n, t / 1e6);
+    index_find_prefix(&ix, "INC", &slot);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (q = 0; q < queries; q++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sink += ef_successor(&ix.sets[slot], (seed >> 11) % x);
+    }
+    printf("successor   %6.1f ns\n", bench_ms_since(&t0) * 1e6 / queries);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (q = 0; q < queries; q++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sink += ef_contains(&ix.sets[slot], (seed >> 11) % x);
+    }
+    printf("membership  %6.1f ns\n", bench_ms_since(&t0) * 1e6 / queries);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (q = 0; q < queries; q++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sink += ef_select(&ix.sets[slot], (seed >> 11) % n);
+    }
+    printf("select      %6.1f ns\n", bench_ms_since(&t0) * 1e6 / queries);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (q = 0; q < queries; q++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        sink += ef_rank(&ix.sets[slot], (seed >> 11) % x);
+    }
+    printf("rank        %6.1f ns\n", bench_ms_since(&t0) * 1e6 / queries);
+    if (sink == 42)
+        printf("\n");
+
+    index_close(&ix);
+    bench_rmtree(dir);
+    free(e);
+    return 0;
+}
+
+/*
+ * Stress benchmark: N reader processes query the published index while a
+ * single writer logs changes through index_add and index_remove (and so
+ * compacts every STRESS_COMPACT records), compared with a quiet phase of
+ * equal length. Latencies go into log-linear histograms (4 buckets per
+ * power of two) in shared memory.
+ *
+ * The writer keeps a sliding window of STRESS_WINDOW "SEQ" tickets: it adds
+ * SEQ i, then removes SEQ i - STRESS_WINDOW. Any state a reader can be
+ * shown, old or new, therefore holds a window ending at some hi that never
+ * moves backwards; a gap, a missing edge or a step back means the reader
+ * saw a torn mix of image and log.
+ */
+
+#define STRESS_BUCKETS 256
+#define STRESS_WINDOW 64
+#define STRESS_COMPACT 256
+
+struct stress_shared {
+    volatile int phase;     /* 0 start, 1 quiet, 2 writing, 3 stop */
+    uint64_t appends, publishes, torn;
+    uint64_t hist[2][STRESS_BUCKETS];
+};
+
+static int stress_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < 4)
+        return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    return msb * 4 + (int)((ns >> (msb - 2)) & 3);
+}
+
+static uint64_t stress_bucket_ns(int b)
+{
+    if (b < 4)
+        return b;
+    return (4ULL | (b & 3)) << (b / 4 - 2);
+}
+
+static int stress_has(const struct tindex *ix, uint64_t seq)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "SEQ%07llu", (unsigned long long)seq);
+    return index_contains(ix, name);
+}
+
+/*
+ * Finds the window at or after the last one seen in *lo and *hi; 0 if it
+ * is contiguous, of a size the writer can leave behind, and not older.
+ */
+static int stress_check(const struct tindex *ix, uint64_t *lo, uint64_t *hi)
+{
+    char name[32], next[32];
+    uint64_t l = *lo, h;
+
+    if (!stress_has(ix, l)) {
+        snprintf(name, sizeof(name), "SEQ%07llu", (unsigned long long)l);
+        if (index_next(ix, name, next, sizeof(next)) != 0)
+            return *hi == 0 ? 0 : -1;
+        l = strtoull(next + 3, NULL, 10);
+    }
+    for (h = l; stress_has(ix, h); h++)
+        ;
+    if (h < *hi || h - l > STRESS_WINDOW + 1 || (l > 0 && h - l < STRESS_WINDOW))
+        return -1;
+    *lo = l;
+    *hi = h;
+    return 0;
+}
+
+static void stress_reader(struct stress_shared *sh, const char *state_dir,
+                          uint64_t universe, uint64_t seed)
+{
+    uint64_t hist[2][STRESS_BUCKETS];
+    struct tindex ix;
+    uint64_t sink = 0, lo = 0, hi = 0, gen, torn = 0;
+    int b;
+
+    memset(hist, 0, sizeof(hist));
+    if (index_open(&ix, state_dir) != 0)
+        _exit(1);
+    while (sh->phase == 0)
+        usleep(1000);
+    while (sh->phase != 3) {
+        struct timespec t0, t1;
+        int phase = sh->phase;
+        uint32_t slot = 0;
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        gen = ix.generation;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        index_refresh(&ix);
+        if (index_find_prefix(&ix, "INC", &slot))
+            sink += ef_successor(&ix.sets[slot], (seed >> 11) % universe);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (phase == 1 || phase == 2)
+            hist[phase - 1][stress_bucket((t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+                                          t1.tv_nsec - t0.tv_nsec)]++;
+        if (ix.generation < gen || stress_check(&ix, &lo, &hi) != 0)
+            torn++;
+    }
+    for (b = 0; b < STRESS_BUCKETS; b++) {
+        __atomic_add_fetch(&sh->hist[0][b], hist[0][b], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->hist[1][b], hist[1][b], __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&sh->torn, torn, __ATOMIC_RELAXED);
+    index_close(&ix);
+    _exit(sink == 1);
+}
+
+static void stress_report(const char *label, const uint64_t *hist)
+{
+    static const double pct[] = { 50, 99, 99.9 };
+    uint64_t total = 0, seen = 0;
+    int b, p = 0;
+
+    for (b = 0; b < STRESS_BUCKETS; b++)
+        total += hist[b];
+    printf("%-8s %10llu lookups", label, (unsigned long long)total);
+    for (b = 0; b < STRESS_BUCKETS && p < 3; b++) {
+        seen += hist[b];
+        while (p < 3 && total && seen >= total * pct[p] / 100) {
+            printf("  p%g <%6.2f us", pct[p], stress_bucket_ns(b + 1) / 1e3);
+            p++;
+        }
+    }
+    printf("\n");
+}
+
+int index_stress_bench(int argc, char *argv[])
+{
+    int readers = argc > 0 ? atoi(argv[0]) : 32;
+    int secs = argc > 1 ? atoi(argv[1]) : 3;
+    size_t n = 200000, i;
+    char dir[256], name[32];
+    struct stress_shared *sh;
+    struct index_writer w;
+    struct index_entry *e;
+    struct timespec start, now;
+    uint64_t seq = 0, gen;
+    pid_t *pids;
+    int rc = 0;
+
+    if (readers < 1)
+        readers = 32;
+    if (secs < 1)
+        secs = 3;
+    if (bench_tmpdir(dir, sizeof(dir), "stress") != 0)
+        return 1;
+    e = calloc(n, sizeof(*e));
+    pids = calloc(readers, sizeof(*pids));
+    sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+              -1, 0);
+    if (!e || !pids || sh == MAP_FAILED || index_writer_open(&w, dir) != 0)
+        return 1;
+    for (i = 0; i < n; i++) {
+        strcpy(e[i].prefix, "INC");
+        e[i].number = i * 2;
+        e[i].width = 7;
+    }
+    if (index_publish(&w, e, n) != 0)
+        return 1;
+    /* Each append is synced; compact sooner so slow disks still republish. */
+    w.compact_after = STRESS_COMPACT;
+
+    for (i = 0; i < (size_t)readers; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            stress_reader(sh, dir, n * 2, i + 1);
+    }
+
+    sh->phase = 1;
+    sleep(secs);
+    sh->phase = 2;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        gen = w.view.generation;
+        snprintf(name, sizeof(name), "SEQ%07llu", (unsigned long long)seq);
+        if (index_add(&w, name) != 0)
+            break;
+        if (seq >= STRESS_WINDOW) {
+            snprintf(name, sizeof(name), "SEQ%07llu",
+                     (unsigned long long)(seq - STRESS_WINDOW));
+            if (index_remove(&w, name) != 0)
+                break;
+        }
+        seq++;
+        sh->appends += seq > STRESS_WINDOW ? 2 : 1;
+        sh->publishes += w.view.generation != gen;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < secs);
+    sh->phase = 3;
+    for (i = 0; i < (size_t)readers; i++)
+        waitpid(pids[i], NULL, 0);
+
+    printf("%d readers, 1 writer, %llu log appends, %llu images published\n", readers,
+           (unsigned long long)sh->appends, (unsigned long long)sh->publishes);
+    stress_report("quiet", sh->hist[0]);
+    stress_report("writing", sh->hist[1]);
+    if (sh->torn) {
+        printf("%llu reads saw an inconsistent index\n", (unsigned long long)sh->torn);
+        rc = 1;
+    }
+
+    index_writer_close(&w);
+    bench_rmtree(dir);
+    munmap(sh, sizeof(*sh));
+    free(pids);
+    free(e);
+    return rc;
+}
+
+/*
+ * Torture test: a child mutates ticket folders and logs each change, and is
+ * SIGKILLed at a random point; some rounds also chop bytes off the log to
+ * mimic a torn append. After recovery the index must match the folders
+ * except for the change in flight (plus the one whose record was torn).
+ */
+
+#define TORTURE_TICKETS 500
+
+static void torture_child(const char *base, const char *state, uint64_t seed)
+{
+    struct index_writer w;
+    char name[32], path[4200];
+
+    if (index_writer_open(&w, state) != 0)
+        _exit(1);
+    w.compact_after = 64;
+    for (;;) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        snprintf(name, sizeof(name), "INC%07llu",
+                 (unsigned long long)((seed >> 33) % TORTURE_TICKETS));
+        snprintf(path, sizeof(path), "%s/%s", base, name);
+        if (mkdir(path, 0755) == 0) {
+            if (index_add(&w, name) != 0)
+                _exit(2);
+        } else if (rmdir(path) == 0) {
+            if (index_remove(&w, name) != 0)
+                _exit(2);
+        }
+    }
+}
+
+static int collect_names(const char *prefix, uint64_t number, uint32_t width, void *arg)
+{
+    unsigned char *seen = arg;
+
+    if (!strcmp(prefix, "INC") && number < TORTURE_TICKETS)
+        seen[number] |= 1;
+    (void)width;
+    return 0;
+}
+
+int index_torture(int argc, char *argv[])
+{
+    int rounds = argc > 0 ? atoi(argv[0]) : 200;
+    char base[256], state[4200], path[4300];
+    unsigned char on_disk[TORTURE_TICKETS], in_index[TORTURE_TICKETS];
+    int r, failures = 0, torn = 0;
+    uint64_t seed = (uint64_t)time(NULL);
+
+    if (rounds < 1)
+        rounds = 200;
+    if (bench_tmpdir(base, sizeof(base), "torture") != 0)
+        return 1;
+    snprintf(state, sizeof(state), "%s/.tfs", base);
+    mkdir(state, 0755);
+
+    for (r = 0; r < rounds; r++) {
+        struct index_writer w;
+        struct tindex ix;
+        struct dirent *de;
+        int i, diff = 0, allowed = 1, reader_diff = 0;
+        pid_t pid;
+        DIR *d;
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        pid = fork();
+        if (pid == 0)
+            torture_child(base, state, seed);
+        usleep(1000 + (seed >> 40) % 30000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        snprintf(path, sizeof(path), "%s/index.wal", state);
+        if ((seed >> 20) % 4 == 0) {
+            struct stat st;
+
+            if (stat(path, &st) == 0 && st.st_size > WAL_HEADER) {
+                if (truncate(path, st.st_size - 1 - (off_t)((seed >> 8) % 20)) == 0) {
+                    allowed = 2;
+                    torn++;
+                }
+            }
+        }
+
+        if (index_writer_open(&w, state) != 0) {
+            printf("round %d: writer recovery failed\n", r);
+            failures++;
+            continue;
+        }
+        memset(on_disk, 0, sizeof(on_disk));
+        memset(in_index, 0, sizeof(in_index));
+        d = opendir(base);
+        while (d && (de = readdir(d)) != NULL) {
+            if (!strncmp(de->d_name, "INC", 3))
+                on_disk[strtoul(de->d_name + 3, NULL, 10) % TORTURE_TICKETS] = 1;
+        }
+        if (d)
+            closedir(d);
+        index_foreach(&w.view, collect_names, in_index);
+        if (index_open(&ix, state) == 0) {
+            unsigned char seen[TORTURE_TICKETS];
+
+            memset(seen, 0, sizeof(seen));
+            index_foreach(&ix, collect_names, seen);
+            reader_diff = memcmp(seen, in_index, sizeof(seen)) != 0;
+            index_close(&ix);
+        }
+        for (i = 0; i < TORTURE_TICKETS; i++)
+            diff += on_disk[i] != in_index[i];
+        if (diff > allowed || reader_diff) {
+            printf("round %d: %d mismatches (allowed %d)%s\n", r, diff, allowed,
+                   reader_diff ? ", reader disagrees with writer" : "");
+            failures++;
+        }
+        /* Re-sync with the folders so the next round starts clean. */
+        for (i = 0; i < TORTURE_TICKETS; i++) {
+            char name[32];
+
+            if (on_disk[i] == in_index[i])
+                continue;
+            snprintf(name, sizeof(name), "INC%07d", i);
+            if (on_disk[i])
+                index_add(&w, name);
+            else
+                index_remove(&w, name);
+        }
+        index_writer_close(&w);
+    }
+    printf("%d rounds, %d with a torn log tail, %d failures\n", rounds, torn, failures);
+
+    bench_rmtree(base);
+    return failures != 0;
+}
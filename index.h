@@ -0,0 +1,148 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "efset.h"
+#include "meta.h"
+#include "ticket.h"
+#include "wal.h"
+
+/*
+ * Ticket index: for every prefix, the set of existing ticket numbers as an
+ * Elias-Fano set. The whole index is one file, <state>/index, read through
+ * a private read-only map; ordinals stay in the registry.
+ *
+ * Names keep their own digit count. Each prefix records the zero-pad width
+ * most of its names are printed with; the set holds the numbers of those
+ * names, and the few printed any other way (INC2 among INC0000001...) are
+ * listed as exceptions with their width. INC2 and INC0000002 are two
+ * different tickets. Entries are ordered by (prefix, number, width).
+ *
+ * Readers never lock. A single writer (serialized by an flock on
+ * <state>/index.lock) writes a complete new image, fsyncs it, renames it
+ * over the old one and only then bumps the generation word in
+ * <state>/index.gen. Readers keep using the image they mapped, which stays
+ * valid after the rename, and compare their generation with the shared
+ * word to notice a newer one.
+ *
+ * Single-ticket changes between images go to <state>/index.wal, whose
+ * header names the image generation it applies to. The writer fsyncs each
+ * record before publishing the new log length next to the generation, and
+ * folds the log into a fresh image once it holds INDEX_COMPACT_RECORDS.
+ * Readers replay only the part of the log they have not seen yet.
+ */
+
+#define INDEX_PREFIX_MAX 24
+#define INDEX_COMPACT_RECORDS 4096
+
+enum { INDEX_OP_ADD = 1, INDEX_OP_REMOVE = 2 };
+
+struct index_prefix {
+    char prefix[INDEX_PREFIX_MAX];
+    uint32_t width;         /* zero-pad width of the numbers in the set */
+    uint32_t reserved;
+    uint64_t ef_offset, ef_len;
+    uint64_t count;         /* numbers in the set */
+    uint64_t exc_offset, exc_count;
+};
+
+/* A name printed with another width than its prefix's; sorted by (number, width). */
+struct index_exception {
+    uint64_t number;
+    uint32_t width;
+    uint32_t reserved;
+};
+
+/* Shared-mapped <state>/index.gen. */
+struct index_shared {
+    uint64_t generation;
+    uint64_t wal_len;
+};
+
+/* Net effect of the log on one ticket name, sorted by (prefix, number, width). */
+struct index_delta {
+    char prefix[INDEX_PREFIX_MAX];
+    uint64_t number;
+    uint32_t width;
+    uint32_t present;
+};
+
+struct tindex {
+    char path[4096];
+    void *map;
+    size_t len;
+    uint64_t generation;
+    const struct index_shared *shared;  /* NULL if index.gen is absent */
+    uint32_t nprefixes;
+    const struct index_prefix *dir;
+    struct efset *sets;
+
+    int wal_fd;
+    uint64_t wal_pos, wal_seq;
+    struct index_delta *delta;
+    size_t ndelta, delta_cap;
+};
+
+struct index_entry {
+    char prefix[INDEX_PREFIX_MAX];
+    uint64_t number;
+    uint32_t width;         /* digits in the name */
+};
+
+struct index_writer {
+    char state_dir[4096];
+    int lock_fd;
+    struct index_shared *shared;
+    struct wal wal;
+    struct tindex view;     /* image plus log as of the last change */
+    uint64_t compact_after;
+};
+
+/* Write a fresh index image from entries (any order); sorts in place. */
+int index_write(const char *path, struct index_entry *e, size_t n,
+                uint64_t generation);
+
+/* Blocks until this process is the only index writer, then recovers the log. */
+int index_writer_open(struct index_writer *w, const char *state_dir);
+void index_writer_close(struct index_writer *w);
+/* Publish a new image built from entries, bump the generation, empty the log. */
+int index_publish(struct index_writer *w, struct index_entry *e, size_t n);
+/* Durably record one ticket appearing or disappearing. */
+int index_add(struct index_writer *w, const char *name);
+int index_remove(struct index_writer *w, const char *name);
+/* Fold the log into a new image. */
+int index_compact(struct index_writer *w);
+
+/* Rebuild from the ticket registry, skipping tickets the metadata marks deleted. */
+int index_build(const char *state_dir, const struct ordmap *names,
+                const struct meta *meta);
+
+int index_open(struct tindex *ix, const char *state_dir);
+/* Map a bare image file, without the log or generation word. */
+int index_map(struct tindex *ix, const char *path);
+void index_close(struct tindex *ix);
+/*
+ * Catch up with the writer: switch to a newer image, or replay new log
+ * records. Returns 1 if anything changed, 0 if already current, -1 if the
+ * newer image could not be mapped (the old one stays in use).
+ */
+int index_refresh(struct tindex *ix);
+
+const struct index_prefix *index_find_prefix(const struct tindex *ix,
+                                             const char *prefix, uint32_t *slot);
+int index_contains(const struct tindex *ix, const char *name);
+/* Name of the first existing ticket after name within its prefix. */
+int index_next(const struct tindex *ix, const char *name, char *out, size_t n);
+/* Every ticket in (prefix, number) order, image and log merged. */
+int index_foreach(const struct tindex *ix,
+                  int (*fn)(const char *prefix, uint64_t number, uint32_t width,
+                            void *arg),
+                  void *arg);
+
+int index_bench(int argc, char *argv[]);
+int index_stress_bench(int argc, char *argv[]);
+int index_torture(int argc, char *argv[]);
+
+#endif
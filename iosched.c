@@ -0,0 +1,386 @@
+#include "iosched.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+/* Background work stays parked this long after the last interactive end. */
+#define IOSCHED_GRACE_NS (20ULL * 1000 * 1000)
+/* An interactive section older than this is treated as abandoned (crash). */
+#define IOSCHED_LEASE_NS (5ULL * 1000 * 1000 * 1000)
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+void iosched_bg_enter(void)
+{
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    struct sched_param sp;
+
+    setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SCHED_IDLE
+    memset(&sp, 0, sizeof(sp));
+    sched_setscheduler(0, SCHED_IDLE, &sp);
+#else
+    (void)sp;
+#endif
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+            IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+static struct iosched_shared *map_shared(const char *state_dir)
+{
+    char path[4096];
+    void *p;
+    int fd;
+
+    if (!state_dir)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/sched", state_dir);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(struct iosched_shared)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(struct iosched_shared), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int interactive_pending(struct iosched *s)
+{
+    uint32_t active = __atomic_load_n(&s->shared->active, __ATOMIC_ACQUIRE);
+    uint64_t stamp = __atomic_load_n(&s->shared->stamp_ns, __ATOMIC_ACQUIRE);
+    uint64_t now = bench_now_ns();
+
+    if (active > 0)
+        return now - stamp < IOSCHED_LEASE_NS;
+    return stamp != 0 && now - stamp < IOSCHED_GRACE_NS;
+}
+
+void iosched_interactive_begin(struct iosched *s)
+{
+    __atomic_store_n(&s->shared->stamp_ns, bench_now_ns(), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->shared->active, 1, __ATOMIC_ACQ_REL);
+}
+
+void iosched_interactive_end(struct iosched *s)
+{
+    uint32_t cur = __atomic_load_n(&s->shared->active, __ATOMIC_ACQUIRE);
+
+    /* Never wrap below zero if a crashed peer left the counter short. */
+    while (cur > 0 && !__atomic_compare_exchange_n(&s->shared->active, &cur,
+                                                    cur - 1, 0, __ATOMIC_ACQ_REL,
+                                                    __ATOMIC_ACQUIRE))
+        ;
+    __atomic_store_n(&s->shared->stamp_ns, bench_now_ns(), __ATOMIC_RELEASE);
+}
+
+void iosched_bg_throttle(struct iosched *s, uint64_t bytes)
+{
+    while (s->yield && interactive_pending(s))
+        sleep_ns(1000000);
+
+    if (s->rate == 0)
+        return;
+
+    for (;;) {
+        uint64_t now, wait;
+
+        pthread_mutex_lock(&s->bucket_lock);
+        now = bench_now_ns();
+        s->tokens += (double)(now - s->refill_ns) * s->rate / 1e9;
+        if (s->tokens > s->burst)
+            s->tokens = s->burst;
+        s->refill_ns = now;
+        if (s->tokens >= bytes || s->tokens >= s->burst) {
+            s->tokens -= bytes;
+            pthread_mutex_unlock(&s->bucket_lock);
+            return;
+        }
+        wait = (uint64_t)((bytes - s->tokens) * 1e9 / s->rate);
+        pthread_mutex_unlock(&s->bucket_lock);
+        sleep_ns(wait < 50000000 ? wait : 50000000);
+        while (s->yield && interactive_pending(s))
+            sleep_ns(1000000);
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct iosched *s = arg;
+
+    iosched_bg_enter();
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        struct iosched_job *job;
+
+        while (!s->head && !s->stopping)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (!s->head)
+            break;
+        job = s->head;
+        s->head = job->next;
+        if (!s->head)
+            s->tail = NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        iosched_bg_throttle(s, 0);
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->pending == 0)
+            pthread_cond_broadcast(&s->idle);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int iosched_init(struct iosched *s, const char *state_dir, int threads,
+                 uint64_t bg_bytes_per_sec)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->shared = map_shared(state_dir);
+    if (!s->shared)
+        s->shared = &s->local;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    pthread_mutex_init(&s->bucket_lock, NULL);
+    s->rate = bg_bytes_per_sec;
+    s->burst = bg_bytes_per_sec ? bg_bytes_per_sec / 4 + 1 : 0;
+    s->tokens = s->burst;
+    s->refill_ns = bench_now_ns();
+    s->yield = 1;
+
+    if (threads <= 0)
+        return 0;
+    s->threads = calloc(threads, sizeof(*s->threads));
+    if (!s->threads)
+        return -1;
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&s->threads[i], NULL, worker, s) != 0)
+            break;
+        s->nthreads++;
+    }
+    return s->nthreads == threads ? 0 : -1;
+}
+
+int iosched_submit(struct iosched *s, void (*fn)(void *), void *arg)
+{
+    struct iosched_job *job;
+
+    if (s->nthreads == 0) {
+        fn(arg);
+        return 0;
+    }
+    job = malloc(sizeof(*job));
+    if (!job)
+        return -1;
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->tail)
+        s->tail->next = job;
+    else
+        s->head = job;
+    s->tail = job;
+    s->pending++;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void iosched_drain(struct iosched *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->pending > 0)
+        pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void iosched_shutdown(struct iosched *s)
+{
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nthreads; i++)
+        pthread_join(s->threads[i], NULL);
+    free(s->threads);
+    s->threads = NULL;
+    s->nthreads = 0;
+    if (s->shared != &s->local)
+        munmap(s->shared, sizeof(struct iosched_shared));
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    pthread_cond_destroy(&s->idle);
+    pthread_mutex_destroy(&s->bucket_lock);
+}
+
+/*
+ * Benchmark: latency of a mkdir/stat/rmdir "open" while background writers
+ * run, and what the writers get done meanwhile: 1 MB writes per second and
+ * how long each took, parking included. Opens spaced closer than the grace
+ * period keep background work parked throughout; spaced wider, it runs in
+ * the gaps.
+ */
+
+struct bench_bg {
+    struct iosched *s;
+    char path[4096];
+    volatile int *stop;
+    volatile int *measure;
+    uint64_t writes, lat_ns, max_ns;
+};
+
+static void bench_writer(void *arg)
+{
+    struct bench_bg *b = arg;
+    static char buf[1 << 20];
+    int fd = open(b->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return;
+    while (!*b->stop) {
+        uint64_t t0 = bench_now_ns(), t;
+
+        iosched_bg_throttle(b->s, sizeof(buf));
+        if (write(fd, buf, sizeof(buf)) < 0)
+            break;
+        fdatasync(fd);
+        if (lseek(fd, 0, SEEK_CUR) > (64 << 20))
+            lseek(fd, 0, SEEK_SET);
+        t = bench_now_ns() - t0;
+        if (*b->measure && !*b->stop) {
+            b->writes++;
+            b->lat_ns += t;
+            if (t > b->max_ns)
+                b->max_ns = t;
+        }
+    }
+    close(fd);
+    unlink(b->path);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(const char *dir, int yield, uint64_t rate, int ops,
+                      int writers, uint64_t gap_ns)
+{
+    struct iosched s;
+    struct bench_bg *bg;
+    volatile int stop = 0, measure = 0;
+    uint64_t *lat, start, elapsed, writes = 0, bg_ns = 0, bg_max = 0;
+    char path[4096];
+    struct stat st;
+    int i;
+
+    iosched_init(&s, NULL, writers, rate);
+    s.yield = yield;
+    bg = calloc(writers, sizeof(*bg));
+    lat = calloc(ops, sizeof(*lat));
+    for (i = 0; i < writers; i++) {
+        bg[i].s = &s;
+        bg[i].stop = &stop;
+        bg[i].measure = &measure;
+        snprintf(bg[i].path, sizeof(bg[i].path), "%s/bg.%d", dir, i);
+        iosched_submit(&s, bench_writer, &bg[i]);
+    }
+    sleep_ns(200000000);
+
+    measure = 1;
+    start = bench_now_ns();
+    for (i = 0; i < ops; i++) {
+        uint64_t t0 = bench_now_ns();
+
+        iosched_interactive_begin(&s);
+        snprintf(path, sizeof(path), "%s/INC%07d", dir, i);
+        mkdir(path, 0755);
+        stat(path, &st);
+        rmdir(path);
+        iosched_interactive_end(&s);
+        lat[i] = bench_now_ns() - t0;
+        sleep_ns(gap_ns);
+    }
+    elapsed = bench_now_ns() - start;
+    stop = 1;
+    iosched_drain(&s);
+    iosched_shutdown(&s);
+
+    for (i = 0; i < writers; i++) {
+        writes += bg[i].writes;
+        bg_ns += bg[i].lat_ns;
+        if (bg[i].max_ns > bg_max)
+            bg_max = bg[i].max_ns;
+    }
+    qsort(lat, ops, sizeof(*lat), cmp_u64);
+    printf("%-10s p50 %8.1f us  p99 %8.1f us  max %8.1f us | background %6.1f MB/s, "
+           "write %7.1f ms mean %8.1f ms max\n",
+           yield ? "scheduled" : "baseline", lat[ops / 2] / 1e3,
+           lat[ops * 99 / 100] / 1e3, lat[ops - 1] / 1e3, writes / (elapsed / 1e9),
+           writes ? bg_ns / 1e6 / writes : 0.0, bg_max / 1e6);
+    free(lat);
+    free(bg);
+}
+
+int iosched_bench(int argc, char *argv[])
+{
+    char dir[256];
+    int ops = argc > 0 ? atoi(argv[0]) : 400;
+    int writers = 4, i;
+
+    if (ops < 1)
+        ops = 400;
+    if (bench_tmpdir(dir, sizeof(dir), "sched") != 0)
+        return 1;
+    /* Opens inside the grace period of the last one, then well outside it. */
+    for (i = 0; i < 2; i++) {
+        uint64_t gap = i == 0 ? IOSCHED_GRACE_NS / 4 : IOSCHED_GRACE_NS * 5 / 2;
+
+        printf("%s%d interactive opens %.0f ms apart under %d background writers\n",
+               i ? "\n" : "", ops, gap / 1e6, writers);
+        bench_run(dir, 0, 0, ops, writers, gap);
+        bench_run(dir, 1, 64ULL << 20, ops, writers, gap);
+    }
+    bench_rmtree(dir);
+    return 0;
+}
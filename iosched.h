@@ -0,0 +1,66 @@
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Two-class scheduler. Interactive work (the open/create path) brackets
+ * itself with iosched_interactive_begin/end. Background jobs run on idle
+ * priority threads, pay for their I/O through a token bucket and stall in
+ * iosched_bg_throttle() while any process is inside an interactive section.
+ */
+
+struct iosched_shared {
+    uint32_t active;        /* interactive sections in flight */
+    uint32_t pad;
+    uint64_t stamp_ns;      /* last begin/end, CLOCK_MONOTONIC */
+};
+
+struct iosched_job {
+    void (*fn)(void *arg);
+    void *arg;
+    struct iosched_job *next;
+};
+
+struct iosched {
+    struct iosched_shared *shared;  /* mmap'd <state>/sched, or &local */
+    struct iosched_shared local;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t idle;
+    struct iosched_job *head, *tail;
+    int pending;
+    int stopping;
+
+    pthread_t *threads;
+    int nthreads;
+
+    pthread_mutex_t bucket_lock;
+    uint64_t rate;          /* bytes per second, 0 = unthrottled */
+    uint64_t burst;
+    double tokens;
+    uint64_t refill_ns;
+
+    int yield;              /* 0 disables yielding (benchmark baseline) */
+};
+
+int iosched_init(struct iosched *s, const char *state_dir, int threads,
+                 uint64_t bg_bytes_per_sec);
+void iosched_shutdown(struct iosched *s);
+
+void iosched_interactive_begin(struct iosched *s);
+void iosched_interactive_end(struct iosched *s);
+
+int iosched_submit(struct iosched *s, void (*fn)(void *), void *arg);
+void iosched_drain(struct iosched *s);
+
+/* Called by background jobs before each unit of I/O. */
+void iosched_bg_throttle(struct iosched *s, uint64_t bytes);
+/* Lower the calling thread to idle CPU and I/O priority. */
+void iosched_bg_enter(void);
+
+int iosched_bench(int argc, char *argv[]);
+
+#endif
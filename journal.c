@@ -0,0 +1,423 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "meta.h"
+#include "timelog.h"
+#include "wal.h"
+
+#define DAYS_MAGIC "TFSJDAY2"
+#define READ_BATCH 1024
+
+struct days_header {
+    char magic[8];
+    uint64_t applied;       /* journal records folded in */
+    uint64_t rows;
+    uint64_t reserved;
+};
+
+#define ROW_OFF(i) ((off_t)(sizeof(struct days_header) + (i) * sizeof(struct journal_day)))
+
+static const char *const type_names[JOURNAL_NTYPES] = {
+    "", "create", "open", "close", "reopen", "archive", "restore", "delete", "size",
+    "tag", "untag",
+};
+
+const char *journal_type_name(int type)
+{
+    return type > 0 && type < JOURNAL_NTYPES ? type_names[type] : "unknown";
+}
+
+static uint32_t rec_crc(const struct journal_rec *r)
+{
+    return crc32c(0, (const char *)r + sizeof(r->crc), sizeof(*r) - sizeof(r->crc));
+}
+
+static int rec_valid(const struct journal_rec *r)
+{
+    return r->crc == rec_crc(r) && r->type > 0 && r->type < JOURNAL_NTYPES;
+}
+
+static void add_to_row(struct journal_day *row, const struct journal_rec *r)
+{
+    row->count[r->type]++;
+    row->bytes += r->bytes;
+}
+
+/* Fold one record into the rows in memory; they stay in day order. */
+static int apply(struct days_header *h, struct journal_day **rows, size_t *cap,
+                 const struct journal_rec *r)
+{
+    uint32_t day = time_day(r->time);
+    uint64_t i = h->rows;
+
+    /* Events arrive in time order, so the row is almost always the last. */
+    while (i > 0 && (*rows)[i - 1].day > day)
+        i--;
+    if (i > 0 && (*rows)[i - 1].day == day) {
+        add_to_row(&(*rows)[i - 1], r);
+        return 0;
+    }
+    if (h->rows == *cap) {
+        size_t n = *cap ? *cap * 2 : 64;
+        struct journal_day *p = realloc(*rows, n * sizeof(*p));
+
+        if (!p)
+            return -1;
+        *rows = p;
+        *cap = n;
+    }
+    memmove(*rows + i + 1, *rows + i, (h->rows - i) * sizeof(**rows));
+    memset(*rows + i, 0, sizeof(**rows));
+    (*rows)[i].day = day;
+    add_to_row(*rows + i, r);
+    h->rows++;
+    return 0;
+}
+
+/* Read the rollup into h and rows; a missing or foreign file starts empty. */
+static int load_days(const char *path, struct days_header *h, struct journal_day **rows,
+                     size_t *cap)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC), rc = 0;
+
+    memset(h, 0, sizeof(*h));
+    if (fd < 0 && errno != ENOENT)
+        return -1;
+    if (fd >= 0 && (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+                    memcmp(h->magic, DAYS_MAGIC, 8)))
+        memset(h, 0, sizeof(*h));
+    memcpy(h->magic, DAYS_MAGIC, 8);
+    if (h->rows) {
+        *cap = h->rows;
+        *rows = malloc(*cap * sizeof(**rows));
+        if (!*rows ||
+            pread(fd, *rows, *cap * sizeof(**rows), ROW_OFF(0)) != (ssize_t)(*cap * sizeof(**rows)))
+            rc = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+/*
+ * Apply every journal record the rollup has not seen; the journal lock is
+ * held. The rows and the applied count are replaced together through a
+ * renamed temporary, so a crash leaves either both old or both new and
+ * the next append replays exactly what is missing.
+ */
+static int catch_up(const char *state_dir, int jfd, uint64_t total)
+{
+    struct journal_rec batch[READ_BATCH];
+    struct journal_day *rows = NULL;
+    struct days_header h;
+    char path[4200], tmp[4300];
+    size_t cap = 0;
+    int fd = -1, rc = -1;
+
+    snprintf(path, sizeof(path), "%s/journal.days", state_dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (load_days(path, &h, &rows, &cap) != 0)
+        goto out;
+    if (h.applied >= total) {
+        rc = 0;
+        goto out;
+    }
+    while (h.applied < total) {
+        size_t n = total - h.applied < READ_BATCH ? total - h.applied : READ_BATCH, i;
+        ssize_t got = pread(jfd, batch, n * sizeof(*batch), h.applied * sizeof(*batch));
+
+        if (got != (ssize_t)(n * sizeof(*batch)))
+            goto out;
+        for (i = 0; i < n; i++)
+            if (rec_valid(&batch[i]) && apply(&h, &rows, &cap, &batch[i]) != 0)
+                goto out;
+        h.applied += n;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        (h.rows && pwrite(fd, rows, h.rows * sizeof(*rows), ROW_OFF(0)) !=
+                       (ssize_t)(h.rows * sizeof(*rows))) ||
+        fdatasync(fd) != 0 || rename(tmp, path) != 0)
+        goto out;
+    rc = 0;
+out:
+    if (fd >= 0)
+        close(fd);
+    if (rc != 0 && fd >= 0)
+        unlink(tmp);
+    free(rows);
+    return rc;
+}
+
+static int open_locked(const char *state_dir, int flags)
+{
+    char path[4200];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/journal", state_dir);
+    fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd >= 0)
+        flock(fd, LOCK_EX);
+    return fd;
+}
+
+int journal_append(const char *state_dir, int type, uint32_t ord, int64_t time,
+                   int64_t bytes)
+{
+    struct journal_rec r;
+    struct stat st;
+    off_t end;
+    int fd, rc = -1;
+
+    fd = open_locked(state_dir, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0)
+        goto out;
+    /* Cut off a record torn by a crash mid-append. */
+    end = st.st_size - st.st_size % sizeof(r);
+    if (end != st.st_size && ftruncate(fd, end) != 0)
+        goto out;
+    memset(&r, 0, sizeof(r));
+    r.type = (uint8_t)type;
+    r.ord = ord;
+    r.time = time;
+    r.bytes = bytes;
+    r.crc = rec_crc(&r);
+    if (pwrite(fd, &r, sizeof(r), end) != sizeof(r))
+        goto out;
+    rc = catch_up(state_dir, fd, end / sizeof(r) + 1);
+out:
+    close(fd);
+    return rc;
+}
+
+int64_t journal_read(const char *state_dir, uint64_t *cursor, journal_fn fn, void *arg)
+{
+    struct journal_rec batch[READ_BATCH];
+    char path[4200];
+    struct stat st;
+    uint64_t total;
+    int64_t count = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/journal", state_dir);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    total = st.st_size / sizeof(*batch);
+    while (*cursor < total) {
+        size_t n = total - *cursor < READ_BATCH ? total - *cursor : READ_BATCH, i;
+
+        if (pread(fd, batch, n * sizeof(*batch), *cursor * sizeof(*batch)) !=
+            (ssize_t)(n * sizeof(*batch))) {
+            close(fd);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            (*cursor)++;
+            if (!rec_valid(&batch[i]))
+                continue;
+            count++;
+            if (fn(&batch[i], arg) != 0) {
+                close(fd);
+                return count;
+            }
+        }
+    }
+    close(fd);
+    return count;
+}
+
+uint64_t journal_end(const char *state_dir)
+{
+    char path[4200];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/journal", state_dir);
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size / sizeof(struct journal_rec) : 0;
+}
+
+int journal_days(const char *state_dir, uint32_t from, uint32_t to,
+                 struct journal_day **rows, size_t *n)
+{
+    const struct journal_day *r;
+    struct days_header h;
+    char path[4200];
+    struct stat st;
+    size_t lo = 0, hi, i, len;
+    char *p;
+    int fd;
+
+    *rows = NULL;
+    *n = 0;
+    snprintf(path, sizeof(path), "%s/journal.days", state_dir);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(h)) {
+        close(fd);
+        return 0;
+    }
+    len = st.st_size;
+    p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    memcpy(&h, p, sizeof(h));
+    if (memcmp(h.magic, DAYS_MAGIC, 8) || ROW_OFF(h.rows) > (off_t)len) {
+        munmap(p, len);
+        return -1;
+    }
+    r = (const struct journal_day *)(p + sizeof(h));
+    hi = h.rows;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (r[mid].day < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < h.rows && r[i].day <= to; i++)
+        ;
+    if (i > lo && !(*rows = malloc((i - lo) * sizeof(**rows)))) {
+        munmap(p, len);
+        return -1;
+    }
+    if (i > lo)
+        memcpy(*rows, r + lo, (i - lo) * sizeof(**rows));
+    *n = i - lo;
+    munmap(p, len);
+    return 0;
+}
+
+struct rebuild {
+    struct journal_day *rows;   /* one per day from first */
+    uint32_t first, ndays;
+    int64_t earliest;           /* first journal event */
+};
+
+static int span_one(const struct journal_rec *r, void *arg)
+{
+    struct rebuild *b = arg;
+    uint32_t day = time_day(r->time);
+
+    if (b->ndays == 0) {
+        b->first = day;
+        b->ndays = 1;
+    } else if (day < b->first) {
+        b->ndays += b->first - day;
+        b->first = day;
+    } else if (day >= b->first + b->ndays) {
+        b->ndays = day - b->first + 1;
+    }
+    if (r->time < b->earliest)
+        b->earliest = r->time;
+    return 0;
+}
+
+static int fold_one(const struct journal_rec *r, void *arg)
+{
+    struct rebuild *b = arg;
+
+    add_to_row(&b->rows[time_day(r->time) - b->first], r);
+    return 0;
+}
+
+int journal_rebuild(const char *state_dir)
+{
+    struct rebuild b;
+    struct days_header h;
+    struct meta meta;
+    struct journal_rec seed;
+    char path[4200], tmp[4300];
+    uint64_t cursor = 0, applied;
+    uint32_t ord, i;
+    int fd, out = -1, have_meta, rc = -1;
+
+    memset(&b, 0, sizeof(b));
+    b.earliest = INT64_MAX;
+    fd = open_locked(state_dir, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return -1;
+    have_meta = meta_open(&meta, state_dir) == 0;
+    if (journal_read(state_dir, &cursor, span_one, &b) < 0)
+        goto out;
+    applied = cursor;
+
+    /* Tickets from before the journal: their creation, with today's size. */
+    memset(&seed, 0, sizeof(seed));
+    seed.type = JOURNAL_CREATE;
+    for (ord = 0; have_meta && ord < meta.count; ord++) {
+        if (meta.state[ord] == TICKET_UNKNOWN || meta.ctime[ord] <= 0 ||
+            meta.ctime[ord] >= b.earliest)
+            continue;
+        seed.time = meta.ctime[ord];
+        span_one(&seed, &b);
+    }
+    b.rows = calloc(b.ndays ? b.ndays : 1, sizeof(*b.rows));
+    if (!b.rows)
+        goto out;
+    for (i = 0; i < b.ndays; i++)
+        b.rows[i].day = b.first + i;
+    cursor = 0;
+    if (journal_read(state_dir, &cursor, fold_one, &b) < 0)
+        goto out;
+    for (ord = 0; have_meta && ord < meta.count; ord++) {
+        if (meta.state[ord] == TICKET_UNKNOWN || meta.ctime[ord] <= 0 ||
+            meta.ctime[ord] >= b.earliest)
+            continue;
+        seed.time = meta.ctime[ord];
+        seed.bytes = meta.state[ord] == TICKET_DELETED ? 0 : meta.size[ord];
+        fold_one(&seed, &b);
+    }
+
+    snprintf(path, sizeof(path), "%s/journal.days", state_dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        goto out;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DAYS_MAGIC, 8);
+    h.applied = applied;
+    for (i = 0; i < b.ndays; i++) {
+        int j, empty = b.rows[i].bytes == 0;
+
+        for (j = 1; j < JOURNAL_NTYPES; j++)
+            empty &= b.rows[i].count[j] == 0;
+        if (empty)
+            continue;
+        if (pwrite(out, &b.rows[i], sizeof(b.rows[i]), ROW_OFF(h.rows)) !=
+            sizeof(b.rows[i]))
+            goto out;
+        h.rows++;
+    }
+    if (pwrite(out, &h, sizeof(h), 0) != sizeof(h) || fdatasync(out) != 0 ||
+        rename(tmp, path) != 0)
+        goto out;
+    rc = 0;
+out:
+    if (out >= 0)
+        close(out);
+    if (rc != 0 && out >= 0)
+        unlink(tmp);
+    if (have_meta)
+        meta_close(&meta);
+    free(b.rows);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,78 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Operation journal: one fixed-size, checksummed record per ticket event
+ * in <state>/journal, appended under flock. A reader's position is a
+ * record index, so anything that follows the journal keeps a cursor and
+ * picks up where it stopped; a torn record at the tail ends the read and
+ * is cut off by the next append.
+ *
+ * Every append also brings the daily rollup (<state>/journal.days) up to
+ * date: one row per day with a count per event type and the net change in
+ * disk usage. The rollup header records how many journal records it has
+ * applied, and an append applies everything past that. Rows and count are
+ * replaced together by renaming a rewritten rollup over the old one, so a
+ * crash at any point is repaired by the next append without counting a
+ * record twice.
+ */
+
+enum {
+    JOURNAL_CREATE = 1,
+    JOURNAL_OPEN,
+    JOURNAL_CLOSE,
+    JOURNAL_REOPEN,
+    JOURNAL_ARCHIVE,
+    JOURNAL_RESTORE,
+    JOURNAL_DELETE,
+    JOURNAL_SIZE,           /* a rescan found the folder changed size */
+    JOURNAL_TAG,
+    JOURNAL_UNTAG,
+    JOURNAL_NTYPES
+};
+
+struct journal_rec {
+    uint32_t crc;           /* crc32c of everything after itself */
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t ord;
+    uint32_t reserved2;
+    int64_t time;
+    int64_t bytes;          /* change in disk usage */
+};
+
+struct journal_day {
+    uint32_t day;           /* local days since the epoch */
+    uint32_t reserved;
+    uint64_t count[JOURNAL_NTYPES];     /* by type; count[0] is unused */
+    int64_t bytes;
+};
+
+int journal_append(const char *state_dir, int type, uint32_t ord, int64_t time,
+                   int64_t bytes);
+
+typedef int (*journal_fn)(const struct journal_rec *r, void *arg);
+
+/*
+ * Call fn for each valid record from index *cursor on, advancing *cursor
+ * past it. Returns the number of records read, or -1 on error.
+ */
+int64_t journal_read(const char *state_dir, uint64_t *cursor, journal_fn fn, void *arg);
+/* Cursor past the last record written so far. */
+uint64_t journal_end(const char *state_dir);
+
+/* Daily rollup rows with from <= day <= to, oldest first; free *rows. */
+int journal_days(const char *state_dir, uint32_t from, uint32_t to,
+                 struct journal_day **rows, size_t *n);
+/*
+ * Rebuild the rollup from the journal. Tickets created before the journal
+ * began are counted from the metadata creation times.
+ */
+int journal_rebuild(const char *state_dir);
+
+const char *journal_type_name(int type);
+
+#endif
@@ -0,0 +1,356 @@
+#include "list.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufout.h"
+#include "meta.h"
+#include "ticket.h"
+
+
+struct listing {
+    struct list_entry *e;
+    size_t n, cap;
+    char *names;
+    size_t names_len, names_cap;
+    char (*prefixes)[TICKET_NAME_MAX + 1];
+    uint32_t nprefixes;
+    int overflow;           /* more prefixes than the key holds: keys are numbers only */
+};
+
+static int64_t parse_since(const char *s)
+{
+    struct tm tm;
+    char *end;
+    long v;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(s, "%Y-%m-%d", &tm);
+    if (end && !*end) {
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+    v = strtol(s, &end, 10);
+    if (end == s || v < 0)
+        return -1;
+    if (!strcmp(end, "d"))
+        return time(NULL) - v * 86400;
+    if (!strcmp(end, "h"))
+        return time(NULL) - v * 3600;
+    if (!strcmp(end, "w"))
+        return time(NULL) - v * 7 * 86400;
+    return -1;
+}
+
+int list_parse_args(int argc, char *argv[], struct list_opts *o)
+{
+    uint64_t page = 0, page_size = 50;
+    int i;
+
+    memset(o, 0, sizeof(*o));
+    for (i = 0; i < argc; i++) {
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "-l")) {
+            o->long_format = 1;
+            continue;
+        }
+        if (!v) {
+            fprintf(stderr, "list: %s needs a value\n", argv[i]);
+            return -1;
+        }
+        if (!strcmp(argv[i], "--prefix")) {
+            o->prefix = v;
+        } else if (!strcmp(argv[i], "--since")) {
+            o->since = parse_since(v);
+            if (o->since < 0) {
+                fprintf(stderr, "list: bad --since '%s'\n", v);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--limit")) {
+            o->limit = strtoull(v, NULL, 10);
+        } else if (!strcmp(argv[i], "--offset")) {
+            o->offset = strtoull(v, NULL, 10);
+        } else if (!strcmp(argv[i], "--page")) {
+            page = strtoull(v, NULL, 10);
+        } else if (!strcmp(argv[i], "--page-size")) {
+            page_size = strtoull(v, NULL, 10);
+        } else {
+            fprintf(stderr, "list: unknown option %s\n", argv[i]);
+            return -1;
+        }
+        i++;
+    }
+    if (page > 0) {
+        o->offset = (page - 1) * page_size;
+        o->limit = page_size;
+    }
+    return 0;
+}
+
+static int prefix_id(struct listing *l, const char *prefix)
+{
+    uint32_t i;
+
+    for (i = 0; i < l->nprefixes; i++)
+        if (!strcmp(l->prefixes[i], prefix))
+            return i;
+    if ((l->nprefixes & (l->nprefixes - 1)) == 0) {
+        void *p = realloc(l->prefixes, (l->nprefixes ? l->nprefixes * 2 : 4) *
+                                       sizeof(*l->prefixes));
+
+        if (!p)
+            return -1;
+        l->prefixes = p;
+    }
+    strcpy(l->prefixes[l->nprefixes], prefix);
+    return l->nprefixes++;
+}
+
+static int push(struct listing *l, const char *name, uint64_t key, uint32_t ord)
+{
+    size_t len = strlen(name) + 1;
+
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 4096;
+        struct list_entry *e = realloc(l->e, cap * sizeof(*e));
+
+        if (!e)
+            return -1;
+        l->e = e;
+        l->cap = cap;
+    }
+    if (l->names_len + len > l->names_cap) {
+        size_t cap = l->names_cap ? l->names_cap * 2 : 65536;
+        char *p = realloc(l->names, cap);
+
+        if (!p)
+            return -1;
+        l->names = p;
+        l->names_cap = cap;
+    }
+    memcpy(l->names + l->names_len, name, len);
+    l->e[l->n].key = key;
+    l->e[l->n].name = (uint32_t)l->names_len;
+    l->e[l->n].ord = ord;
+    l->names_len += len;
+    l->n++;
+    return 0;
+}
+
+int list_radix_sort(struct list_entry *e, size_t n)
+{
+    struct list_entry *tmp, *src = e, *dst;
+    size_t count[8][256];
+    size_t i;
+    int pass, b;
+
+    if (n < 2)
+        return 0;
+    tmp = malloc(n * sizeof(*tmp));
+    if (!tmp)
+        return -1;
+    dst = tmp;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+        for (pass = 0; pass < 8; pass++)
+            count[pass][(e[i].key >> (pass * 8)) & 0xff]++;
+
+    for (pass = 0; pass < 8; pass++) {
+        size_t *c = count[pass], sum = 0;
+        int shift = pass * 8;
+
+        if (c[(e[0].key >> shift) & 0xff] == n)
+            continue;
+        for (b = 0; b < 256; b++) {
+            size_t t = c[b];
+
+            c[b] = sum;
+            sum += t;
+        }
+        for (i = 0; i < n; i++)
+            dst[c[(src[i].key >> shift) & 0xff]++] = src[i];
+        {
+            struct list_entry *t = src;
+
+            src = dst;
+            dst = t;
+        }
+    }
+    if (src != e)
+        memcpy(e, src, n * sizeof(*e));
+    free(tmp);
+    return 0;
+}
+
+static int cmp_prefix(const void *a, const void *b, void *arg)
+{
+    const struct listing *l = arg;
+
+    return strcmp(l->prefixes[*(const uint32_t *)a], l->prefixes[*(const uint32_t *)b]);
+}
+
+static int rank_prefixes(struct listing *l)
+{
+    uint32_t *order, *rank, i;
+
+    /* Prefix ids were handed out in readdir order; remap to sorted rank. */
+    order = malloc(2 * (l->nprefixes + 1) * sizeof(*order));
+    if (!order)
+        return -1;
+    rank = order + l->nprefixes + 1;
+    for (i = 0; i < l->nprefixes; i++)
+        order[i] = i;
+    qsort_r(order, l->nprefixes, sizeof(*order), cmp_prefix, l);
+    for (i = 0; i < l->nprefixes; i++)
+        rank[order[i]] = i;
+    for (i = 0; i < l->n; i++) {
+        uint64_t id = l->e[i].key >> LIST_NUMBER_BITS;
+
+        l->e[i].key = ((uint64_t)rank[id] << LIST_NUMBER_BITS) |
+                      (l->e[i].key & ((1ULL << LIST_NUMBER_BITS) - 1));
+    }
+    free(order);
+    return 0;
+}
+
+/* Natural order by name, for when the prefixes do not fit in the keys. */
+static int cmp_names(const void *a, const void *b, void *arg)
+{
+    const struct list_entry *x = a, *y = b;
+    const char *nx = (const char *)arg + x->name, *ny = (const char *)arg + y->name;
+    char px[TICKET_NAME_MAX + 1], py[TICKET_NAME_MAX + 1];
+    uint64_t vx, vy;
+    int wx, wy, c;
+
+    ticket_parse(nx, px, sizeof(px), &vx, &wx);
+    ticket_parse(ny, py, sizeof(py), &vy, &wy);
+    if ((c = strcmp(px, py)) != 0)
+        return c;
+    if (vx != vy)
+        return vx < vy ? -1 : 1;
+    return strcmp(nx, ny);
+}
+
+static int sort_listing(struct listing *l)
+{
+    if (l->overflow) {
+        qsort_r(l->e, l->n, sizeof(*l->e), cmp_names, l->names);
+        return 0;
+    }
+    if (rank_prefixes(l) != 0)
+        return -1;
+    return list_radix_sort(l->e, l->n);
+}
+
+int list_run(const char *base, const char *state_dir, const struct list_opts *o,
+             int fd)
+{
+    struct listing l;
+    struct ordmap names;
+    struct meta meta;
+    struct bufout *w;
+    struct dirent *de;
+    int have_meta, have_names, basefd, rc = -1;
+    uint64_t i, end;
+    DIR *d;
+
+    memset(&l, 0, sizeof(l));
+    basefd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (basefd < 0)
+        return -1;
+    d = fdopendir(basefd);
+    if (!d) {
+        close(basefd);
+        return -1;
+    }
+    have_names = ordmap_open(&names, state_dir) == 0;
+    have_meta = have_names && meta_open(&meta, state_dir) == 0;
+
+    while ((de = readdir(d)) != NULL) {
+        char prefix[TICKET_NAME_MAX + 1];
+        uint64_t number;
+        uint32_t ord = TICKET_NONE;
+        int width, id;
+
+        if (de->d_name[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN))
+            continue;
+        if (ticket_parse(de->d_name, prefix, sizeof(prefix), &number, &width) != 0 ||
+            number >= (1ULL << LIST_NUMBER_BITS))
+            continue;
+        if (o->prefix && strcmp(prefix, o->prefix) != 0)
+            continue;
+        if (have_names)
+            ord = ordmap_lookup(&names, de->d_name);
+        if (o->since || de->d_type == DT_UNKNOWN) {
+            int64_t mtime;
+            struct stat st;
+
+            if (have_meta && ord < meta.count && meta.ctime[ord] != 0 &&
+                de->d_type == DT_DIR) {
+                mtime = meta.mtime[ord];
+            } else if (fstatat(basefd, de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+                mtime = st.st_mtime;
+            } else {
+                continue;
+            }
+            if (mtime < o->since)
+                continue;
+        }
+        id = prefix_id(&l, prefix);
+        if (id < 0)
+            goto out;
+        if ((uint32_t)id >= LIST_PREFIX_MAX)
+            l.overflow = 1;
+        if (push(&l, de->d_name, ((uint64_t)(id % LIST_PREFIX_MAX) << LIST_NUMBER_BITS) |
+                                 number, ord) != 0)
+            goto out;
+    }
+
+    if (sort_listing(&l) != 0)
+        goto out;
+
+    w = malloc(sizeof(*w));
+    if (!w)
+        goto out;
+    bufout_init(w, fd);
+    end = o->limit ? o->offset + o->limit : l.n;
+    for (i = o->offset; i < end && i < l.n; i++) {
+        const struct list_entry *e = &l.e[i];
+
+        bufout_puts(w, l.names + e->name);
+        if (o->long_format) {
+            if (have_meta && e->ord < meta.count && meta.ctime[e->ord] != 0) {
+                char when[32];
+                time_t t = meta.mtime[e->ord];
+
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+                bufout_printf(w, "\t%s\t%lld\t%s",
+                              ticket_state_name(meta.state[e->ord]),
+                              (long long)meta.size[e->ord], when);
+            } else {
+                bufout_puts(w, "\t-\t-\t-");
+            }
+        }
+        bufout_putc(w, '\n');
+    }
+    rc = bufout_flush(w);
+    free(w);
+
+out:
+    closedir(d);
+    if (have_meta)
+        meta_close(&meta);
+    if (have_names)
+        ordmap_close(&names);
+    free(l.e);
+    free(l.names);
+    free(l.prefixes);
+    return rc;
+}
@@ -0,0 +1,41 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * list: ticket folders under the base in natural order (INC2 before
+ * INC10). Names are parsed into 64-bit keys (prefix rank, number) and
+ * sorted with an LSD radix sort; a base with more prefixes than a key's
+ * 16 prefix bits can rank is sorted by comparing names instead. --prefix
+ * and --since drop entries before the sort, and the page window is
+ * applied while streaming.
+ */
+
+struct list_opts {
+    const char *prefix;     /* NULL for every prefix */
+    int64_t since;          /* minimum mtime, 0 for no limit */
+    uint64_t offset;
+    uint64_t limit;         /* 0 for no limit */
+    int long_format;        /* include state, size and mtime */
+};
+
+/* Key layout: prefix rank above LIST_NUMBER_BITS bits of ticket number. */
+#define LIST_NUMBER_BITS 48
+#define LIST_PREFIX_MAX (1u << (64 - LIST_NUMBER_BITS))
+
+struct list_entry {
+    uint64_t key;
+    uint32_t name;          /* caller's handle, e.g. an arena offset */
+    uint32_t ord;
+};
+
+/* Stable LSD radix sort by key; passes where every key agrees are skipped. */
+int list_radix_sort(struct list_entry *e, size_t n);
+
+int list_parse_args(int argc, char *argv[], struct list_opts *o);
+int list_run(const char *base, const char *state_dir, const struct list_opts *o,
+             int fd);
+
+#endif
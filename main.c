@@ -1,18 +1,1469 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "archive.h"
+#include "bench.h"
+#include "cdc.h"
+#include "cmd.h"
+#include "cmdtab.h"
+#include "config.h"
+#include "delta.h"
+#include "fsck.h"
+#include "hooks.h"
+#include "index.h"
+#include "iosched.h"
+#include "journal.h"
+#include "list.h"
+#include "merkle.h"
+#include "merge.h"
+#include "meta.h"
+#include "mirror.h"
+#include "prefetch.h"
+#include "query.h"
+#include "relocate.h"
+#include "report.h"
+#include "retention.h"
+#include "seal.h"
+#include "selfbench.h"
+#include "tags.h"
+#include "ticket.h"
+#include "ticketfs.h"
+#include "timelog.h"
+#include "views.h"
+
+static int confirm_name(char *name, size_t n) {
+    char line[256];
+
+    for (;;) {
+        printf("Folder name '%s' - use it? [Y/n/new name]: ", name);
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), stdin))
+            return name[0] ? 0 : -1;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || !strcmp(line, "y") || !strcmp(line, "Y"))
+            return name[0] ? 0 : -1;
+        if (!strcmp(line, "n") || !strcmp(line, "N"))
+            continue;
+        tfs_sanitize(line, name, n);
+    }
+}
+
+static int load_state(char *base, size_t nbase, char *state, size_t nstate) {
+    if (config_load_base(base, nbase) != 0 ||
+        config_state_dir(base, state, nstate) != 0) {
+        printf("Could not read or create the base directory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void open_in_file_manager(const char *path) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        execlp("xdg-open", "xdg-open", path, (char *)NULL);
+        _exit(127);
+    }
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+/* Follow the journal into the browsing views; they are a convenience, so only warn. */
+static void update_views(const char *base, const char *state) {
+    struct views_stats st;
+
+    if (views_update(base, state, 0, &st) != 0)
+        fprintf(stderr, "Could not update the views in %s/%s\n", base, VIEWS_DIR);
+}
+
+struct rescan_job {
+    struct meta *meta;
+    const char *state;
+    uint32_t ord;
+    const char *path;
+};
+
+/* Journal size changes of folders already scanned; a first scan is not growth. */
+static void rescan(void *arg) {
+    struct rescan_job *job = arg;
+    int seen = job->ord < job->meta->count && job->meta->mtime[job->ord] != 0;
+    int64_t before = seen ? job->meta->size[job->ord] : 0;
+
+    if (meta_rescan(job->meta, job->ord, job->path) == 0 && seen &&
+        job->meta->size[job->ord] != before)
+        journal_append(job->state, JOURNAL_SIZE, job->ord, time(NULL),
+                       job->meta->size[job->ord] - before);
+}
+
+static int open_ticket(const char *arg) {
+    char name[256], downloads[4096], base[4096], state[4096];
+    struct tfs_ticket t;
+    struct tfs_ctx *ctx;
+    const char *home;
+    int rc = 0;
+
+    tfs_sanitize(arg, name, sizeof(name));
+    if (strcmp(name, arg) != 0 && confirm_name(name, sizeof(name)) != 0) {
+        printf("No usable folder name\n");
+        return 1;
+    }
+    /* The library never asks; the first run asks for the base here. */
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (tfs_ctx_open(&ctx, base) != 0) {
+        printf("Could not read or create the base directory\n");
+        return 1;
+    }
+    /* Read the files used last time ahead while the file manager starts. */
+    if (tfs_open(ctx, name, TFS_OPEN_PREFETCH, NULL, &t) != 0) {
+        printf("Could not create %s/%s: %s\n", tfs_base(ctx), name, strerror(errno));
+        tfs_ctx_close(ctx);
+        return 1;
+    }
+    if (t.merged_from[0])
+        printf("%s was merged into %s\n", t.merged_from, t.name);
+    printf(t.created ? "Directory created\n" : "Directory already exists\n");
+    if (chdir(t.path) != 0) {
+        printf("Could not change to %s: %s\n", t.path, strerror(errno));
+        rc = 1;
+    }
+
+    /* Show what changed since the last visit and remember this one. */
+    if (rc == 0 && t.ord != TICKET_NONE)
+        merkle_visit(tfs_state_dir(ctx), t.ord, t.path, 0, 1, stdout);
+
+    if (rc == 0) {
+        open_in_file_manager(t.path);
+        home = getenv("HOME");
+        if (home) {
+            snprintf(downloads, sizeof(downloads), "%s/Downloads", home);
+            open_in_file_manager(downloads);
+        }
+    }
+    tfs_release(&t);
+    tfs_ctx_close(ctx);
+    return rc;
+}
+
+/* create <ticket>...: make and register tickets without opening them, for scripts */
+static int create_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct tfs_ticket *out;
+    struct tfs_ctx *ctx;
+    char (*names)[TICKET_NAME_MAX + 1];
+    const char **np;
+    int i, rc = 0;
+
+    if (argc < 1) {
+        printf("Usage: create <ticket>...\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (tfs_ctx_open(&ctx, base) != 0) {
+        printf("Could not read or create the base directory\n");
+        return 1;
+    }
+    out = calloc(argc, sizeof(*out));
+    names = calloc(argc, sizeof(*names));
+    np = calloc(argc, sizeof(*np));
+    if (!out || !names || !np) {
+        free(out);
+        free(names);
+        free(np);
+        tfs_ctx_close(ctx);
+        return 1;
+    }
+    /* The same folder names opening them would make, without the prompt. */
+    for (i = 0; i < argc; i++) {
+        tfs_sanitize(argv[i], names[i], sizeof(names[i]));
+        np[i] = names[i];
+    }
+    if (tfs_create_many(ctx, np, argc, out) < 0) {
+        printf("Could not read the ticket registry\n");
+        argc = 0;
+        rc = 1;
+    }
+    for (i = 0; i < argc; i++) {
+        if (!tfs_ticket_name(names[i])) {
+            printf("%s: not a ticket name\n", argv[i]);
+            rc = 1;
+        } else if (out[i].ord == TICKET_NONE) {
+            printf("%s: could not create\n", argv[i]);
+            rc = 1;
+        } else if (out[i].created) {
+            printf("%s: created\n", out[i].name);
+        } else {
+            printf("%s: already exists\n", out[i].name);
+        }
+    }
+    free(out);
+    free(names);
+    free(np);
+    tfs_ctx_close(ctx);
+    return rc;
+}
+
+/* scan: register every ticket folder under the base and refresh its row. */
+static int scan_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct rescan_job *jobs = NULL;
+    struct iosched sched;
+    struct dirent *de;
+    struct ordmap m;
+    struct meta meta;
+    size_t n = 0, cap = 0, i;
+    int base_id;
+    DIR *d;
+
+    (void)argc;
+    (void)argv;
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0 || meta_open(&meta, state) != 0) {
+        printf("Could not open the ticket registry\n");
+        return 1;
+    }
+    base_id = meta_base_id(&meta, base);
+    d = opendir(base);
+    if (!d) {
+        printf("Could not read %s\n", base);
+        return 1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        char prefix[TICKET_NAME_MAX + 1];
+        uint64_t number;
+        uint32_t ord;
+        int width;
+
+        if (de->d_name[0] == '.' || de->d_type != DT_DIR ||
+            ticket_parse(de->d_name, prefix, sizeof(prefix), &number, &width) != 0)
+            continue;
+        ord = ordmap_add(&m, de->d_name);
+        if (ord == TICKET_NONE || meta_reserve(&meta, ord + 1) != 0)
+            continue;
+        if (n == cap) {
+            struct rescan_job *grown;
+
+            cap = cap ? cap * 2 : 1024;
+            grown = realloc(jobs, cap * sizeof(*jobs));
+            if (!grown)
+                break;
+            jobs = grown;
+        }
+        jobs[n].meta = &meta;
+        jobs[n].state = state;
+        jobs[n].ord = ord;
+        jobs[n].path = NULL;
+        if (meta.base[ord] == 0)
+            meta.base[ord] = (uint16_t)(base_id > 0 ? base_id : 0);
+        n++;
+    }
+    closedir(d);
+
+    iosched_init(&sched, state, 4, 0);
+    for (i = 0; i < n; i++) {
+        char *path = malloc(strlen(base) + TICKET_NAME_MAX + 2);
+
+        if (!path)
+            break;
+        sprintf(path, "%s/%s", base, ordmap_name(&m, jobs[i].ord));
+        jobs[i].path = path;
+        iosched_submit(&sched, rescan, &jobs[i]);
+    }
+    iosched_drain(&sched);
+    iosched_shutdown(&sched);
+    for (i = 0; i < n; i++)
+        free((char *)jobs[i].path);
+    free(jobs);
+    printf("Scanned %zu tickets\n", n);
+    if (index_build(state, &m, &meta) != 0)
+        printf("Could not rebuild the ticket index\n");
+    meta_close(&meta);
+    ordmap_close(&m);
+    return 0;
+}
+
+static int stats_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct meta_totals t;
+    struct meta meta;
+    int s;
+
+    (void)argc;
+    (void)argv;
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (meta_open(&meta, state) != 0) {
+        printf("Could not open the metadata store\n");
+        return 1;
+    }
+    meta_totals(&meta, &t);
+    for (s = TICKET_OPEN; s < TICKET_NSTATES; s++)
+        printf("%-9s %8llu tickets %14llu bytes %10llu files\n",
+               ticket_state_name(s), (unsigned long long)t.tickets[s],
+               (unsigned long long)t.bytes[s], (unsigned long long)t.files[s]);
+    meta_close(&meta);
+    return 0;
+}
+
+static int change_tags(int argc, char *argv[], int add) {
+    char base[4096], state[4096], name[TICKET_NAME_MAX + 1];
+    struct ordmap m;
+    uint32_t ord;
+    int i, changed = 0, rc = 0;
 
-int main(int argc, char *argv[]) {
     if (argc < 2) {
-        printf("Usage: %s [ticket number]", argv[0]);
+        printf("Usage: %s <ticket> <tag>...\n", add ? "tag" : "untag");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    /* Only registered tickets are tagged; tagging never creates one. */
+    tfs_sanitize(argv[0], name, sizeof(name));
+    ord = ordmap_lookup(&m, name);
+    ordmap_close(&m);
+    if (ord == TICKET_NONE) {
+        printf("Unknown ticket: %s\n", argv[0]);
+        return 1;
+    }
+    for (i = 1; i < argc; i++) {
+        if (tags_update(state, argv[i], &ord, 1, add) != 0) {
+            printf("Could not update tag %s\n", argv[i]);
+            rc = 1;
+        } else {
+            changed = 1;
+        }
+    }
+    /* Nothing is journalled for a change that did not happen. */
+    if (changed) {
+        journal_append(state, add ? JOURNAL_TAG : JOURNAL_UNTAG, ord, time(NULL), 0);
+        update_views(base, state);
+    }
+    return rc;
+}
+
+static int tag_cmd(int argc, char *argv[]) {
+    return change_tags(argc, argv, 1);
+}
+
+static int untag_cmd(int argc, char *argv[]) {
+    return change_tags(argc, argv, 0);
+}
+
+static int print_ticket(uint32_t ord, void *arg) {
+    const char *name = ordmap_name(arg, ord);
+
+    if (name)
+        printf("%s\n", name);
+    return 0;
+}
+
+/* tagged <tag> [and|or|not <tag>]... evaluated left to right */
+static int tagged_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct rbitmap acc, next;
+    struct ordmap m;
+    int i, rc = 0;
+
+    if (argc < 1 || argc % 2 == 0) {
+        printf("Usage: tagged <tag> [and|or|not <tag>]...\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (tags_load(state, argv[0], &acc) != 0) {
+        printf("Could not read tag %s\n", argv[0]);
+        return 1;
+    }
+    for (i = 1; rc == 0 && i + 1 < argc; i += 2) {
+        if (tags_load(state, argv[i + 1], &next) != 0) {
+            printf("Could not read tag %s\n", argv[i + 1]);
+            rc = 1;
+            break;
+        }
+        if (!strcmp(argv[i], "and"))
+            rc = rb_and(&acc, &acc, &next);
+        else if (!strcmp(argv[i], "or"))
+            rc = rb_or(&acc, &acc, &next);
+        else if (!strcmp(argv[i], "not"))
+            rc = rb_andnot(&acc, &acc, &next);
+        else {
+            printf("Unknown operator: %s\n", argv[i]);
+            rc = 1;
+        }
+        rb_free(&next);
+    }
+    if (rc == 0 && ordmap_open(&m, state) == 0) {
+        rb_foreach(&acc, print_ticket, &m);
+        ordmap_close(&m);
+    }
+    rb_free(&acc);
+    return rc != 0;
+}
+
+static int query_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096], expr[8192];
+    size_t len = 0;
+    int i;
+
+    if (argc < 1) {
+        printf("Usage: query <expression>\n");
+        return 1;
+    }
+    expr[0] = '\0';
+    for (i = 0; i < argc; i++)
+        len += snprintf(expr + len, len < sizeof(expr) ? sizeof(expr) - len : 0,
+                        "%s%s", i ? " " : "", argv[i]);
+    if (len >= sizeof(expr)) {
+        printf("Query too long\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    return query_run(base, state, expr, stdout) != 0;
+}
+
+static int list_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct list_opts opts;
+
+    if (list_parse_args(argc, argv, &opts) != 0) {
+        printf("Usage: list [-l] [--prefix P] [--since 30d|YYYY-MM-DD] "
+               "[--page N [--page-size M] | --offset N --limit M]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (list_run(base, state, &opts, STDOUT_FILENO) != 0) {
+        printf("Could not list %s\n", base);
+        return 1;
+    }
+    return 0;
+}
+
+static int index_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct ordmap m;
+    struct meta meta;
+    int have_meta, rc;
+
+    (void)argc;
+    (void)argv;
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    have_meta = meta_open(&meta, state) == 0;
+    rc = index_build(state, &m, have_meta ? &meta : NULL);
+    if (rc != 0)
+        printf("Could not write the ticket index\n");
+    if (have_meta)
+        meta_close(&meta);
+    ordmap_close(&m);
+    return rc != 0;
+}
+
+static int next_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096], name[TICKET_NAME_MAX + 1];
+    struct tindex ix;
+
+    if (argc != 1) {
+        printf("Usage: next <ticket>\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (index_open(&ix, state) != 0) {
+        printf("No ticket index; run 'index' first\n");
+        return 1;
+    }
+    if (index_next(&ix, argv[0], name, sizeof(name)) != 0) {
+        index_close(&ix);
+        return 1;
+    }
+    printf("%s\n", name);
+    index_close(&ix);
+    return 0;
+}
+
+static int fsck_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct fsck_opts opts = { 0, 0, 0 };
+    struct fsck_report r;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--repair"))
+            opts.repair = 1;
+        else if (!strcmp(argv[i], "-q"))
+            opts.quiet = 1;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            opts.threads = atoi(argv[++i]);
+        else {
+            printf("Usage: fsck [--repair] [-q] [--threads N]\n");
+            return 1;
+        }
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (fsck_run(base, state, &opts, &r, stdout) != 0) {
+        printf("Could not check %s\n", base);
+        return 1;
+    }
+    if (opts.repair && r.repaired)
+        update_views(base, state);
+    printf("%llu folders, %llu indexed: %llu missing, %llu extra, %llu renamed, "
+           "%llu stale (scan %.1f ms)\n",
+           (unsigned long long)r.folders, (unsigned long long)r.indexed,
+           (unsigned long long)r.missing, (unsigned long long)r.extra,
+           (unsigned long long)r.renamed, (unsigned long long)r.stale, r.scan_ms);
+    if (opts.repair)
+        printf("%llu repaired\n", (unsigned long long)r.repaired);
+    return !opts.repair && r.missing + r.extra + r.renamed + r.stale > 0;
+}
+
+/* close <ticket> / reopen <ticket>: retention counts from the last close */
+static int change_state(int argc, char *argv[], int closing) {
+    char base[4096], state[4096];
+    struct ordmap m;
+    struct meta meta;
+    uint32_t ord;
+    int rc = 1;
+
+    if (argc != 1) {
+        printf("Usage: %s <ticket>\n", closing ? "close" : "reopen");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    ord = ordmap_lookup(&m, argv[0]);
+    ordmap_close(&m);
+    if (ord == TICKET_NONE || meta_open(&meta, state) != 0) {
+        printf("Unknown ticket: %s\n", argv[0]);
+        return 1;
+    }
+    if (ord >= meta.count || meta.state[ord] == TICKET_DELETED ||
+        meta.state[ord] == TICKET_UNKNOWN)
+        printf("Unknown ticket: %s\n", argv[0]);
+    else if (meta.state[ord] == TICKET_ARCHIVED)
+        printf("%s is archived; restore it first\n", argv[0]);
+    else if (meta_set_state(&meta, ord, closing ? TICKET_CLOSED : TICKET_OPEN,
+                            time(NULL)) == 0)
+        rc = journal_append(state, closing ? JOURNAL_CLOSE : JOURNAL_REOPEN, ord,
+                            time(NULL), 0) != 0;
+    meta_close(&meta);
+    return rc;
+}
+
+static int close_cmd(int argc, char *argv[]) {
+    return change_state(argc, argv, 1);
+}
+
+static int reopen_cmd(int argc, char *argv[]) {
+    return change_state(argc, argv, 0);
+}
+
+/* retention --days N [--shred] [--rate MB/s] [--threads N] [--dry-run] */
+static int retention_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct retention_opts opts;
+    struct retention_stats st;
+    int i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.days = -1;
+    for (i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--days") && i + 1 < argc)
+            opts.days = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--shred"))
+            opts.shred = 1;
+        else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+            opts.shred_rate = strtoull(argv[++i], NULL, 10) << 20;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            opts.threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--dry-run"))
+            opts.dry_run = 1;
+        else
+            break;
+    }
+    if (i < argc || opts.days < 0) {
+        printf("Usage: retention --days N [--shred] [--rate MB/s] [--threads N] "
+               "[--dry-run]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (retention_run(base, state, &opts, &st, stdout) != 0) {
+        printf("Could not apply retention\n");
+        return 1;
+    }
+    if (opts.dry_run) {
+        printf("%llu tickets closed %lld or more days ago\n",
+               (unsigned long long)st.tickets, (long long)opts.days);
         return 0;
     }
+    printf("Deleted %llu tickets: %llu files, %llu directories, %.1f MB",
+           (unsigned long long)st.tickets, (unsigned long long)st.files,
+           (unsigned long long)st.dirs, st.bytes / 1048576.0);
+    if (opts.shred)
+        printf(", %.1f MB overwritten", st.shredded / 1048576.0);
+    printf(" in %.0f ms\n", st.delete_ms);
+    update_views(base, state);
+    return st.failed != 0;
+}
+
+static int leave_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+
+    (void)argc;
+    (void)argv;
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (timelog_leave(state, time(NULL)) != 0) {
+        printf("Could not record leaving the ticket\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void print_duration(uint64_t seconds) {
+    printf("%4lluh %02llum", (unsigned long long)(seconds / 3600),
+           (unsigned long long)(seconds / 60 % 60));
+}
+
+static void print_day(uint32_t day) {
+    time_t t = (time_t)day * 86400;
+    struct tm tm;
+    char buf[16];
+
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d", &tm);
+    printf("%s", buf);
+}
+
+static int parse_day(const char *s, uint32_t *day) {
+    struct tm tm;
+    const char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(s, "%Y-%m-%d", &tm);
+    if (!end || *end)
+        return -1;
+    *day = (uint32_t)(timegm(&tm) / 86400);
+    return 0;
+}
+
+struct ticket_total {
+    uint32_t ord;
+    uint64_t seconds;
+};
+
+static int by_seconds(const void *a, const void *b) {
+    const struct ticket_total *x = a, *y = b;
+
+    return x->seconds < y->seconds ? 1 : x->seconds > y->seconds ? -1 : 0;
+}
+
+/* time [--day|--week] [--ticket T] [--since DATE] [--until DATE] [--rebuild] */
+static int time_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    uint32_t from = 0, to = UINT32_MAX, only = TICKET_NONE, cur;
+    struct ticket_total *totals = NULL;
+    struct time_row *rows;
+    struct ordmap m;
+    int64_t since;
+    size_t n, i, k = 0;
+    int kind = -1, rebuild = 0;
+    const char *ticket = NULL;
 
+    for (i = 0; i < (size_t)argc; i++) {
+        if (!strcmp(argv[i], "--day"))
+            kind = TIME_DAY;
+        else if (!strcmp(argv[i], "--week"))
+            kind = TIME_WEEK;
+        else if (!strcmp(argv[i], "--ticket") && i + 1 < (size_t)argc)
+            ticket = argv[++i];
+        else if (!strcmp(argv[i], "--since") && i + 1 < (size_t)argc &&
+                 parse_day(argv[i + 1], &from) == 0)
+            i++;
+        else if (!strcmp(argv[i], "--until") && i + 1 < (size_t)argc &&
+                 parse_day(argv[i + 1], &to) == 0)
+            i++;
+        else if (!strcmp(argv[i], "--rebuild"))
+            rebuild = 1;
+        else
+            break;
+    }
+    if (i < (size_t)argc) {
+        printf("Usage: time [--day|--week] [--ticket T] [--since YYYY-MM-DD] "
+               "[--until YYYY-MM-DD] [--rebuild]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (rebuild && timelog_rebuild(state) != 0) {
+        printf("Could not rebuild the time rollups\n");
+        return 1;
+    }
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    if (ticket && (only = ordmap_lookup(&m, ticket)) == TICKET_NONE) {
+        printf("Unknown ticket: %s\n", ticket);
+        ordmap_close(&m);
+        return 1;
+    }
+    /* Totals come from the day rows; weeks only where weeks are asked for. */
+    if (kind == TIME_WEEK) {
+        from = from ? time_week(from) : 0;
+        to = to != UINT32_MAX ? time_week(to) : UINT32_MAX;
+    }
+    if (timelog_rollup(state, kind == TIME_WEEK ? TIME_WEEK : TIME_DAY, from, to, &rows,
+                       &n) != 0) {
+        printf("Could not read the time rollups\n");
+        ordmap_close(&m);
+        return 1;
+    }
+    if (kind < 0)
+        totals = calloc(m.count ? m.count : 1, sizeof(*totals));
+    for (i = 0; i < n; i++) {
+        const struct time_row *r = &rows[i];
+        const char *name = ordmap_name(&m, r->ord);
+
+        if ((only != TICKET_NONE && r->ord != only) || !name)
+            continue;
+        if (kind < 0) {
+            if (totals && r->ord < m.count) {
+                totals[r->ord].ord = r->ord;
+                totals[r->ord].seconds += r->seconds;
+            }
+            continue;
+        }
+        if (kind == TIME_WEEK)
+            printf("week of ");
+        print_day(kind == TIME_WEEK ? time_week_day(r->period) : r->period);
+        printf("  %-24s", name);
+        print_duration(r->seconds);
+        printf("\n");
+    }
+    if (totals) {
+        for (i = 0; i < m.count; i++)
+            if (totals[i].seconds)
+                totals[k++] = totals[i];
+        qsort(totals, k, sizeof(*totals), by_seconds);
+        for (i = 0; i < k; i++) {
+            printf("%-24s", ordmap_name(&m, totals[i].ord));
+            print_duration(totals[i].seconds);
+            printf("\n");
+        }
+        free(totals);
+    }
+    if (timelog_current(state, &cur, &since) == 0 && cur != TICKET_NONE &&
+        ordmap_name(&m, cur)) {
+        time_t t = since;
+        struct tm tm;
+        char buf[32];
+
+        localtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm);
+        printf("Now in %s since %s\n", ordmap_name(&m, cur), buf);
+    }
+    free(rows);
+    ordmap_close(&m);
+    return 0;
+}
+
+/* report [--daily] [--since DATE] [--until DATE] [--out FILE] [--rebuild] */
+static int report_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct report_opts opts = { 1, 0, UINT32_MAX };
+    const char *out = NULL;
+    struct bufout w;
+    int i, fd = STDOUT_FILENO, rebuild = 0, rc;
+
+    for (i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--daily"))
+            opts.weekly = 0;
+        else if (!strcmp(argv[i], "--since") && i + 1 < argc &&
+                 parse_day(argv[i + 1], &opts.from) == 0)
+            i++;
+        else if (!strcmp(argv[i], "--until") && i + 1 < argc &&
+                 parse_day(argv[i + 1], &opts.to) == 0)
+            i++;
+        else if (!strcmp(argv[i], "--out") && i + 1 < argc)
+            out = argv[++i];
+        else if (!strcmp(argv[i], "--rebuild"))
+            rebuild = 1;
+        else
+            break;
+    }
+    if (i < argc) {
+        printf("Usage: report [--daily] [--since YYYY-MM-DD] [--until YYYY-MM-DD] "
+               "[--out FILE] [--rebuild]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (rebuild && journal_rebuild(state) != 0) {
+        printf("Could not rebuild the journal rollup\n");
+        return 1;
+    }
+    if (out && (fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        printf("Could not create %s\n", out);
+        return 1;
+    }
+    bufout_init(&w, fd);
+    rc = report_write(state, &opts, &w);
+    if (out && close(fd) != 0)
+        rc = -1;
+    if (rc != 0)
+        printf("Could not write the report\n");
+    return rc != 0;
+}
+
+struct tag_move {
+    const char *state;
+    uint32_t from, into;
+    int moved;
+};
+
+static int move_tag(const char *tag, void *arg) {
+    struct tag_move *t = arg;
+    struct rbitmap b;
+    int member;
+
+    if (tags_load(t->state, tag, &b) != 0)
+        return 0;
+    member = rb_contains(&b, t->from);
+    rb_free(&b);
+    if (member && tags_move(t->state, tag, t->from, t->into) == 0)
+        t->moved++;
+    return 0;
+}
+
+/* merge <into> <from>: fold a duplicate ticket's folder into the one it duplicates */
+static int merge_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct merge_stats st;
+    struct tag_move tm;
+    struct index_writer w;
+    struct ordmap m;
+    struct meta meta;
+    uint32_t into, from;
+
+    if (argc != 2) {
+        printf("Usage: merge <into> <from>\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    into = ordmap_lookup(&m, argv[0]);
+    from = ordmap_lookup(&m, argv[1]);
+    ordmap_close(&m);
+    if (into == TICKET_NONE || from == TICKET_NONE) {
+        printf("Unknown ticket: %s\n", into == TICKET_NONE ? argv[0] : argv[1]);
+        return 1;
+    }
+    if (merge_folders(base, argv[0], argv[1], &st, stdout) != 0) {
+        printf("Could not merge %s into %s\n", argv[1], argv[0]);
+        return 1;
+    }
+    printf("Merged %s into %s: %llu moved, %llu identical dropped (%.1f MB), "
+           "%llu renamed, %llu folders combined in %.0f ms\n", argv[1], argv[0],
+           (unsigned long long)st.moved, (unsigned long long)st.dropped,
+           st.dropped_bytes / 1048576.0, (unsigned long long)st.suffixed,
+           (unsigned long long)st.dirs, st.ms);
+    if (!st.redirected) {
+        printf("%llu entries could not be moved; %s is left in place\n",
+               (unsigned long long)st.failed, argv[1]);
+        return 1;
+    }
+
+    /* The duplicate is gone as a ticket: its tags, index entry and row move over. */
+    tm.state = state;
+    tm.from = from;
+    tm.into = into;
+    tm.moved = 0;
+    tags_foreach(state, move_tag, &tm);
+    if (tm.moved)
+        journal_append(state, JOURNAL_TAG, into, time(NULL), 0);
+    if (index_writer_open(&w, state) == 0) {
+        index_remove(&w, argv[1]);
+        index_writer_close(&w);
+    }
+    /* Entries were renamed, not copied: the row moves less what was dropped. */
+    if (meta_open(&meta, state) == 0) {
+        int64_t now = time(NULL);
+        int64_t size = from < meta.count ? meta.size[from] : 0;
+        int64_t files = from < meta.count ? meta.files[from] : 0;
+        int64_t grown = size - (int64_t)st.dropped_bytes;
+
+        meta_set_state(&meta, from, TICKET_DELETED, now);
+        meta_on_file(&meta, from, -size, -files, now);
+        journal_append(state, JOURNAL_DELETE, from, now, -size);
+        if (meta_on_file(&meta, into, grown, files - (int64_t)st.dropped, now) == 0 && grown)
+            journal_append(state, JOURNAL_SIZE, into, now, grown);
+        meta_close(&meta);
+    }
+    update_views(base, state);
+    return 0;
+}
+
+/* views [--rebuild]: the by-date, by-tag and by-customer symlink trees */
+static int views_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct views_stats st;
+    int rebuild = argc == 1 && !strcmp(argv[0], "--rebuild");
+
+    if (argc > 1 || (argc == 1 && !rebuild)) {
+        printf("Usage: views [--rebuild]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (views_update(base, state, rebuild, &st) != 0) {
+        printf("Could not update the views in %s/%s\n", base, VIEWS_DIR);
+        return 1;
+    }
+    if (st.rebuilt)
+        printf("Rebuilt %s/%s: %llu tickets, %llu links in %.0f ms\n", base, VIEWS_DIR,
+               (unsigned long long)st.tickets, (unsigned long long)st.links, st.ms);
+    else
+        printf("%llu events, %llu tickets re-linked in %.1f ms\n",
+               (unsigned long long)st.events, (unsigned long long)st.tickets, st.ms);
+    return 0;
+}
+
+/* changes <ticket> [--content] [--mark]: diff against the last visit */
+static int changes_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096], path[8192];
+    uint32_t flags = 0, ord;
+    struct ordmap m;
+    int i, record = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--content"))
+            flags |= MERKLE_CONTENT;
+        else if (!strcmp(argv[i], "--mark"))
+            record = 1;
+        else
+            break;
+    }
+    if (argc < 1 || i < argc) {
+        printf("Usage: changes <ticket> [--content] [--mark]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    ord = ordmap_lookup(&m, argv[0]);
+    ordmap_close(&m);
+    if (ord == TICKET_NONE) {
+        printf("Unknown ticket: %s\n", argv[0]);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", base, argv[0]);
+    if (merkle_visit(state, ord, path, flags, record, stdout) != 0) {
+        printf("Could not read %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/* mirror <dest>: incremental copy of the base, run again to resume */
+static int mirror_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct mirror_opts opts = { 0, 0, 0 };
+    struct mirror_stats st;
     int i;
-    for (i=1; i < argc; i++) {
-        printf("Arg %d\t%s\n",i, argv[i]);
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--dry-run"))
+            opts.dry_run = 1;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            opts.threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+            opts.rate = strtoull(argv[++i], NULL, 10) << 20;
+        else
+            break;
+    }
+    if (argc < 1 || i < argc) {
+        printf("Usage: mirror <dest> [--threads N] [--rate MB/s] [--dry-run]\n");
+        return 1;
     }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    /* A backup should never slow down someone opening tickets. */
+    iosched_bg_enter();
+    if (mirror_run(base, argv[0], &opts, &st, stdout) != 0) {
+        printf("Could not mirror %s to %s\n", base, argv[0]);
+        return 1;
+    }
+    if (opts.dry_run)
+        return 0;
+    printf("%llu copied (%.1f MB), %llu already there, %llu deleted, %llu directories "
+           "and %llu links created; planned in %.0f ms, copied in %.0f ms\n",
+           (unsigned long long)st.copied, st.bytes / 1048576.0,
+           (unsigned long long)st.skipped, (unsigned long long)st.deleted,
+           (unsigned long long)st.dirs, (unsigned long long)st.links, st.plan_ms,
+           st.copy_ms);
+    if (st.failed) {
+        printf("%llu failed; run again to retry\n", (unsigned long long)st.failed);
+        return 1;
+    }
+    return 0;
+}
+
+/* relocate <newdir>: move the base to another volume and switch the config to it */
+static int relocate_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct relocate_opts opts = { 0, 0 };
+    struct relocate_stats st;
+    int i;
 
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            opts.threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rate") && i + 1 < argc)
+            opts.rate = strtoull(argv[++i], NULL, 10) << 20;
+        else
+            break;
+    }
+    if (argc < 1 || i < argc) {
+        printf("Usage: relocate <newdir> [--threads N] [--rate MB/s]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    iosched_bg_enter();
+    if (relocate_run(base, argv[0], &opts, &st, stdout) != 0) {
+        printf("Could not relocate %s to %s\n", base, argv[0]);
+        return 1;
+    }
+    printf("%llu files (%.1f MB), %llu directories, %llu symlinks, %llu hard links; "
+           "%llu already there, %llu resumed, %llu deleted; %d passes, "
+           "copied in %.0f ms, caught up in %.0f ms\n",
+           (unsigned long long)st.files, st.bytes / 1048576.0,
+           (unsigned long long)st.dirs, (unsigned long long)st.symlinks,
+           (unsigned long long)st.hardlinks, (unsigned long long)st.skipped,
+           (unsigned long long)st.resumed, (unsigned long long)st.deleted, st.passes,
+           st.copy_ms, st.delta_ms);
+    printf("The base is now %s; %s was left in place\n", argv[0], base);
     return 0;
+}
 
+/* delta put|get|ls: deduplicated attachment versions kept per ticket */
+static int delta_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096];
+    struct delta_stats st;
+    struct ordmap m;
+    uint32_t ord;
+    int fd, rc;
 
+    if (argc < 2 || (!strcmp(argv[0], "put") && argc < 3) ||
+        (!strcmp(argv[0], "get") && argc < 3)) {
+        printf("Usage: delta put <ticket> <file> [name] | get <ticket> <name> [dest] | "
+               "ls <ticket>\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    ord = ordmap_lookup(&m, argv[1]);
+    ordmap_close(&m);
+    if (ord == TICKET_NONE) {
+        printf("Unknown ticket: %s\n", argv[1]);
+        return 1;
+    }
+    if (!strcmp(argv[0], "ls"))
+        return delta_list(state, ord, stdout) != 0;
+    if (!strcmp(argv[0], "put")) {
+        const char *name = argc > 3 ? argv[3] : strrchr(argv[2], '/');
+
+        name = !name ? argv[2] : name == argv[3] ? name : name + 1;
+        if (delta_put(state, ord, argv[2], name, &st) != 0) {
+            printf("Could not store %s\n", argv[2]);
+            return 1;
+        }
+        printf("%s: %llu chunks, %llu new (%.1f of %.1f MB stored); "
+               "chunked %.2f GB/s, %.0f ms total\n", name,
+               (unsigned long long)st.chunks, (unsigned long long)st.new_chunks,
+               st.new_bytes / 1048576.0, st.bytes / 1048576.0,
+               st.chunk_ms > 0 ? st.bytes / (st.chunk_ms * 1e6) : 0.0, st.total_ms);
+        return 0;
+    }
+    if (!strcmp(argv[0], "get")) {
+        fd = argc > 3 ? open(argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                      : STDOUT_FILENO;
+        if (fd < 0) {
+            printf("Could not create %s\n", argv[3]);
+            return 1;
+        }
+        rc = delta_get(state, ord, argv[2], fd);
+        if (fd != STDOUT_FILENO && close(fd) != 0)
+            rc = -1;
+        if (rc != 0)
+            fprintf(stderr, "Could not read %s\n", argv[2]);
+        return rc != 0;
+    }
+    printf("Unknown delta command: %s\n", argv[0]);
+    return 1;
+}
+
+static int archive_path(const char *state, const char *ticket, char *out, size_t n) {
+    snprintf(out, n, "%s/archive", state);
+    if (mkdir(out, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(out, n, "%s/archive/%s.tfp", state, ticket);
+    return 0;
+}
+
+/* The master key for sealed packs lives next to them. */
+static int archive_key(const char *state, uint8_t key[SEAL_KEY], int create) {
+    char path[4096], old[4200];
+    uint8_t moved[SEAL_KEY];
+
+    if (config_key_path(path, sizeof(path)) != 0) {
+        printf("Could not locate the archive key\n");
+        return -1;
+    }
+    /* Keys used to live in <state>/archive, where mirror copied them too. */
+    snprintf(old, sizeof(old), "%s/archive/key", state);
+    if (access(path, F_OK) != 0 && seal_load_key(old, moved, 0) == 0) {
+        if (seal_save_key(path, moved) != 0 || seal_load_key(path, key, 0) != 0 ||
+            memcmp(key, moved, SEAL_KEY) != 0) {
+            printf("Could not move the archive key from %s to %s\n", old, path);
+            return -1;
+        }
+        unlink(old);
+        printf("Moved the archive key from %s to %s\n", old, path);
+    }
+    if (seal_load_key(path, key, create) != 0) {
+        printf("Could not %s the archive key %s\n", create ? "create" : "read", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* archive <ticket> [--dict|--prefix-dict] [--level N] [--keep] [--encrypt] [--cipher C] */
+static int archive_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096], path[8192], pack[8192];
+    char prefix[TICKET_NAME_MAX + 1], **dirs = NULL;
+    uint8_t key[SEAL_KEY];
+    struct archive_opts opts;
+    struct archive_stats st, vst;
+    struct hooks hooks;
+    struct index_writer w;
+    struct ordmap m;
+    struct meta meta;
+    uint32_t ord;
+    uint64_t number;
+    size_t nsib = 0;
+    int i, width, keep = 0, prefix_dict = 0, rc;
+
+    memset(&opts, 0, sizeof(opts));
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--dict"))
+            opts.dict = 1;
+        else if (!strcmp(argv[i], "--prefix-dict"))
+            opts.dict = prefix_dict = 1;
+        else if (!strcmp(argv[i], "--keep"))
+            keep = 1;
+        else if (!strcmp(argv[i], "--level") && i + 1 < argc)
+            opts.level = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--encrypt"))
+            opts.key = key;
+        else if (!strcmp(argv[i], "--cipher") && i + 1 < argc &&
+                 (opts.cipher = seal_cipher_parse(argv[++i])) > 0)
+            opts.key = key;
+        else
+            break;
+    }
+    if (argc < 1 || i < argc) {
+        printf("Usage: archive <ticket> [--dict|--prefix-dict] [--level N] [--keep] "
+               "[--encrypt] [--cipher aes|chacha]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    if (ordmap_open(&m, state) != 0) {
+        printf("Could not read the ticket registry\n");
+        return 1;
+    }
+    ord = ordmap_lookup(&m, argv[0]);
+    ordmap_close(&m);
+    snprintf(path, sizeof(path), "%s/%s", base, argv[0]);
+    if (ord == TICKET_NONE || archive_path(state, argv[0], pack, sizeof(pack)) != 0) {
+        printf("Unknown ticket: %s\n", argv[0]);
+        return 1;
+    }
+    if (opts.key && archive_key(state, key, 1) != 0)
+        return 1;
+    if (opts.key && !opts.cipher)
+        opts.cipher = seal_default_cipher();
+
+    /* Train across the prefix: sample up to 64 sibling folders. */
+    if (prefix_dict &&
+        ticket_parse(argv[0], prefix, sizeof(prefix), &number, &width) == 0 &&
+        (dirs = calloc(64, sizeof(*dirs))) != NULL) {
+        DIR *d = opendir(base);
+        struct dirent *de;
+
+        while (d && nsib < 64 && (de = readdir(d)) != NULL) {
+            char p2[TICKET_NAME_MAX + 1];
+            uint64_t n2;
+            int w2;
+
+            if (de->d_type != DT_DIR || !strcmp(de->d_name, argv[0]) ||
+                ticket_parse(de->d_name, p2, sizeof(p2), &n2, &w2) != 0 ||
+                strcmp(p2, prefix) != 0)
+                continue;
+            if ((dirs[nsib] = malloc(strlen(base) + strlen(de->d_name) + 2)) != NULL) {
+                sprintf(dirs[nsib], "%s/%s", base, de->d_name);
+                nsib++;
+            }
+        }
+        if (d)
+            closedir(d);
+        opts.sample_dirs = (const char *const *)dirs;
+        opts.nsample_dirs = nsib;
+    }
+
+    rc = archive_pack(path, pack, &opts, &st);
+    for (i = 0; i < (int)nsib; i++)
+        free(dirs[i]);
+    free(dirs);
+    if (rc != 0 || archive_unpack(pack, NULL, opts.key, &vst) != 0) {
+        printf("Could not archive %s\n", path);
+        unlink(pack);
+        return 1;
+    }
+    printf("Archived %s: %llu files, %.1f MB -> %.2f MB (ratio %.2f)", argv[0],
+           (unsigned long long)st.files, st.bytes / 1048576.0, st.packed / 1048576.0,
+           st.packed ? (double)st.bytes / st.packed : 0.0);
+    if (st.dict_len)
+        printf(", %u KB dictionary", st.dict_len / 1024);
+    if (opts.key)
+        printf(", sealed with %s", seal_cipher_name(opts.cipher));
+    printf(" in %.0f ms\n", st.ms);
+    if (!keep && archive_remove(path) != 0)
+        printf("Could not remove %s\n", path);
+    journal_append(state, JOURNAL_ARCHIVE, ord, time(NULL),
+                   (int64_t)st.packed - (keep ? 0 : (int64_t)st.bytes));
+    if (meta_open(&meta, state) == 0) {
+        meta_on_archive(&meta, ord, time(NULL));
+        meta_close(&meta);
+    }
+    /* Archived tickets still exist; keep them indexed under their own name. */
+    if (index_writer_open(&w, state) == 0) {
+        index_add(&w, argv[0]);
+        index_writer_close(&w);
+    }
+    if (hooks_init(&hooks, base, state) == 0) {
+        hooks_fire(&hooks, HOOK_ARCHIVE, ord, argv[0], keep ? path : pack);
+        hooks_shutdown(&hooks);
+    }
+    if (!keep)
+        update_views(base, state);
+    return 0;
+}
+
+/* restore <ticket> [--file <path> [<out>]] */
+static int restore_cmd(int argc, char *argv[]) {
+    char base[4096], state[4096], path[8192], pack[8192];
+    uint8_t key[SEAL_KEY];
+    const uint8_t *k = NULL;
+    struct archive_stats st;
+    struct ordmap m;
+    struct meta meta;
+    struct stat sb;
+    uint32_t ord;
+    int64_t packed;
+    int fd, rc;
+
+    if (argc != 1 && !(argc >= 3 && argc <= 4 && !strcmp(argv[1], "--file"))) {
+        printf("Usage: restore <ticket> [--file <path> [<out>]]\n");
+        return 1;
+    }
+    if (load_state(base, sizeof(base), state, sizeof(state)) != 0)
+        return 1;
+    snprintf(path, sizeof(path), "%s/%s", base, argv[0]);
+    if (archive_path(state, argv[0], pack, sizeof(pack)) != 0 || stat(pack, &sb) != 0) {
+        printf("No archive for %s\n", argv[0]);
+        return 1;
+    }
+    packed = sb.st_size;
+    if (archive_sealed(pack) == 1) {
+        if (archive_key(state, key, 0) != 0)
+            return 1;
+        k = key;
+    }
+
+    /* One file only: leave the pack and the ticket as they are. */
+    if (argc > 1) {
+        fd = argc == 4 ? open(argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                       : STDOUT_FILENO;
+        if (fd < 0) {
+            printf("Could not create %s\n", argv[3]);
+            return 1;
+        }
+        rc = archive_extract(pack, argv[2], k, fd);
+        if (fd != STDOUT_FILENO && close(fd) != 0)
+            rc = -1;
+        if (rc != 0)
+            fprintf(stderr, "Could not restore %s from %s\n", argv[2], argv[0]);
+        return rc != 0;
+    }
+    if (stat(path, &sb) == 0) {
+        printf("%s already exists\n", path);
+        return 1;
+    }
+    if (archive_unpack(pack, path, k, &st) != 0) {
+        printf("Could not restore %s\n", argv[0]);
+        return 1;
+    }
+    unlink(pack);
+    if (ordmap_open(&m, state) == 0) {
+        ord = ordmap_lookup(&m, argv[0]);
+        ordmap_close(&m);
+        if (ord != TICKET_NONE && meta_open(&meta, state) == 0) {
+            meta_set_state(&meta, ord, TICKET_OPEN, time(NULL));
+            meta_rescan(&meta, ord, path);
+            meta_close(&meta);
+            journal_append(state, JOURNAL_RESTORE, ord, time(NULL),
+                           (int64_t)st.bytes - packed);
+        }
+    }
+    printf("Restored %s: %llu files, %.1f MB in %.0f ms\n", argv[0],
+           (unsigned long long)st.files, st.bytes / 1048576.0, st.ms);
+    update_views(base, state);
+    return 0;
+}
+
+static int startup_bench(int argc, char *argv[]);
+
+static int bench_cmd(int argc, char *argv[]) {
+    if (argc > 0 && !strcmp(argv[0], "startup"))
+        return startup_bench(argc - 1, argv + 1);
+    return bench_main(argc, argv);
+}
+
+static const struct command commands[] = {
+#define CMD(name, fn) { #name, fn },
+#include "commands.def"
+#undef CMD
+};
+
+_Static_assert(sizeof(commands) / sizeof(commands[0]) == CMDTAB_COUNT,
+               "cmdtab.h is out of date; regenerate it from commands.def");
+
+/* The command called name, or NULL for a ticket name. */
+static const struct command *find_command(const char *name) {
+    int i = cmdtab_slots[cmd_hash(name, CMDTAB_SEED) & (CMDTAB_SIZE - 1)];
+
+    return i >= 0 && !strcmp(commands[i].name, name) ? &commands[i] : NULL;
+}
+
+/* bench startup [selfbench options]: dispatch lookup cost, then the selfbench timings */
+static int startup_bench(int argc, char *argv[]) {
+    static const char *misses[] = { "INC0000001", "CHG0012345", "RITM0000042", "tags" };
+    const size_t n = sizeof(commands) / sizeof(commands[0]);
+    struct timespec t0;
+    double hash_ms, chain_ms;
+    /* Every lookup's result feeds the sink, so neither loop can be dropped. */
+    volatile size_t sink = 0;
+    const struct command *c;
+    size_t i, j;
+    long k, loops = 200000;
+
+    for (i = 0; i < n; i++) {
+        if (find_command(commands[i].name) != &commands[i]) {
+            printf("%s does not dispatch; regenerate cmdtab.h\n", commands[i].name);
+            return 1;
+        }
+    }
+
+    /* Every command name once and a few ticket names, per loop. */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (k = 0; k < loops; k++) {
+        for (i = 0; i < n; i++) {
+            c = find_command(commands[i].name);
+            sink += c ? (size_t)(c - commands) : n;
+        }
+        for (i = 0; i < sizeof(misses) / sizeof(misses[0]); i++) {
+            c = find_command(misses[i]);
+            sink += c ? (size_t)(c - commands) : n;
+        }
+    }
+    hash_ms = bench_ms_since(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (k = 0; k < loops; k++) {
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < n && strcmp(commands[j].name, commands[i].name); j++)
+                ;
+            sink += j;
+        }
+        for (i = 0; i < sizeof(misses) / sizeof(misses[0]); i++) {
+            for (j = 0; j < n && strcmp(commands[j].name, misses[i]); j++)
+                ;
+            sink += j;
+        }
+    }
+    chain_ms = bench_ms_since(&t0);
+    k = loops * (long)(n + sizeof(misses) / sizeof(misses[0]));
+    printf("dispatch: perfect hash %.1f ns, strcmp chain %.1f ns per lookup (%zu commands)\n",
+           hash_ms * 1e6 / k, chain_ms * 1e6 / k, n);
+
+    /* What a command costs from exec to exit is selfbench's job. */
+    return selfbench_main(argc, argv);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s [ticket number]\n", argv[0]);
+        return 1;
+    }
+
+    const struct command *c = find_command(argv[1]);
+
+    if (c)
+        return c->fn(argc - 2, argv + 2);
+
+    int i;
+    int rc = 0;
+    for (i=1; i < argc; i++) {
+        rc |= open_ticket(argv[i]);
+    }
 
+    return rc;
 }
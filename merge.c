@@ -0,0 +1,253 @@
+#include "merge.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "bench.h"
+
+#define MERGE_BUF (1 << 16)
+#define MERGE_TMP ".merge-"
+
+struct merger {
+    const char *from;       /* used in suffixes */
+    struct merge_stats *st;
+    FILE *out;
+    EVP_MD_CTX *ctx;
+    char *buf;
+    char path[4096];        /* of the entry being merged, relative to the folders */
+};
+
+static int digest(struct merger *m, int dirfd, const char *name,
+                  uint8_t md[EVP_MAX_MD_SIZE])
+{
+    ssize_t r;
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+    if (fd < 0)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    EVP_DigestInit_ex(m->ctx, EVP_sha256(), NULL);
+    while ((r = read(fd, m->buf, MERGE_BUF)) > 0)
+        EVP_DigestUpdate(m->ctx, m->buf, r);
+    close(fd);
+    EVP_DigestFinal_ex(m->ctx, md, NULL);
+    return r < 0 ? -1 : 0;
+}
+
+/* Whether two entries of the same name hold the same thing. */
+static int same(struct merger *m, int afd, int bfd, const char *name,
+                const struct stat *as, const struct stat *bs)
+{
+    uint8_t a[EVP_MAX_MD_SIZE], b[EVP_MAX_MD_SIZE];
+    char la[4096], lb[4096];
+    ssize_t na, nb;
+
+    if (S_ISREG(as->st_mode) && S_ISREG(bs->st_mode)) {
+        if (as->st_size != bs->st_size)
+            return 0;
+        if (as->st_dev == bs->st_dev && as->st_ino == bs->st_ino)
+            return 1;
+        return digest(m, afd, name, a) == 0 && digest(m, bfd, name, b) == 0 &&
+               !memcmp(a, b, 32);
+    }
+    if (S_ISLNK(as->st_mode) && S_ISLNK(bs->st_mode)) {
+        na = readlinkat(afd, name, la, sizeof(la));
+        nb = readlinkat(bfd, name, lb, sizeof(lb));
+        return na >= 0 && na == nb && !memcmp(la, lb, na);
+    }
+    return 0;
+}
+
+/* Move from/name into into as "stem (from).ext", "stem (from 2).ext", ... */
+static int move_suffixed(struct merger *m, int afd, int bfd, const char *name, int is_dir)
+{
+    const char *dot = is_dir ? NULL : strrchr(name, '.');
+    char cand[512];
+    int len, n;
+
+    if (dot == name)
+        dot = NULL;
+    len = dot ? (int)(dot - name) : (int)strlen(name);
+    for (n = 1; n < 1000; n++) {
+        if (n == 1)
+            snprintf(cand, sizeof(cand), "%.*s (%s)%s", len, name, m->from, dot ? dot : "");
+        else
+            snprintf(cand, sizeof(cand), "%.*s (%s %d)%s", len, name, m->from, n,
+                     dot ? dot : "");
+        if (strlen(cand) > 255)
+            break;
+        if (renameat2(bfd, name, afd, cand, RENAME_NOREPLACE) == 0) {
+            if (m->out)
+                fprintf(m->out, "> %s as %s\n", m->path, cand);
+            m->st->suffixed++;
+            return 0;
+        }
+        if (errno != EEXIST)
+            return -1;
+    }
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+static void merge_dir(struct merger *m, int afd, int bfd);
+
+static void merge_entry(struct merger *m, int afd, int bfd, const char *name)
+{
+    struct stat as, bs;
+    size_t len = strlen(m->path);
+    int rc = 0;
+
+    snprintf(m->path + len, sizeof(m->path) - len, "%s%s", len ? "/" : "", name);
+    if (renameat2(bfd, name, afd, name, RENAME_NOREPLACE) == 0) {
+        m->st->moved++;
+        goto done;
+    }
+    if (errno != EEXIST || fstatat(afd, name, &as, AT_SYMLINK_NOFOLLOW) != 0 ||
+        fstatat(bfd, name, &bs, AT_SYMLINK_NOFOLLOW) != 0) {
+        rc = -1;
+    } else if (S_ISDIR(as.st_mode) && S_ISDIR(bs.st_mode)) {
+        int sa = openat(afd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int sb = openat(bfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (sa >= 0 && sb >= 0) {
+            merge_dir(m, sa, sb);
+            m->st->dirs++;
+            /* Whatever failed inside has been counted; only an empty one goes. */
+            unlinkat(bfd, name, AT_REMOVEDIR);
+        } else {
+            rc = -1;
+        }
+        if (sa >= 0)
+            close(sa);
+        if (sb >= 0)
+            close(sb);
+    } else if (same(m, afd, bfd, name, &as, &bs)) {
+        if (unlinkat(bfd, name, 0) == 0) {
+            m->st->dropped++;
+            if (S_ISREG(bs.st_mode) && bs.st_nlink == 1)
+                m->st->dropped_bytes += bs.st_size;
+            if (m->out)
+                fprintf(m->out, "= %s\n", m->path);
+        } else {
+            rc = -1;
+        }
+    } else {
+        rc = move_suffixed(m, afd, bfd, name, S_ISDIR(bs.st_mode));
+    }
+    if (rc != 0) {
+        m->st->failed++;
+        fprintf(stderr, "merge: could not merge %s: %s\n", m->path, strerror(errno));
+    }
+done:
+    m->path[len] = '\0';
+}
+
+static void merge_dir(struct merger *m, int afd, int bfd)
+{
+    int fd = dup(bfd);
+    struct dirent *de;
+    DIR *d;
+
+    if (fd < 0 || !(d = fdopendir(fd))) {
+        if (fd >= 0)
+            close(fd);
+        m->st->failed++;
+        return;
+    }
+    /* Entries only ever leave this directory, so the listing stays sound. */
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        merge_entry(m, afd, bfd, de->d_name);
+    }
+    closedir(d);
+}
+
+/* Swap the emptied folder for a symlink, then sweep up late writes and remove it. */
+static int redirect(struct merger *m, int basefd, int afd, const char *into,
+                    const char *from)
+{
+    char tmp[300];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), MERGE_TMP "%s", from);
+    unlinkat(basefd, tmp, 0);
+    if (symlinkat(into, basefd, tmp) != 0)
+        return -1;
+    if (renameat2(basefd, tmp, basefd, from, RENAME_EXCHANGE) != 0) {
+        unlinkat(basefd, tmp, 0);
+        return -1;
+    }
+    fd = openat(basefd, tmp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        merge_dir(m, afd, fd);
+        close(fd);
+    }
+    if (unlinkat(basefd, tmp, AT_REMOVEDIR) != 0)
+        fprintf(stderr, "merge: %s was left behind: %s\n", tmp, strerror(errno));
+    return 0;
+}
+
+int merge_folders(const char *base, const char *into, const char *from,
+                  struct merge_stats *st, FILE *out)
+{
+    struct merger m;
+    struct timespec t0;
+    struct stat as, bs;
+    int basefd, afd = -1, bfd = -1, rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    memset(&m, 0, sizeof(m));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    basefd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (basefd < 0)
+        return -1;
+    afd = openat(basefd, into, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    bfd = openat(basefd, from, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (afd < 0 || bfd < 0 || fstat(afd, &as) != 0 || fstat(bfd, &bs) != 0) {
+        fprintf(stderr, "merge: %s and %s must both be folders\n", into, from);
+        goto out;
+    }
+    if (as.st_ino == bs.st_ino) {
+        fprintf(stderr, "merge: %s and %s are the same folder\n", into, from);
+        goto out;
+    }
+    if (as.st_dev != bs.st_dev) {
+        fprintf(stderr, "merge: %s and %s are on different filesystems\n", into, from);
+        goto out;
+    }
+    m.from = from;
+    m.st = st;
+    m.out = out;
+    m.ctx = EVP_MD_CTX_new();
+    m.buf = malloc(MERGE_BUF);
+    if (!m.ctx || !m.buf)
+        goto out;
+    merge_dir(&m, afd, bfd);
+    if (st->failed == 0) {
+        if (redirect(&m, basefd, afd, into, from) != 0)
+            fprintf(stderr, "merge: could not replace %s with a link: %s\n", from,
+                    strerror(errno));
+        else
+            st->redirected = 1;
+    }
+    rc = 0;
+out:
+    st->ms = bench_ms_since(&t0);
+    EVP_MD_CTX_free(m.ctx);
+    free(m.buf);
+    if (afd >= 0)
+        close(afd);
+    if (bfd >= 0)
+        close(bfd);
+    close(basefd);
+    return rc;
+}
@@ -0,0 +1,36 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Merge the folder of a duplicate ticket into the one it duplicates,
+ * moving entries with renameat2(RENAME_NOREPLACE) only: data is never
+ * copied, and each entry is either still in `from` or already in `into`.
+ * An entry that is absent from `into` moves whole, directories included.
+ * Directories present on both sides are merged recursively. Files present
+ * on both sides are compared by size and SHA-256: an identical copy in
+ * `from` is dropped, a different one moves in as "name (from).ext".
+ *
+ * Once `from` is empty it is swapped for a symlink to `into` with
+ * RENAME_EXCHANGE, so the old name keeps working. Anything written into
+ * `from` while the merge ran is merged after the swap, before the empty
+ * directory is removed. Both folders must be on the same filesystem.
+ */
+
+struct merge_stats {
+    uint64_t moved;         /* entries moved whole */
+    uint64_t dropped;       /* identical files removed from `from` */
+    uint64_t suffixed;      /* conflicting entries moved under a new name */
+    uint64_t dirs;          /* directories merged into existing ones */
+    uint64_t failed;        /* entries left behind */
+    uint64_t dropped_bytes;
+    int redirected;
+    double ms;
+};
+
+int merge_folders(const char *base, const char *into, const char *from,
+                  struct merge_stats *st, FILE *out);
+
+#endif
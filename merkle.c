@@ -0,0 +1,642 @@
+#include "merkle.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "bench.h"
+
+#define MERKLE_MAGIC "TFSMKL1"
+#define MERKLE_NONE UINT32_MAX
+#define MERKLE_DEPTH 64
+
+struct merkle_header {
+    char magic[8];
+    int64_t taken;
+    uint32_t count, names_len, flags, reserved;
+};
+
+struct builder {
+    struct merkle *m;
+    const struct merkle *prev;
+    EVP_MD_CTX *ctx;
+    char *buf;              /* content read buffer */
+};
+
+static const char *node_name(const struct merkle *m, uint32_t i)
+{
+    return m->names + m->nodes[i].name;
+}
+
+static int grow_nodes(struct merkle *m, uint32_t n)
+{
+    uint32_t cap = m->cap ? m->cap : 1024;
+    struct merkle_node *p;
+
+    if (m->count + n <= m->cap)
+        return 0;
+    while (cap < m->count + n)
+        cap *= 2;
+    p = realloc(m->nodes, (size_t)cap * sizeof(*p));
+    if (!p)
+        return -1;
+    m->nodes = p;
+    if (m->flags & MERKLE_CONTENT) {
+        uint8_t (*c)[MERKLE_HASH] = realloc(m->content, (size_t)cap * MERKLE_HASH);
+
+        if (!c)
+            return -1;
+        m->content = c;
+    }
+    m->cap = cap;
+    return 0;
+}
+
+static int add_name(struct merkle *m, const char *name, uint32_t *off)
+{
+    size_t len = strlen(name) + 1;
+
+    if (m->names_len + len > m->names_cap) {
+        uint32_t cap = m->names_cap ? m->names_cap : 16384;
+        char *p;
+
+        while (cap < m->names_len + len)
+            cap *= 2;
+        p = realloc(m->names, cap);
+        if (!p)
+            return -1;
+        m->names = p;
+        m->names_cap = cap;
+    }
+    memcpy(m->names + m->names_len, name, len);
+    *off = m->names_len;
+    m->names_len += len;
+    return 0;
+}
+
+static int hash_content(struct builder *b, int dirfd, const char *name,
+                        uint8_t out[MERKLE_HASH])
+{
+    uint8_t md[EVP_MAX_MD_SIZE];
+    ssize_t r;
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+    if (fd < 0)
+        return -1;
+    EVP_DigestInit_ex(b->ctx, EVP_sha256(), NULL);
+    while ((r = read(fd, b->buf, 1 << 16)) > 0)
+        EVP_DigestUpdate(b->ctx, b->buf, r);
+    close(fd);
+    EVP_DigestFinal_ex(b->ctx, md, NULL);
+    memcpy(out, md, MERKLE_HASH);
+    return r < 0 ? -1 : 0;
+}
+
+static int cmp_names(const void *a, const void *b, void *arena)
+{
+    return strcmp((const char *)arena + *(const uint32_t *)a,
+                  (const char *)arena + *(const uint32_t *)b);
+}
+
+/*
+ * Fill in the children of directory node idx. The children are reserved
+ * as one block before recursing, so every node's children sit after it;
+ * pidx is the same directory in the previous summary, if any.
+ */
+static int fill(struct builder *b, int dirfd, uint32_t idx, uint32_t pidx, int depth)
+{
+    struct merkle *m = b->m;
+    const struct merkle *prev = b->prev;
+    char *arena = NULL;
+    uint32_t *offs = NULL, n = 0, cap = 0, first, j, pj = 0, pn = 0, pfirst = 0;
+    size_t alen = 0, acap = 0;
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+    int rc = -1;
+
+    if (!d) {
+        close(dirfd);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name) + 1;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (n == cap) {
+            uint32_t *p = realloc(offs, (cap = cap ? cap * 2 : 64) * sizeof(*p));
+
+            if (!p)
+                goto out;
+            offs = p;
+        }
+        if (alen + len > acap) {
+            char *p = realloc(arena, acap = (acap + len) * 2);
+
+            if (!p)
+                goto out;
+            arena = p;
+        }
+        memcpy(arena + alen, de->d_name, len);
+        offs[n++] = (uint32_t)alen;
+        alen += len;
+    }
+    qsort_r(offs, n, sizeof(*offs), cmp_names, arena);
+
+    if (grow_nodes(m, n) != 0)
+        goto out;
+    first = m->count;
+    m->count += n;
+    m->nodes[idx].first = first;
+    m->nodes[idx].nchild = n;
+    if (pidx != MERKLE_NONE) {
+        pfirst = prev->nodes[pidx].first;
+        pn = prev->nodes[pidx].nchild;
+    }
+
+    for (j = 0; j < n; j++) {
+        const char *name = arena + offs[j];
+        uint32_t c = first + j, pc = MERKLE_NONE;
+        struct merkle_node *nd;
+        struct statx stx;
+        int cmp = 1;
+
+        /* Both listings are sorted, so the previous child is found by merging. */
+        while (pj < pn && (cmp = strcmp(node_name(prev, pfirst + pj), name)) < 0)
+            pj++;
+        if (pj < pn && cmp == 0)
+            pc = pfirst + pj;
+
+        nd = &m->nodes[c];
+        memset(nd, 0, sizeof(*nd));
+        if (add_name(m, name, &nd->name) != 0)
+            goto out;
+        nd->first = MERKLE_NONE;
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME,
+                  &stx) != 0) {
+            nd->type = MERKLE_OTHER;
+            continue;
+        }
+        nd->mtime_ns = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+        if (S_ISDIR(stx.stx_mode)) {
+            int fd;
+
+            nd->type = MERKLE_DIR;
+            if (pc != MERKLE_NONE && prev->nodes[pc].type != MERKLE_DIR)
+                pc = MERKLE_NONE;
+            if (depth < MERKLE_DEPTH &&
+                (fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+                fill(b, fd, c, pc, depth + 1);
+            continue;
+        }
+        nd->type = S_ISREG(stx.stx_mode) ? MERKLE_FILE
+                   : S_ISLNK(stx.stx_mode) ? MERKLE_LINK : MERKLE_OTHER;
+        nd->size = stx.stx_size;
+        if (nd->type != MERKLE_FILE || !(m->flags & MERKLE_CONTENT))
+            continue;
+        if (pc != MERKLE_NONE && prev->content && prev->nodes[pc].type == MERKLE_FILE &&
+            prev->nodes[pc].size == nd->size && prev->nodes[pc].mtime_ns == nd->mtime_ns)
+            memcpy(m->content[c], prev->content[pc], MERKLE_HASH);
+        else if (hash_content(b, dirfd, name, m->content[c]) != 0)
+            memset(m->content[c], 0, MERKLE_HASH);
+    }
+    rc = 0;
+out:
+    closedir(d);
+    free(arena);
+    free(offs);
+    return rc;
+}
+
+/* Children follow their parent, so one backwards pass hashes bottom-up. */
+static void hash_nodes(struct builder *b)
+{
+    struct merkle *m = b->m;
+    uint8_t md[EVP_MAX_MD_SIZE];
+    uint32_t i = m->count;
+
+    while (i-- > 0) {
+        struct merkle_node *nd = &m->nodes[i];
+
+        EVP_DigestInit_ex(b->ctx, EVP_sha256(), NULL);
+        EVP_DigestUpdate(b->ctx, &nd->type, sizeof(nd->type));
+        if (nd->type == MERKLE_DIR) {
+            uint32_t j;
+
+            nd->size = 0;
+            for (j = 0; j < nd->nchild; j++) {
+                const struct merkle_node *c = &m->nodes[nd->first + j];
+                const char *name = node_name(m, nd->first + j);
+
+                EVP_DigestUpdate(b->ctx, name, strlen(name) + 1);
+                EVP_DigestUpdate(b->ctx, c->hash, MERKLE_HASH);
+                nd->size += c->type == MERKLE_DIR ? c->size : c->type == MERKLE_FILE;
+            }
+        } else {
+            EVP_DigestUpdate(b->ctx, &nd->size, sizeof(nd->size));
+            EVP_DigestUpdate(b->ctx, &nd->mtime_ns, sizeof(nd->mtime_ns));
+            if (nd->type == MERKLE_FILE && (m->flags & MERKLE_CONTENT))
+                EVP_DigestUpdate(b->ctx, m->content[i], MERKLE_HASH);
+        }
+        EVP_DigestFinal_ex(b->ctx, md, NULL);
+        memcpy(nd->hash, md, MERKLE_HASH);
+    }
+}
+
+int merkle_build(const char *dir, const struct merkle *prev, uint32_t flags,
+                 struct merkle *out)
+{
+    struct builder b;
+    int fd, rc;
+
+    memset(out, 0, sizeof(*out));
+    out->flags = flags;
+    out->taken = time(NULL);
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    b.m = out;
+    b.prev = prev && prev->count ? prev : NULL;
+    b.ctx = EVP_MD_CTX_new();
+    b.buf = (flags & MERKLE_CONTENT) ? malloc(1 << 16) : NULL;
+    if (!b.ctx || ((flags & MERKLE_CONTENT) && !b.buf) || grow_nodes(out, 1) != 0 ||
+        add_name(out, "", &(uint32_t){ 0 }) != 0) {
+        close(fd);
+        rc = -1;
+        goto out;
+    }
+    memset(&out->nodes[0], 0, sizeof(out->nodes[0]));
+    out->nodes[0].type = MERKLE_DIR;
+    out->count = 1;
+    rc = fill(&b, fd, 0, b.prev ? 0 : MERKLE_NONE, 0);
+    if (rc == 0)
+        hash_nodes(&b);
+out:
+    EVP_MD_CTX_free(b.ctx);
+    free(b.buf);
+    if (rc != 0)
+        merkle_free(out);
+    return rc;
+}
+
+void merkle_free(struct merkle *m)
+{
+    if (m->map) {
+        munmap(m->map, m->map_len);
+    } else {
+        free(m->nodes);
+        free(m->content);
+        free(m->names);
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+static void summary_path(const char *state_dir, uint32_t ord, char *out, size_t n)
+{
+    snprintf(out, n, "%s/merkle/%u", state_dir, ord);
+}
+
+/*
+ * A loaded summary is trusted by the diff and by the next build, so check
+ * that every name ends inside the names block and every directory's
+ * children lie after it, within the node count and the build's depth.
+ */
+static int check_tree(const struct merkle *m)
+{
+    uint8_t *level;
+    uint32_t i, j;
+    int rc = 0;
+
+    if (m->names_len == 0 || m->names[m->names_len - 1] != '\0')
+        return -1;
+    level = calloc(m->count, 1);
+    if (!level)
+        return -1;
+    for (i = 0; i < m->count && rc == 0; i++) {
+        const struct merkle_node *nd = &m->nodes[i];
+
+        if (nd->name >= m->names_len || nd->type > MERKLE_LINK)
+            rc = -1;
+        else if (nd->nchild == 0)
+            continue;
+        else if (nd->type != MERKLE_DIR || nd->first <= i ||
+                 (uint64_t)nd->first + nd->nchild > m->count || level[i] > MERKLE_DEPTH)
+            rc = -1;
+        else
+            for (j = 0; j < nd->nchild; j++)
+                level[nd->first + j] = level[i] + 1;
+    }
+    free(level);
+    return rc;
+}
+
+int merkle_read(const char *path, struct merkle *m)
+{
+    struct merkle_header h;
+    struct stat st;
+    size_t need;
+    char *p;
+    int fd;
+
+    memset(m, 0, sizeof(*m));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(h)) {
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    memcpy(&h, p, sizeof(h));
+    need = sizeof(h) + (size_t)h.count * sizeof(struct merkle_node) + h.names_len;
+    if (h.flags & MERKLE_CONTENT)
+        need += (size_t)h.count * MERKLE_HASH;
+    if (memcmp(h.magic, MERKLE_MAGIC, 8) != 0 || h.count == 0 ||
+        need != (size_t)st.st_size) {
+        munmap(p, st.st_size);
+        return -1;
+    }
+    m->map = p;
+    m->map_len = st.st_size;
+    m->count = h.count;
+    m->names_len = h.names_len;
+    m->flags = h.flags;
+    m->taken = h.taken;
+    m->nodes = (struct merkle_node *)(p + sizeof(h));
+    p += sizeof(h) + (size_t)h.count * sizeof(struct merkle_node);
+    if (h.flags & MERKLE_CONTENT) {
+        m->content = (uint8_t (*)[MERKLE_HASH])p;
+        p += (size_t)h.count * MERKLE_HASH;
+    }
+    m->names = p;
+    if (check_tree(m) != 0) {
+        fprintf(stderr, "merkle: %s is damaged\n", path);
+        merkle_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+int merkle_load(const char *state_dir, uint32_t ord, struct merkle *m)
+{
+    char path[4200];
+
+    summary_path(state_dir, ord, path, sizeof(path));
+    return merkle_read(path, m);
+}
+
+static int write_all(int fd, const void *p, size_t n)
+{
+    const char *c = p;
+
+    while (n > 0) {
+        ssize_t w = write(fd, c, n);
+
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c += w;
+        n -= w;
+    }
+    return 0;
+}
+
+int merkle_write(const char *path, const struct merkle *m)
+{
+    char tmp[4400];
+    struct merkle_header h;
+    int fd, rc;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MERKLE_MAGIC, 8);
+    h.taken = m->taken;
+    h.count = m->count;
+    h.names_len = m->names_len;
+    h.flags = m->flags;
+    rc = write_all(fd, &h, sizeof(h));
+    if (rc == 0)
+        rc = write_all(fd, m->nodes, (size_t)m->count * sizeof(*m->nodes));
+    if (rc == 0 && (m->flags & MERKLE_CONTENT))
+        rc = write_all(fd, m->content, (size_t)m->count * MERKLE_HASH);
+    if (rc == 0)
+        rc = write_all(fd, m->names, m->names_len);
+    if (close(fd) != 0)
+        rc = -1;
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0)
+        unlink(tmp);
+    return rc;
+}
+
+int merkle_save(const char *state_dir, uint32_t ord, const struct merkle *m)
+{
+    char path[4200];
+
+    snprintf(path, sizeof(path), "%s/merkle", state_dir);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        return -1;
+    summary_path(state_dir, ord, path, sizeof(path));
+    return merkle_write(path, m);
+}
+
+static void report(const struct merkle *m, uint32_t i, char c, char *path, size_t len,
+                   FILE *out)
+{
+    const struct merkle_node *nd = &m->nodes[i];
+
+    if (!out)
+        return;
+    if (nd->type == MERKLE_DIR)
+        fprintf(out, "%c %.*s/ (%lld files)\n", c, (int)len, path, (long long)nd->size);
+    else
+        fprintf(out, "%c %.*s\n", c, (int)len, path);
+}
+
+static void diff_dir(const struct merkle *a, uint32_t ai, const struct merkle *b,
+                     uint32_t bi, char *path, size_t len, FILE *out,
+                     struct merkle_diff *d)
+{
+    const struct merkle_node *an = &a->nodes[ai], *bn = &b->nodes[bi];
+    uint32_t i = 0, j = 0;
+
+    while (i < an->nchild || j < bn->nchild) {
+        uint32_t x = an->first + i, y = bn->first + j;
+        const char *name;
+        size_t n;
+        int c;
+
+        if (i == an->nchild)
+            c = 1;
+        else if (j == bn->nchild)
+            c = -1;
+        else
+            c = strcmp(node_name(a, x), node_name(b, y));
+        name = c <= 0 ? node_name(a, x) : node_name(b, y);
+        n = snprintf(path + len, len < 4096 ? 4096 - len : 0, "%s%s", len ? "/" : "",
+                     name);
+        if (len + n >= 4096)
+            n = 4095 - len;
+        d->visited++;
+
+        if (c < 0) {
+            d->removed++;
+            report(a, x, '-', path, len + n, out);
+            i++;
+        } else if (c > 0) {
+            d->added++;
+            report(b, y, '+', path, len + n, out);
+            j++;
+        } else {
+            if (memcmp(a->nodes[x].hash, b->nodes[y].hash, MERKLE_HASH) != 0) {
+                if (a->nodes[x].type == MERKLE_DIR && b->nodes[y].type == MERKLE_DIR) {
+                    diff_dir(a, x, b, y, path, len + n, out, d);
+                } else {
+                    d->modified++;
+                    report(b, y, 'M', path, len + n, out);
+                }
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+void merkle_diff(const struct merkle *old, const struct merkle *cur, FILE *out,
+                 struct merkle_diff *d)
+{
+    char path[4097];
+
+    memset(d, 0, sizeof(*d));
+    d->visited = 1;
+    if (memcmp(old->nodes[0].hash, cur->nodes[0].hash, MERKLE_HASH) == 0)
+        return;
+    path[0] = '\0';
+    diff_dir(old, 0, cur, 0, path, 0, out, d);
+}
+
+int merkle_visit(const char *state_dir, uint32_t ord, const char *dir, uint32_t flags,
+                 int record, FILE *out)
+{
+    struct merkle prev, cur;
+    struct merkle_diff d;
+    int have_prev = merkle_load(state_dir, ord, &prev) == 0;
+
+    if (have_prev)
+        flags |= prev.flags & MERKLE_CONTENT;
+    if (merkle_build(dir, have_prev ? &prev : NULL, flags, &cur) != 0) {
+        if (have_prev)
+            merkle_free(&prev);
+        return -1;
+    }
+    if (have_prev) {
+        char when[32];
+        time_t t = prev.taken;
+
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+        merkle_diff(&prev, &cur, out, &d);
+        if (d.added + d.removed + d.modified == 0)
+            fprintf(out, "No changes since %s\n", when);
+        else
+            fprintf(out, "Since %s: %llu added, %llu removed, %llu modified\n", when,
+                    (unsigned long long)d.added, (unsigned long long)d.removed,
+                    (unsigned long long)d.modified);
+        merkle_free(&prev);
+    }
+    if (record && merkle_save(state_dir, ord, &cur) != 0)
+        fprintf(stderr, "merkle: could not save the summary for ticket %u\n", ord);
+    merkle_free(&cur);
+    return 0;
+}
+
+/* bench merkle [files]: summary and diff cost for a mostly unchanged tree */
+int merkle_bench(int argc, char *argv[])
+{
+    long files = argc > 0 ? strtol(argv[0], NULL, 10) : 100000, i;
+    char root[256], path[320];
+    struct merkle a, b;
+    struct merkle_diff d;
+    struct timespec t0;
+    double t;
+    int fd;
+
+    if (files <= 0)
+        files = 100000;
+    if (bench_tmpdir(root, sizeof(root), "merkle") != 0)
+        return 1;
+    for (i = 0; i < files; i++) {
+        if (i % 1000 == 0) {
+            snprintf(path, sizeof(path), "%s/d%03ld", root, i / 1000);
+            mkdir(path, 0755);
+        }
+        snprintf(path, sizeof(path), "%s/d%03ld/f%05ld", root, i / 1000, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            write_all(fd, path, strlen(path));
+            close(fd);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (merkle_build(root, NULL, 0, &a) != 0) {
+        printf("merkle build failed\n");
+        bench_rmtree(root);
+        return 1;
+    }
+    t = bench_ms_since(&t0);
+    printf("%ld files: summary of %u nodes (%.1f MB) built in %.1f ms\n", files, a.count,
+           (a.count * sizeof(struct merkle_node) + a.names_len) / 1048576.0, t);
+
+    for (i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/d%03ld/f%05ld", root, (i * files / 3) / 1000,
+                 i * files / 3);
+        fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd >= 0) {
+            write_all(fd, "x", 1);
+            close(fd);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/d000/new", root);
+    close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    merkle_build(root, &a, 0, &b);
+    t = bench_ms_since(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    merkle_diff(&a, &b, NULL, &d);
+    printf("rebuild %.1f ms, diff %.3f ms: %llu added, %llu modified, "
+           "%llu of %u nodes visited\n", t, bench_ms_since(&t0),
+           (unsigned long long)d.added, (unsigned long long)d.modified,
+           (unsigned long long)d.visited, b.count);
+    merkle_free(&a);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    merkle_build(root, NULL, MERKLE_CONTENT, &a);
+    t = bench_ms_since(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    merkle_free(&b);
+    merkle_build(root, &a, MERKLE_CONTENT, &b);
+    printf("with content: cold %.1f ms, reusing unchanged hashes %.1f ms\n", t,
+           bench_ms_since(&t0));
+    merkle_free(&a);
+    merkle_free(&b);
+    bench_rmtree(root);
+    return 0;
+}
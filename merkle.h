@@ -0,0 +1,74 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-ticket Merkle summary: one node per file or directory, each
+ * directory's children stored contiguously and sorted by name. A file's
+ * hash covers its size and mtime (and optionally its content); a
+ * directory's hash covers its children's names, types and hashes, so two
+ * trees are compared by descending only into directories whose hashes
+ * differ. A summary is saved at each visit under <state>/merkle/<ord>.
+ */
+
+#define MERKLE_HASH 16          /* truncated SHA-256 */
+#define MERKLE_CONTENT 0x1      /* file hashes include content */
+
+/* A link's size is its target's length; its target itself is not hashed. */
+enum { MERKLE_FILE, MERKLE_DIR, MERKLE_OTHER, MERKLE_LINK };
+
+struct merkle_node {
+    uint8_t hash[MERKLE_HASH];
+    int64_t size;           /* files: bytes; directories: files below */
+    int64_t mtime_ns;
+    uint32_t name;          /* offset into names; the root's name is empty */
+    uint32_t first;         /* directories: index of the first child */
+    uint32_t nchild;
+    uint32_t type;
+};
+
+struct merkle {
+    struct merkle_node *nodes;
+    uint8_t (*content)[MERKLE_HASH];    /* per node, with MERKLE_CONTENT */
+    char *names;
+    uint32_t count, names_len;
+    uint32_t flags;
+    int64_t taken;          /* when the summary was made */
+
+    void *map;              /* loaded summaries point into the file */
+    size_t map_len;
+    uint32_t cap, names_cap;
+};
+
+struct merkle_diff {
+    uint64_t added, removed, modified;
+    uint64_t visited;       /* nodes compared */
+};
+
+/* prev, if given, supplies content hashes for files whose size and mtime match. */
+int merkle_build(const char *dir, const struct merkle *prev, uint32_t flags,
+                 struct merkle *out);
+int merkle_load(const char *state_dir, uint32_t ord, struct merkle *m);
+int merkle_save(const char *state_dir, uint32_t ord, const struct merkle *m);
+/* The same for a summary kept anywhere; writes go through a temporary file. */
+int merkle_read(const char *path, struct merkle *m);
+int merkle_write(const char *path, const struct merkle *m);
+void merkle_free(struct merkle *m);
+
+/* Prints "+ path", "- path" and "M path" lines to out when it is not NULL. */
+void merkle_diff(const struct merkle *old, const struct merkle *cur, FILE *out,
+                 struct merkle_diff *d);
+
+/*
+ * Compare the folder with the summary from the last visit, print what
+ * changed and, with record set, save the new summary. Content hashing is
+ * used when asked for or when the previous summary had it.
+ */
+int merkle_visit(const char *state_dir, uint32_t ord, const char *dir, uint32_t flags,
+                 int record, FILE *out);
+
+int merkle_bench(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,375 @@
+#include "meta.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ticket.h"
+
+#define META_GROW 65536
+
+static const struct {
+    const char *file;
+    size_t elem;
+} columns[META_NCOLS] = {
+    { "ctime.i64", 8 },
+    { "mtime.i64", 8 },
+    { "size.i64", 8 },
+    { "files.i64", 8 },
+    { "state.u8", 1 },
+    { "base.u16", 2 },
+    { "ino.u64", 8 },
+    { "closed.i64", 8 },
+};
+
+static void bind_views(struct meta *m)
+{
+    m->ctime = m->col[META_CTIME].data;
+    m->mtime = m->col[META_MTIME].data;
+    m->size = m->col[META_SIZE].data;
+    m->files = m->col[META_FILES].data;
+    m->state = m->col[META_STATE].data;
+    m->base = m->col[META_BASE].data;
+    m->ino = m->col[META_INO].data;
+    m->closed = m->col[META_CLOSED].data;
+}
+
+static int map_col(struct meta_col *c, size_t rows)
+{
+    void *p;
+
+    if (c->data && c->cap >= rows)
+        return 0;
+    if (rows == 0)
+        return 0;
+    p = mmap(NULL, rows * c->elem, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    if (c->data)
+        munmap(c->data, c->cap * c->elem);
+    c->data = p;
+    c->cap = rows;
+    return 0;
+}
+
+static int sync_count(struct meta *m)
+{
+    size_t rows = SIZE_MAX;
+    int i;
+
+    for (i = 0; i < META_NCOLS; i++) {
+        struct stat st;
+
+        if (fstat(m->col[i].fd, &st) != 0)
+            return -1;
+        if ((size_t)st.st_size / m->col[i].elem < rows)
+            rows = st.st_size / m->col[i].elem;
+    }
+    for (i = 0; i < META_NCOLS; i++)
+        if (map_col(&m->col[i], rows) != 0)
+            return -1;
+    m->count = (uint32_t)rows;
+    bind_views(m);
+    return 0;
+}
+
+int meta_open(struct meta *m, const char *state_dir)
+{
+    char path[4200];
+    int i;
+
+    memset(m, 0, sizeof(*m));
+    for (i = 0; i < META_NCOLS; i++)
+        m->col[i].fd = -1;
+    snprintf(m->dir, sizeof(m->dir), "%s/meta", state_dir);
+    if (mkdir(m->dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    for (i = 0; i < META_NCOLS; i++) {
+        snprintf(path, sizeof(path), "%s/%s", m->dir, columns[i].file);
+        m->col[i].elem = columns[i].elem;
+        m->col[i].fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m->col[i].fd < 0) {
+            meta_close(m);
+            return -1;
+        }
+    }
+    /* A column added since the store was created starts out short. */
+    {
+        size_t rows = 0;
+        struct stat st;
+
+        for (i = 0; i < META_NCOLS; i++)
+            if (fstat(m->col[i].fd, &st) == 0 && (size_t)st.st_size / m->col[i].elem > rows)
+                rows = st.st_size / m->col[i].elem;
+        flock(m->col[0].fd, LOCK_EX);
+        for (i = 0; i < META_NCOLS; i++)
+            if (fstat(m->col[i].fd, &st) == 0 &&
+                (size_t)st.st_size < rows * m->col[i].elem &&
+                ftruncate(m->col[i].fd, rows * m->col[i].elem) != 0)
+                break;
+        flock(m->col[0].fd, LOCK_UN);
+    }
+    if (sync_count(m) != 0) {
+        meta_close(m);
+        return -1;
+    }
+    return 0;
+}
+
+void meta_close(struct meta *m)
+{
+    int i;
+
+    for (i = 0; i < META_NCOLS; i++) {
+        if (m->col[i].data)
+            munmap(m->col[i].data, m->col[i].cap * m->col[i].elem);
+        if (m->col[i].fd >= 0)
+            close(m->col[i].fd);
+        m->col[i].data = NULL;
+        m->col[i].fd = -1;
+    }
+    m->count = 0;
+    bind_views(m);
+}
+
+int meta_reserve(struct meta *m, uint32_t n)
+{
+    size_t rows;
+    int i, rc = 0;
+
+    if (n <= m->count)
+        return 0;
+    /* Another process may already have grown the files. */
+    if (sync_count(m) != 0)
+        return -1;
+    if (n <= m->count)
+        return 0;
+
+    rows = ((size_t)n + META_GROW - 1) / META_GROW * META_GROW;
+    flock(m->col[0].fd, LOCK_EX);
+    for (i = 0; i < META_NCOLS && rc == 0; i++) {
+        struct stat st;
+
+        /* Growing only ever extends; new rows read as zero. */
+        if (fstat(m->col[i].fd, &st) != 0)
+            rc = -1;
+        else if ((size_t)st.st_size < rows * m->col[i].elem)
+            rc = ftruncate(m->col[i].fd, rows * m->col[i].elem);
+    }
+    flock(m->col[0].fd, LOCK_UN);
+    if (rc != 0)
+        return -1;
+    return sync_count(m);
+}
+
+int meta_base_id(struct meta *m, const char *base)
+{
+    char path[4200], line[4096];
+    int id = 0, fd;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/bases", m->dir);
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    flock(fd, LOCK_EX);
+    f = fdopen(dup(fd), "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (!strcmp(line, base))
+                break;
+            id++;
+        }
+        if (feof(f)) {
+            size_t len = strlen(base);
+
+            snprintf(line, sizeof(line), "%s\n", base);
+            if (write(fd, line, len + 1) != (ssize_t)(len + 1))
+                id = -1;
+        }
+        fclose(f);
+    } else {
+        id = -1;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return id;
+}
+
+int meta_on_create(struct meta *m, uint32_t ord, int base_id, uint64_t ino,
+                   int64_t now)
+{
+    if (meta_reserve(m, ord + 1) != 0)
+        return -1;
+    if (m->ctime[ord] == 0)
+        m->ctime[ord] = now;
+    m->mtime[ord] = now;
+    m->state[ord] = TICKET_OPEN;
+    m->base[ord] = (uint16_t)(base_id > 0 ? base_id : 0);
+    m->ino[ord] = ino;
+    return 0;
+}
+
+int meta_on_file(struct meta *m, uint32_t ord, int64_t bytes_delta,
+                 int64_t files_delta, int64_t now)
+{
+    if (meta_reserve(m, ord + 1) != 0)
+        return -1;
+    __atomic_add_fetch(&m->size[ord], bytes_delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->files[ord], files_delta, __ATOMIC_RELAXED);
+    if (now > m->mtime[ord])
+        m->mtime[ord] = now;
+    return 0;
+}
+
+int meta_set_state(struct meta *m, uint32_t ord, int state, int64_t now)
+{
+    if (meta_reserve(m, ord + 1) != 0)
+        return -1;
+    m->state[ord] = (uint8_t)state;
+    if (state == TICKET_CLOSED)
+        m->closed[ord] = now;
+    if (now > m->mtime[ord])
+        m->mtime[ord] = now;
+    return 0;
+}
+
+int meta_on_archive(struct meta *m, uint32_t ord, int64_t now)
+{
+    return meta_set_state(m, ord, TICKET_ARCHIVED, now);
+}
+
+static void walk(int dirfd, int64_t *bytes, int64_t *files, int64_t *mtime,
+                 int depth)
+{
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+
+    if (!d) {
+        close(dirfd);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if (st.st_mtime > *mtime)
+            *mtime = st.st_mtime;
+        if (S_ISDIR(st.st_mode) && depth < 64) {
+            int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (fd >= 0)
+                walk(fd, bytes, files, mtime, depth + 1);
+        } else if (S_ISREG(st.st_mode)) {
+            *bytes += st.st_size;
+            (*files)++;
+        }
+    }
+    closedir(d);
+}
+
+int meta_rescan(struct meta *m, uint32_t ord, const char *dir)
+{
+    int64_t bytes = 0, files = 0, mtime = 0;
+    struct statx stx;
+    int fd;
+
+    if (meta_reserve(m, ord + 1) != 0)
+        return -1;
+    if (statx(AT_FDCWD, dir, 0, STATX_MTIME | STATX_BTIME | STATX_CTIME | STATX_INO,
+              &stx) != 0) {
+        m->state[ord] = TICKET_DELETED;
+        return 0;
+    }
+    mtime = stx.stx_mtime.tv_sec;
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    walk(fd, &bytes, &files, &mtime, 0);
+    if (m->ctime[ord] == 0)
+        m->ctime[ord] = (stx.stx_mask & STATX_BTIME) ? stx.stx_btime.tv_sec
+                                                    : stx.stx_ctime.tv_sec;
+    m->mtime[ord] = mtime;
+    m->size[ord] = bytes;
+    m->files[ord] = files;
+    m->ino[ord] = stx.stx_ino;
+    if (m->state[ord] == TICKET_UNKNOWN || m->state[ord] == TICKET_DELETED)
+        m->state[ord] = TICKET_OPEN;
+    return 0;
+}
+
+/* One pass over three columns, each row added to the totals of its state. */
+void meta_totals(const struct meta *m, struct meta_totals *t)
+{
+    uint32_t i;
+
+    memset(t, 0, sizeof(*t));
+    for (i = 0; i < m->count; i++) {
+        uint8_t s = m->state[i];
+
+        if (s >= TICKET_NSTATES)
+            continue;
+        t->tickets[s]++;
+        t->bytes[s] += (uint64_t)m->size[i];
+        t->files[s] += (uint64_t)m->files[i];
+    }
+}
+
+int meta_bench(int argc, char *argv[])
+{
+    uint32_t rows = argc > 0 ? (uint32_t)atoi(argv[0]) : 1000000;
+    struct meta_totals t;
+    struct timespec t0, t1;
+    struct meta m;
+    uint32_t i;
+    double secs, bytes;
+    int r, rounds = 20;
+
+    if (rows == 0)
+        rows = 1000000;
+    memset(&m, 0, sizeof(m));
+    m.count = rows;
+    m.ctime = calloc(rows, 8);
+    m.mtime = calloc(rows, 8);
+    m.size = calloc(rows, 8);
+    m.files = calloc(rows, 8);
+    m.state = calloc(rows, 1);
+    if (!m.ctime || !m.mtime || !m.size || !m.files || !m.state)
+        return 1;
+    for (i = 0; i < rows; i++) {
+        m.size[i] = (int64_t)(i * 2654435761u % 5000000);
+        m.files[i] = i % 200;
+        m.state[i] = i % 7 == 0 ? TICKET_ARCHIVED : TICKET_OPEN;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (r = 0; r < rounds; r++)
+        meta_totals(&m, &t);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    bytes = (double)rows * (8 + 8 + 1) * rounds;
+    printf("%u rows: totals in %.2f ms, %.1f GB/s of column data\n", rows,
+           secs * 1e3 / rounds, bytes / secs / 1e9);
+    printf("open %llu tickets, %llu bytes; archived %llu tickets\n",
+           (unsigned long long)t.tickets[TICKET_OPEN],
+           (unsigned long long)t.bytes[TICKET_OPEN],
+           (unsigned long long)t.tickets[TICKET_ARCHIVED]);
+    free(m.ctime);
+    free(m.mtime);
+    free(m.size);
+    free(m.files);
+    free(m.state);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef META_H
+#define META_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ticket.h"
+
+/*
+ * Columnar per-ticket metadata. Each attribute is one contiguous array
+ * indexed by ticket ordinal and backed by its own file under
+ * <state>/meta, mapped shared so every process sees updates in place.
+ * Timestamps are seconds since the epoch.
+ */
+
+enum {
+    META_CTIME,
+    META_MTIME,
+    META_SIZE,
+    META_FILES,
+    META_STATE,
+    META_BASE,
+    META_INO,
+    META_CLOSED,
+    META_NCOLS
+};
+
+struct meta_col {
+    void *data;
+    size_t elem;
+    size_t cap;             /* rows mapped */
+    int fd;
+};
+
+struct meta {
+    char dir[4096];
+    struct meta_col col[META_NCOLS];
+    uint32_t count;         /* rows backed by every column */
+
+    /* Typed views of col[].data, refreshed whenever a column is remapped. */
+    int64_t *ctime;
+    int64_t *mtime;
+    int64_t *size;
+    int64_t *files;
+    uint8_t *state;
+    uint16_t *base;
+    uint64_t *ino;          /* folder inode, to recognise renames */
+    int64_t *closed;        /* when last closed, 0 if never */
+};
+
+struct meta_totals {
+    uint64_t tickets[TICKET_NSTATES];   /* by enum ticket_state */
+    uint64_t bytes[TICKET_NSTATES];
+    uint64_t files[TICKET_NSTATES];
+};
+
+int meta_open(struct meta *m, const char *state_dir);
+void meta_close(struct meta *m);
+/* Make sure rows [0, n) exist, growing the files as needed. */
+int meta_reserve(struct meta *m, uint32_t n);
+
+int meta_base_id(struct meta *m, const char *base);
+
+/* Event hooks keep the columns current without rescanning the tree. */
+int meta_on_create(struct meta *m, uint32_t ord, int base_id, uint64_t ino,
+                   int64_t now);
+int meta_on_file(struct meta *m, uint32_t ord, int64_t bytes_delta,
+                 int64_t files_delta, int64_t now);
+int meta_on_archive(struct meta *m, uint32_t ord, int64_t now);
+int meta_set_state(struct meta *m, uint32_t ord, int state, int64_t now);
+/* Recompute size, file count and mtime of one ticket from its directory. */
+int meta_rescan(struct meta *m, uint32_t ord, const char *dir);
+
+void meta_totals(const struct meta *m, struct meta_totals *t);
+
+int meta_bench(int argc, char *argv[]);
+
+#endif
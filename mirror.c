@@ -0,0 +1,641 @@
+#include "mirror.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+#include "iosched.h"
+#include "merkle.h"
+
+#define MIRROR_DIR ".tfs-mirror"
+#define MIRROR_THREADS 8
+/* Copies pay the scheduler in steps this large. */
+#define MIRROR_UNIT (4LL << 20)
+/* Attempts at a consistent copy of a state file being written to. */
+#define MIRROR_SNAPSHOT_TRIES 5
+
+/*
+ * Never copied, and removed from the destination on every run in case an
+ * older one copied them: where the archive key lived before it moved out
+ * of the base.
+ */
+static const char *const private_paths[] = { ".tfs/archive/key" };
+
+enum { OP_DELETE, OP_MKDIR, OP_COPY, OP_LINK };
+
+struct op {
+    int kind;
+    uint32_t path;          /* offset into the path arena */
+    int64_t size, mtime_ns;
+};
+
+struct plan {
+    char *arena;
+    size_t len, cap;
+    struct op *ops;
+    size_t n, nalloc;
+    char path[4097];
+};
+
+struct file {
+    const struct op *op;
+    int remaining;          /* chunks still being copied */
+    int failed;
+};
+
+struct run;
+
+struct job {
+    struct run *run;
+    struct file *file;
+    int64_t off, len;       /* len < 0: the whole file */
+};
+
+struct run {
+    int basefd, destfd;
+    const char *arena;
+    struct job *jobs;
+    struct mirror_stats *st;
+    struct iosched sched;
+};
+
+static int push_op(struct plan *p, int kind, size_t pathlen, const struct merkle_node *nd)
+{
+    if (p->n == p->nalloc) {
+        size_t cap = p->nalloc ? p->nalloc * 2 : 1024;
+        struct op *o = realloc(p->ops, cap * sizeof(*o));
+
+        if (!o)
+            return -1;
+        p->ops = o;
+        p->nalloc = cap;
+    }
+    if (p->len + pathlen + 1 > p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 65536;
+        char *a;
+
+        while (cap < p->len + pathlen + 1)
+            cap *= 2;
+        a = realloc(p->arena, cap);
+        if (!a)
+            return -1;
+        p->arena = a;
+        p->cap = cap;
+    }
+    memcpy(p->arena + p->len, p->path, pathlen);
+    p->arena[p->len + pathlen] = '\0';
+    p->ops[p->n].kind = kind;
+    p->ops[p->n].path = (uint32_t)p->len;
+    p->ops[p->n].size = nd ? nd->size : 0;
+    p->ops[p->n].mtime_ns = nd ? nd->mtime_ns : 0;
+    p->len += pathlen + 1;
+    p->n++;
+    return 0;
+}
+
+static int plan_dir(struct plan *p, const struct merkle *a, uint32_t ai,
+                    const struct merkle *b, uint32_t bi, size_t len);
+
+static int private_path(const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(private_paths) / sizeof(private_paths[0]); i++)
+        if (!strcmp(path, private_paths[i]))
+            return 1;
+    return 0;
+}
+
+/* Something the destination does not have yet. */
+static int plan_new(struct plan *p, const struct merkle *b, uint32_t y, size_t len)
+{
+    const struct merkle_node *nd = &b->nodes[y];
+
+    if (nd->type == MERKLE_DIR)
+        return push_op(p, OP_MKDIR, len, nd) || plan_dir(p, NULL, 0, b, y, len);
+    if (nd->type == MERKLE_FILE)
+        return push_op(p, OP_COPY, len, nd);
+    if (nd->type == MERKLE_LINK)
+        return push_op(p, OP_LINK, len, nd);
+    return 0;
+}
+
+/* Merge the two sorted child lists; a is the destination's summary or NULL. */
+static int plan_dir(struct plan *p, const struct merkle *a, uint32_t ai,
+                    const struct merkle *b, uint32_t bi, size_t len)
+{
+    uint32_t na = a ? a->nodes[ai].nchild : 0, nb = b->nodes[bi].nchild, i = 0, j = 0;
+
+    while (i < na || j < nb) {
+        uint32_t x = a ? a->nodes[ai].first + i : 0, y = b->nodes[bi].first + j;
+        const char *name;
+        size_t n;
+        int c;
+
+        if (i == na)
+            c = 1;
+        else if (j == nb)
+            c = -1;
+        else
+            c = strcmp(a->names + a->nodes[x].name, b->names + b->nodes[y].name);
+        name = c < 0 ? a->names + a->nodes[x].name : b->names + b->nodes[y].name;
+        n = snprintf(p->path + len, sizeof(p->path) - len, "%s%s", len ? "/" : "", name);
+        if (len + n >= sizeof(p->path) - 1) {
+            fprintf(stderr, "mirror: path too long under %.*s\n", (int)len, p->path);
+            return -1;
+        }
+        if (c >= 0 && private_path(p->path)) {
+            i += c == 0;
+            j++;
+            continue;
+        }
+
+        if (c < 0) {
+            if (push_op(p, OP_DELETE, len + n, NULL) != 0)
+                return -1;
+            i++;
+            continue;
+        }
+        if (c == 0) {
+            const struct merkle_node *o = &a->nodes[x], *nd = &b->nodes[y];
+
+            i++;
+            j++;
+            if (!memcmp(o->hash, nd->hash, MERKLE_HASH))
+                continue;
+            if (o->type == MERKLE_DIR && nd->type == MERKLE_DIR) {
+                if (plan_dir(p, a, x, b, y, len + n) != 0)
+                    return -1;
+                continue;
+            }
+            if (o->type != nd->type && push_op(p, OP_DELETE, len + n, NULL) != 0)
+                return -1;
+            if (plan_new(p, b, y, len + n) != 0)
+                return -1;
+            continue;
+        }
+        if (plan_new(p, b, y, len + n) != 0)
+            return -1;
+        j++;
+    }
+    return 0;
+}
+
+static int remove_path(int at, const char *path)
+{
+    int fd;
+
+    if (unlinkat(at, path, 0) == 0 || errno == ENOENT)
+        return 0;
+    fd = openat(at, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        DIR *d = fdopendir(fd);
+        struct dirent *de;
+
+        if (!d) {
+            close(fd);
+            return -1;
+        }
+        while ((de = readdir(d)) != NULL)
+            if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+                remove_path(dirfd(d), de->d_name);
+        closedir(d);
+    }
+    return unlinkat(at, path, AT_REMOVEDIR) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+static void part_name(const char *path, char *out, size_t n)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash)
+        snprintf(out, n, "%.*s/.%s.tfs-part", (int)(slash - path), path, slash + 1);
+    else
+        snprintf(out, n, ".%s.tfs-part", path);
+}
+
+int mirror_copy_range(int in, int out, int64_t off, int64_t len, uint64_t *copied)
+{
+    loff_t ri = off, ro = off;
+    char *buf = NULL;
+    int rc = 0;
+
+    while (len != 0) {
+        size_t want = len < 0 || len > (1 << 30) ? (1 << 30) : (size_t)len;
+        ssize_t r = copy_file_range(in, &ri, out, &ro, want, 0);
+
+        if (r < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                      errno == EOPNOTSUPP)) {
+            if (!buf && !(buf = malloc(1 << 20))) {
+                rc = -1;
+                break;
+            }
+            r = pread(in, buf, want < (1 << 20) ? want : (1 << 20), ri);
+            if (r > 0 && pwrite(out, buf, r, ro) != r)
+                r = -1;
+            if (r > 0) {
+                ri += r;
+                ro += r;
+            }
+        }
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+        if (r == 0)
+            break;
+        *copied += r;
+        if (len > 0)
+            len -= r;
+    }
+    free(buf);
+    return rc;
+}
+
+static int finish_file(struct run *r, const struct file *f, int fd, mode_t mode)
+{
+    const char *path = r->arena + f->op->path;
+    char part[4200];
+    struct timespec ts[2];
+
+    part_name(path, part, sizeof(part));
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_NOW;
+    ts[1].tv_sec = f->op->mtime_ns / 1000000000LL;
+    ts[1].tv_nsec = f->op->mtime_ns % 1000000000LL;
+    if (fchmod(fd, mode & 07777) != 0 || futimens(fd, ts) != 0 ||
+        renameat(r->destfd, part, r->destfd, path) != 0) {
+        unlinkat(r->destfd, part, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* Already there from an interrupted run? */
+static int up_to_date(struct run *r, const struct op *op)
+{
+    struct statx stx;
+
+    return statx(r->destfd, r->arena + op->path, AT_SYMLINK_NOFOLLOW,
+                 STATX_SIZE | STATX_MTIME, &stx) == 0 &&
+           (int64_t)stx.stx_size == op->size &&
+           stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec == op->mtime_ns;
+}
+
+/* Live state under <base>/.tfs (see config_state_dir), written in place. */
+static int state_file(const char *path)
+{
+    return !strncmp(path, ".tfs/", 5);
+}
+
+/* mirror_copy_range in MIRROR_UNIT steps, each paid for at the scheduler. */
+static int copy_paced(struct run *r, int in, int out, int64_t off, int64_t len,
+                      uint64_t *copied)
+{
+    while (len != 0) {
+        int64_t step = len < 0 || len > MIRROR_UNIT ? MIRROR_UNIT : len;
+        uint64_t before = *copied;
+
+        iosched_bg_throttle(&r->sched, (uint64_t)step);
+        if (mirror_copy_range(in, out, off, step, copied) != 0)
+            return -1;
+        if (*copied - before < (uint64_t)step)
+            break;
+        off += step;
+        if (len > 0)
+            len -= step;
+    }
+    return 0;
+}
+
+/*
+ * Copy a state file that other processes may be writing: retry until the
+ * source looks the same after the copy as before it. Files replaced by
+ * rename are consistent anyway, since the open descriptor keeps the old one.
+ */
+static int copy_snapshot(struct run *r, const char *path, int in, int out,
+                         uint64_t *copied)
+{
+    struct stat a, b;
+    uint64_t n;
+    int i;
+
+    for (i = 0; i < MIRROR_SNAPSHOT_TRIES; i++) {
+        n = 0;
+        if (fstat(in, &a) != 0 || ftruncate(out, 0) != 0 ||
+            copy_paced(r, in, out, 0, -1, &n) != 0 || fstat(in, &b) != 0)
+            return -1;
+        *copied += n;
+        if (a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+            a.st_mtim.tv_nsec == b.st_mtim.tv_nsec && a.st_ctim.tv_sec == b.st_ctim.tv_sec &&
+            a.st_ctim.tv_nsec == b.st_ctim.tv_nsec && (int64_t)n == b.st_size)
+            return 0;
+    }
+    fprintf(stderr, "mirror: %s kept changing while being copied\n", path);
+    return -1;
+}
+
+static void copy_job(void *arg)
+{
+    struct job *j = arg;
+    struct run *r = j->run;
+    struct file *f = j->file;
+    const char *path = r->arena + f->op->path;
+    char part[4200];
+    uint64_t copied = 0;
+    struct stat st;
+    int in, out = -1, ok = 0;
+
+    part_name(path, part, sizeof(part));
+    if (j->len < 0 && up_to_date(r, f->op)) {
+        __atomic_add_fetch(&r->st->skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    in = openat(r->basefd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in >= 0 && fstat(in, &st) == 0) {
+        if (j->len < 0)
+            out = openat(r->destfd, part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         st.st_mode & 07777);
+        else
+            out = openat(r->destfd, part, O_WRONLY | O_CLOEXEC);
+    }
+    if (out >= 0 && j->len < 0 && state_file(path))
+        ok = copy_snapshot(r, path, in, out, &copied) == 0;
+    else if (out >= 0)
+        ok = copy_paced(r, in, out, j->len < 0 ? 0 : j->off, j->len, &copied) == 0;
+    if (in >= 0)
+        close(in);
+    __atomic_add_fetch(&r->st->bytes, copied, __ATOMIC_RELAXED);
+
+    if (j->len < 0) {
+        if (ok && finish_file(r, f, out, st.st_mode) == 0)
+            __atomic_add_fetch(&r->st->copied, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_add_fetch(&r->st->failed, 1, __ATOMIC_RELAXED);
+        if (out >= 0)
+            close(out);
+        return;
+    }
+    if (!ok)
+        __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+    /* The last chunk to finish renames the file into place. */
+    if (__atomic_sub_fetch(&f->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (!__atomic_load_n(&f->failed, __ATOMIC_RELAXED) && out >= 0 &&
+            finish_file(r, f, out, st.st_mode) == 0) {
+            __atomic_add_fetch(&r->st->copied, 1, __ATOMIC_RELAXED);
+        } else {
+            unlinkat(r->destfd, part, 0);
+            __atomic_add_fetch(&r->st->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (out >= 0)
+        close(out);
+}
+
+/* Recreate a symlink with the source's target, swapped in by rename. */
+static int copy_link(struct run *r, const struct op *op)
+{
+    const char *path = r->arena + op->path;
+    char target[PATH_MAX], cur[PATH_MAX], part[4200];
+    struct timespec ts[2];
+    ssize_t n, m;
+
+    n = readlinkat(r->basefd, path, target, sizeof(target) - 1);
+    if (n < 0)
+        return -1;
+    m = readlinkat(r->destfd, path, cur, sizeof(cur));
+    if (m == n && !memcmp(cur, target, n))
+        return 0;
+    target[n] = '\0';
+    part_name(path, part, sizeof(part));
+    unlinkat(r->destfd, part, 0);
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_NOW;
+    ts[1].tv_sec = op->mtime_ns / 1000000000LL;
+    ts[1].tv_nsec = op->mtime_ns % 1000000000LL;
+    if (symlinkat(target, r->destfd, part) != 0)
+        return -1;
+    utimensat(r->destfd, part, ts, AT_SYMLINK_NOFOLLOW);
+    if (renameat(r->destfd, part, r->destfd, path) != 0) {
+        unlinkat(r->destfd, part, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/* Lay out the jobs: chunks of large files first, then whole small files. */
+static int make_jobs(struct run *r, const struct plan *p, struct file **files,
+                     size_t *njobs)
+{
+    size_t nf = 0, n = 0, cap = 0, i;
+    struct job *jobs = NULL;
+    int pass;
+
+    *files = calloc(p->n ? p->n : 1, sizeof(**files));
+    if (!*files)
+        return -1;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < p->n; i++) {
+            const struct op *op = &p->ops[i];
+            int big = op->size >= MIRROR_CHUNK && !state_file(r->arena + op->path);
+            struct file *f;
+            int64_t off;
+
+            if (op->kind != OP_COPY || big != !pass)
+                continue;
+            f = &(*files)[nf++];
+            f->op = op;
+            if (big) {
+                char part[4200];
+                int fd;
+
+                if (up_to_date(r, op)) {
+                    r->st->skipped++;
+                    continue;
+                }
+                part_name(r->arena + op->path, part, sizeof(part));
+                fd = openat(r->destfd, part, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+                if (fd < 0 || ftruncate(fd, op->size) != 0) {
+                    if (fd >= 0)
+                        close(fd);
+                    r->st->failed++;
+                    continue;
+                }
+                close(fd);
+            }
+            for (off = 0; off < op->size || (!big && off == 0); off += MIRROR_CHUNK) {
+                if (n == cap) {
+                    struct job *jb = realloc(jobs, (cap = cap ? cap * 2 : 1024) * sizeof(*jb));
+
+                    if (!jb) {
+                        free(jobs);
+                        return -1;
+                    }
+                    jobs = jb;
+                }
+                jobs[n].run = r;
+                jobs[n].file = f;
+                jobs[n].off = off;
+                jobs[n].len = big ? (op->size - off < MIRROR_CHUNK ? op->size - off
+                                                                   : MIRROR_CHUNK)
+                                  : -1;
+                if (big)
+                    f->remaining++;
+                n++;
+                if (!big)
+                    break;
+            }
+        }
+    }
+    r->jobs = jobs;
+    *njobs = n;
+    return 0;
+}
+
+static int mkdir_p(const char *path)
+{
+    char buf[PATH_MAX];
+    char *s;
+
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (s = buf + 1; *s; s++) {
+        if (*s != '/')
+            continue;
+        *s = '\0';
+        if (mkdir(buf, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *s = '/';
+    }
+    return mkdir(buf, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+int mirror_run(const char *base, const char *dest, const struct mirror_opts *o,
+               struct mirror_stats *st, FILE *out)
+{
+    char rbase[PATH_MAX], rdest[PATH_MAX], manifest[PATH_MAX + 64], state[PATH_MAX + 8];
+    struct merkle old, cur;
+    struct plan p;
+    struct run r;
+    struct file *files = NULL;
+    struct timespec t0;
+    size_t njobs = 0, i, blen;
+    int have_old, rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    memset(&p, 0, sizeof(p));
+    memset(&r, 0, sizeof(r));
+    r.basefd = r.destfd = -1;
+    if (mkdir_p(dest) != 0 || !realpath(base, rbase) || !realpath(dest, rdest)) {
+        fprintf(stderr, "mirror: cannot use %s: %s\n", dest, strerror(errno));
+        return -1;
+    }
+    blen = strlen(rbase);
+    if (!strncmp(rdest, rbase, blen) && (rdest[blen] == '/' || rdest[blen] == '\0')) {
+        fprintf(stderr, "mirror: %s is inside the base directory\n", dest);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    snprintf(manifest, sizeof(manifest), "%s/%s", rdest, MIRROR_DIR);
+    if (mkdir(manifest, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(manifest, sizeof(manifest), "%s/%s/summary", rdest, MIRROR_DIR);
+    have_old = merkle_read(manifest, &old) == 0;
+    if (merkle_build(rbase, NULL, 0, &cur) != 0) {
+        if (have_old)
+            merkle_free(&old);
+        return -1;
+    }
+    if (plan_dir(&p, have_old ? &old : NULL, 0, &cur, 0, 0) != 0)
+        goto out;
+    st->plan_ms = bench_ms_since(&t0);
+
+    if (o->dry_run) {
+        static const char *const verbs[] = { "delete", "mkdir", "copy", "link" };
+
+        for (i = 0; i < p.n; i++)
+            fprintf(out, "%-6s %s\n", verbs[p.ops[i].kind], p.arena + p.ops[i].path);
+        rc = 0;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r.basefd = open(rbase, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    r.destfd = open(rdest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    r.arena = p.arena;
+    r.st = st;
+    if (r.basefd < 0 || r.destfd < 0)
+        goto out;
+
+    /* Deletions first, so a path that changed type can be recreated. */
+    for (i = 0; i < p.n; i++) {
+        if (p.ops[i].kind != OP_DELETE)
+            continue;
+        if (remove_path(r.destfd, p.arena + p.ops[i].path) == 0)
+            st->deleted++;
+        else
+            st->failed++;
+    }
+    for (i = 0; i < sizeof(private_paths) / sizeof(private_paths[0]); i++)
+        if (unlinkat(r.destfd, private_paths[i], 0) == 0)
+            st->deleted++;
+    for (i = 0; i < p.n; i++) {
+        if (p.ops[i].kind != OP_MKDIR)
+            continue;
+        if (mkdirat(r.destfd, p.arena + p.ops[i].path, 0755) == 0 || errno == EEXIST)
+            st->dirs++;
+        else
+            st->failed++;
+    }
+    for (i = 0; i < p.n; i++) {
+        if (p.ops[i].kind != OP_LINK)
+            continue;
+        if (copy_link(&r, &p.ops[i]) == 0)
+            st->links++;
+        else
+            st->failed++;
+    }
+    if (make_jobs(&r, &p, &files, &njobs) != 0)
+        goto out;
+    /* Background work: paced, and parked while anyone opens a ticket. */
+    config_state_dir(rbase, state, sizeof(state));
+    iosched_init(&r.sched, state, o->threads > 0 ? o->threads : MIRROR_THREADS, o->rate);
+    for (i = 0; i < njobs; i++)
+        if (iosched_submit(&r.sched, copy_job, &r.jobs[i]) != 0)
+            copy_job(&r.jobs[i]);
+    iosched_drain(&r.sched);
+    iosched_shutdown(&r.sched);
+
+    /* The summary only moves forward once the data it describes is durable. */
+    if (st->failed == 0) {
+        syncfs(r.destfd);
+        if (merkle_write(manifest, &cur) != 0)
+            goto out;
+    }
+    st->copy_ms = bench_ms_since(&t0);
+    rc = 0;
+
+out:
+    free(r.jobs);
+    free(files);
+    free(p.ops);
+    free(p.arena);
+    if (r.basefd >= 0)
+        close(r.basefd);
+    if (r.destfd >= 0)
+        close(r.destfd);
+    merkle_free(&cur);
+    if (have_old)
+        merkle_free(&old);
+    return rc;
+}
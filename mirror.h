@@ -0,0 +1,47 @@
+#ifndef MIRROR_H
+#define MIRROR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Incremental mirror of the base directory. The destination keeps a
+ * Merkle summary of what it holds (<dest>/.tfs-mirror); each run diffs
+ * the base against it, creates new directories and symlinks, propagates
+ * deletions and copies new or changed files as background work through
+ * iosched, paced and parked while tickets are being opened. Files of
+ * MIRROR_CHUNK or more are split into chunks copied in parallel with
+ * copy_file_range. State files under .tfs, which other processes write in
+ * place, are copied again until a copy sees no change in the source.
+ *
+ * Every file and link lands through a temporary name and gets the source
+ * mtime, so an interrupted run is resumed by running again: files the
+ * destination already holds at the right size and mtime are skipped, and
+ * the summary is only replaced once every copy has succeeded.
+ */
+
+#define MIRROR_CHUNK (32LL << 20)
+
+struct mirror_opts {
+    int threads;            /* 0 for the default */
+    int dry_run;            /* print the plan only */
+    uint64_t rate;          /* bytes per second, 0 = unthrottled */
+};
+
+struct mirror_stats {
+    uint64_t dirs, links, deleted, copied, skipped, failed;
+    uint64_t bytes;
+    double plan_ms, copy_ms;
+};
+
+int mirror_run(const char *base, const char *dest, const struct mirror_opts *o,
+               struct mirror_stats *st, FILE *out);
+
+/*
+ * Copy len bytes (len < 0: to the end) at off from in to the same offset
+ * in out: copy_file_range where the filesystems allow it, pread/pwrite
+ * otherwise. Adds the bytes copied to *copied.
+ */
+int mirror_copy_range(int in, int out, int64_t off, int64_t len, uint64_t *copied);
+
+#endif
@@ -0,0 +1,70 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define POOL_BATCH 64
+
+struct pool_run {
+    size_t n;
+    size_t next;
+    size_t batch;
+    void (*fn)(size_t i, void *arg);
+    void *arg;
+};
+
+int pool_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        return 1;
+    return n > 64 ? 64 : (int)n;
+}
+
+static void *pool_worker(void *p)
+{
+    struct pool_run *r = p;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&r->next, r->batch, __ATOMIC_RELAXED);
+        size_t end = i + r->batch;
+
+        if (i >= r->n)
+            break;
+        if (end > r->n)
+            end = r->n;
+        for (; i < end; i++)
+            r->fn(i, r->arg);
+    }
+    return NULL;
+}
+
+void pool_for_batched(size_t n, int threads, size_t batch,
+                      void (*fn)(size_t i, void *arg), void *arg)
+{
+    struct pool_run r = { n, 0, batch ? batch : 1, fn, arg };
+    pthread_t *tids;
+    int i, started = 0;
+
+    if (threads <= 0)
+        threads = pool_default_threads();
+    if ((size_t)threads > (n + r.batch - 1) / r.batch)
+        threads = (int)((n + r.batch - 1) / r.batch);
+    if (threads < 1)
+        threads = 1;
+    tids = threads > 1 ? calloc(threads - 1, sizeof(*tids)) : NULL;
+    for (i = 0; tids && i < threads - 1; i++)
+        if (pthread_create(&tids[i], NULL, pool_worker, &r) == 0)
+            started++;
+    pool_worker(&r);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+void pool_for(size_t n, int threads, void (*fn)(size_t i, void *arg), void *arg)
+{
+    pool_for_batched(n, threads, POOL_BATCH, fn, arg);
+}
@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Parallel for: calls fn(i, arg) for every i in [0, n) from up to
+ * `threads` threads (the caller included), handing out indexes in small
+ * batches from a shared counter. threads <= 0 means one per online CPU.
+ */
+void pool_for(size_t n, int threads, void (*fn)(size_t i, void *arg), void *arg);
+/* The same with a chosen batch size; use 1 for long, uneven items. */
+void pool_for_batched(size_t n, int threads, size_t batch,
+                      void (*fn)(size_t i, void *arg), void *arg);
+
+int pool_default_threads(void);
+
+#endif
@@ -0,0 +1,448 @@
+#include "prefetch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define PREFETCH_MAGIC "TFSPF01"
+#define PREFETCH_DEPTH 64
+
+struct record_header {
+    char magic[8];
+    uint32_t count, reserved;
+};
+
+/* Record entry, followed by path_len bytes of relative path. */
+struct record_entry {
+    uint64_t size;
+    int64_t used_ns;        /* later of atime and mtime */
+    uint32_t path_len, reserved;
+};
+
+struct seen {
+    uint64_t size;
+    int64_t used_ns;
+    uint32_t path;          /* offset into the arena */
+    uint32_t path_len;
+};
+
+struct walk {
+    struct seen *v;
+    size_t n, cap;
+    char *arena;
+    size_t len, acap;
+    uint64_t entries;
+};
+
+static void record_path(const char *state_dir, uint32_t ord, char *out, size_t n)
+{
+    snprintf(out, n, "%s/prefetch/%u", state_dir, ord);
+}
+
+/* Load the record, most recently used first. */
+static int load_record(const char *state_dir, uint32_t ord, struct walk *w)
+{
+    struct record_header h;
+    char path[4200];
+    FILE *f;
+    uint32_t i;
+
+    record_path(state_dir, ord, path, sizeof(path));
+    f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, PREFETCH_MAGIC, 8) ||
+        h.count > PREFETCH_MAX || !(w->v = calloc(h.count ? h.count : 1, sizeof(*w->v))) ||
+        !(w->arena = malloc(w->acap = (size_t)h.count * 4097 + 1))) {
+        fclose(f);
+        return -1;
+    }
+    for (i = 0; i < h.count; i++) {
+        struct record_entry e;
+
+        if (fread(&e, sizeof(e), 1, f) != 1 || e.path_len > 4096 ||
+            fread(w->arena + w->len, 1, e.path_len, f) != e.path_len)
+            break;
+        w->v[i].size = e.size;
+        w->v[i].used_ns = e.used_ns;
+        w->v[i].path = (uint32_t)w->len;
+        w->v[i].path_len = e.path_len;
+        w->arena[w->len + e.path_len] = '\0';
+        w->len += e.path_len + 1;
+        w->n++;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int save_record(const char *state_dir, uint32_t ord, const struct walk *w)
+{
+    struct record_header h;
+    char path[4200], tmp[4300];
+    size_t i, n = w->n < PREFETCH_MAX ? w->n : PREFETCH_MAX;
+    FILE *f;
+    int rc = 0;
+
+    snprintf(path, sizeof(path), "%s/prefetch", state_dir);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        return -1;
+    record_path(state_dir, ord, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    f = fopen(tmp, "wb");
+    if (!f)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PREFETCH_MAGIC, 8);
+    h.count = (uint32_t)n;
+    if (fwrite(&h, sizeof(h), 1, f) != 1)
+        rc = -1;
+    for (i = 0; rc == 0 && i < n; i++) {
+        struct record_entry e = { w->v[i].size, w->v[i].used_ns, w->v[i].path_len, 0 };
+
+        if (fwrite(&e, sizeof(e), 1, f) != 1 ||
+            fwrite(w->arena + w->v[i].path, 1, e.path_len, f) != e.path_len)
+            rc = -1;
+    }
+    if (fclose(f) != 0)
+        rc = -1;
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0)
+        unlink(tmp);
+    return rc;
+}
+
+/*
+ * Take the most recently used files until the budget is spent, then issue
+ * them oldest first, which is the order they were used in. Only the last
+ * file taken can overrun the budget; it gets just its head.
+ */
+static void issue(int dirfd, const struct walk *w, uint64_t budget,
+                  struct prefetch_stats *st)
+{
+    uint64_t used = 0;
+    size_t n = 0, i;
+
+    while (n < w->n && used < budget)
+        used += w->v[n++].size;
+    for (i = n; i-- > 0;) {
+        const struct seen *s = &w->v[i];
+        uint64_t len = s->size;
+        int fd;
+
+        if (i == n - 1 && used > budget)
+            len -= used - budget;
+        fd = openat(dirfd, w->arena + s->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) == 0) {
+            st->files++;
+            st->bytes += len;
+        }
+        close(fd);
+    }
+}
+
+static int push(struct walk *w, const char *path, const struct statx *stx)
+{
+    size_t len = strlen(path);
+    int64_t a = stx->stx_atime.tv_sec * 1000000000LL + stx->stx_atime.tv_nsec;
+    int64_t m = stx->stx_mtime.tv_sec * 1000000000LL + stx->stx_mtime.tv_nsec;
+
+    if (w->n == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 1024;
+        struct seen *p = realloc(w->v, cap * sizeof(*p));
+
+        if (!p)
+            return -1;
+        w->v = p;
+        w->cap = cap;
+    }
+    if (w->len + len + 1 > w->acap) {
+        size_t cap = w->acap ? w->acap * 2 : 65536;
+        char *p;
+
+        while (cap < w->len + len + 1)
+            cap *= 2;
+        p = realloc(w->arena, cap);
+        if (!p)
+            return -1;
+        w->arena = p;
+        w->acap = cap;
+    }
+    memcpy(w->arena + w->len, path, len + 1);
+    w->v[w->n].size = stx->stx_size;
+    w->v[w->n].used_ns = a > m ? a : m;
+    w->v[w->n].path = (uint32_t)w->len;
+    w->v[w->n].path_len = (uint32_t)len;
+    w->len += len + 1;
+    w->n++;
+    return 0;
+}
+
+/* Stat everything below dirfd; this is what warms the dentry and inode caches. */
+static void walk(struct walk *w, int dirfd, const char *prefix, int depth)
+{
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+    char path[4097];
+
+    if (!d) {
+        close(dirfd);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        struct statx stx;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        w->entries++;
+        if (statx(dirfd, de->d_name, AT_SYMLINK_NOFOLLOW,
+                  STATX_TYPE | STATX_SIZE | STATX_ATIME | STATX_MTIME, &stx) != 0 ||
+            (size_t)snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "",
+                             de->d_name) >= sizeof(path))
+            continue;
+        if (S_ISREG(stx.stx_mode) && stx.stx_size > 0) {
+            push(w, path, &stx);
+        } else if (S_ISDIR(stx.stx_mode) && depth < PREFETCH_DEPTH) {
+            int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                            O_CLOEXEC);
+
+            if (fd >= 0)
+                walk(w, fd, path, depth + 1);
+        }
+    }
+    closedir(d);
+}
+
+static int by_recency(const void *a, const void *b)
+{
+    const struct seen *x = a, *y = b;
+
+    return x->used_ns < y->used_ns ? 1 : x->used_ns > y->used_ns ? -1 : 0;
+}
+
+static void *run(void *arg)
+{
+    struct prefetch *p = arg;
+    struct timespec t0;
+    struct walk rec, cur;
+    int dirfd = open(p->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirfd < 0)
+        return NULL;
+    memset(&rec, 0, sizeof(rec));
+    memset(&cur, 0, sizeof(cur));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (load_record(p->state_dir, p->ord, &rec) == 0 && rec.n > 0)
+        issue(dirfd, &rec, p->budget, &p->st);
+    p->st.issue_ms = bench_ms_since(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    walk(&cur, dup(dirfd), "", 0);
+    p->st.entries = cur.entries;
+    qsort(cur.v, cur.n, sizeof(*cur.v), by_recency);
+    save_record(p->state_dir, p->ord, &cur);
+    p->st.walk_ms = bench_ms_since(&t0);
+
+    close(dirfd);
+    free(rec.v);
+    free(rec.arena);
+    free(cur.v);
+    free(cur.arena);
+    return NULL;
+}
+
+int prefetch_start(struct prefetch *p, const char *state_dir, uint32_t ord, const char *dir,
+                   uint64_t budget)
+{
+    memset(p, 0, sizeof(*p));
+    p->ord = ord;
+    p->budget = budget ? budget : PREFETCH_BUDGET;
+    p->state_dir = strdup(state_dir);
+    p->dir = strdup(dir);
+    if (p->state_dir && p->dir && pthread_create(&p->thread, NULL, run, p) == 0) {
+        p->started = 1;
+        return 0;
+    }
+    free(p->state_dir);
+    free(p->dir);
+    return -1;
+}
+
+void prefetch_wait(struct prefetch *p)
+{
+    if (!p->started)
+        return;
+    pthread_join(p->thread, NULL);
+    p->started = 0;
+    free(p->state_dir);
+    free(p->dir);
+}
+
+/* Drop the page cache for one file; clean pages only, so sync first. */
+static void evict(int dirfd, const char *path)
+{
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int drop_caches(void)
+{
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+    int ok;
+
+    if (fd < 0)
+        return -1;
+    sync();
+    ok = write(fd, "3", 1) == 1;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/*
+ * bench prefetch [MB] [files] [gap ms]: time to first byte and to read
+ * the working set after an open, cold against prefetched. The gap stands
+ * for the file manager and editor starting up.
+ */
+int prefetch_bench(int argc, char *argv[])
+{
+    long mb = argc > 0 ? strtol(argv[0], NULL, 10) : 256;
+    long nbig = argc > 1 ? strtol(argv[1], NULL, 10) : 8;
+    long gap = argc > 2 ? strtol(argv[2], NULL, 10) : 200;
+    char dir[256], root[300], state[300], path[400], *buf;
+    size_t size, chunk = 1 << 20;
+    long i, j, mode;
+    int rootfd, dropped = 0, rc = 1;
+
+    if (mb <= 0 || nbig <= 0 || gap < 0) {
+        printf("Usage: bench prefetch [MB] [files] [gap ms]\n");
+        return 1;
+    }
+    size = (size_t)mb * 1048576 / nbig;
+    buf = malloc(chunk);
+    if (!buf || bench_tmpdir(dir, sizeof(dir), "prefetch") != 0) {
+        free(buf);
+        return 1;
+    }
+    snprintf(root, sizeof(root), "%s/ticket", dir);
+    snprintf(state, sizeof(state), "%s/state", dir);
+    mkdir(root, 0755);
+    mkdir(state, 0755);
+    rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (i = 0; i < (long)chunk; i++)
+        buf[i] = (char)(i * 2654435761u >> 13);
+    /* The working set: big files, used just now; and older small files around it. */
+    for (i = 0; i < 2000; i++) {
+        struct timespec old[2] = { { time(NULL) - 86400 * 3, 0 }, { time(NULL) - 86400 * 3, 0 } };
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/d%02ld", root, i / 100);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/d%02ld/note%04ld.txt", root, i / 100, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || write(fd, buf, 4096) != 4096) {
+            printf("could not create the file set\n");
+            goto out;
+        }
+        futimens(fd, old);
+        close(fd);
+    }
+    for (i = 0; i < nbig; i++) {
+        struct timespec used[2] = { { time(NULL) - nbig + i, 0 }, { time(NULL) - 86400, 0 } };
+        size_t done;
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/capture%02ld.pcap", root, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        for (done = 0; fd >= 0 && done < size; done += chunk)
+            if (write(fd, buf, size - done < chunk ? size - done : chunk) <= 0)
+                break;
+        if (fd < 0 || done < size) {
+            printf("could not create the file set\n");
+            goto out;
+        }
+        futimens(fd, used);
+        close(fd);
+    }
+    {
+        struct prefetch p;
+
+        /* The first open only records the working set. */
+        prefetch_start(&p, state, 0, root, 0);
+        prefetch_wait(&p);
+    }
+
+    for (mode = 0; mode < 2; mode++) {
+        struct prefetch p;
+        struct timespec t0, t1;
+        double ttfb = 0, first = 0, total;
+
+        for (i = 0; i < nbig; i++) {
+            snprintf(path, sizeof(path), "capture%02ld.pcap", i);
+            evict(rootfd, path);
+        }
+        for (i = 0; i < 2000; i++) {
+            snprintf(path, sizeof(path), "d%02ld/note%04ld.txt", i / 100, i);
+            evict(rootfd, path);
+        }
+        dropped = drop_caches() == 0;
+        if (mode == 1)
+            prefetch_start(&p, state, 0, root, 0);
+        usleep(gap * 1000);
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < nbig; i++) {
+            struct timespec f0, f1;
+            size_t done = 0;
+            ssize_t r;
+            int fd;
+
+            snprintf(path, sizeof(path), "capture%02ld.pcap", i);
+            clock_gettime(CLOCK_MONOTONIC, &f0);
+            fd = openat(rootfd, path, O_RDONLY | O_CLOEXEC);
+            for (j = 0; fd >= 0 && (r = read(fd, buf, chunk)) > 0; j++) {
+                if (j == 0) {
+                    clock_gettime(CLOCK_MONOTONIC, &f1);
+                    ttfb += (f1.tv_sec - f0.tv_sec) * 1e3 + (f1.tv_nsec - f0.tv_nsec) / 1e6;
+                    if (i == 0)
+                        first = ttfb;
+                }
+                done += r;
+            }
+            if (fd >= 0)
+                close(fd);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        total = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        printf("%-10s first byte %.2f ms (mean %.2f ms over %ld files), working set %.0f ms",
+               mode ? "prefetch" : "cold", first, ttfb / nbig, nbig, total);
+        if (mode == 1) {
+            prefetch_wait(&p);
+            printf("; %llu files / %.0f MB issued in %.1f ms, %llu entries walked in %.1f ms",
+                   (unsigned long long)p.st.files, p.st.bytes / 1048576.0, p.st.issue_ms,
+                   (unsigned long long)p.st.entries, p.st.walk_ms);
+        }
+        printf("\n");
+    }
+    printf("caches dropped with %s\n", dropped ? "drop_caches" : "fadvise(DONTNEED) per file");
+    rc = 0;
+out:
+    close(rootfd);
+    bench_rmtree(dir);
+    free(buf);
+    return rc;
+}
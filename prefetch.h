@@ -0,0 +1,44 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Working-set prefetch for a ticket being opened. Each open records the
+ * ticket's most recently used files (by access time, or modification
+ * time where atime does not move) under <state>/prefetch/<ord>. The next
+ * open replays that record on its own thread: the most recent files that
+ * fit the byte budget get posix_fadvise(WILLNEED), issued in the order
+ * they were last used, and a file larger than what is left of the budget
+ * has only its head read ahead. The thread then walks the whole tree,
+ * which warms the dentry and inode caches and produces the new record.
+ */
+
+#define PREFETCH_MAX 256
+#define PREFETCH_BUDGET (256LL << 20)
+
+struct prefetch_stats {
+    uint64_t files, bytes;  /* read ahead */
+    uint64_t entries;       /* seen by the walk */
+    double issue_ms, walk_ms;
+};
+
+struct prefetch {
+    pthread_t thread;
+    int started;
+    char *state_dir, *dir;
+    uint32_t ord;
+    uint64_t budget;
+    struct prefetch_stats st;
+};
+
+/* Start prefetching dir; budget 0 means PREFETCH_BUDGET. */
+int prefetch_start(struct prefetch *p, const char *state_dir, uint32_t ord, const char *dir,
+                   uint64_t budget);
+/* Wait for the walk to finish and the record to be saved. */
+void prefetch_wait(struct prefetch *p);
+
+int prefetch_bench(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,763 @@
+#include "query.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "meta.h"
+#include "rbitmap.h"
+#include "tags.h"
+#include "ticket.h"
+
+#define QUERY_BLOCK 1024
+
+enum { Q_AND, Q_OR, Q_NOT, Q_PRED };
+enum { F_TAG, F_PREFIX, F_STATE, F_HAS, F_MODIFIED, F_CREATED, F_SIZE, F_FILES };
+enum { OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE };
+/* Evaluation classes, cheapest first. */
+enum { CLS_BITMAP, CLS_COLUMN, CLS_FS };
+
+enum {
+    COL_MTIME = 1 << 0,
+    COL_CTIME = 1 << 1,
+    COL_SIZE = 1 << 2,
+    COL_FILES = 1 << 3,
+    COL_STATE = 1 << 4
+};
+
+struct qnode {
+    int kind;
+    struct qnode *l, *r;
+    int field, op, cls;
+    int64_t value;
+    char text[128];
+    struct rbitmap bits;    /* F_TAG */
+};
+
+struct block {
+    uint32_t n;
+    uint32_t ord[QUERY_BLOCK];
+    int64_t mtime[QUERY_BLOCK];
+    int64_t ctime[QUERY_BLOCK];
+    int64_t size[QUERY_BLOCK];
+    int64_t files[QUERY_BLOCK];
+    uint8_t state[QUERY_BLOCK];
+};
+
+struct query {
+    const char *base;
+    const char *state_dir;
+    struct ordmap names;
+    struct meta meta;
+    int have_meta;
+    const char *p;          /* parser cursor */
+    char err[256];
+    int64_t now;
+    struct qnode **conj;
+    int nconj;
+};
+
+/* ---- parsing ---- */
+
+static struct qnode *node_new(int kind, struct qnode *l, struct qnode *r)
+{
+    struct qnode *n = calloc(1, sizeof(*n));
+
+    if (n) {
+        n->kind = kind;
+        n->l = l;
+        n->r = r;
+    }
+    return n;
+}
+
+static void node_free(struct qnode *n)
+{
+    if (!n)
+        return;
+    node_free(n->l);
+    node_free(n->r);
+    rb_free(&n->bits);
+    free(n);
+}
+
+static void skip_ws(struct query *q)
+{
+    while (isspace((unsigned char)*q->p))
+        q->p++;
+}
+
+static int word_char(char c)
+{
+    return c && !isspace((unsigned char)c) && c != '(' && c != ')';
+}
+
+/* Copy the next bare word into buf without consuming it; returns length. */
+static size_t peek_word(struct query *q, char *buf, size_t n)
+{
+    size_t len = 0;
+
+    skip_ws(q);
+    while (word_char(q->p[len]) && len + 1 < n) {
+        buf[len] = q->p[len];
+        len++;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static int parse_op(const char **s)
+{
+    const char *p = *s;
+
+    if (p[0] == '<' && p[1] == '=') { *s += 2; return OP_LE; }
+    if (p[0] == '>' && p[1] == '=') { *s += 2; return OP_GE; }
+    if (p[0] == '!' && p[1] == '=') { *s += 2; return OP_NE; }
+    if (p[0] == '<') { *s += 1; return OP_LT; }
+    if (p[0] == '>') { *s += 1; return OP_GT; }
+    if (p[0] == '=') { *s += 1; return OP_EQ; }
+    return -1;
+}
+
+static int flip_op(int op)
+{
+    switch (op) {
+    case OP_LT: return OP_GT;
+    case OP_LE: return OP_GE;
+    case OP_GT: return OP_LT;
+    case OP_GE: return OP_LE;
+    }
+    return op;
+}
+
+static int parse_size(const char *s, int64_t *out)
+{
+    char *end;
+    double v = strtod(s, &end);
+    int shift = 0;
+
+    if (end == s)
+        return -1;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': shift = 10; end++; break;
+    case 'M': shift = 20; end++; break;
+    case 'G': shift = 30; end++; break;
+    case 'T': shift = 40; end++; break;
+    }
+    if (*end == 'B' || *end == 'b')
+        end++;
+    if (*end)
+        return -1;
+    *out = (int64_t)(v * (double)(1LL << shift));
+    return 0;
+}
+
+/* Fills *out with a timestamp; *age is set when the value was a duration. */
+static int parse_time(struct query *q, const char *s, int64_t *out, int *age)
+{
+    struct tm tm;
+    char *end;
+    long v;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(s, "%Y-%m-%d", &tm);
+    if (end && !*end) {
+        tm.tm_isdst = -1;
+        *out = mktime(&tm);
+        *age = 0;
+        return 0;
+    }
+    v = strtol(s, &end, 10);
+    if (end == s)
+        return -1;
+    switch (*end) {
+    case 's': break;
+    case 'm': v *= 60; break;
+    case 'h': v *= 3600; break;
+    case 'd': v *= 86400; break;
+    case 'w': v *= 7 * 86400; break;
+    default: return -1;
+    }
+    if (end[1])
+        return -1;
+    *out = q->now - v;
+    *age = 1;
+    return 0;
+}
+
+static struct qnode *parse_pred(struct query *q)
+{
+    static const struct { const char *name; int field; } fields[] = {
+        { "tag", F_TAG }, { "prefix", F_PREFIX }, { "state", F_STATE },
+        { "has", F_HAS }, { "modified", F_MODIFIED }, { "created", F_CREATED },
+        { "size", F_SIZE }, { "files", F_FILES },
+    };
+    char word[256];
+    const char *rest;
+    struct qnode *n;
+    size_t len = peek_word(q, word, sizeof(word)), i, flen = 0;
+    int field = -1;
+
+    if (len == 0) {
+        snprintf(q->err, sizeof(q->err), "expected a predicate");
+        return NULL;
+    }
+    q->p += len;
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        flen = strlen(fields[i].name);
+        if (!strncmp(word, fields[i].name, flen) && !isalnum((unsigned char)word[flen])) {
+            field = fields[i].field;
+            break;
+        }
+    }
+    if (field < 0) {
+        snprintf(q->err, sizeof(q->err), "unknown predicate '%s'", word);
+        return NULL;
+    }
+    n = node_new(Q_PRED, NULL, NULL);
+    if (!n)
+        return NULL;
+    n->field = field;
+    rest = word + flen;
+
+    if (field == F_TAG || field == F_PREFIX || field == F_STATE || field == F_HAS) {
+        if (*rest != ':' || !rest[1]) {
+            snprintf(q->err, sizeof(q->err), "expected %s:VALUE", fields[i].name);
+            goto fail;
+        }
+        snprintf(n->text, sizeof(n->text), "%s", rest + 1);
+        n->op = OP_EQ;
+        if (field == F_STATE && (n->value = ticket_state_parse(n->text)) < 0) {
+            snprintf(q->err, sizeof(q->err), "unknown state '%s'", n->text);
+            goto fail;
+        }
+        n->cls = field == F_TAG ? CLS_BITMAP : field == F_HAS ? CLS_FS : CLS_COLUMN;
+        return n;
+    }
+
+    n->op = parse_op(&rest);
+    n->cls = CLS_COLUMN;
+    if (n->op < 0) {
+        snprintf(q->err, sizeof(q->err), "expected a comparison in '%s'", word);
+        goto fail;
+    }
+    if (field == F_MODIFIED || field == F_CREATED) {
+        int age;
+
+        if (parse_time(q, rest, &n->value, &age) != 0) {
+            snprintf(q->err, sizeof(q->err), "bad time '%s'", rest);
+            goto fail;
+        }
+        /* Younger than N days means a timestamp after now - N. */
+        if (age)
+            n->op = flip_op(n->op);
+    } else if (parse_size(rest, &n->value) != 0) {
+        snprintf(q->err, sizeof(q->err), "bad number '%s'", rest);
+        goto fail;
+    }
+    return n;
+
+fail:
+    node_free(n);
+    return NULL;
+}
+
+static struct qnode *parse_or(struct query *q);
+
+static int accept_word(struct query *q, const char *kw)
+{
+    char word[16];
+    size_t len = peek_word(q, word, sizeof(word));
+
+    if (len && !strcmp(word, kw)) {
+        q->p += len;
+        return 1;
+    }
+    return 0;
+}
+
+static struct qnode *parse_unary(struct query *q)
+{
+    struct qnode *n;
+
+    skip_ws(q);
+    if (accept_word(q, "not") || (*q->p == '!' && q->p[1] != '=' && q->p++)) {
+        n = parse_unary(q);
+        return n ? node_new(Q_NOT, n, NULL) : NULL;
+    }
+    if (*q->p == '(') {
+        q->p++;
+        n = parse_or(q);
+        skip_ws(q);
+        if (n && *q->p != ')') {
+            snprintf(q->err, sizeof(q->err), "missing ')'");
+            node_free(n);
+            return NULL;
+        }
+        q->p++;
+        return n;
+    }
+    return parse_pred(q);
+}
+
+static struct qnode *parse_and(struct query *q)
+{
+    struct qnode *l = parse_unary(q), *r;
+
+    while (l && accept_word(q, "and")) {
+        r = parse_unary(q);
+        if (!r) {
+            node_free(l);
+            return NULL;
+        }
+        l = node_new(Q_AND, l, r);
+    }
+    return l;
+}
+
+static struct qnode *parse_or(struct query *q)
+{
+    struct qnode *l = parse_and(q), *r;
+
+    while (l && accept_word(q, "or")) {
+        r = parse_and(q);
+        if (!r) {
+            node_free(l);
+            return NULL;
+        }
+        l = node_new(Q_OR, l, r);
+    }
+    return l;
+}
+
+/* ---- planning ---- */
+
+static int classify(struct qnode *n)
+{
+    int a, b;
+
+    if (n->kind == Q_PRED)
+        return n->cls;
+    a = classify(n->l);
+    b = n->r ? classify(n->r) : a;
+    n->cls = a > b ? a : b;
+    return n->cls;
+}
+
+static unsigned columns_needed(const struct qnode *n)
+{
+    if (!n)
+        return 0;
+    if (n->kind != Q_PRED)
+        return columns_needed(n->l) | columns_needed(n->r);
+    switch (n->field) {
+    case F_MODIFIED: return COL_MTIME;
+    case F_CREATED: return COL_CTIME;
+    case F_SIZE: return COL_SIZE;
+    case F_FILES: return COL_FILES;
+    case F_STATE: return COL_STATE;
+    }
+    return 0;
+}
+
+static int load_tags(struct query *q, struct qnode *n)
+{
+    if (!n)
+        return 0;
+    if (n->kind == Q_PRED && n->field == F_TAG) {
+        if (tags_load(q->state_dir, n->text, &n->bits) != 0) {
+            snprintf(q->err, sizeof(q->err), "cannot read tag '%s'", n->text);
+            return -1;
+        }
+        return 0;
+    }
+    if (load_tags(q, n->l) != 0)
+        return -1;
+    return load_tags(q, n->r);
+}
+
+static int add_conjuncts(struct query *q, struct qnode *n)
+{
+    struct qnode **c;
+
+    if (n->kind == Q_AND) {
+        if (add_conjuncts(q, n->l) != 0 || add_conjuncts(q, n->r) != 0)
+            return -1;
+        n->l = n->r = NULL;
+        node_free(n);
+        return 0;
+    }
+    c = realloc(q->conj, (q->nconj + 1) * sizeof(*c));
+    if (!c)
+        return -1;
+    q->conj = c;
+    q->conj[q->nconj++] = n;
+    return 0;
+}
+
+static uint64_t cost_of(const struct qnode *n)
+{
+    if (n->kind == Q_PRED && n->field == F_TAG)
+        return rb_cardinality(&n->bits);
+    if (n->kind == Q_NOT)
+        return UINT32_MAX;
+    return UINT32_MAX / 2;
+}
+
+static int cmp_conj(const void *a, const void *b)
+{
+    const struct qnode *x = *(struct qnode *const *)a;
+    const struct qnode *y = *(struct qnode *const *)b;
+    uint64_t cx, cy;
+
+    if (x->cls != y->cls)
+        return x->cls - y->cls;
+    cx = cost_of(x);
+    cy = cost_of(y);
+    return cx < cy ? -1 : cx > cy;
+}
+
+/* Bitmap-class subtree to a bitmap; the universe bounds NOT. */
+static int eval_bitmap(struct query *q, const struct qnode *n, struct rbitmap *out)
+{
+    struct rbitmap a, b;
+    int rc;
+
+    rb_init(out);
+    if (n->kind == Q_PRED)
+        return rb_or(out, &n->bits, out);
+    rb_init(&a);
+    rb_init(&b);
+    rc = eval_bitmap(q, n->l, &a);
+    if (rc == 0 && n->kind == Q_NOT)
+        rc = rb_not(out, &a, q->names.count);
+    else if (rc == 0 && (rc = eval_bitmap(q, n->r, &b)) == 0)
+        rc = n->kind == Q_AND ? rb_and(out, &a, &b) : rb_or(out, &a, &b);
+    rb_free(&a);
+    rb_free(&b);
+    return rc;
+}
+
+/* ---- evaluation ---- */
+
+static void walk_usage(int dirfd, int64_t *bytes, int64_t *files, int depth)
+{
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+
+    if (!d) {
+        close(dirfd);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode) && depth < 64) {
+            int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (fd >= 0)
+                walk_usage(fd, bytes, files, depth + 1);
+        } else if (S_ISREG(st.st_mode)) {
+            *bytes += st.st_size;
+            (*files)++;
+        }
+    }
+    closedir(d);
+}
+
+/* Fill the needed columns for ticket i of the block from the filesystem. */
+static void gather_fs(struct query *q, struct block *b, uint32_t i, int basefd,
+                      unsigned need)
+{
+    const char *name = ordmap_name(&q->names, b->ord[i]);
+    struct statx stx;
+
+    b->mtime[i] = b->ctime[i] = b->size[i] = b->files[i] = 0;
+    b->state[i] = TICKET_DELETED;
+    if (basefd < 0 || !name ||
+        statx(basefd, name, AT_SYMLINK_NOFOLLOW, STATX_MTIME | STATX_BTIME |
+              STATX_CTIME, &stx) != 0)
+        return;
+    b->state[i] = TICKET_OPEN;
+    b->mtime[i] = stx.stx_mtime.tv_sec;
+    b->ctime[i] = (stx.stx_mask & STATX_BTIME) ? stx.stx_btime.tv_sec
+                                              : stx.stx_ctime.tv_sec;
+    if (need & (COL_SIZE | COL_FILES)) {
+        int fd = openat(basefd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd >= 0)
+            walk_usage(fd, &b->size[i], &b->files[i], 0);
+    }
+}
+
+/*
+ * Fill the needed columns for the block: rows the metadata store knows
+ * are gathered straight from its arrays, anything else from the filesystem.
+ */
+static void gather(struct query *q, struct block *b, unsigned need)
+{
+    const struct meta *m = &q->meta;
+    uint32_t i, n = q->have_meta ? m->count : 0;
+    int basefd = -1;
+
+    for (i = 0; i < b->n; i++) {
+        uint32_t ord = b->ord[i];
+
+        if (ord < n && m->ctime[ord] != 0) {
+            b->mtime[i] = m->mtime[ord];
+            b->ctime[i] = m->ctime[ord];
+            b->size[i] = m->size[ord];
+            b->files[i] = m->files[ord];
+            b->state[i] = m->state[ord];
+            continue;
+        }
+        if (basefd < 0)
+            basefd = open(q->base, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        gather_fs(q, b, i, basefd, need);
+    }
+    if (basefd >= 0)
+        close(basefd);
+}
+
+/* Branch-free comparisons so the loops vectorize. */
+static void cmp_i64(const int64_t *v, uint32_t n, int op, int64_t k, uint8_t *m)
+{
+    uint32_t i;
+
+    switch (op) {
+    case OP_LT: for (i = 0; i < n; i++) m[i] = v[i] < k; break;
+    case OP_LE: for (i = 0; i < n; i++) m[i] = v[i] <= k; break;
+    case OP_GT: for (i = 0; i < n; i++) m[i] = v[i] > k; break;
+    case OP_GE: for (i = 0; i < n; i++) m[i] = v[i] >= k; break;
+    case OP_EQ: for (i = 0; i < n; i++) m[i] = v[i] == k; break;
+    default:    for (i = 0; i < n; i++) m[i] = v[i] != k; break;
+    }
+}
+
+static int has_match(struct query *q, const char *name, const char *glob)
+{
+    char path[8192];
+    struct dirent *de;
+    DIR *d;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", q->base, name);
+    d = opendir(path);
+    if (!d)
+        return 0;
+    while (!found && (de = readdir(d)) != NULL)
+        found = fnmatch(glob, de->d_name, 0) == 0;
+    closedir(d);
+    return found;
+}
+
+static void eval_block(struct query *q, const struct qnode *n,
+                       const struct block *b, uint8_t *m)
+{
+    uint8_t tmp[QUERY_BLOCK];
+    uint32_t i;
+
+    switch (n->kind) {
+    case Q_AND:
+        eval_block(q, n->l, b, m);
+        eval_block(q, n->r, b, tmp);
+        for (i = 0; i < b->n; i++)
+            m[i] &= tmp[i];
+        return;
+    case Q_OR:
+        eval_block(q, n->l, b, m);
+        eval_block(q, n->r, b, tmp);
+        for (i = 0; i < b->n; i++)
+            m[i] |= tmp[i];
+        return;
+    case Q_NOT:
+        eval_block(q, n->l, b, m);
+        for (i = 0; i < b->n; i++)
+            m[i] ^= 1;
+        return;
+    }
+
+    switch (n->field) {
+    case F_TAG:
+        for (i = 0; i < b->n; i++)
+            m[i] = (uint8_t)rb_contains(&n->bits, b->ord[i]);
+        break;
+    case F_PREFIX:
+        for (i = 0; i < b->n; i++) {
+            const char *name = ordmap_name(&q->names, b->ord[i]);
+            size_t len = strlen(n->text);
+
+            m[i] = name && !strncmp(name, n->text, len) &&
+                   (isdigit((unsigned char)name[len]));
+        }
+        break;
+    case F_STATE:
+        for (i = 0; i < b->n; i++)
+            m[i] = b->state[i] == n->value;
+        break;
+    case F_HAS:
+        for (i = 0; i < b->n; i++) {
+            const char *name = ordmap_name(&q->names, b->ord[i]);
+
+            m[i] = name && has_match(q, name, n->text);
+        }
+        break;
+    case F_MODIFIED: cmp_i64(b->mtime, b->n, n->op, n->value, m); break;
+    case F_CREATED:  cmp_i64(b->ctime, b->n, n->op, n->value, m); break;
+    case F_SIZE:     cmp_i64(b->size, b->n, n->op, n->value, m); break;
+    case F_FILES:    cmp_i64(b->files, b->n, n->op, n->value, m); break;
+    }
+}
+
+/* Keep only the rows whose mask byte is set. */
+static void compact(struct block *b, const uint8_t *m, unsigned cols)
+{
+    uint32_t i, j = 0;
+
+    for (i = 0; i < b->n; i++) {
+        if (!m[i])
+            continue;
+        b->ord[j] = b->ord[i];
+        if (cols & COL_MTIME) b->mtime[j] = b->mtime[i];
+        if (cols & COL_CTIME) b->ctime[j] = b->ctime[i];
+        if (cols & COL_SIZE) b->size[j] = b->size[i];
+        if (cols & COL_FILES) b->files[j] = b->files[i];
+        if (cols & COL_STATE) b->state[j] = b->state[i];
+        j++;
+    }
+    b->n = j;
+}
+
+static void run_block(struct query *q, struct block *b, int first, unsigned cols,
+                      FILE *out)
+{
+    uint8_t m[QUERY_BLOCK];
+    int i;
+
+    if (cols)
+        gather(q, b, cols);
+    for (i = first; i < q->nconj && b->n; i++) {
+        eval_block(q, q->conj[i], b, m);
+        compact(b, m, cols);
+    }
+    for (i = 0; i < (int)b->n; i++) {
+        const char *name = ordmap_name(&q->names, b->ord[i]);
+
+        if (name) {
+            fputs(name, out);
+            fputc('\n', out);
+        }
+    }
+    fflush(out);
+}
+
+int query_run(const char *base, const char *state_dir, const char *expr, FILE *out)
+{
+    struct query q;
+    struct qnode *root;
+    struct rbitmap cand;
+    struct block *b = NULL;
+    unsigned cols = 0;
+    int first = 0, rc = -1, i;
+
+    memset(&q, 0, sizeof(q));
+    q.base = base;
+    q.state_dir = state_dir;
+    q.p = expr;
+    q.now = time(NULL);
+    rb_init(&cand);
+
+    root = parse_or(&q);
+    skip_ws(&q);
+    if (root && *q.p) {
+        snprintf(q.err, sizeof(q.err), "unexpected '%s'", q.p);
+        node_free(root);
+        root = NULL;
+    }
+    if (!root) {
+        fprintf(stderr, "query: %s\n", q.err[0] ? q.err : "out of memory");
+        return -1;
+    }
+    if (ordmap_open(&q.names, state_dir) != 0) {
+        fprintf(stderr, "query: cannot read the ticket registry\n");
+        node_free(root);
+        return -1;
+    }
+    q.have_meta = meta_open(&q.meta, state_dir) == 0;
+    classify(root);
+    if (load_tags(&q, root) != 0) {
+        fprintf(stderr, "query: %s\n", q.err);
+        node_free(root);
+        goto out;
+    }
+    if (add_conjuncts(&q, root) != 0) {
+        fprintf(stderr, "query: out of memory\n");
+        goto out;
+    }
+    qsort(q.conj, q.nconj, sizeof(*q.conj), cmp_conj);
+
+    /* Stage 1: intersect the pure-bitmap conjuncts into a candidate set. */
+    while (first < q.nconj && q.conj[first]->cls == CLS_BITMAP) {
+        struct rbitmap r;
+
+        if (eval_bitmap(&q, q.conj[first], &r) != 0)
+            goto out;
+        if (first == 0) {
+            rb_free(&cand);
+            cand = r;
+        } else {
+            rb_and(&cand, &cand, &r);
+            rb_free(&r);
+        }
+        first++;
+    }
+    for (i = first; i < q.nconj; i++)
+        cols |= columns_needed(q.conj[i]);
+
+    /* Stages 2 and 3: blocks of candidates through the remaining conjuncts. */
+    b = malloc(sizeof(*b));
+    if (!b)
+        goto out;
+    if (first > 0) {
+        uint32_t from = 0;
+
+        while ((b->n = rb_extract(&cand, from, b->ord, QUERY_BLOCK)) > 0) {
+            from = b->ord[b->n - 1] + 1;
+            run_block(&q, b, first, cols, out);
+            if (from == 0)
+                break;
+        }
+    } else {
+        uint32_t ord = 0;
+
+        while (ord < q.names.count) {
+            for (b->n = 0; b->n < QUERY_BLOCK && ord < q.names.count; ord++)
+                b->ord[b->n++] = ord;
+            run_block(&q, b, first, cols, out);
+        }
+    }
+    rc = 0;
+
+out:
+    for (i = 0; i < q.nconj; i++)
+        node_free(q.conj[i]);
+    free(q.conj);
+    free(b);
+    rb_free(&cand);
+    if (q.have_meta)
+        meta_close(&q.meta);
+    ordmap_close(&q.names);
+    return rc;
+}
@@ -0,0 +1,28 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+
+/*
+ * query: boolean expressions over ticket attributes.
+ *
+ *   tag:vpn and modified<30d and size>1G and not state:archived
+ *
+ * Predicates:
+ *   tag:NAME  prefix:INC  state:open|closed|archived|deleted  has:GLOB
+ *   modified|created OP (30d | 12h | 2w | YYYY-MM-DD)
+ *   size OP N[K|M|G|T]   files OP N
+ * OP is one of < <= > >= = !=. A duration compares age ("modified<30d" is
+ * "changed less than 30 days ago"); a date compares the timestamp itself.
+ * Combine with and, or, not and parentheses.
+ *
+ * The expression is split into top-level conjuncts and run cheapest first:
+ * tag bitmaps pick the candidates, per-ticket columns (from the metadata
+ * store) are filtered a block at a time, and only the survivors reach
+ * predicates that touch the filesystem.
+ */
+
+int query_run(const char *base, const char *state_dir, const char *expr,
+              FILE *out);
+
+#endif
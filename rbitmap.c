@@ -0,0 +1,659 @@
+#include "rbitmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RB_MAGIC "TFSRBM1"
+
+struct rb_file_header {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct rb_file_entry {
+    uint16_t key;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t card;
+    uint64_t offset;
+};
+
+void rb_init(struct rbitmap *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+static void container_free(struct rb_container *c)
+{
+    if (c->owned)
+        free(c->u.array);
+}
+
+void rb_free(struct rbitmap *b)
+{
+    uint32_t i;
+
+    for (i = 0; i < b->n; i++)
+        container_free(&b->c[i]);
+    free(b->c);
+    if (b->map)
+        munmap(b->map, b->map_len);
+    rb_init(b);
+}
+
+/* Index of the container with key, or -(insertion point) - 1. */
+static int64_t find_key(const struct rbitmap *b, uint16_t key)
+{
+    int64_t lo = 0, hi = (int64_t)b->n - 1;
+
+    while (lo <= hi) {
+        int64_t mid = (lo + hi) >> 1;
+
+        if (b->c[mid].key < key)
+            lo = mid + 1;
+        else if (b->c[mid].key > key)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+    return -lo - 1;
+}
+
+static int reserve(struct rbitmap *b, uint32_t n)
+{
+    struct rb_container *c;
+    uint32_t cap;
+
+    if (n <= b->cap)
+        return 0;
+    cap = b->cap ? b->cap * 2 : 8;
+    while (cap < n)
+        cap *= 2;
+    c = realloc(b->c, cap * sizeof(*c));
+    if (!c)
+        return -1;
+    b->c = c;
+    b->cap = cap;
+    return 0;
+}
+
+static int array_find(const uint16_t *a, uint32_t n, uint16_t v)
+{
+    int32_t lo = 0, hi = (int32_t)n - 1;
+
+    while (lo <= hi) {
+        int32_t mid = (lo + hi) >> 1;
+
+        if (a[mid] < v)
+            lo = mid + 1;
+        else if (a[mid] > v)
+            hi = mid - 1;
+        else
+            return mid;
+    }
+    return -lo - 1;
+}
+
+/* Take private ownership of mapped data before the first write. */
+static int make_owned(struct rb_container *c, uint32_t min_cap)
+{
+    if (c->type == RB_BITSET) {
+        uint64_t *bits;
+
+        if (c->owned)
+            return 0;
+        bits = malloc(RB_WORDS * sizeof(uint64_t));
+        if (!bits)
+            return -1;
+        memcpy(bits, c->u.bits, RB_WORDS * sizeof(uint64_t));
+        c->u.bits = bits;
+        c->owned = 1;
+        return 0;
+    }
+    if (!c->owned || c->cap < min_cap) {
+        uint32_t cap = c->cap > 4 ? c->cap : 4;
+        uint16_t *a;
+
+        while (cap < min_cap)
+            cap *= 2;
+        if (cap > RB_ARRAY_MAX)
+            cap = RB_ARRAY_MAX;
+        if (c->owned) {
+            a = realloc(c->u.array, cap * sizeof(uint16_t));
+        } else {
+            a = malloc(cap * sizeof(uint16_t));
+            if (a)
+                memcpy(a, c->u.array, c->card * sizeof(uint16_t));
+        }
+        if (!a)
+            return -1;
+        c->u.array = a;
+        c->cap = cap;
+        c->owned = 1;
+    }
+    return 0;
+}
+
+static int array_to_bitset(struct rb_container *c)
+{
+    uint64_t *bits = calloc(RB_WORDS, sizeof(uint64_t));
+    uint32_t i;
+
+    if (!bits)
+        return -1;
+    for (i = 0; i < c->card; i++)
+        bits[c->u.array[i] >> 6] |= 1ULL << (c->u.array[i] & 63);
+    container_free(c);
+    c->u.bits = bits;
+    c->type = RB_BITSET;
+    c->owned = 1;
+    c->cap = 0;
+    return 0;
+}
+
+static int bitset_to_array(struct rb_container *c)
+{
+    uint16_t *a = malloc((c->card ? c->card : 1) * sizeof(uint16_t));
+    uint32_t w, n = 0;
+
+    if (!a)
+        return -1;
+    for (w = 0; w < RB_WORDS; w++) {
+        uint64_t word = c->u.bits[w];
+
+        while (word) {
+            a[n++] = (uint16_t)(w * 64 + __builtin_ctzll(word));
+            word &= word - 1;
+        }
+    }
+    container_free(c);
+    c->u.array = a;
+    c->type = RB_ARRAY;
+    c->owned = 1;
+    c->cap = c->card ? c->card : 1;
+    return 0;
+}
+
+int rb_add(struct rbitmap *b, uint32_t v)
+{
+    uint16_t key = v >> 16, low = v & 0xffff;
+    int64_t i = find_key(b, key);
+    struct rb_container *c;
+
+    if (i < 0) {
+        i = -i - 1;
+        if (reserve(b, b->n + 1) != 0)
+            return -1;
+        memmove(&b->c[i + 1], &b->c[i], (b->n - i) * sizeof(*b->c));
+        b->n++;
+        c = &b->c[i];
+        memset(c, 0, sizeof(*c));
+        c->key = key;
+        c->type = RB_ARRAY;
+    }
+    c = &b->c[i];
+
+    if (c->type == RB_BITSET) {
+        uint64_t bit = 1ULL << (low & 63);
+
+        if (c->u.bits[low >> 6] & bit)
+            return 0;
+        if (make_owned(c, 0) != 0)
+            return -1;
+        c->u.bits[low >> 6] |= bit;
+        c->card++;
+        return 0;
+    }
+
+    {
+        int pos = c->card ? array_find(c->u.array, c->card, low) : -1;
+
+        if (pos >= 0)
+            return 0;
+        if (c->card == RB_ARRAY_MAX) {
+            if (array_to_bitset(c) != 0)
+                return -1;
+            return rb_add(b, v);
+        }
+        pos = -pos - 1;
+        if (make_owned(c, c->card + 1) != 0)
+            return -1;
+        memmove(&c->u.array[pos + 1], &c->u.array[pos],
+                (c->card - pos) * sizeof(uint16_t));
+        c->u.array[pos] = low;
+        c->card++;
+    }
+    return 0;
+}
+
+int rb_remove(struct rbitmap *b, uint32_t v)
+{
+    uint16_t low = v & 0xffff;
+    int64_t i = find_key(b, v >> 16);
+    struct rb_container *c;
+
+    if (i < 0)
+        return 0;
+    c = &b->c[i];
+    if (c->type == RB_BITSET) {
+        uint64_t bit = 1ULL << (low & 63);
+
+        if (!(c->u.bits[low >> 6] & bit))
+            return 0;
+        if (make_owned(c, 0) != 0)
+            return -1;
+        c->u.bits[low >> 6] &= ~bit;
+        if (--c->card <= RB_ARRAY_MAX / 2)
+            return bitset_to_array(c);
+        return 0;
+    } else {
+        int pos = array_find(c->u.array, c->card, low);
+
+        if (pos < 0)
+            return 0;
+        if (make_owned(c, c->card) != 0)
+            return -1;
+        memmove(&c->u.array[pos], &c->u.array[pos + 1],
+                (c->card - pos - 1) * sizeof(uint16_t));
+        c->card--;
+    }
+    if (c->card == 0) {
+        container_free(c);
+        memmove(&b->c[i], &b->c[i + 1], (b->n - i - 1) * sizeof(*b->c));
+        b->n--;
+    }
+    return 0;
+}
+
+int rb_contains(const struct rbitmap *b, uint32_t v)
+{
+    uint16_t low = v & 0xffff;
+    int64_t i = find_key(b, v >> 16);
+    const struct rb_container *c;
+
+    if (i < 0)
+        return 0;
+    c = &b->c[i];
+    if (c->type == RB_BITSET)
+        return (c->u.bits[low >> 6] >> (low & 63)) & 1;
+    return array_find(c->u.array, c->card, low) >= 0;
+}
+
+uint64_t rb_cardinality(const struct rbitmap *b)
+{
+    uint64_t n = 0;
+    uint32_t i;
+
+    for (i = 0; i < b->n; i++)
+        n += b->c[i].card;
+    return n;
+}
+
+/* Set operations work on a scratch 1024-word bitset per key. */
+
+static void load_bits(uint64_t *dst, const struct rb_container *c)
+{
+    uint32_t i;
+
+    if (!c) {
+        memset(dst, 0, RB_WORDS * sizeof(uint64_t));
+    } else if (c->type == RB_BITSET) {
+        memcpy(dst, c->u.bits, RB_WORDS * sizeof(uint64_t));
+    } else {
+        memset(dst, 0, RB_WORDS * sizeof(uint64_t));
+        for (i = 0; i < c->card; i++)
+            dst[c->u.array[i] >> 6] |= 1ULL << (c->u.array[i] & 63);
+    }
+}
+
+static int append_bits(struct rbitmap *out, uint16_t key, const uint64_t *bits)
+{
+    struct rb_container *c;
+    uint32_t w, card = 0;
+
+    for (w = 0; w < RB_WORDS; w++)
+        card += __builtin_popcountll(bits[w]);
+    if (card == 0)
+        return 0;
+    if (reserve(out, out->n + 1) != 0)
+        return -1;
+    c = &out->c[out->n];
+    memset(c, 0, sizeof(*c));
+    c->key = key;
+    c->card = card;
+    c->type = RB_BITSET;
+    c->owned = 1;
+    c->u.bits = malloc(RB_WORDS * sizeof(uint64_t));
+    if (!c->u.bits)
+        return -1;
+    memcpy(c->u.bits, bits, RB_WORDS * sizeof(uint64_t));
+    out->n++;
+    if (card <= RB_ARRAY_MAX)
+        return bitset_to_array(c);
+    return 0;
+}
+
+/* Array-array intersection without going through a bitset. */
+static int append_array_and(struct rbitmap *out, const struct rb_container *x,
+                            const struct rb_container *y)
+{
+    struct rb_container *c;
+    uint32_t i = 0, j = 0, n = 0;
+    uint16_t *a;
+
+    a = malloc((x->card < y->card ? x->card : y->card) * sizeof(uint16_t) + 2);
+    if (!a)
+        return -1;
+    while (i < x->card && j < y->card) {
+        if (x->u.array[i] < y->u.array[j])
+            i++;
+        else if (x->u.array[i] > y->u.array[j])
+            j++;
+        else {
+            a[n++] = x->u.array[i];
+            i++;
+            j++;
+        }
+    }
+    if (n == 0 || reserve(out, out->n + 1) != 0) {
+        free(a);
+        return n == 0 ? 0 : -1;
+    }
+    c = &out->c[out->n++];
+    memset(c, 0, sizeof(*c));
+    c->key = x->key;
+    c->type = RB_ARRAY;
+    c->owned = 1;
+    c->card = n;
+    c->cap = n;
+    c->u.array = a;
+    return 0;
+}
+
+enum { OP_AND, OP_OR, OP_ANDNOT };
+
+static int binop(struct rbitmap *out, const struct rbitmap *a,
+                 const struct rbitmap *b, int op)
+{
+    uint64_t x[RB_WORDS], y[RB_WORDS];
+    struct rbitmap r;
+    uint32_t i = 0, j = 0, w;
+
+    rb_init(&r);
+    while (i < a->n || j < b->n) {
+        const struct rb_container *ca = NULL, *cb = NULL;
+        uint16_t key;
+
+        if (j >= b->n || (i < a->n && a->c[i].key < b->c[j].key)) {
+            ca = &a->c[i++];
+        } else if (i >= a->n || b->c[j].key < a->c[i].key) {
+            cb = &b->c[j++];
+        } else {
+            ca = &a->c[i++];
+            cb = &b->c[j++];
+        }
+        key = ca ? ca->key : cb->key;
+
+        if (op == OP_AND && (!ca || !cb))
+            continue;
+        if (op == OP_ANDNOT && !ca)
+            continue;
+        if (op == OP_AND && ca->type == RB_ARRAY && cb->type == RB_ARRAY) {
+            if (append_array_and(&r, ca, cb) != 0)
+                goto fail;
+            continue;
+        }
+
+        load_bits(x, ca);
+        load_bits(y, cb);
+        for (w = 0; w < RB_WORDS; w++) {
+            if (op == OP_AND)
+                x[w] &= y[w];
+            else if (op == OP_OR)
+                x[w] |= y[w];
+            else
+                x[w] &= ~y[w];
+        }
+        if (append_bits(&r, key, x) != 0)
+            goto fail;
+    }
+    rb_free(out);
+    *out = r;
+    return 0;
+
+fail:
+    rb_free(&r);
+    return -1;
+}
+
+int rb_and(struct rbitmap *out, const struct rbitmap *a, const struct rbitmap *b)
+{
+    return binop(out, a, b, OP_AND);
+}
+
+int rb_or(struct rbitmap *out, const struct rbitmap *a, const struct rbitmap *b)
+{
+    return binop(out, a, b, OP_OR);
+}
+
+int rb_andnot(struct rbitmap *out, const struct rbitmap *a, const struct rbitmap *b)
+{
+    return binop(out, a, b, OP_ANDNOT);
+}
+
+int rb_not(struct rbitmap *out, const struct rbitmap *a, uint32_t universe)
+{
+    uint64_t x[RB_WORDS];
+    struct rbitmap r;
+    uint32_t key, i = 0, w;
+    uint32_t nkeys = (universe + 0xffff) >> 16;
+
+    rb_init(&r);
+    for (key = 0; key < nkeys; key++) {
+        const struct rb_container *c = NULL;
+        uint32_t limit = universe - (key << 16);
+
+        while (i < a->n && a->c[i].key < key)
+            i++;
+        if (i < a->n && a->c[i].key == key)
+            c = &a->c[i];
+        load_bits(x, c);
+        for (w = 0; w < RB_WORDS; w++)
+            x[w] = ~x[w];
+        if (limit < 65536) {
+            w = limit >> 6;
+            if (limit & 63)
+                x[w++] &= (1ULL << (limit & 63)) - 1;
+            for (; w < RB_WORDS; w++)
+                x[w] = 0;
+        }
+        if (append_bits(&r, (uint16_t)key, x) != 0) {
+            rb_free(&r);
+            return -1;
+        }
+    }
+    rb_free(out);
+    *out = r;
+    return 0;
+}
+
+int rb_foreach(const struct rbitmap *b, int (*fn)(uint32_t v, void *arg), void *arg)
+{
+    uint32_t i, j, w;
+
+    for (i = 0; i < b->n; i++) {
+        const struct rb_container *c = &b->c[i];
+        uint32_t high = (uint32_t)c->key << 16;
+
+        if (c->type == RB_ARRAY) {
+            for (j = 0; j < c->card; j++)
+                if (fn(high | c->u.array[j], arg))
+                    return 1;
+            continue;
+        }
+        for (w = 0; w < RB_WORDS; w++) {
+            uint64_t word = c->u.bits[w];
+
+            while (word) {
+                if (fn(high | (w * 64 + __builtin_ctzll(word)), arg))
+                    return 1;
+                word &= word - 1;
+            }
+        }
+    }
+    return 0;
+}
+
+size_t rb_extract(const struct rbitmap *b, uint32_t from, uint32_t *out, size_t n)
+{
+    size_t got = 0;
+    uint32_t i, j, w;
+
+    for (i = 0; i < b->n && got < n; i++) {
+        const struct rb_container *c = &b->c[i];
+        uint32_t high = (uint32_t)c->key << 16;
+
+        if (high + 0xffff < from)
+            continue;
+        if (c->type == RB_ARRAY) {
+            for (j = 0; j < c->card && got < n; j++)
+                if ((high | c->u.array[j]) >= from)
+                    out[got++] = high | c->u.array[j];
+            continue;
+        }
+        for (w = 0; w < RB_WORDS && got < n; w++) {
+            uint64_t word = c->u.bits[w];
+
+            while (word && got < n) {
+                uint32_t v = high | (w * 64 + __builtin_ctzll(word));
+
+                if (v >= from)
+                    out[got++] = v;
+                word &= word - 1;
+            }
+        }
+    }
+    return got;
+}
+
+static size_t container_bytes(const struct rb_container *c)
+{
+    if (c->type == RB_BITSET)
+        return RB_WORDS * sizeof(uint64_t);
+    return (c->card * sizeof(uint16_t) + 7) & ~(size_t)7;
+}
+
+int rb_save(const struct rbitmap *b, const char *path)
+{
+    struct rb_file_header h;
+    struct rb_file_entry *dir;
+    char tmp[4200];
+    uint64_t off;
+    uint32_t i;
+    FILE *f;
+
+    dir = calloc(b->n ? b->n : 1, sizeof(*dir));
+    if (!dir)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RB_MAGIC, sizeof(h.magic));
+    h.count = b->n;
+    off = sizeof(h) + (uint64_t)b->n * sizeof(*dir);
+    for (i = 0; i < b->n; i++) {
+        dir[i].key = b->c[i].key;
+        dir[i].type = b->c[i].type;
+        dir[i].card = b->c[i].card;
+        dir[i].offset = off;
+        off += container_bytes(&b->c[i]);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        free(dir);
+        return -1;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(dir, sizeof(*dir), b->n, f);
+    for (i = 0; i < b->n; i++) {
+        static const char zero[8];
+        const struct rb_container *c = &b->c[i];
+        size_t len = c->type == RB_BITSET ? RB_WORDS * sizeof(uint64_t)
+                                          : c->card * sizeof(uint16_t);
+
+        fwrite(c->u.array, 1, len, f);
+        fwrite(zero, 1, container_bytes(c) - len, f);
+    }
+    free(dir);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        remove(tmp);
+        return -1;
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int rb_map(struct rbitmap *b, const char *path)
+{
+    const struct rb_file_header *h;
+    const struct rb_file_entry *dir;
+    struct stat st;
+    uint32_t i;
+    void *p;
+    int fd;
+
+    rb_init(b);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    b->map = p;
+    b->map_len = st.st_size;
+
+    h = p;
+    if (memcmp(h->magic, RB_MAGIC, sizeof(h->magic)) != 0 ||
+        sizeof(*h) + (uint64_t)h->count * sizeof(*dir) > b->map_len)
+        goto corrupt;
+    dir = (const struct rb_file_entry *)(h + 1);
+    if (reserve(b, h->count) != 0)
+        goto corrupt;
+    for (i = 0; i < h->count; i++) {
+        struct rb_container *c = &b->c[i];
+
+        memset(c, 0, sizeof(*c));
+        c->key = dir[i].key;
+        c->type = dir[i].type;
+        c->card = dir[i].card;
+        if ((c->type != RB_ARRAY && c->type != RB_BITSET) ||
+            (c->type == RB_ARRAY && c->card > RB_ARRAY_MAX) ||
+            dir[i].offset + container_bytes(c) > b->map_len)
+            goto corrupt;
+        c->u.array = (uint16_t *)((char *)p + dir[i].offset);
+        c->cap = c->card;
+        b->n++;
+    }
+    return 0;
+
+corrupt:
+    rb_free(b);
+    errno = EINVAL;
+    return -1;
+}
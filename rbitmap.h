@@ -0,0 +1,63 @@
+#ifndef RBITMAP_H
+#define RBITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Roaring-style compressed bitmap over 32-bit ticket ordinals. The value
+ * space is cut into 65536-wide chunks keyed by the high 16 bits; each chunk
+ * is a sorted uint16 array while sparse and a 1024-word bitmap once it
+ * holds more than RB_ARRAY_MAX values.
+ *
+ * A bitmap loaded with rb_map() points straight into the mapped file and
+ * copies a container only when it is first modified.
+ */
+
+#define RB_ARRAY_MAX 4096
+#define RB_WORDS 1024
+
+enum { RB_ARRAY = 1, RB_BITSET = 2 };
+
+struct rb_container {
+    uint16_t key;
+    uint8_t type;
+    uint8_t owned;          /* data is malloc'd rather than mapped */
+    uint32_t card;
+    uint32_t cap;           /* array capacity when owned */
+    union {
+        uint16_t *array;
+        uint64_t *bits;
+    } u;
+};
+
+struct rbitmap {
+    struct rb_container *c;
+    uint32_t n, cap;
+    void *map;
+    size_t map_len;
+};
+
+void rb_init(struct rbitmap *b);
+void rb_free(struct rbitmap *b);
+
+int rb_add(struct rbitmap *b, uint32_t v);
+int rb_remove(struct rbitmap *b, uint32_t v);
+int rb_contains(const struct rbitmap *b, uint32_t v);
+uint64_t rb_cardinality(const struct rbitmap *b);
+
+int rb_and(struct rbitmap *out, const struct rbitmap *a, const struct rbitmap *b);
+int rb_or(struct rbitmap *out, const struct rbitmap *a, const struct rbitmap *b);
+int rb_andnot(struct rbitmap *out, const struct rbitmap *a, const struct rbitmap *b);
+/* Complement within [0, universe). */
+int rb_not(struct rbitmap *out, const struct rbitmap *a, uint32_t universe);
+
+/* Calls fn for every value in ascending order; stops when fn returns non-zero. */
+int rb_foreach(const struct rbitmap *b, int (*fn)(uint32_t v, void *arg), void *arg);
+/* Fills up to n values starting at the first value >= from; returns count. */
+size_t rb_extract(const struct rbitmap *b, uint32_t from, uint32_t *out, size_t n);
+
+int rb_save(const struct rbitmap *b, const char *path);
+int rb_map(struct rbitmap *b, const char *path);
+
+#endif
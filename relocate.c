@@ -0,0 +1,1042 @@
+#include "relocate.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+#include "iosched.h"
+#include "meta.h"
+#include "mirror.h"
+#include "ticket.h"
+
+#define RELOCATE_THREADS 8
+#define RELOCATE_QUEUE 1024     /* jobs between the walker and the pool */
+#define CHECKPOINT_MS 5000
+#define XATTR_BUF 65536
+
+struct top {                /* a top-level entry; checkpointed when refs reach 0 */
+    int refs;
+    int failed;
+    char name[];
+};
+
+struct rfile {
+    struct top *top;
+    struct stat st;
+    int remaining;          /* chunks still being copied */
+    int failed;
+    char path[];
+};
+
+struct rjob {
+    struct rfile *f;
+    int64_t off, len;       /* len < 0: the whole file */
+};
+
+struct rdir {
+    char *path;
+    struct stat st;
+};
+
+struct hardlink {
+    char *path, *first;
+};
+
+struct inode {
+    dev_t dev;
+    ino_t ino;
+    char *path;             /* where it was first copied; NULL for a free slot */
+};
+
+struct relocator {
+    int srcfd, dstfd, ckpt_fd, pend_fd;
+    struct iosched sched;
+    struct relocate_stats *st;
+
+    pthread_mutex_t lock;
+    pthread_cond_t more, room;
+    struct rjob *ring[RELOCATE_QUEUE];
+    size_t head, count;
+    int stopping;
+    pthread_t *threads;
+    int nthreads;
+    struct top **finished;  /* waiting for the next checkpoint */
+    size_t nfinished, fcap;
+
+    /* Walker only. */
+    int skip_done, prune;
+    char **done;
+    size_t ndone;
+    struct rdir *dirs;
+    size_t ndirs, dcap;
+    struct hardlink *links;
+    size_t nlinks, lcap;
+    struct inode *inodes;
+    size_t ninodes, icap;
+    char *pending;          /* link and directory records not yet in the checkpoint */
+    size_t npending, pcap;
+    int force_state;        /* copy .tfs even where it looks unchanged */
+    struct timespec last_commit;
+};
+
+static void count(uint64_t *c, uint64_t n)
+{
+    __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+static void fail(struct relocator *r, struct top *t, const char *path, const char *what)
+{
+    fprintf(stderr, "relocate: could not %s %s: %s\n", what, path, strerror(errno));
+    count(&r->st->failed, 1);
+    if (t)
+        __atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void top_release(struct relocator *r, struct top *t)
+{
+    if (!t || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (__atomic_load_n(&t->failed, __ATOMIC_RELAXED)) {
+        free(t);
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (r->nfinished == r->fcap) {
+        size_t cap = r->fcap ? r->fcap * 2 : 256;
+        struct top **v = realloc(r->finished, cap * sizeof(*v));
+
+        if (!v) {
+            pthread_mutex_unlock(&r->lock);
+            free(t);
+            return;
+        }
+        r->finished = v;
+        r->fcap = cap;
+    }
+    r->finished[r->nfinished++] = t;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Record finished entries once the data behind them is on disk. */
+static void commit(struct relocator *r)
+{
+    struct top **v;
+    size_t n, i;
+
+    pthread_mutex_lock(&r->lock);
+    v = r->finished;
+    n = r->nfinished;
+    r->finished = NULL;
+    r->nfinished = r->fcap = 0;
+    pthread_mutex_unlock(&r->lock);
+    clock_gettime(CLOCK_MONOTONIC, &r->last_commit);
+    /*
+     * Links and directory attributes are only applied once the pass is
+     * over; they reach the checkpoint first so a resumed run still does
+     * them for entries it skips.
+     */
+    if (r->npending) {
+        if (write(r->pend_fd, r->pending, r->npending) != (ssize_t)r->npending ||
+            fdatasync(r->pend_fd) != 0) {
+            fprintf(stderr, "relocate: could not write the checkpoint\n");
+            for (i = 0; i < n; i++)
+                free(v[i]);
+            free(v);
+            return;
+        }
+        r->npending = 0;
+    }
+    if (n == 0) {
+        free(v);
+        return;
+    }
+    syncfs(r->dstfd);
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(v[i]->name);
+
+        v[i]->name[len] = '\n';
+        if (write(r->ckpt_fd, v[i]->name, len + 1) != (ssize_t)(len + 1))
+            fprintf(stderr, "relocate: could not write the checkpoint\n");
+        free(v[i]);
+    }
+    fdatasync(r->ckpt_fd);
+    free(v);
+}
+
+static int copy_xattrs(int in, int out)
+{
+    char *names = malloc(XATTR_BUF), *value = malloc(XATTR_BUF), *p;
+    ssize_t n, v;
+    int rc = 0;
+
+    if (!names || !value) {
+        rc = -1;
+        goto out;
+    }
+    n = flistxattr(in, names, XATTR_BUF);
+    if (n < 0) {
+        rc = errno == ENOTSUP ? 0 : -1;
+        goto out;
+    }
+    for (p = names; p < names + n; p += strlen(p) + 1) {
+        v = fgetxattr(in, p, value, XATTR_BUF);
+        if (v < 0) {
+            rc = -1;
+            break;
+        }
+        /* security.* and trusted.* need privileges the caller may not have. */
+        if (fsetxattr(out, p, value, v, 0) != 0 && errno != ENOTSUP && errno != EPERM) {
+            rc = -1;
+            break;
+        }
+    }
+out:
+    free(names);
+    free(value);
+    return rc;
+}
+
+/* Owner, mode, xattrs and times, in the order that keeps each one. */
+static int copy_attrs(int in, int out, const struct stat *st)
+{
+    struct timespec ts[2];
+
+    ts[0] = st->st_atim;
+    ts[1] = st->st_mtim;
+    if (fchown(out, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+        return -1;
+    if (fchmod(out, st->st_mode & 07777) != 0 || copy_xattrs(in, out) != 0)
+        return -1;
+    return futimens(out, ts);
+}
+
+static void part_path(const char *path, char *out, size_t n)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash)
+        snprintf(out, n, "%.*s/.%s.tfs-part", (int)(slash - path), path, slash + 1);
+    else
+        snprintf(out, n, ".%s.tfs-part", path);
+}
+
+static int remove_path(int at, const char *path)
+{
+    int fd;
+
+    if (unlinkat(at, path, 0) == 0 || errno == ENOENT)
+        return 0;
+    fd = openat(at, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        DIR *d = fdopendir(fd);
+        struct dirent *de;
+
+        if (!d) {
+            close(fd);
+            return -1;
+        }
+        while ((de = readdir(d)) != NULL)
+            if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+                remove_path(dirfd(d), de->d_name);
+        closedir(d);
+    }
+    return unlinkat(at, path, AT_REMOVEDIR) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+static void copy_job(struct relocator *r, struct rjob *j)
+{
+    struct rfile *f = j->f;
+    char part[PATH_MAX + 32];
+    uint64_t copied = 0;
+    int in, out = -1, ok = 0;
+
+    part_path(f->path, part, sizeof(part));
+    iosched_bg_throttle(&r->sched, j->len < 0 ? (uint64_t)f->st.st_size : (uint64_t)j->len);
+    in = openat(r->srcfd, f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in >= 0)
+        out = openat(r->dstfd, part,
+                     j->len < 0 ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_WRONLY | O_CLOEXEC,
+                     0600);
+    if (out >= 0)
+        ok = mirror_copy_range(in, out, j->len < 0 ? 0 : j->off, j->len, &copied) == 0;
+    count(&r->st->bytes, copied);
+    if (!ok)
+        __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+
+    /* The last chunk to finish puts the file in place. */
+    if (__atomic_sub_fetch(&f->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (!__atomic_load_n(&f->failed, __ATOMIC_RELAXED) && out >= 0 &&
+            copy_attrs(in, out, &f->st) == 0 &&
+            renameat(r->dstfd, part, r->dstfd, f->path) == 0) {
+            count(&r->st->files, 1);
+        } else {
+            fail(r, f->top, f->path, "copy");
+            unlinkat(r->dstfd, part, 0);
+        }
+        top_release(r, f->top);
+        free(f);
+    }
+    if (in >= 0)
+        close(in);
+    if (out >= 0)
+        close(out);
+}
+
+static void *worker(void *arg)
+{
+    struct relocator *r = arg;
+    struct rjob *j;
+
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->count == 0 && !r->stopping)
+            pthread_cond_wait(&r->more, &r->lock);
+        if (r->count == 0) {
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+        j = r->ring[r->head];
+        r->head = (r->head + 1) % RELOCATE_QUEUE;
+        r->count--;
+        pthread_cond_signal(&r->room);
+        pthread_mutex_unlock(&r->lock);
+        copy_job(r, j);
+        free(j);
+    }
+}
+
+/* Hand a job to the pool, waiting while the queue is full. */
+static int submit(struct relocator *r, struct rfile *f, int64_t off, int64_t len)
+{
+    struct rjob *j = malloc(sizeof(*j));
+
+    if (!j)
+        return -1;
+    j->f = f;
+    j->off = off;
+    j->len = len;
+    pthread_mutex_lock(&r->lock);
+    while (r->count == RELOCATE_QUEUE)
+        pthread_cond_wait(&r->room, &r->lock);
+    r->ring[(r->head + r->count) % RELOCATE_QUEUE] = j;
+    r->count++;
+    pthread_cond_signal(&r->more);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+static size_t inode_slot(const struct relocator *r, dev_t dev, ino_t ino)
+{
+    size_t i = ((uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ dev) & (r->icap - 1);
+
+    while (r->inodes[i].path && (r->inodes[i].dev != dev || r->inodes[i].ino != ino))
+        i = (i + 1) & (r->icap - 1);
+    return i;
+}
+
+/* The first path seen for a multiply-linked file, or NULL after recording this one. */
+static const char *inode_first(struct relocator *r, const struct stat *st, const char *path)
+{
+    size_t i;
+
+    if (r->ninodes * 2 >= r->icap) {
+        size_t cap = r->icap ? r->icap * 2 : 1024, old = r->icap, k;
+        struct inode *prev = r->inodes;
+
+        r->inodes = calloc(cap, sizeof(*r->inodes));
+        if (!r->inodes) {
+            r->inodes = prev;
+            return NULL;
+        }
+        r->icap = cap;
+        for (k = 0; k < old; k++)
+            if (prev[k].path)
+                r->inodes[inode_slot(r, prev[k].dev, prev[k].ino)] = prev[k];
+        free(prev);
+    }
+    i = inode_slot(r, st->st_dev, st->st_ino);
+    if (r->inodes[i].path)
+        return r->inodes[i].path;
+    r->inodes[i].dev = st->st_dev;
+    r->inodes[i].ino = st->st_ino;
+    r->inodes[i].path = strdup(path);
+    if (r->inodes[i].path)
+        r->ninodes++;
+    return NULL;
+}
+
+/* Queue "L" path first or "D" path, each NUL-terminated, for the next commit. */
+static void record(struct relocator *r, char type, const char *path, const char *first)
+{
+    size_t len = 1 + strlen(path) + 1 + (first ? strlen(first) + 1 : 0);
+
+    if (r->npending + len > r->pcap) {
+        size_t cap = r->pcap ? r->pcap * 2 : 65536;
+        char *p;
+
+        while (cap < r->npending + len)
+            cap *= 2;
+        if (!(p = realloc(r->pending, cap)))
+            return;
+        r->pending = p;
+        r->pcap = cap;
+    }
+    r->pending[r->npending++] = type;
+    strcpy(r->pending + r->npending, path);
+    r->npending += strlen(path) + 1;
+    if (first) {
+        strcpy(r->pending + r->npending, first);
+        r->npending += strlen(first) + 1;
+    }
+}
+
+static int push_link(struct relocator *r, const char *path, const char *first)
+{
+    if (r->nlinks == r->lcap) {
+        size_t cap = r->lcap ? r->lcap * 2 : 64;
+        struct hardlink *v = realloc(r->links, cap * sizeof(*v));
+
+        if (!v)
+            return -1;
+        r->links = v;
+        r->lcap = cap;
+    }
+    r->links[r->nlinks].path = strdup(path);
+    r->links[r->nlinks].first = strdup(first);
+    r->nlinks++;
+    return 0;
+}
+
+static void queue_file(struct relocator *r, const char *path, const struct stat *st,
+                       struct top *t)
+{
+    const char *first = NULL;
+    struct rfile *f;
+    struct stat ds;
+    int64_t off;
+
+    if (st->st_nlink > 1 && (first = inode_first(r, st, path)) != NULL) {
+        if (push_link(r, path, first) != 0)
+            fail(r, t, path, "link");
+        else
+            record(r, 'L', path, first);
+        return;
+    }
+    if (fstatat(r->dstfd, path, &ds, AT_SYMLINK_NOFOLLOW) == 0 &&
+        !(r->force_state && !strncmp(path, ".tfs/", 5))) {
+        if (S_ISREG(ds.st_mode) && ds.st_size == st->st_size &&
+            ds.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+            ds.st_mtim.tv_nsec == st->st_mtim.tv_nsec) {
+            count(&r->st->skipped, 1);
+            return;
+        }
+        if (S_ISDIR(ds.st_mode))
+            remove_path(r->dstfd, path);
+    }
+    f = calloc(1, sizeof(*f) + strlen(path) + 1);
+    if (!f) {
+        fail(r, t, path, "queue");
+        return;
+    }
+    f->top = t;
+    f->st = *st;
+    strcpy(f->path, path);
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_ACQ_REL);
+    if (st->st_size < RELOCATE_CHUNK) {
+        f->remaining = 1;
+        if (submit(r, f, 0, -1) != 0) {
+            fail(r, t, path, "queue");
+            top_release(r, t);
+            free(f);
+        }
+        return;
+    }
+
+    /* Chunks write into a part file sized up front. */
+    {
+        char part[PATH_MAX + 32];
+        int fd;
+
+        part_path(path, part, sizeof(part));
+        fd = openat(r->dstfd, part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0 || ftruncate(fd, st->st_size) != 0) {
+            if (fd >= 0)
+                close(fd);
+            fail(r, t, path, "create");
+            top_release(r, t);
+            free(f);
+            return;
+        }
+        close(fd);
+    }
+    f->remaining = (int)((st->st_size + RELOCATE_CHUNK - 1) / RELOCATE_CHUNK);
+    for (off = 0; off < st->st_size; off += RELOCATE_CHUNK) {
+        int64_t len = st->st_size - off < RELOCATE_CHUNK ? st->st_size - off : RELOCATE_CHUNK;
+
+        if (submit(r, f, off, len) != 0) {
+            /* Account for the chunks that will never run. */
+            int left = (int)((st->st_size - off + RELOCATE_CHUNK - 1) / RELOCATE_CHUNK);
+
+            __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+            if (__atomic_sub_fetch(&f->remaining, left, __ATOMIC_ACQ_REL) == 0) {
+                fail(r, t, path, "queue");
+                top_release(r, t);
+                free(f);
+            }
+            return;
+        }
+    }
+}
+
+static void copy_link(struct relocator *r, const char *path, const struct stat *st,
+                      struct top *t)
+{
+    char target[PATH_MAX], cur[PATH_MAX];
+    struct timespec ts[2];
+    ssize_t n, m;
+
+    n = readlinkat(r->srcfd, path, target, sizeof(target) - 1);
+    if (n < 0) {
+        fail(r, t, path, "read link");
+        return;
+    }
+    m = readlinkat(r->dstfd, path, cur, sizeof(cur));
+    if (m == n && !memcmp(cur, target, n))
+        return;
+    target[n] = '\0';
+    remove_path(r->dstfd, path);
+    if (symlinkat(target, r->dstfd, path) != 0) {
+        fail(r, t, path, "create link");
+        return;
+    }
+    ts[0] = st->st_atim;
+    ts[1] = st->st_mtim;
+    fchownat(r->dstfd, path, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+    utimensat(r->dstfd, path, ts, AT_SYMLINK_NOFOLLOW);
+    count(&r->st->symlinks, 1);
+}
+
+static void push_dir(struct relocator *r, const char *path, const struct stat *st)
+{
+    if (r->ndirs == r->dcap) {
+        size_t cap = r->dcap ? r->dcap * 2 : 256;
+        struct rdir *v = realloc(r->dirs, cap * sizeof(*v));
+
+        if (!v)
+            return;
+        r->dirs = v;
+        r->dcap = cap;
+    }
+    r->dirs[r->ndirs].path = strdup(path);
+    r->dirs[r->ndirs].st = *st;
+    if (r->dirs[r->ndirs].path)
+        r->ndirs++;
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int is_done(const struct relocator *r, const char *name)
+{
+    return r->ndone && bsearch(&name, r->done, r->ndone, sizeof(*r->done), by_name);
+}
+
+/* Delta passes: drop what is no longer in the source. */
+static void prune_dir(struct relocator *r, char *path, size_t len)
+{
+    int fd = openat(r->dstfd, len ? path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    if (fd < 0 || !(d = fdopendir(fd))) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        size_t n;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+            (!len && !strcmp(de->d_name, RELOCATE_DIR)))
+            continue;
+        n = snprintf(path + len, PATH_MAX - len, "%s%s", len ? "/" : "", de->d_name);
+        if (len + n < PATH_MAX && fstatat(r->srcfd, path, &st, AT_SYMLINK_NOFOLLOW) != 0 &&
+            errno == ENOENT && remove_path(r->dstfd, path) == 0)
+            count(&r->st->deleted, 1);
+        path[len] = '\0';
+    }
+    closedir(d);
+}
+
+static void walk_dir(struct relocator *r, char *path, size_t len, struct top *top)
+{
+    int fd = openat(r->srcfd, len ? path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct dirent *de;
+    DIR *d;
+
+    if (fd < 0 || !(d = fdopendir(fd))) {
+        if (fd >= 0)
+            close(fd);
+        fail(r, top, len ? path : ".", "read");
+        return;
+    }
+    if (r->prune)
+        prune_dir(r, path, len);
+    while ((de = readdir(d)) != NULL) {
+        struct top *t = top;
+        struct stat st, ds;
+        size_t n;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+            (!len && !strcmp(de->d_name, RELOCATE_DIR)))
+            continue;
+        n = snprintf(path + len, PATH_MAX - len, "%s%s", len ? "/" : "", de->d_name);
+        if (len + n >= PATH_MAX) {
+            path[len] = '\0';
+            errno = ENAMETOOLONG;
+            fail(r, top, de->d_name, "copy");
+            continue;
+        }
+        if (!len) {
+            if (r->skip_done && is_done(r, de->d_name)) {
+                r->st->resumed++;
+                path[len] = '\0';
+                continue;
+            }
+            if (bench_ms_since(&r->last_commit) >= CHECKPOINT_MS)
+                commit(r);
+            t = calloc(1, sizeof(*t) + n + 1);
+            if (!t) {
+                fail(r, NULL, path, "copy");
+                path[len] = '\0';
+                continue;
+            }
+            t->refs = 1;
+            memcpy(t->name, de->d_name, n + 1);
+        }
+
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            fail(r, t, path, "stat");
+        } else if (S_ISDIR(st.st_mode)) {
+            if (fstatat(r->dstfd, path, &ds, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(ds.st_mode))
+                remove_path(r->dstfd, path);
+            if (mkdirat(r->dstfd, path, 0700) == 0)
+                count(&r->st->dirs, 1);
+            else if (errno != EEXIST)
+                fail(r, t, path, "create");
+            push_dir(r, path, &st);
+            record(r, 'D', path, NULL);
+            walk_dir(r, path, len + n, t);
+        } else if (S_ISREG(st.st_mode)) {
+            queue_file(r, path, &st, t);
+        } else if (S_ISLNK(st.st_mode)) {
+            copy_link(r, path, &st, t);
+        } else if (S_ISFIFO(st.st_mode)) {
+            if (mkfifoat(r->dstfd, path, st.st_mode & 07777) != 0 && errno != EEXIST)
+                fail(r, t, path, "create");
+        } else {
+            fprintf(stderr, "relocate: skipping special file %s\n", path);
+        }
+        if (!len)
+            top_release(r, t);
+        path[len] = '\0';
+    }
+    closedir(d);
+}
+
+/* After the pool is done: hard links, then directory attributes, innermost first. */
+static void finish_pass(struct relocator *r)
+{
+    struct stat a, b;
+    size_t i;
+
+    for (i = 0; i < r->nlinks; i++) {
+        const struct hardlink *l = &r->links[i];
+
+        if (!l->path || !l->first)
+            continue;
+        if (linkat(r->dstfd, l->first, r->dstfd, l->path, 0) == 0)
+            count(&r->st->hardlinks, 1);
+        else if (errno != EEXIST || fstatat(r->dstfd, l->first, &a, AT_SYMLINK_NOFOLLOW) != 0 ||
+                 fstatat(r->dstfd, l->path, &b, AT_SYMLINK_NOFOLLOW) != 0)
+            fail(r, NULL, l->path, "link");
+        else if (a.st_ino != b.st_ino &&
+                 (remove_path(r->dstfd, l->path) != 0 ||
+                  linkat(r->dstfd, l->first, r->dstfd, l->path, 0) != 0))
+            fail(r, NULL, l->path, "link");
+        else if (a.st_ino != b.st_ino)
+            count(&r->st->hardlinks, 1);
+        free(l->path);
+        free(l->first);
+    }
+    r->nlinks = 0;
+    for (i = r->ndirs; i-- > 0;) {
+        const struct rdir *d = &r->dirs[i];
+        int in = openat(r->srcfd, d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int out = openat(r->dstfd, d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (in < 0 || out < 0 || copy_attrs(in, out, &d->st) != 0)
+            fail(r, NULL, d->path, "set attributes of");
+        if (in >= 0)
+            close(in);
+        if (out >= 0)
+            close(out);
+        free(d->path);
+    }
+    r->ndirs = 0;
+    for (i = 0; i < r->icap; i++)
+        free(r->inodes[i].path);
+    free(r->inodes);
+    r->inodes = NULL;
+    r->ninodes = r->icap = 0;
+}
+
+static int run_pass(struct relocator *r)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    int i;
+
+    r->stopping = 0;
+    for (i = 0; i < r->nthreads; i++)
+        if (pthread_create(&r->threads[i], NULL, worker, r) != 0)
+            break;
+    if (i == 0)
+        return -1;
+    r->nthreads = i;
+    if (fstat(r->srcfd, &st) == 0)
+        push_dir(r, ".", &st);
+    path[0] = '\0';
+    walk_dir(r, path, 0, NULL);
+
+    pthread_mutex_lock(&r->lock);
+    r->stopping = 1;
+    pthread_cond_broadcast(&r->more);
+    pthread_mutex_unlock(&r->lock);
+    for (i = 0; i < r->nthreads; i++)
+        pthread_join(r->threads[i], NULL);
+    finish_pass(r);
+    commit(r);
+    /* Everything recorded has now been applied. */
+    if (!r->st->failed && ftruncate(r->pend_fd, 0) != 0)
+        fprintf(stderr, "relocate: could not reset the checkpoint\n");
+    r->st->passes++;
+    return 0;
+}
+
+static uint64_t changes(const struct relocate_stats *st)
+{
+    return st->files + st->dirs + st->symlinks + st->hardlinks + st->deleted;
+}
+
+/* Links and directories an interrupted run found but had not applied yet. */
+static int load_pending(struct relocator *r)
+{
+    struct stat st;
+    char *buf, *p, *end;
+
+    if (fstat(r->pend_fd, &st) != 0)
+        return -1;
+    if (st.st_size == 0)
+        return 0;
+    buf = malloc(st.st_size + 1);
+    if (!buf || pread(r->pend_fd, buf, st.st_size, 0) != st.st_size) {
+        free(buf);
+        return -1;
+    }
+    buf[st.st_size] = '\0';
+    end = buf + st.st_size;
+    for (p = buf; p < end;) {
+        char type = *p++;
+        char *path = p, *first = NULL;
+        struct stat ss;
+
+        p = memchr(p, '\0', end - p);
+        if (!p)
+            break;
+        p++;
+        if (type == 'L') {
+            first = p;
+            p = memchr(p, '\0', end - p);
+            if (!p)
+                break;
+            p++;
+            push_link(r, path, first);
+        } else if (type == 'D' && fstatat(r->srcfd, path, &ss, AT_SYMLINK_NOFOLLOW) == 0 &&
+                   S_ISDIR(ss.st_mode)) {
+            push_dir(r, path, &ss);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/* Load the checkpoint; refuses a destination that holds anything else. */
+static int open_checkpoint(struct relocator *r, const char *rbase)
+{
+    char line[PATH_MAX], *buf = NULL, *p;
+    struct dirent *de;
+    struct stat st;
+    ssize_t n;
+    int fd, others = 0, fresh;
+    DIR *d;
+
+    fd = dup(r->dstfd);
+    if (fd < 0 || !(d = fdopendir(fd))) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL)
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..") &&
+            strcmp(de->d_name, RELOCATE_DIR))
+            others = 1;
+    closedir(d);
+    fresh = mkdirat(r->dstfd, RELOCATE_DIR, 0755) == 0;
+    if (!fresh && errno != EEXIST)
+        return -1;
+    if (fresh && others) {
+        unlinkat(r->dstfd, RELOCATE_DIR, AT_REMOVEDIR);
+        fprintf(stderr, "relocate: the destination is not empty\n");
+        return -1;
+    }
+
+    /* The source this destination is a copy of. */
+    fd = openat(r->dstfd, RELOCATE_DIR "/source", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    n = pread(fd, line, sizeof(line) - 1, 0);
+    line[n > 0 ? n : 0] = '\0';
+    if (n <= 0) {
+        size_t len = strlen(rbase);
+
+        if (pwrite(fd, rbase, len, 0) != (ssize_t)len || fdatasync(fd) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else if (strcmp(line, rbase) != 0) {
+        fprintf(stderr, "relocate: the destination holds a copy of %s\n", line);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    r->pend_fd = openat(r->dstfd, RELOCATE_DIR "/pending",
+                        O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (r->pend_fd < 0 || load_pending(r) != 0)
+        return -1;
+    r->ckpt_fd = openat(r->dstfd, RELOCATE_DIR "/done",
+                        O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (r->ckpt_fd < 0 || fstat(r->ckpt_fd, &st) != 0)
+        return -1;
+    if (st.st_size == 0)
+        return 0;
+    buf = malloc(st.st_size + 1);
+    if (!buf || pread(r->ckpt_fd, buf, st.st_size, 0) != st.st_size) {
+        free(buf);
+        return -1;
+    }
+    buf[st.st_size] = '\0';
+    for (p = buf; *p; p++)
+        r->ndone += *p == '\n';
+    r->done = calloc(r->ndone ? r->ndone : 1, sizeof(*r->done));
+    if (!r->done) {
+        free(buf);
+        return -1;
+    }
+    r->ndone = 0;
+    for (p = strtok(buf, "\n"); p; p = strtok(NULL, "\n"))
+        if ((r->done[r->ndone] = strdup(p)) != NULL)
+            r->ndone++;
+    free(buf);
+    qsort(r->done, r->ndone, sizeof(*r->done), by_name);
+    return 0;
+}
+
+/* Hold <state>/index.lock, the lock every index writer takes; -1 on failure. */
+static int index_fence(const char *state)
+{
+    char path[PATH_MAX + 32];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/index.lock", state);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* Point the moved metadata at the new folders: inode numbers change with the volume. */
+static void rebind(const char *rdest)
+{
+    char state[PATH_MAX + 16], path[PATH_MAX * 2];
+    struct ordmap names;
+    struct meta meta;
+    struct stat st;
+    uint32_t ord;
+    int id;
+
+    snprintf(state, sizeof(state), "%s/.tfs", rdest);
+    if (meta_open(&meta, state) != 0)
+        return;
+    if (ordmap_open(&names, state) != 0) {
+        meta_close(&meta);
+        return;
+    }
+    id = meta_base_id(&meta, rdest);
+    for (ord = 0; ord < meta.count && ord < names.count; ord++) {
+        const char *name = ordmap_name(&names, ord);
+
+        if (!name)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", rdest, name);
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        meta.ino[ord] = st.st_ino;
+        if (id >= 0)
+            meta.base[ord] = (uint16_t)id;
+    }
+    ordmap_close(&names);
+    meta_close(&meta);
+}
+
+int relocate_run(const char *base, const char *dest, const struct relocate_opts *o,
+                 struct relocate_stats *st, FILE *out)
+{
+    char rbase[PATH_MAX], rdest[PATH_MAX], state[PATH_MAX + 16];
+    struct relocator r;
+    struct timespec t0;
+    size_t blen, dlen, i;
+    uint64_t before;
+    int rc = -1, made, quiet = 0, fence = -1;
+
+    memset(st, 0, sizeof(*st));
+    memset(&r, 0, sizeof(r));
+    r.srcfd = r.dstfd = r.ckpt_fd = r.pend_fd = -1;
+    made = mkdir(dest, 0755) == 0;
+    if ((!made && errno != EEXIST) || !realpath(base, rbase) || !realpath(dest, rdest)) {
+        fprintf(stderr, "relocate: cannot use %s: %s\n", dest, strerror(errno));
+        return -1;
+    }
+    blen = strlen(rbase);
+    dlen = strlen(rdest);
+    if ((!strncmp(rdest, rbase, blen) && (rdest[blen] == '/' || rdest[blen] == '\0')) ||
+        (!strncmp(rbase, rdest, dlen) && rbase[dlen] == '/')) {
+        fprintf(stderr, "relocate: %s and %s overlap\n", base, dest);
+        if (made)
+            rmdir(rdest);
+        return -1;
+    }
+    r.srcfd = open(rbase, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    r.dstfd = open(rdest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (r.srcfd < 0 || r.dstfd < 0 || open_checkpoint(&r, rbase) != 0)
+        goto out;
+    r.st = st;
+    r.nthreads = o->threads > 0 ? o->threads : RELOCATE_THREADS;
+    r.threads = calloc(r.nthreads, sizeof(*r.threads));
+    if (!r.threads)
+        goto out;
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.more, NULL);
+    pthread_cond_init(&r.room, NULL);
+    /* Paced like other background work and yielding to ticket opens. */
+    config_state_dir(rbase, state, sizeof(state));
+    iosched_init(&r.sched, state, 0, o->rate);
+    clock_gettime(CLOCK_MONOTONIC, &r.last_commit);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (out && r.ndone)
+        fprintf(out, "Resuming: %zu entries already copied\n", r.ndone);
+    r.skip_done = 1;
+    if (run_pass(&r) != 0)
+        goto stop;
+    st->copy_ms = bench_ms_since(&t0);
+    if (out)
+        fprintf(out, "Copied %llu files, %.1f MB in %.0f ms; catching up\n",
+                (unsigned long long)st->files, st->bytes / 1048576.0, st->copy_ms);
+
+    /* Whatever changed during the copy, until a pass finds nothing. */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    r.skip_done = 0;
+    r.prune = 1;
+    for (i = 0; i < RELOCATE_DELTA_PASSES && !quiet; i++) {
+        before = changes(st);
+        if (run_pass(&r) != 0)
+            goto stop;
+        quiet = changes(st) == before;
+    }
+    if (!quiet) {
+        fprintf(stderr, "relocate: the base was still changing after %d passes; "
+                "run again when it is quieter to resume\n", RELOCATE_DELTA_PASSES);
+        goto stop;
+    }
+
+    /*
+     * Last pass and the switch with the index writer lock held, so no
+     * ticket comes or goes in between and the state files are copied
+     * whole rather than mid-update.
+     */
+    fence = index_fence(state);
+    if (fence < 0) {
+        fprintf(stderr, "relocate: could not lock the index: %s\n", strerror(errno));
+        goto stop;
+    }
+    r.force_state = 1;
+    if (run_pass(&r) != 0)
+        goto stop;
+    st->delta_ms = bench_ms_since(&t0);
+    if (st->failed) {
+        fprintf(stderr, "relocate: %llu entries failed; run again to resume\n",
+                (unsigned long long)st->failed);
+        goto stop;
+    }
+
+    rebind(rdest);
+    if (config_save_base(rdest) != 0) {
+        fprintf(stderr, "relocate: could not update the config\n");
+        goto stop;
+    }
+    remove_path(r.dstfd, RELOCATE_DIR);
+    rc = 0;
+stop:
+    if (fence >= 0)
+        close(fence);
+    iosched_shutdown(&r.sched);
+    pthread_cond_destroy(&r.more);
+    pthread_cond_destroy(&r.room);
+    pthread_mutex_destroy(&r.lock);
+out:
+    for (i = 0; i < r.ndone; i++)
+        free(r.done[i]);
+    free(r.done);
+    free(r.dirs);
+    free(r.links);
+    free(r.threads);
+    free(r.finished);
+    free(r.pending);
+    if (r.ckpt_fd >= 0)
+        close(r.ckpt_fd);
+    if (r.pend_fd >= 0)
+        close(r.pend_fd);
+    if (r.srcfd >= 0)
+        close(r.srcfd);
+    if (r.dstfd >= 0)
+        close(r.dstfd);
+    return rc;
+}
@@ -0,0 +1,53 @@
+#ifndef RELOCATE_H
+#define RELOCATE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Move the whole base directory, state included, to another volume. A
+ * walker thread goes through the base in directory order and feeds a
+ * bounded queue; a pool of copy threads drains it, so copying starts with
+ * the first file rather than after a full scan. Files of RELOCATE_CHUNK
+ * or more are split into chunks copied in parallel. Every file lands
+ * through a temporary name with its mode, owner, times and extended
+ * attributes; files hard-linked to each other are linked again.
+ *
+ * Each top-level entry (a ticket folder, or .tfs) is written to a
+ * checkpoint in <dest>/.tfs-relocate once all its files are copied and
+ * synced, and an interrupted run started again skips those. Hard links
+ * and directory attributes, applied at the end of a pass, are recorded
+ * there first so a resumed run still applies them. The bulk copy is
+ * followed by up to RELOCATE_DELTA_PASSES delta passes that copy what
+ * changed meanwhile (tickets created during the copy included) and drop
+ * what was deleted, until a pass finds nothing; if none does, relocate
+ * fails and can be resumed later. A last pass then runs with the index
+ * writer lock held, copying .tfs again whatever it looks like, and only
+ * then is the new base recorded in the config, which is replaced
+ * atomically. The old base is left in place.
+ */
+
+#define RELOCATE_CHUNK (32LL << 20)
+#define RELOCATE_DIR ".tfs-relocate"
+#define RELOCATE_DELTA_PASSES 3
+
+struct relocate_opts {
+    int threads;            /* 0 for the default */
+    uint64_t rate;          /* bytes per second, 0 = unthrottled */
+};
+
+struct relocate_stats {
+    uint64_t files, dirs, symlinks, hardlinks;
+    uint64_t skipped;       /* already at the destination */
+    uint64_t resumed;       /* top-level entries skipped from the checkpoint */
+    uint64_t deleted;       /* removed by a delta pass */
+    uint64_t failed;
+    uint64_t bytes;
+    int passes;
+    double copy_ms, delta_ms;
+};
+
+int relocate_run(const char *base, const char *dest, const struct relocate_opts *o,
+                 struct relocate_stats *st, FILE *out);
+
+#endif
@@ -0,0 +1,174 @@
+#include "report.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "journal.h"
+#include "timelog.h"
+
+struct period {
+    uint64_t count[JOURNAL_NTYPES];
+    int64_t bytes;
+    uint64_t seconds;
+};
+
+static void put_date(struct bufout *w, uint32_t day)
+{
+    time_t t = (time_t)day * 86400;
+    struct tm tm;
+    char buf[16];
+
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%d", &tm);
+    bufout_puts(w, buf);
+}
+
+static uint32_t key(const struct report_opts *o, uint32_t day)
+{
+    return o->weekly ? time_week(day) : day;
+}
+
+int report_write(const char *state_dir, const struct report_opts *o, struct bufout *w)
+{
+    struct journal_day *days = NULL;
+    struct time_row *time = NULL;
+    struct period *p = NULL;
+    size_t nd, nt, i;
+    uint32_t first = UINT32_MAX, last = 0, k, n;
+    int rc = -1;
+
+    if (journal_days(state_dir, o->from, o->to, &days, &nd) != 0 ||
+        timelog_rollup(state_dir, TIME_DAY, o->from, o->to, &time, &nt) != 0)
+        goto out;
+    if (nd) {
+        first = key(o, days[0].day);
+        last = key(o, days[nd - 1].day);
+    }
+    if (nt && key(o, time[0].period) < first)
+        first = key(o, time[0].period);
+    if (nt && key(o, time[nt - 1].period) > last)
+        last = key(o, time[nt - 1].period);
+    n = first <= last ? last - first + 1 : 0;
+    if (!(p = calloc(n ? n : 1, sizeof(*p))))
+        goto out;
+    for (i = 0; i < nd; i++) {
+        struct period *q = &p[key(o, days[i].day) - first];
+        int t;
+
+        for (t = 1; t < JOURNAL_NTYPES; t++)
+            q->count[t] += days[i].count[t];
+        q->bytes += days[i].bytes;
+    }
+    for (i = 0; i < nt; i++)
+        p[key(o, time[i].period) - first].seconds += time[i].seconds;
+
+    bufout_puts(w, o->weekly ? "week" : "day");
+    bufout_puts(w, ",created,opened,closed,archived,restored,deleted,disk_growth_bytes,"
+                   "hours\n");
+    for (k = 0; k < n; k++) {
+        const struct period *q = &p[k];
+
+        put_date(w, o->weekly ? time_week_day(first + k) : first + k);
+        bufout_printf(w, ",%llu,%llu,%llu,%llu,%llu,%llu,%lld,%.2f\n",
+                      (unsigned long long)q->count[JOURNAL_CREATE],
+                      (unsigned long long)q->count[JOURNAL_OPEN],
+                      (unsigned long long)q->count[JOURNAL_CLOSE],
+                      (unsigned long long)q->count[JOURNAL_ARCHIVE],
+                      (unsigned long long)q->count[JOURNAL_RESTORE],
+                      (unsigned long long)q->count[JOURNAL_DELETE], (long long)q->bytes,
+                      q->seconds / 3600.0);
+    }
+    rc = bufout_flush(w);
+out:
+    free(days);
+    free(time);
+    free(p);
+    return rc;
+}
+
+struct scan_weeks {
+    struct period *p;
+    uint32_t first, n;
+};
+
+static int scan_one(const struct journal_rec *r, void *arg)
+{
+    struct scan_weeks *s = arg;
+    uint32_t week = time_week(time_day(r->time));
+
+    if (week >= s->first && week - s->first < s->n) {
+        s->p[week - s->first].count[r->type]++;
+        s->p[week - s->first].bytes += r->bytes;
+    }
+    return 0;
+}
+
+/* bench report [events]: three years of journal, weekly CSV from rollups vs a scan */
+int report_bench(int argc, char *argv[])
+{
+    static const int mix[] = { JOURNAL_OPEN, JOURNAL_OPEN, JOURNAL_OPEN, JOURNAL_SIZE,
+                               JOURNAL_SIZE, JOURNAL_CREATE, JOURNAL_CLOSE, JOURNAL_ARCHIVE };
+    long events = argc > 0 ? strtol(argv[0], NULL, 10) : 200000;
+    char root[256];
+    struct report_opts o = { 1, 0, UINT32_MAX };
+    struct scan_weeks s;
+    struct timespec t0;
+    struct bufout *w;
+    uint64_t seed = 5, cursor = 0;
+    int64_t now = time(NULL) - 3 * 365 * 86400LL, step;
+    double load_ms, rollup_ms, scan_ms;
+    long e;
+    int devnull;
+
+    if (events <= 0)
+        events = 200000;
+    step = 3 * 365 * 86400LL / events;
+    if (bench_tmpdir(root, sizeof(root), "report") != 0)
+        return 1;
+    if (!(w = malloc(sizeof(*w)))) {
+        bench_rmtree(root);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (e = 0; e < events; e++) {
+        int type = mix[bench_rnd(&seed) % 8];
+        int64_t bytes;
+
+        now += step;
+        bytes = type == JOURNAL_SIZE ? (int64_t)(bench_rnd(&seed) % 4096) << 10 : 0;
+        if (journal_append(root, type, bench_rnd(&seed) % 5000, now, bytes) != 0)
+            break;
+    }
+    load_ms = bench_ms_since(&t0);
+
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    bufout_init(w, devnull);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    report_write(root, &o, w);
+    rollup_ms = bench_ms_since(&t0);
+    close(devnull);
+
+    memset(&s, 0, sizeof(s));
+    s.first = time_week(time_day(now - 3 * 365 * 86400LL)) - 1;
+    s.n = 3 * 53 + 4;
+    s.p = calloc(s.n, sizeof(*s.p));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (s.p)
+        journal_read(root, &cursor, scan_one, &s);
+    scan_ms = bench_ms_since(&t0);
+
+    printf("%ld events appended in %.0f ms (%.1f us each, rollup included)\n", e, load_ms,
+           load_ms * 1e3 / (e ? e : 1));
+    printf("weekly CSV over 3 years: rollups %.2f ms, scanning the journal %.1f ms (%.0fx)\n",
+           rollup_ms, scan_ms, scan_ms / (rollup_ms > 0 ? rollup_ms : 1e-3));
+    free(s.p);
+    free(w);
+    bench_rmtree(root);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+
+#include "bufout.h"
+
+/*
+ * Activity report as CSV, one line per day or week: tickets created,
+ * opened, closed, archived, restored and deleted, net disk growth, and
+ * hours spent. Everything comes from rollups kept current on each write
+ * (the journal's daily rows and the time log's day rows), so a report
+ * over years reads a few thousand rows and no events.
+ */
+
+struct report_opts {
+    int weekly;
+    uint32_t from, to;      /* days, inclusive */
+};
+
+int report_write(const char *state_dir, const struct report_opts *o, struct bufout *w);
+
+int report_bench(int argc, char *argv[]);
+
+#endif
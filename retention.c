@@ -0,0 +1,297 @@
+#include "retention.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/rand.h>
+
+#include "bench.h"
+#include "index.h"
+#include "iosched.h"
+#include "journal.h"
+#include "meta.h"
+#include "pool.h"
+#include "ticket.h"
+
+#define SHRED_BUF (1 << 20)
+
+struct sweep;
+
+struct victim {
+    struct sweep *sweep;
+    uint32_t ord;
+    int failed;
+    int64_t bytes;          /* disk usage given back, for the journal */
+};
+
+struct sweep {
+    const char *base, *state_dir;
+    const struct retention_opts *o;
+    const struct ordmap *names;
+    struct victim *v;
+    struct iosched sched;
+    unsigned char *noise;   /* shared random block for overwriting */
+    struct retention_stats *st;
+};
+
+static void count(uint64_t *c, uint64_t n)
+{
+    __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+/* Overwrite a file in place before it is unlinked; hard links are left alone. */
+static int shred_at(struct sweep *s, int dirfd, const char *name)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    off_t off = 0;
+    int rc = 0;
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        close(fd);
+        return 0;
+    }
+    while (off < st.st_size && rc == 0) {
+        size_t n = st.st_size - off < SHRED_BUF ? (size_t)(st.st_size - off) : SHRED_BUF;
+        ssize_t w;
+
+        iosched_bg_throttle(&s->sched, n);
+        w = pwrite(fd, s->noise, n, off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            rc = -1;
+        else
+            off += w;
+    }
+    if (rc == 0 && fdatasync(fd) != 0)
+        rc = -1;
+    close(fd);
+    if (rc == 0)
+        count(&s->st->shredded, st.st_size);
+    return rc;
+}
+
+static int remove_file(struct sweep *s, int dirfd, const char *name, int is_reg)
+{
+    struct stat st;
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+        count(&s->st->bytes, st.st_size);
+        is_reg = 1;
+    }
+    if (is_reg && s->o->shred && shred_at(s, dirfd, name) != 0)
+        return -1;
+    if (unlinkat(dirfd, name, 0) != 0 && errno != ENOENT)
+        return -1;
+    count(&s->st->files, 1);
+    return 0;
+}
+
+/* Empty the directory behind dirfd, which this takes ownership of. */
+static int remove_tree(struct sweep *s, int dirfd)
+{
+    struct dirent *de;
+    DIR *d = fdopendir(dirfd);
+    int rc = 0;
+
+    if (!d) {
+        close(dirfd);
+        return -1;
+    }
+    /* Deleting is metadata work: no tokens, but let interactive work go first. */
+    iosched_bg_throttle(&s->sched, 0);
+    while ((de = readdir(d)) != NULL) {
+        unsigned char type = de->d_type;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+
+            if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if (type == DT_DIR) {
+            int fd = openat(dirfd, de->d_name,
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            if (fd < 0 || remove_tree(s, fd) != 0 ||
+                unlinkat(dirfd, de->d_name, AT_REMOVEDIR) != 0)
+                rc = -1;
+            else
+                count(&s->st->dirs, 1);
+        } else if (remove_file(s, dirfd, de->d_name, type == DT_REG) != 0) {
+            rc = -1;
+        }
+    }
+    closedir(d);
+    return rc;
+}
+
+/* Remove dir/name, file or tree; a missing path is not an error. */
+static int remove_path(struct sweep *s, const char *dir, const char *name)
+{
+    int at = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC), fd, rc = 0;
+
+    if (at < 0)
+        return errno == ENOENT ? 0 : -1;
+    fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        if (remove_tree(s, fd) != 0 || unlinkat(at, name, AT_REMOVEDIR) != 0)
+            rc = -1;
+        else
+            count(&s->st->dirs, 1);
+    } else if (errno == ENOTDIR || errno == ELOOP) {
+        rc = remove_file(s, at, name, 0);
+    } else if (errno != ENOENT) {
+        rc = -1;
+    }
+    close(at);
+    return rc;
+}
+
+/* Runs on a scheduler thread, already in the background class. */
+static void sweep_one(void *arg)
+{
+    struct victim *v = arg;
+    struct sweep *s = v->sweep;
+    const char *name = ordmap_name(s->names, v->ord);
+    char dir[4200], file[TICKET_NAME_MAX + 16];
+
+    if (remove_path(s, s->base, name) != 0)
+        v->failed = 1;
+    snprintf(dir, sizeof(dir), "%s/archive", s->state_dir);
+    snprintf(file, sizeof(file), "%s.tfp", name);
+    if (remove_path(s, dir, file) != 0)
+        v->failed = 1;
+    snprintf(dir, sizeof(dir), "%s/merkle", s->state_dir);
+    snprintf(file, sizeof(file), "%u", v->ord);
+    if (remove_path(s, dir, file) != 0)
+        v->failed = 1;
+    snprintf(dir, sizeof(dir), "%s/delta", s->state_dir);
+    if (remove_path(s, dir, file) != 0)
+        v->failed = 1;
+    snprintf(dir, sizeof(dir), "%s/prefetch", s->state_dir);
+    if (remove_path(s, dir, file) != 0)
+        v->failed = 1;
+}
+
+int retention_run(const char *base, const char *state_dir, const struct retention_opts *o,
+                  struct retention_stats *st, FILE *out)
+{
+    struct sweep s;
+    struct meta meta;
+    struct ordmap names;
+    struct timespec t0;
+    int64_t cutoff = time(NULL) - o->days * 86400;
+    size_t n = 0, i;
+    uint32_t ord;
+    int rc = -1;
+
+    memset(st, 0, sizeof(*st));
+    memset(&s, 0, sizeof(s));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (meta_open(&meta, state_dir) != 0)
+        return -1;
+    if (ordmap_open(&names, state_dir) != 0) {
+        meta_close(&meta);
+        return -1;
+    }
+    s.v = malloc((meta.count ? meta.count : 1) * sizeof(*s.v));
+    if (!s.v)
+        goto out;
+    for (ord = 0; ord < meta.count && ord < names.count; ord++) {
+        if ((meta.state[ord] != TICKET_CLOSED && meta.state[ord] != TICKET_ARCHIVED) ||
+            meta.closed[ord] == 0 || meta.closed[ord] > cutoff || !ordmap_name(&names, ord))
+            continue;
+        s.v[n].sweep = &s;
+        s.v[n].ord = ord;
+        s.v[n].failed = 0;
+        s.v[n].bytes = meta.size[ord];
+        if (meta.state[ord] == TICKET_ARCHIVED) {
+            char pack[4200];
+            struct stat sb;
+
+            snprintf(pack, sizeof(pack), "%s/archive/%s.tfp", state_dir,
+                     ordmap_name(&names, ord));
+            s.v[n].bytes = stat(pack, &sb) == 0 ? sb.st_size : 0;
+        }
+        n++;
+    }
+    st->select_ms = bench_ms_since(&t0);
+    if (o->dry_run) {
+        for (i = 0; out && i < n; i++)
+            fprintf(out, "%s (closed %lld days ago)\n", ordmap_name(&names, s.v[i].ord),
+                    (long long)((time(NULL) - meta.closed[s.v[i].ord]) / 86400));
+        st->tickets = n;
+        rc = 0;
+        goto out;
+    }
+
+    s.base = base;
+    s.state_dir = state_dir;
+    s.o = o;
+    s.names = &names;
+    s.st = st;
+    if (o->shred &&
+        (!(s.noise = malloc(SHRED_BUF)) || RAND_bytes(s.noise, SHRED_BUF) != 1))
+        goto out;
+    /*
+     * The deletions run on the scheduler's own threads, which drop to the
+     * idle class; this thread keeps its priority, so the index lock taken
+     * below is never held by an idle-class thread.
+     */
+    iosched_init(&s.sched, state_dir, o->threads > 0 ? o->threads : pool_default_threads(),
+                 o->shred_rate);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++)
+        if (iosched_submit(&s.sched, sweep_one, &s.v[i]) != 0)
+            s.v[i].failed = 1;
+    iosched_drain(&s.sched);
+    st->delete_ms = bench_ms_since(&t0);
+    iosched_shutdown(&s.sched);
+
+    /* Only tickets that are fully gone leave the index. */
+    {
+        struct index_writer w;
+        int have_index = index_writer_open(&w, state_dir) == 0;
+        int64_t now = time(NULL);
+
+        for (i = 0; i < n; i++) {
+            const char *name = ordmap_name(&names, s.v[i].ord);
+
+            if (s.v[i].failed) {
+                st->failed++;
+                if (out)
+                    fprintf(out, "could not fully remove %s\n", name);
+                continue;
+            }
+            if (have_index)
+                index_remove(&w, name);
+            meta_set_state(&meta, s.v[i].ord, TICKET_DELETED, now);
+            meta_on_file(&meta, s.v[i].ord, -meta.size[s.v[i].ord],
+                         -meta.files[s.v[i].ord], now);
+            journal_append(state_dir, JOURNAL_DELETE, s.v[i].ord, now, -s.v[i].bytes);
+            st->tickets++;
+        }
+        if (have_index)
+            index_writer_close(&w);
+    }
+    rc = 0;
+out:
+    free(s.noise);
+    free(s.v);
+    ordmap_close(&names);
+    meta_close(&meta);
+    return rc;
+}
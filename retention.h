@@ -0,0 +1,41 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Retention sweep: delete every ticket closed at least `days` ago. The
+ * candidates come from the metadata columns (state and close time), so
+ * the base is never walked. Each expired ticket's folder, archive pack,
+ * change summary, delta recipes and prefetch record are removed on the
+ * I/O scheduler's background threads, each tree with unlinkat relative to
+ * directory fds; the caller's own priority is left alone, and it updates
+ * the index and metadata once the deletions are done.
+ *
+ * With shred set, every regular file with a single link is overwritten
+ * once with random data and synced before it is unlinked. The overwrite
+ * runs in the background I/O class, paced by shred_rate and stalling
+ * while anything interactive is in flight. It only reaches the blocks a
+ * filesystem rewrites in place; copy-on-write filesystems and SSDs may
+ * keep the old data elsewhere.
+ */
+
+struct retention_opts {
+    int64_t days;
+    int shred;
+    uint64_t shred_rate;    /* bytes per second, 0 = unthrottled */
+    int threads;            /* 0 for one per CPU */
+    int dry_run;            /* list what would be deleted */
+};
+
+struct retention_stats {
+    uint64_t tickets, files, dirs, bytes, shredded;
+    uint64_t failed;        /* tickets not fully removed */
+    double select_ms, delete_ms;
+};
+
+int retention_run(const char *base, const char *state_dir, const struct retention_opts *o,
+                  struct retention_stats *st, FILE *out);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef SEAL_H
+#define SEAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Authenticated encryption of independent segments. Each sealed object
+ * has its own key, HMAC-SHA256(master, context), where the context holds
+ * a fresh random salt and whatever plaintext header must not be altered.
+ * Segment i uses the nonce 0^32 || i, so nonces never repeat under one
+ * key; the index and a last-segment flag are bound in as associated data,
+ * which catches reordered, dropped or truncated segments. Sealing is in
+ * place (ciphertext is as long as plaintext) with a separate 16-byte tag.
+ */
+
+#define SEAL_KEY 32
+#define SEAL_SALT 32
+#define SEAL_TAG 16
+
+enum { SEAL_NONE, SEAL_AES_GCM, SEAL_CHACHA20_POLY1305 };
+
+struct seal {
+    int cipher;
+    uint8_t key[SEAL_KEY];
+};
+
+/* AES-256-GCM when the CPU has AES-NI and PCLMULQDQ, else ChaCha20-Poly1305. */
+int seal_default_cipher(void);
+const char *seal_cipher_name(int cipher);
+int seal_cipher_parse(const char *name);
+
+int seal_init(struct seal *s, int cipher, const uint8_t master[SEAL_KEY],
+              const void *context, size_t len);
+void seal_wipe(struct seal *s);
+int seal_segment(const struct seal *s, uint64_t index, int last, uint8_t *buf, size_t len,
+                 uint8_t tag[SEAL_TAG]);
+/* Returns -1, leaving buf undefined, when the tag does not match. */
+int unseal_segment(const struct seal *s, uint64_t index, int last, uint8_t *buf,
+                   size_t len, const uint8_t tag[SEAL_TAG]);
+
+/* Load the key file at path, creating a random one when create is set. */
+int seal_load_key(const char *path, uint8_t key[SEAL_KEY], int create);
+/* Write key to path (mode 0600); an existing key file is left as it is. */
+int seal_save_key(const char *path, const uint8_t key[SEAL_KEY]);
+
+int seal_bench(int argc, char *argv[]);
+
+#endif
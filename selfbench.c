@@ -0,0 +1,602 @@
+#include "selfbench.h"
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+#include "tags.h"
+#include "ticketfs.h"
+
+extern char **environ;
+
+#define MAX_ARGS 4
+#define MAX_LIBS 32
+
+/* The commands a user types most, from the usage path up to a create. */
+static const struct {
+    const char *label;
+    const char *args[MAX_ARGS];
+} commands[] = {
+    { "usage",   { "next" } },
+    { "list",    { "list" } },
+    { "stats",   { "stats" } },
+    { "next",    { "next", "INC0000100" } },
+    { "tagged",  { "tagged", "vpn" } },
+    { "query",   { "query", "tag:vpn and size<1M" } },
+    { "report",  { "report", "--daily" } },
+    { "create",  { "create" } },        /* a fresh name is appended per run */
+};
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+struct sample {
+    double ms;
+    long minflt, majflt, maxrss, csw;
+    long long rdwr;         /* syscr + syscw */
+};
+
+struct result {
+    double p50, p90, p99, max, mean;
+    double minflt, majflt, maxrss, csw;
+    double rdwr;            /* -1: /proc/<pid>/io not readable */
+    long syscalls;          /* -1: not counted */
+};
+
+struct bench {
+    char home[256], base[300];
+    char **env;
+    char *libs[MAX_LIBS];
+    int nlibs;
+    int drop_caches;        /* evict with /proc/sys/vm/drop_caches */
+    long created;
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* The children see the scratch base through HOME and nothing else. */
+static char **child_env(const char *home)
+{
+    size_t n = 0, i, k = 0;
+    char **env;
+
+    while (environ[n])
+        n++;
+    env = calloc(n + 2, sizeof(*env));
+    if (!env)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        if (strncmp(environ[i], "HOME=", 5) == 0 ||
+            strncmp(environ[i], "USERPROFILE=", 12) == 0 ||
+            strncmp(environ[i], "XDG_CONFIG_HOME=", 16) == 0)
+            continue;
+        env[k++] = environ[i];
+    }
+    env[k] = malloc(strlen(home) + 6);
+    if (!env[k]) {
+        free(env);
+        return NULL;
+    }
+    sprintf(env[k], "HOME=%s", home);
+    return env;
+}
+
+static int setup(struct bench *b)
+{
+    const char *keep[] = { "HOME", "USERPROFILE", "XDG_CONFIG_HOME" };
+    char *saved[3], name[32];
+    const char **names = NULL;
+    struct tfs_ticket *out = NULL;
+    struct tfs_ctx *c = NULL;
+    uint32_t *ords = NULL;
+    size_t i, k = 0;
+    int rc = -1;
+
+    if (bench_tmpdir(b->home, sizeof(b->home), "selfbench") != 0) {
+        b->home[0] = '\0';
+        return -1;
+    }
+    snprintf(b->base, sizeof(b->base), "%s/base", b->home);
+    b->env = child_env(b->home);
+    names = calloc(SELFBENCH_TICKETS, sizeof(*names));
+    out = calloc(SELFBENCH_TICKETS, sizeof(*out));
+    ords = calloc(SELFBENCH_TICKETS, sizeof(*ords));
+    if (!b->env || !names || !out || !ords || tfs_ctx_open(&c, b->base) != 0)
+        goto out;
+    for (i = 0; i < SELFBENCH_TICKETS; i++) {
+        snprintf(name, sizeof(name), "INC%07zu", i);
+        if (!(names[i] = strdup(name)))
+            goto out;
+    }
+    if (tfs_create_many(c, names, SELFBENCH_TICKETS, out) < 0)
+        goto out;
+    /* One ticket in ten carries the tag the tagged and query runs ask for. */
+    for (i = 0; i < SELFBENCH_TICKETS; i += 10)
+        if (out[i].ord != TICKET_NONE)
+            ords[k++] = out[i].ord;
+    if (tags_update(tfs_state_dir(c), "vpn", ords, k, 1) != 0)
+        goto out;
+
+    for (i = 0; i < 3; i++) {
+        const char *v = getenv(keep[i]);
+
+        saved[i] = v ? strdup(v) : NULL;
+        unsetenv(keep[i]);
+    }
+    setenv("HOME", b->home, 1);
+    rc = config_save_base(b->base);
+    for (i = 0; i < 3; i++) {
+        if (saved[i])
+            setenv(keep[i], saved[i], 1);
+        else
+            unsetenv(keep[i]);
+        free(saved[i]);
+    }
+    if (rc != 0)
+        fprintf(stderr, "selfbench: could not write the scratch config\n");
+out:
+    if (c)
+        tfs_ctx_close(c);
+    if (names)
+        for (i = 0; i < SELFBENCH_TICKETS; i++)
+            free((char *)names[i]);
+    free(names);
+    free(out);
+    free(ords);
+    return rc;
+}
+
+static void teardown(struct bench *b)
+{
+    int i;
+
+    if (b->env) {
+        for (i = 0; b->env[i]; i++)
+            ;
+        free(b->env[i - 1]);
+        free(b->env);
+    }
+    for (i = 0; i < b->nlibs; i++)
+        free(b->libs[i]);
+    bench_rmtree(b->home);
+}
+
+/* Shared objects mapped into this process: what a dynamic build loads too. */
+static void find_libs(struct bench *b)
+{
+    char line[4352], *path;
+    FILE *f = fopen("/proc/self/maps", "r");
+    int i;
+
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f) && b->nlibs < MAX_LIBS) {
+        path = strchr(line, '/');
+        if (!path || !strstr(path, ".so"))
+            continue;
+        path[strcspn(path, "\n")] = '\0';
+        for (i = 0; i < b->nlibs && strcmp(b->libs[i], path); i++)
+            ;
+        if (i == b->nlibs && (b->libs[i] = strdup(path)))
+            b->nlibs++;
+    }
+    fclose(f);
+}
+
+static void evict_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static int evict_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    if (type == FTW_F)
+        evict_file(path);
+    return 0;
+}
+
+/*
+ * Make the next run start cold. As root the whole page cache goes;
+ * otherwise the pages we can name are dropped one file at a time: the
+ * binary, the shared libraries and everything under the scratch base.
+ * Dirty pages cannot be dropped, so the base is synced first.
+ */
+static void evict(struct bench *b, const char *bin)
+{
+    int fd, i;
+
+    fd = open(b->home, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        syncfs(fd);
+        close(fd);
+    }
+    if (b->drop_caches) {
+        fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            if (write(fd, "3", 1) == 1) {
+                close(fd);
+                return;
+            }
+            close(fd);
+        }
+        b->drop_caches = 0;
+    }
+    evict_file(bin);
+    for (i = 0; i < b->nlibs; i++)
+        evict_file(b->libs[i]);
+    nftw(b->home, evict_entry, 16, FTW_PHYS);
+}
+
+static void build_args(struct bench *b, const char *bin, size_t cmd, char *name,
+                       char *args[MAX_ARGS + 2])
+{
+    int i;
+
+    args[0] = (char *)bin;
+    for (i = 0; i < MAX_ARGS && commands[cmd].args[i]; i++)
+        args[i + 1] = (char *)commands[cmd].args[i];
+    if (!strcmp(commands[cmd].label, "create")) {
+        snprintf(name, 32, "NEW%07ld", b->created++);
+        args[++i] = name;
+    }
+    args[i + 1] = NULL;
+}
+
+static void quiet_child(void)
+{
+    int null = open("/dev/null", O_RDWR);
+
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+}
+
+static long long proc_io(pid_t pid)
+{
+    char path[64], key[32];
+    long long v, total = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fscanf(f, "%31[^:]: %lld\n", key, &v) == 2)
+        if (!strcmp(key, "syscr") || !strcmp(key, "syscw"))
+            total += v;
+    fclose(f);
+    return total;
+}
+
+/*
+ * One exec-to-exit run. The clock stops when the child exits; waitid
+ * with WNOWAIT leaves it a zombie so its /proc/<pid>/io is still there,
+ * and wait4 then reaps it with its rusage.
+ */
+static int run_once(struct bench *b, char *const args[], struct sample *s)
+{
+    struct timespec t0;
+    struct rusage ru;
+    siginfo_t si;
+    pid_t pid;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = fork();
+    if (pid == 0) {
+        quiet_child();
+        execve(args[0], args, b->env);
+        _exit(127);
+    }
+    if (pid < 0)
+        return -1;
+    if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) != 0)
+        return -1;
+    s->ms = bench_ms_since(&t0);
+    s->rdwr = proc_io(pid);
+    if (wait4(pid, &status, 0, &ru) != pid)
+        return -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        fprintf(stderr, "selfbench: could not run %s\n", args[0]);
+        return -1;
+    }
+    s->minflt = ru.ru_minflt;
+    s->majflt = ru.ru_majflt;
+    s->maxrss = ru.ru_maxrss;
+    s->csw = ru.ru_nvcsw + ru.ru_nivcsw;
+    return 0;
+}
+
+/*
+ * Syscalls made by one run, counted with ptrace syscall stops (two per
+ * call, one for the exit_group that never returns). -1 where tracing is
+ * not allowed.
+ */
+static long count_syscalls(struct bench *b, char *const args[])
+{
+    long stops = 0;
+    pid_t pid, t;
+    int status;
+
+    pid = fork();
+    if (pid == 0) {
+        quiet_child();
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+            _exit(126);
+        raise(SIGSTOP);
+        execve(args[0], args, b->env);
+        _exit(127);
+    }
+    if (pid < 0)
+        return -1;
+    if (waitpid(pid, &status, 0) != pid)
+        return -1;
+    if (!WIFSTOPPED(status))
+        return -1;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL,
+               (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                              PTRACE_O_EXITKILL)) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    /* Threads the command starts are followed too; ECHILD once all are gone. */
+    while ((t = waitpid(-1, &status, __WALL)) > 0) {
+        int sig = 0;
+
+        if (!WIFSTOPPED(status))
+            continue;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+        else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+            sig = WSTOPSIG(status);
+        ptrace(PTRACE_SYSCALL, t, NULL, (void *)(long)sig);
+    }
+    return (stops + 1) / 2;
+}
+
+static int measure(struct bench *b, const char *bin, size_t cmd, int runs, int cold,
+                   struct result *r)
+{
+    struct sample *s = calloc(runs, sizeof(*s));
+    double *ms = calloc(runs, sizeof(*ms));
+    char *args[MAX_ARGS + 2], name[32];
+    int i, io = 1, rc = -1;
+
+    if (!s || !ms)
+        goto out;
+    memset(r, 0, sizeof(*r));
+    r->syscalls = -1;
+    if (!cold) {
+        build_args(b, bin, cmd, name, args);
+        if (run_once(b, args, &s[0]) != 0)
+            goto out;
+        build_args(b, bin, cmd, name, args);
+        r->syscalls = count_syscalls(b, args);
+    }
+    for (i = 0; i < runs; i++) {
+        build_args(b, bin, cmd, name, args);
+        if (cold)
+            evict(b, bin);
+        if (run_once(b, args, &s[i]) != 0)
+            goto out;
+        ms[i] = s[i].ms;
+        r->mean += s[i].ms / runs;
+        r->minflt += (double)s[i].minflt / runs;
+        r->majflt += (double)s[i].majflt / runs;
+        r->maxrss += (double)s[i].maxrss / runs;
+        r->csw += (double)s[i].csw / runs;
+        r->rdwr += (double)s[i].rdwr / runs;
+        io &= s[i].rdwr >= 0;
+    }
+    if (!io)
+        r->rdwr = -1;
+    qsort(ms, runs, sizeof(*ms), cmp_double);
+    r->p50 = ms[(runs - 1) / 2];
+    r->p90 = ms[(int)((runs - 1) * 0.90)];
+    r->p99 = ms[(int)((runs - 1) * 0.99)];
+    r->max = ms[runs - 1];
+    rc = 0;
+out:
+    free(s);
+    free(ms);
+    return rc;
+}
+
+/* Static or dynamic: a dynamic executable names its loader in PT_INTERP. */
+static void describe(const char *bin, FILE *out)
+{
+    Elf64_Ehdr eh;
+    Elf64_Phdr ph;
+    struct stat st;
+    char interp[256] = "";
+    int fd = open(bin, O_RDONLY | O_CLOEXEC), i, found = 0;
+
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        fprintf(out, "%s: not readable\n", bin);
+        return;
+    }
+    if (pread(fd, &eh, sizeof(eh), 0) == sizeof(eh) &&
+        memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 && eh.e_ident[EI_CLASS] == ELFCLASS64) {
+        for (i = 0; i < eh.e_phnum; i++) {
+            if (pread(fd, &ph, sizeof(ph), eh.e_phoff + (off_t)i * eh.e_phentsize) != sizeof(ph))
+                break;
+            if (ph.p_type == PT_INTERP && ph.p_filesz < sizeof(interp) &&
+                pread(fd, interp, ph.p_filesz, ph.p_offset) == (ssize_t)ph.p_filesz) {
+                interp[ph.p_filesz] = '\0';
+                found = 1;
+            }
+        }
+    }
+    close(fd);
+    if (found)
+        fprintf(out, "%s: dynamic (%s), %lld KB\n", bin, interp, (long long)st.st_size / 1024);
+    else
+        fprintf(out, "%s: static, %lld KB\n", bin, (long long)st.st_size / 1024);
+}
+
+static void print_row(FILE *out, const char *mode, const char *label, const struct result *r)
+{
+    fprintf(out, "%-4s %-7s %7.2f %7.2f %7.2f %7.2f %7.2f %7.0f %6.1f %7.0f %5.1f ",
+            mode, label, r->p50, r->p90, r->p99, r->max, r->mean, r->minflt,
+            r->majflt, r->maxrss, r->csw);
+    if (r->rdwr >= 0)
+        fprintf(out, "%6.0f ", r->rdwr);
+    else
+        fprintf(out, "%6s ", "-");
+    if (r->syscalls >= 0)
+        fprintf(out, "%8ld\n", r->syscalls);
+    else
+        fprintf(out, "%8s\n", "-");
+}
+
+int selfbench_run(const struct selfbench_opts *o, FILE *out)
+{
+    struct selfbench_opts opts = *o;
+    struct result (*res)[2][NCOMMANDS] = NULL;
+    struct bench b;
+    char self[4096];
+    const char *method;
+    ssize_t len;
+    size_t c;
+    int i, mode, rc = -1;
+
+    memset(&b, 0, sizeof(b));
+    if (opts.runs <= 0)
+        opts.runs = 30;
+    if (opts.cold_runs < 0)
+        opts.cold_runs = 0;
+    if (opts.nbinaries == 0) {
+        len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (len <= 0) {
+            fprintf(stderr, "selfbench: cannot find this binary\n");
+            return -1;
+        }
+        self[len] = '\0';
+        opts.binaries[opts.nbinaries++] = self;
+    }
+    for (i = 0; i < opts.nbinaries; i++) {
+        if (access(opts.binaries[i], X_OK) != 0) {
+            fprintf(stderr, "selfbench: %s: %s\n", opts.binaries[i], strerror(errno));
+            return -1;
+        }
+    }
+    res = calloc(opts.nbinaries, sizeof(*res));
+    if (!res || setup(&b) != 0)
+        goto out;
+    find_libs(&b);
+    b.drop_caches = opts.drop_caches && opts.cold_runs;
+    if (b.drop_caches && geteuid() != 0) {
+        fprintf(stderr, "selfbench: --drop-caches needs root; using posix_fadvise\n");
+        b.drop_caches = 0;
+    }
+
+    fprintf(out, "scratch base: %d tickets, %d tagged; %d warm runs", SELFBENCH_TICKETS,
+            (SELFBENCH_TICKETS + 9) / 10, opts.runs);
+    if (opts.cold_runs)
+        fprintf(out, ", %d cold runs", opts.cold_runs);
+    fprintf(out, " per command\n");
+    for (i = 0; i < opts.nbinaries; i++) {
+        fprintf(out, "\n");
+        describe(opts.binaries[i], out);
+        fprintf(out, "mode command   p50ms   p90ms   p99ms   maxms  meanms  minflt majflt  rss KB   csw  rd+wr syscalls\n");
+        for (mode = 0; mode < 2; mode++) {
+            int cold = mode == 1;
+
+            if (cold && !opts.cold_runs)
+                break;
+            for (c = 0; c < NCOMMANDS; c++) {
+                if (measure(&b, opts.binaries[i], c, cold ? opts.cold_runs : opts.runs,
+                            cold, &res[i][mode][c]) != 0)
+                    goto out;
+                print_row(out, cold ? "cold" : "warm", commands[c].label, &res[i][mode][c]);
+            }
+        }
+    }
+    if (opts.cold_runs) {
+        method = b.drop_caches ? "drop_caches" : "posix_fadvise(DONTNEED) on the binary, "
+                 "its libraries and the base; the kernel may keep shared pages";
+        fprintf(out, "\ncold runs evicted with %s\n", method);
+    }
+
+    if (opts.nbinaries > 1) {
+        fprintf(out, "\np50 ms, side by side\ncommand  ");
+        for (i = 0; i < opts.nbinaries; i++)
+            fprintf(out, "   warm#%d", i + 1);
+        if (opts.cold_runs)
+            for (i = 0; i < opts.nbinaries; i++)
+                fprintf(out, "   cold#%d", i + 1);
+        fprintf(out, "\n");
+        for (c = 0; c < NCOMMANDS; c++) {
+            fprintf(out, "%-8s ", commands[c].label);
+            for (i = 0; i < opts.nbinaries; i++)
+                fprintf(out, " %8.2f", res[i][0][c].p50);
+            if (opts.cold_runs)
+                for (i = 0; i < opts.nbinaries; i++)
+                    fprintf(out, " %8.2f", res[i][1][c].p50);
+            fprintf(out, "\n");
+        }
+        for (i = 0; i < opts.nbinaries; i++)
+            fprintf(out, "#%d %s\n", i + 1, opts.binaries[i]);
+    }
+    rc = 0;
+out:
+    free(res);
+    if (b.home[0])
+        teardown(&b);
+    return rc;
+}
+
+int selfbench_main(int argc, char *argv[])
+{
+    struct selfbench_opts opts = { { NULL }, 0, 30, 10, 0 };
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+            opts.runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--cold-runs") && i + 1 < argc)
+            opts.cold_runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--no-cold"))
+            opts.cold_runs = 0;
+        else if (!strcmp(argv[i], "--drop-caches"))
+            opts.drop_caches = 1;
+        else if (!strcmp(argv[i], "--binary") && i + 1 < argc &&
+                 opts.nbinaries < SELFBENCH_MAX_BINARIES)
+            opts.binaries[opts.nbinaries++] = argv[++i];
+        else
+            break;
+    }
+    if (i < argc) {
+        printf("Usage: selfbench [--runs N] [--cold-runs N | --no-cold] [--drop-caches] "
+               "[--binary PATH]...\n");
+        return 1;
+    }
+    return selfbench_run(&opts, stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+#ifndef SELFBENCH_H
+#define SELFBENCH_H
+
+#include <stdio.h>
+
+/*
+ * Startup budget: exec-to-exit latency of the common commands, measured
+ * from outside on a scratch base of SELFBENCH_TICKETS tickets. Every
+ * command runs warm (after one untimed run) and cold (with the binary,
+ * its libraries and the state files dropped from the page cache first:
+ * posix_fadvise by default, or the whole cache through
+ * /proc/sys/vm/drop_caches when asked to and running as root).
+ * Next to the latency distribution it reports what the kernel accounted
+ * to the child: page faults, peak RSS and context switches from wait4(),
+ * read and write syscalls from /proc/<pid>/io (read before the child is
+ * reaped) and, from one extra traced run, the total number of syscalls.
+ *
+ * Several binaries can be measured side by side, for instance the usual
+ * build next to a -static one or one linked against a minimal libc.
+ */
+
+#define SELFBENCH_TICKETS 2000
+#define SELFBENCH_MAX_BINARIES 4
+
+struct selfbench_opts {
+    const char *binaries[SELFBENCH_MAX_BINARIES];   /* none: this binary */
+    int nbinaries;
+    int runs;               /* warm runs per command */
+    int cold_runs;          /* 0 skips the cold pass */
+    int drop_caches;        /* evict the whole page cache; needs root */
+};
+
+int selfbench_run(const struct selfbench_opts *o, FILE *out);
+/* selfbench [--runs N] [--cold-runs N | --no-cold] [--drop-caches] [--binary PATH]... */
+int selfbench_main(int argc, char *argv[]);
+
+#endif
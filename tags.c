@@ -0,0 +1,334 @@
+#include "tags.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+int tags_valid_name(const char *tag)
+{
+    size_t n = strlen(tag);
+
+    if (n == 0 || n > 64 || tag[0] == '.')
+        return 0;
+    for (; *tag; tag++)
+        if (*tag == '/' || *tag == '\n' || (unsigned char)*tag < 0x20)
+            return 0;
+    return 1;
+}
+
+static int tag_path(const char *state_dir, const char *tag, char *out, size_t n)
+{
+    char dir[4096];
+
+    if (!tags_valid_name(tag))
+        return -1;
+    snprintf(dir, sizeof(dir), "%s/tags", state_dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    if (snprintf(out, n, "%s/%s.rbm", dir, tag) >= (int)n)
+        return -1;
+    return 0;
+}
+
+/* <tag>.log beside <tag>.rbm. */
+static void log_path(const char *path, char *out, size_t n)
+{
+    snprintf(out, n, "%.*s.log", (int)(strlen(path) - 4), path);
+}
+
+static int apply(struct rbitmap *b, const struct tag_change *c, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        if ((c[i].add ? rb_add(b, c[i].ord) : rb_remove(b, c[i].ord)) != 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * The whole records of the log; a torn last record is ignored. Replaying a
+ * log onto an image that already has its changes gives the same image, so
+ * a log is still safe to replay after a compaction that crashed before
+ * truncating it.
+ */
+static int read_log(int fd, struct tag_change **out, size_t *n)
+{
+    struct stat st;
+    size_t len;
+    ssize_t got;
+
+    *out = NULL;
+    *n = 0;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    len = (size_t)st.st_size / sizeof(**out) * sizeof(**out);
+    if (len == 0)
+        return 0;
+    *out = malloc(len);
+    if (!*out)
+        return -1;
+    got = pread(fd, *out, len, 0);
+    if (got < 0) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    *n = (size_t)got / sizeof(**out);
+    return 0;
+}
+
+int tags_load(const char *state_dir, const char *tag, struct rbitmap *b)
+{
+    char path[4200], logp[4200], lock[4200];
+    struct tag_change *c = NULL;
+    size_t n = 0;
+    int fd, lockfd, rc = 0;
+
+    rb_init(b);
+    if (tag_path(state_dir, tag, path, sizeof(path)) != 0)
+        return -1;
+    /*
+     * The image and the log are read under a shared lock, so a compaction
+     * cannot fold newer changes into the image between the two reads. The
+     * log then holds exactly the changes made since the image was written,
+     * and they are replayed onto it in order. Without a lock file no tag
+     * has been written yet.
+     */
+    snprintf(lock, sizeof(lock), "%s/tags/.lock", state_dir);
+    lockfd = open(lock, O_RDONLY | O_CLOEXEC);
+    if (lockfd >= 0)
+        flock(lockfd, LOCK_SH);
+    if (rb_map(b, path) != 0 && errno != ENOENT)
+        rc = -1;
+    log_path(path, logp, sizeof(logp));
+    fd = rc == 0 ? open(logp, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0) {
+        rc = read_log(fd, &c, &n);
+        close(fd);
+    } else if (rc == 0 && errno != ENOENT) {
+        rc = -1;
+    }
+    if (lockfd >= 0) {
+        flock(lockfd, LOCK_UN);
+        close(lockfd);
+    }
+    if (rc == 0)
+        rc = apply(b, c, n);
+    free(c);
+    if (rc != 0)
+        rb_free(b);
+    return rc;
+}
+
+/* Under the lock: fold the log and c into a new image, then empty the log. */
+static int compact(const char *path, int logfd, const struct tag_change *c, size_t n)
+{
+    struct tag_change *logged;
+    struct rbitmap b;
+    size_t nlog;
+    int rc = 0;
+
+    if (read_log(logfd, &logged, &nlog) != 0)
+        return -1;
+    rb_init(&b);
+    if (rb_map(&b, path) != 0 && errno != ENOENT)
+        rc = -1;
+    if (rc == 0)
+        rc = apply(&b, logged, nlog);
+    if (rc == 0)
+        rc = apply(&b, c, n);
+    if (rc == 0)
+        rc = rb_save(&b, path);
+    if (rc == 0 && ftruncate(logfd, 0) != 0)
+        rc = -1;
+    rb_free(&b);
+    free(logged);
+    return rc;
+}
+
+int tags_apply(const char *state_dir, const char *tag, const struct tag_change *c,
+               size_t n)
+{
+    char path[4200], logp[4200], lock[4200];
+    struct stat st;
+    off_t end;
+    int fd, logfd, rc = 0;
+
+    if (tag_path(state_dir, tag, path, sizeof(path)) != 0)
+        return -1;
+    log_path(path, logp, sizeof(logp));
+    snprintf(lock, sizeof(lock), "%s/tags/.lock", state_dir);
+    fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    flock(fd, LOCK_EX);
+    logfd = open(logp, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (logfd < 0 || fstat(logfd, &st) != 0) {
+        rc = -1;
+        goto out;
+    }
+
+    /*
+     * A new tag gets its image at once so tags_foreach sees it, and a batch
+     * larger than the log is worth goes straight into the image.
+     */
+    end = st.st_size / (off_t)sizeof(*c) * (off_t)sizeof(*c);
+    if (access(path, F_OK) != 0 || n > TAGS_LOG_BATCH) {
+        rc = compact(path, logfd, c, n);
+        goto out;
+    }
+    /* Drop a record torn by a crash so the appends stay aligned. */
+    if (end != st.st_size && ftruncate(logfd, end) != 0) {
+        rc = -1;
+        goto out;
+    }
+    if (pwrite(logfd, c, n * sizeof(*c), end) != (ssize_t)(n * sizeof(*c)) ||
+        fdatasync(logfd) != 0)
+        rc = -1;
+    else if ((size_t)end / sizeof(*c) + n >= TAGS_LOG_MAX)
+        rc = compact(path, logfd, NULL, 0);
+
+out:
+    if (logfd >= 0)
+        close(logfd);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return rc;
+}
+
+int tags_update(const char *state_dir, const char *tag, const uint32_t *ords,
+                size_t n, int add)
+{
+    struct tag_change buf[TAGS_LOG_BATCH] = { { 0, 0 } }, *c = buf;
+    size_t i;
+    int rc;
+
+    if (n > TAGS_LOG_BATCH) {
+        c = malloc(n * sizeof(*c));
+        if (!c)
+            return -1;
+    }
+    for (i = 0; i < n; i++) {
+        c[i].ord = ords[i];
+        c[i].add = add != 0;
+    }
+    rc = tags_apply(state_dir, tag, c, n);
+    if (c != buf)
+        free(c);
+    return rc;
+}
+
+int tags_move(const char *state_dir, const char *tag, uint32_t from, uint32_t to)
+{
+    struct tag_change c[2] = { { to, 1 }, { from, 0 } };
+
+    return tags_apply(state_dir, tag, c, 2);
+}
+
+int tags_foreach(const char *state_dir, int (*fn)(const char *tag, void *arg),
+                 void *arg)
+{
+    char dir[4096];
+    struct dirent *de;
+    DIR *d;
+
+    snprintf(dir, sizeof(dir), "%s/tags", state_dir);
+    d = opendir(dir);
+    if (!d)
+        return errno == ENOENT ? 0 : -1;
+    while ((de = readdir(d)) != NULL) {
+        char name[256];
+        size_t len = strlen(de->d_name);
+
+        if (de->d_name[0] == '.' || len < 5 || strcmp(de->d_name + len - 4, ".rbm"))
+            continue;
+        memcpy(name, de->d_name, len - 4);
+        name[len - 4] = '\0';
+        if (fn(name, arg))
+            break;
+    }
+    closedir(d);
+    return 0;
+}
+
+/* Benchmark: set algebra over synthetic tags on a few hundred thousand tickets. */
+
+static double elapsed_us(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+int tags_bench(int argc, char *argv[])
+{
+    uint32_t universe = argc > 0 ? (uint32_t)atoi(argv[0]) : 500000;
+    struct rbitmap dense, sparse, out;
+    struct timespec t0, t1;
+    uint32_t v, seed = 12345;
+    int i, rounds = 100;
+    double t;
+
+    if (universe == 0)
+        universe = 500000;
+    rb_init(&dense);
+    rb_init(&sparse);
+    rb_init(&out);
+    for (v = 0; v < universe; v++) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 3 == 0)
+            rb_add(&dense, v);
+        if ((seed >> 8) % 97 == 0)
+            rb_add(&sparse, v);
+    }
+    printf("universe %u, dense %llu, sparse %llu\n", universe,
+           (unsigned long long)rb_cardinality(&dense),
+           (unsigned long long)rb_cardinality(&sparse));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < rounds; i++)
+        rb_and(&out, &dense, &sparse);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t = elapsed_us(&t0, &t1) / rounds;
+    printf("AND     %8.1f us  -> %llu\n", t, (unsigned long long)rb_cardinality(&out));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < rounds; i++)
+        rb_or(&out, &dense, &sparse);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t = elapsed_us(&t0, &t1) / rounds;
+    printf("OR      %8.1f us  -> %llu\n", t, (unsigned long long)rb_cardinality(&out));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < rounds; i++)
+        rb_andnot(&out, &dense, &sparse);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t = elapsed_us(&t0, &t1) / rounds;
+    printf("ANDNOT  %8.1f us  -> %llu\n", t, (unsigned long long)rb_cardinality(&out));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < rounds; i++)
+        rb_not(&out, &sparse, universe);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t = elapsed_us(&t0, &t1) / rounds;
+    printf("NOT     %8.1f us  -> %llu\n", t, (unsigned long long)rb_cardinality(&out));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < 100000; i++) {
+        rb_add(&sparse, (uint32_t)(i * 7919u) % universe);
+        rb_remove(&sparse, (uint32_t)(i * 7919u) % universe);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("tag+untag %6.3f us\n", elapsed_us(&t0, &t1) / 100000);
+
+    rb_free(&dense);
+    rb_free(&sparse);
+    rb_free(&out);
+    return 0;
+}
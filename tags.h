@@ -0,0 +1,38 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbitmap.h"
+
+/*
+ * One roaring bitmap of ticket ordinals per tag, in <state>/tags/<tag>.rbm.
+ * Small changes are appended to <tag>.log and synced instead of rewriting
+ * the bitmap; loading replays the log, and it is folded into the bitmap
+ * once it holds TAGS_LOG_MAX changes.
+ */
+
+#define TAGS_LOG_BATCH 64       /* larger changes rewrite the bitmap directly */
+#define TAGS_LOG_MAX 4096
+
+struct tag_change {
+    uint32_t ord;
+    uint32_t add;           /* 0 to remove */
+};
+
+int tags_valid_name(const char *tag);
+int tags_load(const char *state_dir, const char *tag, struct rbitmap *b);
+/* Applies all of c under one lock with one sync. */
+int tags_apply(const char *state_dir, const char *tag, const struct tag_change *c,
+               size_t n);
+int tags_update(const char *state_dir, const char *tag, const uint32_t *ords,
+                size_t n, int add);
+/* Moves the tag from one ticket to another in a single change. */
+int tags_move(const char *state_dir, const char *tag, uint32_t from, uint32_t to);
+int tags_foreach(const char *state_dir, int (*fn)(const char *tag, void *arg),
+                 void *arg);
+
+int tags_bench(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "archive.h"
+#include "test.h"
+
+/* Rename one table of contents entry in place; the names must be the same length. */
+static int patch_name(const char *pack, const char *from, const char *to)
+{
+    static char buf[1 << 20];
+    size_t n = strlen(from);
+    char *p, *last = NULL;
+    ssize_t len;
+    int fd = open(pack, O_RDWR | O_CLOEXEC), rc = -1;
+
+    if (fd < 0)
+        return -1;
+    len = read(fd, buf, sizeof(buf));
+    /* The table of contents is at the end, after any file holding the same bytes. */
+    for (p = buf; len > 0 && (p = memmem(p, buf + len - p, from, n)) != NULL; p++)
+        last = p;
+    if (last && strlen(to) == n && pwrite(fd, to, n, last - buf) == (ssize_t)n)
+        rc = 0;
+    close(fd);
+    return rc;
+}
+
+static int pack_tree(const char *src, const char *pack)
+{
+    struct archive_opts o;
+    struct archive_stats st;
+
+    memset(&o, 0, sizeof(o));
+    return archive_pack(src, pack, &o, &st);
+}
+
+/* Names that only contain dots come back intact, checked and unpacked. */
+static void dotted_names_round_trip(void)
+{
+    static const char *const names[] = { "sub/..data", "..hidden", "a..b", "sub/.x" };
+    char dir[256], src[300], dst[300], pack[300], path[400], buf[256];
+    struct archive_stats st;
+    size_t i;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-archive") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(src, sizeof(src), "%s/INC0000001", dir);
+    snprintf(dst, sizeof(dst), "%s/out", dir);
+    snprintf(pack, sizeof(pack), "%s/INC0000001.tfp", dir);
+    mkdir(src, 0755);
+    snprintf(path, sizeof(path), "%s/sub", src);
+    mkdir(path, 0755);
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", src, names[i]);
+        CHECK(test_write(path, names[i]) == 0);
+    }
+
+    CHECK(pack_tree(src, pack) == 0);
+    CHECK(archive_unpack(pack, NULL, NULL, &st) == 0);
+    CHECK(archive_unpack(pack, dst, NULL, &st) == 0);
+    CHECK(st.files == 4);
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dst, names[i]);
+        CHECK(!strcmp(test_read(path, buf, sizeof(buf)), names[i]));
+    }
+    snprintf(path, sizeof(path), "%s/extracted", dir);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(archive_extract(pack, "sub/..data", NULL, fd) == 0);
+    close(fd);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "sub/..data"));
+    bench_rmtree(dir);
+}
+
+/* Absolute and parent-relative names are refused before anything is written. */
+static void escaping_names_rejected(void)
+{
+    char dir[256], src[300], dst[300], pack[300], path[400];
+    struct archive_stats st;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-archive") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(src, sizeof(src), "%s/INC0000001", dir);
+    snprintf(dst, sizeof(dst), "%s/out/in", dir);
+    snprintf(pack, sizeof(pack), "%s/INC0000001.tfp", dir);
+    mkdir(src, 0755);
+    snprintf(path, sizeof(path), "%s/out", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/ab", src);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/ab/zz", src);
+    CHECK(test_write(path, "escape") == 0);
+
+    CHECK(pack_tree(src, pack) == 0);
+    CHECK(patch_name(pack, "ab/zz", "../zz") == 0);
+    CHECK(archive_unpack(pack, NULL, NULL, &st) != 0);
+    CHECK(archive_unpack(pack, dst, NULL, &st) != 0);
+    snprintf(path, sizeof(path), "%s/out/zz", dir);
+    CHECK(!test_exists(path));
+
+    CHECK(pack_tree(src, pack) == 0);
+    CHECK(patch_name(pack, "ab/zz", "/ab/z") == 0);
+    CHECK(archive_unpack(pack, NULL, NULL, &st) != 0);
+
+    CHECK(pack_tree(src, pack) == 0);
+    CHECK(patch_name(pack, "ab/zz", "ab/./") == 0);
+    CHECK(archive_unpack(pack, NULL, NULL, &st) != 0);
+    bench_rmtree(dir);
+}
+
+/* An entry below a symlink is not written through it, whatever the order. */
+static void symlinked_parent_rejected(void)
+{
+    char dir[256], src[300], dst[300], pack[300], path[400], outside[300];
+    struct archive_stats st;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-archive") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(src, sizeof(src), "%s/INC0000001", dir);
+    snprintf(dst, sizeof(dst), "%s/out", dir);
+    snprintf(pack, sizeof(pack), "%s/INC0000001.tfp", dir);
+    snprintf(outside, sizeof(outside), "%s/outside", dir);
+    mkdir(src, 0755);
+    mkdir(outside, 0755);
+    snprintf(path, sizeof(path), "%s/evil", src);
+    CHECK(symlink(outside, path) == 0);
+    snprintf(path, sizeof(path), "%s/evim", src);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/evim/x", src);
+    CHECK(test_write(path, "escape") == 0);
+
+    CHECK(pack_tree(src, pack) == 0);
+    CHECK(patch_name(pack, "evim/x", "evil/x") == 0);
+    CHECK(archive_unpack(pack, dst, NULL, &st) != 0);
+    snprintf(path, sizeof(path), "%s/x", outside);
+    CHECK(!test_exists(path));
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(dotted_names_round_trip);
+    RUN(escaping_names_rejected);
+    RUN(symlinked_parent_rejected);
+    return TEST_EXIT();
+}
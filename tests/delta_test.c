@@ -0,0 +1,167 @@
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cdc.h"
+#include "delta.h"
+#include "test.h"
+
+#define DATA (3 << 20)
+#define EDIT_AT (DATA / 2)
+#define EDIT 100
+
+static uint8_t v1[DATA], v2[DATA + EDIT], back[DATA + EDIT];
+
+/* v2 is v1 with EDIT bytes inserted halfway. */
+static void make_versions(void)
+{
+    RAND_bytes(v1, sizeof(v1));
+    memcpy(v2, v1, EDIT_AT);
+    RAND_bytes(v2 + EDIT_AT, EDIT);
+    memcpy(v2 + EDIT_AT + EDIT, v1 + EDIT_AT, DATA - EDIT_AT);
+}
+
+static size_t cut_points(const uint8_t *p, size_t n, size_t *cuts, size_t max)
+{
+    size_t off = 0, k = 0;
+
+    while (off < n && k < max) {
+        off += cdc_next(p + off, n - off);
+        cuts[k++] = off;
+    }
+    return k;
+}
+
+/* Every chunk but the last is between CDC_MIN and CDC_MAX, and they tile the input. */
+static void chunks_within_bounds(void)
+{
+    size_t cuts[DATA / CDC_MIN + 1], n, i, prev = 0;
+    int ok = 1;
+
+    n = cut_points(v1, DATA, cuts, sizeof(cuts) / sizeof(cuts[0]));
+    CHECK(n > 0 && cuts[n - 1] == DATA);
+    for (i = 0; i + 1 < n; i++) {
+        ok &= cuts[i] - prev > CDC_MIN && cuts[i] - prev <= CDC_MAX;
+        prev = cuts[i];
+    }
+    CHECK(ok);
+    /* Random bytes: the average lands near CDC_AVG. */
+    CHECK(DATA / n > CDC_AVG / 2 && DATA / n < CDC_AVG * 2);
+}
+
+/* An insertion moves the cut points next to it; past CDC_MAX they line up again. */
+static void edit_moves_nearby_cuts_only(void)
+{
+    size_t a[DATA / CDC_MIN + 1], b[DATA / CDC_MIN + 2], na, nb, i, j = 0;
+    int ok = 1;
+
+    na = cut_points(v1, DATA, a, sizeof(a) / sizeof(a[0]));
+    nb = cut_points(v2, DATA + EDIT, b, sizeof(b) / sizeof(b[0]));
+    for (i = 0; i < na && a[i] < EDIT_AT; i++)
+        ok &= a[i] == b[i];
+    for (; i < na; i++) {
+        if (a[i] < EDIT_AT + 2 * CDC_MAX)
+            continue;
+        while (j < nb && b[j] < a[i] + EDIT)
+            j++;
+        ok &= j < nb && b[j] == a[i] + EDIT;
+    }
+    CHECK(ok);
+}
+
+static int put_bytes(const char *dir, const char *state, const char *name, const uint8_t *p,
+                     size_t n, struct delta_stats *st)
+{
+    char path[400];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, p, n) != (ssize_t)n) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return delta_put(state, 7, path, name, st);
+}
+
+static int get_matches(const char *dir, const char *state, const char *name, const uint8_t *p,
+                       size_t n)
+{
+    char path[400];
+    int fd, ok;
+
+    snprintf(path, sizeof(path), "%s/out", dir);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return 0;
+    ok = delta_get(state, 7, name, fd) == 0 && pread(fd, back, sizeof(back), 0) == (ssize_t)n &&
+         !memcmp(back, p, n);
+    close(fd);
+    return ok;
+}
+
+/* A second version stores only the chunks around the edit; both read back whole. */
+static void versions_round_trip(void)
+{
+    char dir[256], state[300], path[400];
+    struct delta_stats st;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-delta") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(state, sizeof(state), "%s/state", dir);
+    mkdir(state, 0755);
+    CHECK(put_bytes(dir, state, "v1.bin", v1, DATA, &st) == 0);
+    CHECK(st.new_chunks == st.chunks && st.new_bytes == DATA);
+    CHECK(put_bytes(dir, state, "v2.bin", v2, DATA + EDIT, &st) == 0);
+    CHECK(st.new_chunks >= 1 && st.new_chunks <= 4 && st.chunks > 20);
+    CHECK(get_matches(dir, state, "v1.bin", v1, DATA));
+    CHECK(get_matches(dir, state, "v2.bin", v2, DATA + EDIT));
+    snprintf(path, sizeof(path), "%s/chunks/table", state);
+    CHECK(test_exists(path));
+    bench_rmtree(dir);
+}
+
+/* A damaged chunk table is rebuilt from the index, and nothing is stored twice. */
+static void damaged_table_rebuilt(void)
+{
+    char dir[256], state[300], path[400];
+    struct delta_stats st;
+    uint64_t dirty = UINT64_MAX;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-delta") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(state, sizeof(state), "%s/state", dir);
+    mkdir(state, 0755);
+    CHECK(put_bytes(dir, state, "v1.bin", v1, DATA, &st) == 0);
+
+    /* As a put that died part way leaves it: count follows the 8-byte magic. */
+    snprintf(path, sizeof(path), "%s/chunks/table", state);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    CHECK(fd >= 0 && pwrite(fd, &dirty, sizeof(dirty), 8) == sizeof(dirty));
+    close(fd);
+    CHECK(put_bytes(dir, state, "again.bin", v1, DATA, &st) == 0);
+    CHECK(st.new_chunks == 0);
+
+    CHECK(truncate(path, 100) == 0);
+    CHECK(put_bytes(dir, state, "v2.bin", v2, DATA + EDIT, &st) == 0);
+    CHECK(st.new_chunks <= 4);
+    CHECK(get_matches(dir, state, "v2.bin", v2, DATA + EDIT));
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    make_versions();
+    RUN(chunks_within_bounds);
+    RUN(edit_moves_nearby_cuts_only);
+    RUN(versions_round_trip);
+    RUN(damaged_table_rebuilt);
+    return TEST_EXIT();
+}
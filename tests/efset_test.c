@@ -0,0 +1,106 @@
+#include <stdlib.h>
+
+#include "efset.h"
+#include "test.h"
+
+#define MAXN 20000
+
+static uint64_t vals[MAXN];
+static uint64_t blob[(MAXN * 40) / 8 + 64];
+
+/* What each query should return for x, from a binary search of vals[0, n). */
+static int probe(const struct efset *s, uint64_t n, uint64_t x)
+{
+    uint64_t lo = 0, hi = n, above, v = 0;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (vals[mid] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    above = lo < n && vals[lo] == x ? lo + 1 : lo;
+    return ef_rank(s, x) == lo && ef_lower_bound(s, x, &v) == lo &&
+           (lo == n || v == vals[lo]) && ef_contains(s, x) == (above != lo) &&
+           ef_successor(s, x) == (above < n ? vals[above] : EF_NONE);
+}
+
+/* Encode vals[0, n) and compare every query with the array itself. */
+static int matches(uint64_t n)
+{
+    uint64_t u = n ? vals[n - 1] + 1 : 0, i, v;
+    struct ef_iter it;
+    struct efset s;
+    int ok = 1;
+
+    if (ef_size(n, u) > sizeof(blob) || ef_build(vals, n, blob, sizeof(blob)) != 0 ||
+        ef_view(&s, blob, ef_size(n, u)) != 0)
+        return 0;
+    ok &= s.n == n;
+    for (i = 0; i < n; i++)
+        ok &= ef_select(&s, i) == vals[i];
+    ef_iter_init(&it, &s);
+    for (i = 0; i < n && ef_iter_next(&it, &v); i++)
+        ok &= v == vals[i];
+    ok &= i == n && !ef_iter_next(&it, &v);
+
+    /* Each member, its neighbours, and past the end. */
+    for (i = 0; i < n; i++) {
+        ok &= probe(&s, n, vals[i]) && probe(&s, n, vals[i] + 1);
+        if (vals[i] > 0)
+            ok &= probe(&s, n, vals[i] - 1);
+    }
+    ok &= probe(&s, n, 0) && probe(&s, n, u) && probe(&s, n, u + 1000);
+    return ok;
+}
+
+/* Consecutive numbers, the usual shape of a prefix: no low bits at all. */
+static void dense_run(void)
+{
+    uint64_t i;
+
+    for (i = 0; i < MAXN; i++)
+        vals[i] = i + 1;
+    CHECK(matches(MAXN));
+    CHECK(matches(EF_SAMPLE));
+    CHECK(matches(EF_SAMPLE + 1));
+    CHECK(matches(1));
+    CHECK(matches(0));
+}
+
+/* Random gaps of every size, so the samples land mid-word and mid-run. */
+static void sparse_random(void)
+{
+    uint32_t seed = 7;
+    uint64_t i, v = 0;
+
+    for (i = 0; i < MAXN; i++) {
+        seed = seed * 1103515245 + 12345;
+        v += 1 + (seed >> 16) % (i % 3 == 0 ? 5000 : 20);
+        vals[i] = v;
+    }
+    CHECK(matches(MAXN));
+    CHECK(matches(3 * EF_SAMPLE - 1));
+}
+
+/* A few ticket numbers far apart, as after a renumbering. */
+static void far_apart(void)
+{
+    vals[0] = 3;
+    vals[1] = 1000000;
+    vals[2] = 1000001;
+    vals[3] = 9999999;
+    CHECK(matches(4));
+    vals[0] = 0;
+    CHECK(matches(1));
+}
+
+int main(void)
+{
+    RUN(dense_run);
+    RUN(sparse_random);
+    RUN(far_apart);
+    return TEST_EXIT();
+}
@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "fsck.h"
+#include "index.h"
+#include "meta.h"
+#include "test.h"
+
+static const char *const tickets[] = { "INC0000001", "INC2", "INC0000002", "INC0000003" };
+
+/* A base of four tickets, registered and indexed, with INC2 archived. */
+static int setup(char *dir, size_t n, char *base, char *state, size_t len)
+{
+    char path[400];
+    struct ordmap m;
+    struct meta meta;
+    size_t i;
+
+    if (bench_tmpdir(dir, n, "test-fsck") != 0)
+        return -1;
+    snprintf(base, len, "%s/base", dir);
+    snprintf(state, len, "%s/state", dir);
+    mkdir(base, 0755);
+    mkdir(state, 0755);
+    if (ordmap_open(&m, state) != 0)
+        return -1;
+    if (meta_open(&meta, state) != 0) {
+        ordmap_close(&m);
+        return -1;
+    }
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", base, tickets[i]);
+        mkdir(path, 0755);
+        meta_rescan(&meta, ordmap_add(&m, tickets[i]), path);
+    }
+    CHECK(index_build(state, &m, &meta) == 0);
+    meta_on_archive(&meta, ordmap_lookup(&m, "INC2"), time(NULL));
+    snprintf(path, sizeof(path), "%s/INC2", base);
+    rmdir(path);
+    meta_close(&meta);
+    ordmap_close(&m);
+    return 0;
+}
+
+static int indexed(const char *state, const char *name)
+{
+    struct tindex ix;
+    int has;
+
+    if (index_open(&ix, state) != 0)
+        return 0;
+    has = index_contains(&ix, name);
+    index_close(&ix);
+    return has;
+}
+
+/* An archived INC2 is neither missing nor dropped by a repair. */
+static void archived_not_missing(void)
+{
+    char dir[256], base[300], state[300];
+    struct fsck_opts o = { 1, 1, 1 };
+    struct fsck_report r;
+
+    if (setup(dir, sizeof(dir), base, state, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(fsck_run(base, state, &o, &r, stdout) == 0);
+    CHECK(r.folders == 3);
+    CHECK(r.indexed == 4);
+    CHECK(r.missing == 0 && r.extra == 0);
+    CHECK(indexed(state, "INC2"));
+    CHECK(indexed(state, "INC0000002"));
+    bench_rmtree(dir);
+}
+
+/* A ticket gone without being archived is missing, and only it is unindexed. */
+static void repair_drops_only_missing(void)
+{
+    char dir[256], base[300], state[300], path[400];
+    struct fsck_opts o = { 1, 1, 1 };
+    struct fsck_report r;
+
+    if (setup(dir, sizeof(dir), base, state, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    /* Made first, so it cannot reuse INC0000002's inode and pass for a rename. */
+    snprintf(path, sizeof(path), "%s/INC0000004", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000002", base);
+    rmdir(path);
+    CHECK(fsck_run(base, state, &o, &r, stdout) == 0);
+    CHECK(r.missing == 1 && r.extra == 1);
+    CHECK(r.repaired == 2);
+    CHECK(!indexed(state, "INC0000002"));
+    CHECK(indexed(state, "INC0000004"));
+    CHECK(indexed(state, "INC2"));
+
+    CHECK(fsck_run(base, state, &o, &r, stdout) == 0);
+    CHECK(r.missing == 0 && r.extra == 0 && r.renamed == 0);
+    bench_rmtree(dir);
+}
+
+/* A folder renamed to another ticket name pairs up with its old entry. */
+static void rename_paired_by_inode(void)
+{
+    char dir[256], base[300], state[300], from[400], to[400];
+    struct fsck_opts o = { 1, 1, 1 };
+    struct fsck_report r;
+
+    if (setup(dir, sizeof(dir), base, state, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(from, sizeof(from), "%s/INC0000003", base);
+    snprintf(to, sizeof(to), "%s/CHG0000003", base);
+    CHECK(rename(from, to) == 0);
+    CHECK(fsck_run(base, state, &o, &r, stdout) == 0);
+    CHECK(r.renamed == 1 && r.missing == 0 && r.extra == 0);
+    CHECK(!indexed(state, "INC0000003"));
+    CHECK(indexed(state, "CHG0000003"));
+    bench_rmtree(dir);
+}
+
+/* More prefixes than a sort key can rank still come out in index order. */
+static void many_prefixes_in_order(void)
+{
+    enum { NPREFIX = 65536 + 40 };
+    char dir[256], base[300], state[300], path[400], name[32], prev[32], line[64];
+    struct fsck_opts o = { 0, 0, 0 };
+    struct fsck_report r;
+    FILE *out = tmpfile();
+    long i, lines = 0, ordered = 1;
+
+    if (!out || bench_tmpdir(dir, sizeof(dir), "test-fsck") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(base, sizeof(base), "%s/base", dir);
+    snprintf(state, sizeof(state), "%s/state", dir);
+    mkdir(base, 0755);
+    mkdir(state, 0755);
+    for (i = NPREFIX - 1; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s/%c%c%c%c%ld", base, 'A' + (int)(i / 17576),
+                 'A' + (int)(i / 676 % 26), 'A' + (int)(i / 26 % 26), 'A' + (int)(i % 26),
+                 NPREFIX - i);
+        mkdir(path, 0755);
+    }
+    CHECK(fsck_run(base, state, &o, &r, out) == 0);
+    CHECK(r.folders == NPREFIX && r.extra == NPREFIX);
+    rewind(out);
+    prev[0] = '\0';
+    while (fgets(line, sizeof(line), out)) {
+        if (sscanf(line, "extra %31s", name) != 1)
+            continue;
+        /* Distinct four-letter prefixes: strcmp on the names is index order. */
+        ordered &= strcmp(prev, name) < 0;
+        snprintf(prev, sizeof(prev), "%s", name);
+        lines++;
+    }
+    CHECK(lines == NPREFIX && ordered);
+    fclose(out);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(archived_not_missing);
+    RUN(repair_drops_only_missing);
+    RUN(rename_paired_by_inode);
+    RUN(many_prefixes_in_order);
+    return TEST_EXIT();
+}
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "hooks.h"
+#include "test.h"
+
+static int calls, release;
+
+static void on_create(const struct hook_event *ev)
+{
+    /* "stuck" callbacks hang until the case lets them go. */
+    if (!strcmp(ev->ticket, "stuck"))
+        while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE))
+            usleep(1000);
+    __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+}
+
+static const struct hook_plugin plugin = { HOOKS_ABI, "test", on_create, NULL, NULL };
+
+static int wait_calls(int want, long ms)
+{
+    while (__atomic_load_n(&calls, __ATOMIC_RELAXED) < want && ms-- > 0)
+        usleep(1000);
+    return __atomic_load_n(&calls, __ATOMIC_RELAXED) >= want;
+}
+
+/* Every event fired before shutdown reaches the plugin. */
+static void events_delivered(void)
+{
+    char dir[256];
+    struct hooks h;
+    int i;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-hooks") != 0) {
+        CHECK(0);
+        return;
+    }
+    calls = 0;
+    CHECK(hooks_init(&h, dir, dir) == 0);
+    CHECK(hooks_add(&h, &plugin) == 0);
+    for (i = 0; i < 100; i++)
+        hooks_fire(&h, HOOK_CREATE, (uint32_t)i, "INC0000001", dir);
+    hooks_shutdown(&h);
+    CHECK(calls == 100);
+    bench_rmtree(dir);
+}
+
+/*
+ * With every worker stuck and nothing more submitted, the timeout still
+ * fires: the stuck workers are replaced and a later event runs promptly.
+ */
+static void stuck_workers_replaced_without_submits(void)
+{
+    char dir[256];
+    struct hooks h;
+    int i;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-hooks") != 0) {
+        CHECK(0);
+        return;
+    }
+    calls = 0;
+    release = 0;
+    CHECK(hooks_init(&h, dir, dir) == 0);
+    h.timeout_ms = 100;
+    CHECK(hooks_add(&h, &plugin) == 0);
+    for (i = 0; i < HOOKS_THREADS; i++)
+        hooks_fire(&h, HOOK_CREATE, (uint32_t)i, "stuck", dir);
+    usleep(400 * 1000);
+    hooks_fire(&h, HOOK_CREATE, 99, "INC0000099", dir);
+    CHECK(wait_calls(1, 200));
+    __atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+    hooks_shutdown(&h);
+    CHECK(wait_calls(1 + HOOKS_THREADS, 1000));
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(events_delivered);
+    RUN(stuck_workers_replaced_without_submits);
+    return TEST_EXIT();
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+
+#include "index.h"
+#include "test.h"
+
+struct names {
+    char buf[16][32];
+    int n;
+};
+
+static int collect(const char *prefix, uint64_t number, uint32_t width, void *arg)
+{
+    struct names *c = arg;
+
+    if (c->n < 16)
+        snprintf(c->buf[c->n++], sizeof(c->buf[0]), "%s%0*llu", prefix, (int)width,
+                 (unsigned long long)number);
+    return 0;
+}
+
+static void entry(struct index_entry *e, const char *name)
+{
+    int width;
+
+    memset(e, 0, sizeof(*e));
+    ticket_parse(name, e->prefix, sizeof(e->prefix), &e->number, &width);
+    e->width = (uint32_t)width;
+}
+
+/* Every name the index lists, in order, joined by spaces. */
+static const char *listing(const struct tindex *ix, char *out, size_t n)
+{
+    struct names c;
+    size_t len = 0;
+    int i;
+
+    memset(&c, 0, sizeof(c));
+    index_foreach(ix, collect, &c);
+    out[0] = '\0';
+    for (i = 0; i < c.n; i++)
+        len += snprintf(out + len, n - len, "%s%s", i ? " " : "", c.buf[i]);
+    return out;
+}
+
+static const char *next(const struct tindex *ix, const char *name, char *out, size_t n)
+{
+    if (index_next(ix, name, out, n) != 0)
+        snprintf(out, n, "-");
+    return out;
+}
+
+static const char *const mixed[] = {
+    "INC0000001", "INC2", "INC0000002", "INC0000010", "INC12", "INC0000013",
+};
+
+static void check_mixed(const struct tindex *ix)
+{
+    char buf[256];
+
+    CHECK(!strcmp(listing(ix, buf, sizeof(buf)),
+                  "INC0000001 INC2 INC0000002 INC0000010 INC12 INC0000013"));
+    CHECK(index_contains(ix, "INC2"));
+    CHECK(index_contains(ix, "INC0000002"));
+    CHECK(index_contains(ix, "INC12"));
+    CHECK(!index_contains(ix, "INC0000012"));
+    CHECK(!index_contains(ix, "INC1"));
+    CHECK(!index_contains(ix, "INC0000003"));
+    CHECK(!strcmp(next(ix, "INC0000001", buf, sizeof(buf)), "INC2"));
+    CHECK(!strcmp(next(ix, "INC2", buf, sizeof(buf)), "INC0000002"));
+    CHECK(!strcmp(next(ix, "INC0000002", buf, sizeof(buf)), "INC0000010"));
+    CHECK(!strcmp(next(ix, "INC0000010", buf, sizeof(buf)), "INC12"));
+    CHECK(!strcmp(next(ix, "INC12", buf, sizeof(buf)), "INC0000013"));
+    CHECK(!strcmp(next(ix, "INC0000013", buf, sizeof(buf)), "-"));
+}
+
+/* An image keeps INC2 and INC0000002 apart and prints each as named. */
+static void image_keeps_widths(void)
+{
+    char dir[256], path[300];
+    struct index_entry e[6];
+    struct tindex ix;
+    size_t i;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-index") != 0) {
+        CHECK(0);
+        return;
+    }
+    for (i = 0; i < 6; i++)
+        entry(&e[i], mixed[5 - i]);
+    snprintf(path, sizeof(path), "%s/index", dir);
+    CHECK(index_write(path, e, 6, 1) == 0);
+    CHECK(index_map(&ix, path) == 0);
+    check_mixed(&ix);
+    index_close(&ix);
+    bench_rmtree(dir);
+}
+
+/* Names added through the log read the same before and after compaction. */
+static void log_keeps_widths(void)
+{
+    char dir[256], buf[256];
+    struct index_writer w;
+    struct tindex ix;
+    size_t i;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-index") != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(index_writer_open(&w, dir) == 0);
+    CHECK(index_publish(&w, NULL, 0) == 0);
+    for (i = 0; i < 6; i++)
+        CHECK(index_add(&w, mixed[i]) == 0);
+    CHECK(index_add(&w, "INC3") == 0);
+    CHECK(index_remove(&w, "INC3") == 0);
+    CHECK(index_open(&ix, dir) == 0);
+    check_mixed(&ix);
+    index_close(&ix);
+
+    CHECK(index_compact(&w) == 0);
+    CHECK(index_open(&ix, dir) == 0);
+    check_mixed(&ix);
+    index_close(&ix);
+
+    /* Removing one width leaves the other. */
+    CHECK(index_remove(&w, "INC0000002") == 0);
+    CHECK(index_remove(&w, "INC12") == 0);
+    CHECK(index_open(&ix, dir) == 0);
+    CHECK(index_contains(&ix, "INC2"));
+    CHECK(!index_contains(&ix, "INC0000002"));
+    CHECK(!strcmp(next(&ix, "INC2", buf, sizeof(buf)), "INC0000010"));
+    CHECK(!strcmp(next(&ix, "INC0000010", buf, sizeof(buf)), "INC0000013"));
+    CHECK(!strcmp(listing(&ix, buf, sizeof(buf)),
+                  "INC0000001 INC2 INC0000010 INC0000013"));
+    index_close(&ix);
+    index_writer_close(&w);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(image_keeps_widths);
+    RUN(log_keeps_widths);
+    return TEST_EXIT();
+}
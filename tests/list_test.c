@@ -0,0 +1,52 @@
+#include <stdlib.h>
+
+#include "list.h"
+#include "test.h"
+
+/* Tickets under 300 prefixes are all listed, prefix by prefix in natural order. */
+static void lists_many_prefixes(void)
+{
+    static const char *const numbers[] = { "10", "2", "1" };
+    char dir[256], base[300], path[400], out[400], expect[32];
+    static char buf[65536];
+    struct list_opts o;
+    char *line;
+    int fd, i, j, lines = 0;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-list") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(base, sizeof(base), "%s/base", dir);
+    mkdir(base, 0755);
+    for (i = 0; i < 300; i++) {
+        for (j = 0; j < 3; j++) {
+            snprintf(path, sizeof(path), "%s/X%c%c%s", base, 'A' + i / 26, 'A' + i % 26,
+                     numbers[j]);
+            mkdir(path, 0755);
+        }
+    }
+    memset(&o, 0, sizeof(o));
+    snprintf(out, sizeof(out), "%s/out", dir);
+    fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(fd >= 0 && list_run(base, dir, &o, fd) == 0);
+    close(fd);
+    test_read(out, buf, sizeof(buf));
+    for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n"), lines++) {
+        i = lines / 3;
+        snprintf(expect, sizeof(expect), "X%c%c%d", 'A' + i / 26, 'A' + i % 26,
+                 (int[]){ 1, 2, 10 }[lines % 3]);
+        if (strcmp(line, expect) != 0) {
+            CHECK(!strcmp(line, expect));
+            break;
+        }
+    }
+    CHECK(lines == 900);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(lists_many_prefixes);
+    return TEST_EXIT();
+}
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+
+#include "merge.h"
+#include "test.h"
+
+static void setup(char *dir, size_t n)
+{
+    char path[400];
+
+    if (bench_tmpdir(dir, n, "test-merge") != 0)
+        return;
+    snprintf(path, sizeof(path), "%s/INC0000001", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000002", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000001/logs", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000002/logs", dir);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/INC0000001/same.txt", dir);
+    test_write(path, "identical\n");
+    snprintf(path, sizeof(path), "%s/INC0000002/same.txt", dir);
+    test_write(path, "identical\n");
+    snprintf(path, sizeof(path), "%s/INC0000001/notes.txt", dir);
+    test_write(path, "ours\n");
+    snprintf(path, sizeof(path), "%s/INC0000002/notes.txt", dir);
+    test_write(path, "theirs\n");
+    snprintf(path, sizeof(path), "%s/INC0000002/only.txt", dir);
+    test_write(path, "only in the duplicate\n");
+    snprintf(path, sizeof(path), "%s/INC0000002/logs/b.log", dir);
+    test_write(path, "b\n");
+    snprintf(path, sizeof(path), "%s/INC0000001/logs/a.log", dir);
+    test_write(path, "a\n");
+}
+
+/* Unique entries move, identical ones go, conflicts get a suffix, dirs merge. */
+static void merges_entries(void)
+{
+    char dir[256], path[400], buf[64];
+    struct merge_stats st;
+
+    setup(dir, sizeof(dir));
+    CHECK(merge_folders(dir, "INC0000001", "INC0000002", &st, NULL) == 0);
+    CHECK(st.failed == 0);
+    CHECK(st.moved == 2);
+    CHECK(st.dropped == 1);
+    CHECK(st.suffixed == 1);
+    CHECK(st.dirs == 1);
+
+    snprintf(path, sizeof(path), "%s/INC0000001/notes.txt", dir);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "ours\n"));
+    snprintf(path, sizeof(path), "%s/INC0000001/notes (INC0000002).txt", dir);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "theirs\n"));
+    snprintf(path, sizeof(path), "%s/INC0000001/only.txt", dir);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "only in the duplicate\n"));
+    snprintf(path, sizeof(path), "%s/INC0000001/logs/a.log", dir);
+    CHECK(test_exists(path));
+    snprintf(path, sizeof(path), "%s/INC0000001/logs/b.log", dir);
+    CHECK(test_exists(path));
+    bench_rmtree(dir);
+}
+
+/* The emptied duplicate becomes a link to the folder it was merged into. */
+static void redirects_old_name(void)
+{
+    char dir[256], path[400], target[64];
+    struct merge_stats st;
+    struct stat s;
+    ssize_t len;
+
+    setup(dir, sizeof(dir));
+    CHECK(merge_folders(dir, "INC0000001", "INC0000002", &st, NULL) == 0);
+    CHECK(st.redirected);
+    snprintf(path, sizeof(path), "%s/INC0000002", dir);
+    CHECK(lstat(path, &s) == 0 && S_ISLNK(s.st_mode));
+    len = readlink(path, target, sizeof(target) - 1);
+    CHECK(len == 10 && !memcmp(target, "INC0000001", 10));
+    snprintf(path, sizeof(path), "%s/INC0000002/only.txt", dir);
+    CHECK(test_exists(path));
+    bench_rmtree(dir);
+}
+
+/* A folder is not merged into itself, nor is a missing one. */
+static void rejects_bad_pairs(void)
+{
+    char dir[256];
+    struct merge_stats st;
+
+    setup(dir, sizeof(dir));
+    CHECK(merge_folders(dir, "INC0000001", "INC0000001", &st, NULL) != 0);
+    CHECK(merge_folders(dir, "INC0000001", "INC0000009", &st, NULL) != 0);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(merges_entries);
+    RUN(redirects_old_name);
+    RUN(rejects_bad_pairs);
+    return TEST_EXIT();
+}
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+
+#include "merkle.h"
+#include "test.h"
+
+static int make_tree(const char *dir)
+{
+    char path[400];
+
+    snprintf(path, sizeof(path), "%s/tree", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/tree/sub", dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/tree/a.txt", dir);
+    if (test_write(path, "alpha") != 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/tree/sub/b.txt", dir);
+    return test_write(path, "beta");
+}
+
+/* A saved summary reads back equal, and a new file shows up in the diff. */
+static void summary_round_trip(void)
+{
+    char dir[256], tree[300], path[400];
+    struct merkle m, back, cur;
+    struct merkle_diff d;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-merkle") != 0 || make_tree(dir) != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(tree, sizeof(tree), "%s/tree", dir);
+    snprintf(path, sizeof(path), "%s/summary", dir);
+    CHECK(merkle_build(tree, NULL, MERKLE_CONTENT, &m) == 0);
+    CHECK(m.count == 4);
+    CHECK(merkle_write(path, &m) == 0);
+    CHECK(merkle_read(path, &back) == 0);
+    CHECK(back.count == m.count && back.flags == MERKLE_CONTENT);
+    merkle_diff(&m, &back, NULL, &d);
+    CHECK(d.added == 0 && d.removed == 0 && d.modified == 0);
+
+    snprintf(path, sizeof(path), "%s/tree/sub/c.txt", dir);
+    CHECK(test_write(path, "gamma") == 0);
+    CHECK(merkle_build(tree, &back, MERKLE_CONTENT, &cur) == 0);
+    merkle_diff(&back, &cur, NULL, &d);
+    CHECK(d.added == 1 && d.removed == 0 && d.modified == 0);
+    merkle_free(&cur);
+    merkle_free(&back);
+    merkle_free(&m);
+    bench_rmtree(dir);
+}
+
+/* Child ranges and name offsets that leave the file are refused on read. */
+static void damaged_summary_rejected(void)
+{
+    char dir[256], tree[300], path[400];
+    struct merkle m, back;
+    struct merkle_node saved;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-merkle") != 0 || make_tree(dir) != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(tree, sizeof(tree), "%s/tree", dir);
+    snprintf(path, sizeof(path), "%s/summary", dir);
+    CHECK(merkle_build(tree, NULL, 0, &m) == 0);
+    saved = m.nodes[0];
+
+    m.nodes[0].first = 1000000;
+    CHECK(merkle_write(path, &m) == 0);
+    CHECK(merkle_read(path, &back) != 0);
+
+    m.nodes[0] = saved;
+    m.nodes[0].nchild = m.count;
+    CHECK(merkle_write(path, &m) == 0);
+    CHECK(merkle_read(path, &back) != 0);
+
+    /* A directory listing itself would send the diff round in circles. */
+    m.nodes[0] = saved;
+    m.nodes[0].first = 0;
+    CHECK(merkle_write(path, &m) == 0);
+    CHECK(merkle_read(path, &back) != 0);
+
+    m.nodes[0] = saved;
+    m.nodes[1].name = m.names_len;
+    CHECK(merkle_write(path, &m) == 0);
+    CHECK(merkle_read(path, &back) != 0);
+
+    m.nodes[1].name = 0;
+    CHECK(merkle_write(path, &m) == 0);
+    CHECK(merkle_read(path, &back) == 0);
+    merkle_free(&back);
+    merkle_free(&m);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(summary_round_trip);
+    RUN(damaged_summary_rejected);
+    return TEST_EXIT();
+}
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+
+#include "mirror.h"
+#include "test.h"
+
+static int setup(char *dir, size_t n, char *base, char *dest, size_t len)
+{
+    char path[400];
+
+    if (bench_tmpdir(dir, n, "test-mirror") != 0)
+        return -1;
+    snprintf(base, len, "%s/base", dir);
+    snprintf(dest, len, "%s/dest", dir);
+    mkdir(base, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000001", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000001/notes.txt", base);
+    test_write(path, "router reboot\n");
+    snprintf(path, sizeof(path), "%s/.tfs", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/.tfs/archive", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/.tfs/archive/key", base);
+    test_write(path, "0123456789abcdef0123456789abcdef");
+    snprintf(path, sizeof(path), "%s/.tfs/meta", base);
+    test_write(path, "state\n");
+    /* A merge redirect and a dangling view link. */
+    snprintf(path, sizeof(path), "%s/INC0000002", base);
+    symlink("INC0000001", path);
+    snprintf(path, sizeof(path), "%s/.tfs/gone", base);
+    symlink("../INC0000009", path);
+    return 0;
+}
+
+static int link_is(const char *path, const char *target)
+{
+    char buf[256];
+    ssize_t n = readlink(path, buf, sizeof(buf) - 1);
+
+    if (n < 0)
+        return 0;
+    buf[n] = '\0';
+    return !strcmp(buf, target);
+}
+
+/* Links arrive as links, state as files, and the archive key not at all. */
+static void copies_links_not_key(void)
+{
+    char dir[256], base[300], dest[300], path[400], buf[64];
+    struct mirror_opts o = { 2, 0, 0 };
+    struct mirror_stats st;
+
+    if (setup(dir, sizeof(dir), base, dest, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(mirror_run(base, dest, &o, &st, stdout) == 0);
+    CHECK(st.failed == 0);
+    CHECK(st.links == 2);
+    snprintf(path, sizeof(path), "%s/INC0000002", dest);
+    CHECK(link_is(path, "INC0000001"));
+    snprintf(path, sizeof(path), "%s/.tfs/gone", dest);
+    CHECK(link_is(path, "../INC0000009"));
+    snprintf(path, sizeof(path), "%s/INC0000001/notes.txt", dest);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "router reboot\n"));
+    snprintf(path, sizeof(path), "%s/.tfs/meta", dest);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "state\n"));
+    snprintf(path, sizeof(path), "%s/.tfs/archive/key", dest);
+    CHECK(!test_exists(path));
+    bench_rmtree(dir);
+}
+
+/* A retargeted link is replaced; a key an older run copied is removed. */
+static void updates_links_and_drops_key(void)
+{
+    char dir[256], base[300], dest[300], path[400];
+    struct mirror_opts o = { 2, 0, 0 };
+    struct mirror_stats st;
+
+    if (setup(dir, sizeof(dir), base, dest, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(mirror_run(base, dest, &o, &st, stdout) == 0);
+    snprintf(path, sizeof(path), "%s/.tfs/archive/key", dest);
+    test_write(path, "copied by an older mirror");
+    snprintf(path, sizeof(path), "%s/INC0000002", base);
+    unlink(path);
+    symlink("INC0000003", path);
+    CHECK(mirror_run(base, dest, &o, &st, stdout) == 0);
+    CHECK(st.failed == 0 && st.links == 1);
+    snprintf(path, sizeof(path), "%s/INC0000002", dest);
+    CHECK(link_is(path, "INC0000003"));
+    snprintf(path, sizeof(path), "%s/.tfs/archive/key", dest);
+    CHECK(!test_exists(path));
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(copies_links_not_key);
+    RUN(updates_links_and_drops_key);
+    return TEST_EXIT();
+}
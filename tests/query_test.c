@@ -0,0 +1,88 @@
+#include <stdlib.h>
+
+#include "query.h"
+#include "tags.h"
+#include "test.h"
+#include "ticketfs.h"
+
+static char base[256], state[4096];
+
+/* INC0000001 and INC0000002 are tagged vpn; only INC0000002 holds a .txt file. */
+static int setup(void)
+{
+    static const char *const names[] = { "INC0000001", "INC0000002", "INC0000003",
+                                         "CHG0000001" };
+    struct tfs_ticket out[4];
+    struct tfs_ctx *c;
+    char path[400];
+    uint32_t ords[2];
+
+    if (bench_tmpdir(base, sizeof(base), "test-query") != 0 || tfs_ctx_open(&c, base) != 0)
+        return -1;
+    snprintf(state, sizeof(state), "%s", tfs_state_dir(c));
+    if (tfs_create_many(c, names, 4, out) != 4) {
+        tfs_ctx_close(c);
+        return -1;
+    }
+    tfs_ctx_close(c);
+    ords[0] = out[0].ord;
+    ords[1] = out[1].ord;
+    snprintf(path, sizeof(path), "%s/INC0000002/notes.txt", base);
+    if (test_write(path, "vpn down") != 0)
+        return -1;
+    return tags_update(state, "vpn", ords, 2, 1);
+}
+
+/* The names query prints for expr, one per line, or "error". */
+static const char *run(const char *expr, char *buf, size_t n)
+{
+    FILE *f;
+    int rc;
+
+    buf[0] = '\0';
+    f = fmemopen(buf, n, "w");
+    if (!f)
+        return "error";
+    rc = query_run(base, state, expr, f);
+    fclose(f);
+    return rc == 0 ? buf : "error";
+}
+
+/* Tag bitmaps, columns and folder contents combine as the expression says. */
+static void predicates_combine(void)
+{
+    char buf[256];
+
+    CHECK(!strcmp(run("tag:vpn", buf, sizeof(buf)), "INC0000001\nINC0000002\n"));
+    CHECK(!strcmp(run("tag:vpn and has:*.txt", buf, sizeof(buf)), "INC0000002\n"));
+    CHECK(!strcmp(run("prefix:INC and not tag:vpn", buf, sizeof(buf)), "INC0000003\n"));
+    CHECK(!strcmp(run("prefix:CHG or (tag:vpn and not has:*.txt)", buf, sizeof(buf)),
+                  "INC0000001\nCHG0000001\n"));
+    CHECK(!strcmp(run("state:open and tag:vpn and files>=0", buf, sizeof(buf)),
+                  "INC0000001\nINC0000002\n"));
+    CHECK(!strcmp(run("tag:vpn and size>1G", buf, sizeof(buf)), ""));
+    CHECK(!strcmp(run("tag:nothing", buf, sizeof(buf)), ""));
+}
+
+/* A malformed expression is an error, not an empty result. */
+static void bad_expressions_rejected(void)
+{
+    char buf[256];
+
+    CHECK(!strcmp(run("tag:vpn and", buf, sizeof(buf)), "error"));
+    CHECK(!strcmp(run("(tag:vpn", buf, sizeof(buf)), "error"));
+    CHECK(!strcmp(run("colour:red", buf, sizeof(buf)), "error"));
+    CHECK(!strcmp(run("size>lots", buf, sizeof(buf)), "error"));
+}
+
+int main(void)
+{
+    if (setup() != 0) {
+        fprintf(stderr, "query_test: could not set up a base\n");
+        return 1;
+    }
+    RUN(predicates_combine);
+    RUN(bad_expressions_rejected);
+    bench_rmtree(base);
+    return TEST_EXIT();
+}
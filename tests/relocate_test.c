@@ -0,0 +1,158 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "relocate.h"
+#include "test.h"
+
+/* A base of two tickets sharing a hard-linked file, a redirect link and state. */
+static int setup(char *dir, size_t n, char *base, char *dest, size_t len)
+{
+    char path[400], other[400];
+
+    if (bench_tmpdir(dir, n, "test-relocate") != 0)
+        return -1;
+    setenv("XDG_CONFIG_HOME", dir, 1);
+    snprintf(base, len, "%s/base", dir);
+    snprintf(dest, len, "%s/dest", dir);
+    mkdir(base, 0755);
+    snprintf(path, sizeof(path), "%s/.tfs", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/.tfs/meta", base);
+    test_write(path, "state\n");
+    snprintf(path, sizeof(path), "%s/INC0000001", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000002", base);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000001/notes.txt", base);
+    test_write(path, "router reboot\n");
+    snprintf(other, sizeof(other), "%s/INC0000002/same.txt", base);
+    link(path, other);
+    snprintf(path, sizeof(path), "%s/INC0000003", base);
+    symlink("INC0000001", path);
+    return config_save_base(base);
+}
+
+static int same_inode(const char *dest, const char *a, const char *b)
+{
+    char pa[400], pb[400];
+    struct stat sa, sb;
+
+    snprintf(pa, sizeof(pa), "%s/%s", dest, a);
+    snprintf(pb, sizeof(pb), "%s/%s", dest, b);
+    return stat(pa, &sa) == 0 && stat(pb, &sb) == 0 && sa.st_ino == sb.st_ino;
+}
+
+/* Everything arrives, hard links stay links, and the config follows. */
+static void moves_and_switches(void)
+{
+    char dir[256], base[300], dest[300], path[400], buf[64], rdest[PATH_MAX];
+    struct relocate_opts o = { 2, 0 };
+    struct relocate_stats st;
+
+    if (setup(dir, sizeof(dir), base, dest, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(relocate_run(base, dest, &o, &st, NULL) == 0);
+    CHECK(st.failed == 0 && st.hardlinks == 1 && st.symlinks == 1);
+    snprintf(path, sizeof(path), "%s/INC0000002/same.txt", dest);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "router reboot\n"));
+    CHECK(same_inode(dest, "INC0000001/notes.txt", "INC0000002/same.txt"));
+    snprintf(path, sizeof(path), "%s/.tfs/meta", dest);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "state\n"));
+    snprintf(path, sizeof(path), "%s/" RELOCATE_DIR, dest);
+    CHECK(!test_exists(path));
+    CHECK(config_read_base(path, sizeof(path)) == 0);
+    CHECK(realpath(dest, rdest) && !strcmp(path, rdest));
+    bench_rmtree(dir);
+}
+
+/* A link found before an interruption is made by the resumed run. */
+static void resume_applies_pending_links(void)
+{
+    static const char pending[] = "LINC0000002/same.txt\0INC0000001/notes.txt";
+    char dir[256], base[300], dest[300], path[400], rbase[PATH_MAX];
+    struct relocate_opts o = { 2, 0 };
+    struct relocate_stats st;
+    int fd;
+
+    if (setup(dir, sizeof(dir), base, dest, sizeof(base)) != 0 || !realpath(base, rbase)) {
+        CHECK(0);
+        return;
+    }
+    /* As left by a run stopped after checkpointing both tickets. */
+    mkdir(dest, 0755);
+    snprintf(path, sizeof(path), "%s/" RELOCATE_DIR, dest);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/" RELOCATE_DIR "/source", dest);
+    test_write(path, rbase);
+    snprintf(path, sizeof(path), "%s/" RELOCATE_DIR "/done", dest);
+    test_write(path, "INC0000001\nINC0000002\n");
+    snprintf(path, sizeof(path), "%s/" RELOCATE_DIR "/pending", dest);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && write(fd, pending, sizeof(pending)) == (ssize_t)sizeof(pending));
+    close(fd);
+    snprintf(path, sizeof(path), "%s/INC0000001", dest);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000002", dest);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/INC0000001/notes.txt", dest);
+    test_write(path, "router reboot\n");
+
+    CHECK(relocate_run(base, dest, &o, &st, NULL) == 0);
+    CHECK(st.resumed == 2 && st.failed == 0);
+    CHECK(same_inode(dest, "INC0000001/notes.txt", "INC0000002/same.txt"));
+    bench_rmtree(dir);
+}
+
+struct churn {
+    const char *base;
+    volatile int stop;
+};
+
+static void *churn(void *arg)
+{
+    struct churn *c = arg;
+    char path[400];
+    long i;
+
+    for (i = 0; !c->stop; i++) {
+        snprintf(path, sizeof(path), "%s/INC0000001/log%ld.txt", c->base, i);
+        test_write(path, "x");
+    }
+    return NULL;
+}
+
+/* A base that never stops changing is not switched to. */
+static void refuses_busy_base(void)
+{
+    char dir[256], base[300], dest[300], path[400], rbase[PATH_MAX];
+    struct relocate_opts o = { 2, 0 };
+    struct relocate_stats st;
+    struct churn c;
+    pthread_t t;
+
+    if (setup(dir, sizeof(dir), base, dest, sizeof(base)) != 0 || !realpath(base, rbase)) {
+        CHECK(0);
+        return;
+    }
+    c.base = base;
+    c.stop = 0;
+    pthread_create(&t, NULL, churn, &c);
+    CHECK(relocate_run(base, dest, &o, &st, NULL) != 0);
+    c.stop = 1;
+    pthread_join(t, NULL);
+    CHECK(st.passes == 1 + RELOCATE_DELTA_PASSES);
+    CHECK(config_read_base(path, sizeof(path)) == 0 && !strcmp(path, rbase));
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(moves_and_switches);
+    RUN(resume_applies_pending_links);
+    RUN(refuses_busy_base);
+    return TEST_EXIT();
+}
@@ -0,0 +1,155 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "meta.h"
+#include "retention.h"
+#include "test.h"
+
+static const char *const tickets[] = { "INC0000001", "INC0000002", "INC0000003" };
+
+/* INC0000001 closed 40 days ago, INC0000002 closed 2 days ago, INC0000003 open. */
+static int setup(char *dir, size_t n, char *base, char *state, size_t len)
+{
+    static const int64_t closed_days[] = { 40, 2, -1 };
+    char path[400];
+    struct ordmap m;
+    struct meta meta;
+    int64_t now = time(NULL);
+    size_t i;
+
+    if (bench_tmpdir(dir, n, "test-retention") != 0)
+        return -1;
+    snprintf(base, len, "%s/base", dir);
+    snprintf(state, len, "%s/state", dir);
+    mkdir(base, 0755);
+    mkdir(state, 0755);
+    if (ordmap_open(&m, state) != 0)
+        return -1;
+    if (meta_open(&meta, state) != 0) {
+        ordmap_close(&m);
+        return -1;
+    }
+    for (i = 0; i < 3; i++) {
+        uint32_t ord = ordmap_add(&m, tickets[i]);
+
+        snprintf(path, sizeof(path), "%s/%s", base, tickets[i]);
+        mkdir(path, 0755);
+        strcat(path, "/notes.txt");
+        test_write(path, "customer called back\n");
+        *strrchr(path, '/') = '\0';
+        meta_rescan(&meta, ord, path);
+        if (closed_days[i] >= 0)
+            meta_set_state(&meta, ord, TICKET_CLOSED, now - closed_days[i] * 86400);
+        else
+            meta_set_state(&meta, ord, TICKET_OPEN, now);
+    }
+    meta_close(&meta);
+    ordmap_close(&m);
+    return 0;
+}
+
+static int exists(const char *base, const char *name)
+{
+    char path[400];
+
+    snprintf(path, sizeof(path), "%s/%s", base, name);
+    return test_exists(path);
+}
+
+static int state_of(const char *state, const char *name)
+{
+    struct ordmap m;
+    struct meta meta;
+    uint32_t ord;
+    int s = -1;
+
+    if (ordmap_open(&m, state) != 0)
+        return -1;
+    ord = ordmap_lookup(&m, name);
+    if (meta_open(&meta, state) == 0) {
+        if (ord < meta.count)
+            s = meta.state[ord];
+        meta_close(&meta);
+    }
+    ordmap_close(&m);
+    return s;
+}
+
+/* Only the ticket closed longer ago than the cutoff is removed. */
+static void prunes_by_age(void)
+{
+    char dir[256], base[300], state[300];
+    struct retention_opts o = { 30, 0, 0, 2, 0 };
+    struct retention_stats st;
+
+    if (setup(dir, sizeof(dir), base, state, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(retention_run(base, state, &o, &st, NULL) == 0);
+    CHECK(st.tickets == 1 && st.failed == 0);
+    CHECK(st.files == 1 && st.dirs == 1);
+    CHECK(!exists(base, "INC0000001"));
+    CHECK(state_of(state, "INC0000001") == TICKET_DELETED);
+    CHECK(exists(base, "INC0000002") && exists(base, "INC0000003"));
+    CHECK(state_of(state, "INC0000002") == TICKET_CLOSED);
+    CHECK(state_of(state, "INC0000003") == TICKET_OPEN);
+
+    /* A second sweep finds nothing left to do. */
+    CHECK(retention_run(base, state, &o, &st, NULL) == 0);
+    CHECK(st.tickets == 0);
+    bench_rmtree(dir);
+}
+
+/* Recent and open tickets survive any cutoff they do not reach; a dry run deletes nothing. */
+static void leaves_recent_alone(void)
+{
+    char dir[256], base[300], state[300];
+    struct retention_opts o = { 1, 0, 0, 0, 1 };
+    struct retention_stats st;
+
+    if (setup(dir, sizeof(dir), base, state, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(retention_run(base, state, &o, &st, NULL) == 0);
+    CHECK(st.tickets == 2);
+    CHECK(exists(base, "INC0000001") && exists(base, "INC0000002"));
+
+    o.days = 365;
+    o.dry_run = 0;
+    CHECK(retention_run(base, state, &o, &st, NULL) == 0);
+    CHECK(st.tickets == 0);
+    CHECK(exists(base, "INC0000001") && exists(base, "INC0000002") &&
+          exists(base, "INC0000003"));
+    bench_rmtree(dir);
+}
+
+/* The sweep runs on background threads; the caller keeps its priority. */
+static void caller_keeps_priority(void)
+{
+    char dir[256], base[300], state[300];
+    struct retention_opts o = { 30, 0, 0, 2, 0 };
+    struct retention_stats st;
+    int before;
+
+    if (setup(dir, sizeof(dir), base, state, sizeof(base)) != 0) {
+        CHECK(0);
+        return;
+    }
+    before = getpriority(PRIO_PROCESS, 0);
+    CHECK(retention_run(base, state, &o, &st, NULL) == 0);
+    CHECK(getpriority(PRIO_PROCESS, 0) == before);
+    CHECK(sched_getscheduler(0) == SCHED_OTHER);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(prunes_by_age);
+    RUN(leaves_recent_alone);
+    RUN(caller_keeps_priority);
+    return TEST_EXIT();
+}
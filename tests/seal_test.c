@@ -0,0 +1,189 @@
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "archive.h"
+#include "seal.h"
+#include "test.h"
+
+static const int ciphers[] = { SEAL_AES_GCM, SEAL_CHACHA20_POLY1305 };
+
+static void fill(uint8_t *buf, size_t n, uint32_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        buf[i] = (uint8_t)((seed + i) * 2654435761u >> 24);
+}
+
+/* Segments come back as sealed, under both ciphers. */
+static void segments_round_trip(void)
+{
+    uint8_t master[SEAL_KEY], tag[4][SEAL_TAG], buf[4][1000], orig[4][1000];
+    struct seal s;
+    size_t c;
+    int i;
+
+    RAND_bytes(master, sizeof(master));
+    for (c = 0; c < sizeof(ciphers) / sizeof(ciphers[0]); c++) {
+        CHECK(seal_init(&s, ciphers[c], master, "ctx", 3) == 0);
+        for (i = 0; i < 4; i++) {
+            fill(orig[i], sizeof(orig[i]), i);
+            memcpy(buf[i], orig[i], sizeof(buf[i]));
+            CHECK(seal_segment(&s, i, i == 3, buf[i], sizeof(buf[i]), tag[i]) == 0);
+            CHECK(memcmp(buf[i], orig[i], sizeof(buf[i])) != 0);
+        }
+        for (i = 0; i < 4; i++) {
+            CHECK(unseal_segment(&s, i, i == 3, buf[i], sizeof(buf[i]), tag[i]) == 0);
+            CHECK(memcmp(buf[i], orig[i], sizeof(buf[i])) == 0);
+        }
+        seal_wipe(&s);
+    }
+}
+
+/* A flipped bit, a moved segment, a dropped last flag or another context all fail. */
+static void tampering_detected(void)
+{
+    uint8_t master[SEAL_KEY], tag[SEAL_TAG], buf[256], copy[256];
+    struct seal s, other;
+    size_t c;
+
+    RAND_bytes(master, sizeof(master));
+    for (c = 0; c < sizeof(ciphers) / sizeof(ciphers[0]); c++) {
+        CHECK(seal_init(&s, ciphers[c], master, "ctx", 3) == 0);
+        CHECK(seal_init(&other, ciphers[c], master, "cty", 3) == 0);
+        fill(buf, sizeof(buf), 7);
+        CHECK(seal_segment(&s, 5, 0, buf, sizeof(buf), tag) == 0);
+
+        memcpy(copy, buf, sizeof(copy));
+        copy[100] ^= 1;
+        CHECK(unseal_segment(&s, 5, 0, copy, sizeof(copy), tag) != 0);
+        memcpy(copy, buf, sizeof(copy));
+        CHECK(unseal_segment(&s, 6, 0, copy, sizeof(copy), tag) != 0);
+        memcpy(copy, buf, sizeof(copy));
+        CHECK(unseal_segment(&s, 5, 1, copy, sizeof(copy), tag) != 0);
+        memcpy(copy, buf, sizeof(copy));
+        CHECK(unseal_segment(&other, 5, 0, copy, sizeof(copy), tag) != 0);
+        memcpy(copy, buf, sizeof(copy));
+        CHECK(unseal_segment(&s, 5, 0, copy, sizeof(copy), tag) == 0);
+        seal_wipe(&s);
+        seal_wipe(&other);
+    }
+}
+
+/* A sealed pack unpacks to the same files with the key, and not without it. */
+static void sealed_pack_round_trip(void)
+{
+    char dir[256], src[300], dst[300], pack[300], path[400], buf[256];
+    struct archive_opts o;
+    struct archive_stats st;
+    uint8_t key[SEAL_KEY], wrong[SEAL_KEY];
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-seal") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(src, sizeof(src), "%s/INC0000001", dir);
+    snprintf(dst, sizeof(dst), "%s/out", dir);
+    snprintf(pack, sizeof(pack), "%s/INC0000001.tfp", dir);
+    mkdir(src, 0755);
+    snprintf(path, sizeof(path), "%s/notes.txt", src);
+    CHECK(test_write(path, "router reboot at 09:40\n") == 0);
+    snprintf(path, sizeof(path), "%s/logs", src);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/logs/syslog", src);
+    CHECK(test_write(path, "kernel: link down\nkernel: link up\n") == 0);
+
+    RAND_bytes(key, sizeof(key));
+    RAND_bytes(wrong, sizeof(wrong));
+    memset(&o, 0, sizeof(o));
+    o.key = key;
+    CHECK(archive_pack(src, pack, &o, &st) == 0);
+    CHECK(st.files == 2);
+    CHECK(archive_sealed(pack) == 1);
+    CHECK(archive_unpack(pack, NULL, wrong, &st) != 0);
+    CHECK(archive_unpack(pack, dst, key, &st) == 0);
+    snprintf(path, sizeof(path), "%s/notes.txt", dst);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "router reboot at 09:40\n"));
+    snprintf(path, sizeof(path), "%s/logs/syslog", dst);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), "kernel: link down\nkernel: link up\n"));
+    bench_rmtree(dir);
+}
+
+/*
+ * A pack spanning several batches of segments round-trips, keeps no
+ * plaintext, and refuses a header whose table of contents was moved.
+ */
+static void large_sealed_pack(void)
+{
+    char dir[256], src[300], dst[300], pack[300], path[400], buf[256];
+    static uint8_t data[5 << 20], back[5 << 20];
+    static const char note[] = "customer VPN password rotated";
+    struct archive_opts o;
+    struct archive_stats st;
+    uint8_t key[SEAL_KEY], raw[sizeof(note)];
+    uint64_t toc_off;
+    ssize_t got;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-seal") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(src, sizeof(src), "%s/INC0000002", dir);
+    snprintf(dst, sizeof(dst), "%s/out", dir);
+    snprintf(pack, sizeof(pack), "%s/INC0000002.tfp", dir);
+    mkdir(src, 0755);
+    snprintf(path, sizeof(path), "%s/notes.txt", src);
+    CHECK(test_write(path, note) == 0);
+    RAND_bytes(data, sizeof(data));
+    snprintf(path, sizeof(path), "%s/capture.pcap", src);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(fd >= 0 && write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+    close(fd);
+
+    RAND_bytes(key, sizeof(key));
+    memset(&o, 0, sizeof(o));
+    o.key = key;
+    CHECK(archive_pack(src, pack, &o, &st) == 0);
+    snprintf(path, sizeof(path), "%s.tmp", pack);
+    CHECK(!test_exists(path));
+    fd = open(pack, O_RDONLY | O_CLOEXEC);
+    got = fd >= 0 ? read(fd, back, sizeof(back)) : -1;
+    CHECK(got > 0 && !memmem(back, got, note, sizeof(note) - 1) &&
+          !memmem(back, got, data + 4096, 64));
+    close(fd);
+
+    CHECK(archive_unpack(pack, dst, key, &st) == 0);
+    CHECK(st.files == 2);
+    snprintf(path, sizeof(path), "%s/notes.txt", dst);
+    CHECK(!strcmp(test_read(path, buf, sizeof(buf)), note));
+    snprintf(path, sizeof(path), "%s/capture.pcap", dst);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    CHECK(fd >= 0 && read(fd, back, sizeof(back)) == (ssize_t)sizeof(data) &&
+          !memcmp(back, data, sizeof(data)));
+    close(fd);
+    snprintf(path, sizeof(path), "%s/extracted", dir);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    CHECK(archive_extract(pack, "notes.txt", key, fd) == 0);
+    CHECK(pread(fd, raw, sizeof(raw), 0) == (ssize_t)sizeof(note) - 1);
+    close(fd);
+
+    /* toc_off follows the magic, flags, dict_len and count in the header. */
+    fd = open(pack, O_RDWR | O_CLOEXEC);
+    CHECK(pread(fd, &toc_off, sizeof(toc_off), 24) == sizeof(toc_off));
+    toc_off -= 8;
+    CHECK(pwrite(fd, &toc_off, sizeof(toc_off), 24) == sizeof(toc_off));
+    close(fd);
+    CHECK(archive_unpack(pack, NULL, key, &st) != 0);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(segments_round_trip);
+    RUN(tampering_detected);
+    RUN(sealed_pack_round_trip);
+    RUN(large_sealed_pack);
+    return TEST_EXIT();
+}
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+
+#include "tags.h"
+#include "test.h"
+
+static uint64_t count(const char *state, const char *tag)
+{
+    struct rbitmap b;
+    uint64_t n;
+
+    if (tags_load(state, tag, &b) != 0)
+        return (uint64_t)-1;
+    n = rb_cardinality(&b);
+    rb_free(&b);
+    return n;
+}
+
+static int has(const char *state, const char *tag, uint32_t ord)
+{
+    struct rbitmap b;
+    int in;
+
+    if (tags_load(state, tag, &b) != 0)
+        return 0;
+    in = rb_contains(&b, ord);
+    rb_free(&b);
+    return in;
+}
+
+static int seen(const char *tag, void *arg)
+{
+    (void)tag;
+    (*(int *)arg)++;
+    return 0;
+}
+
+/* Small changes go to the log, are seen by loads and listed at once. */
+static void logs_small_changes(void)
+{
+    char dir[256], path[400];
+    struct stat st;
+    uint32_t ord;
+    int tags = 0;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-tags") != 0) {
+        CHECK(0);
+        return;
+    }
+    ord = 7;
+    CHECK(tags_update(dir, "vpn", &ord, 1, 1) == 0);
+    for (ord = 10; ord < 20; ord++)
+        CHECK(tags_update(dir, "vpn", &ord, 1, 1) == 0);
+    ord = 12;
+    CHECK(tags_update(dir, "vpn", &ord, 1, 0) == 0);
+    CHECK(tags_move(dir, "vpn", 7, 100) == 0);
+    CHECK(count(dir, "vpn") == 10);
+    CHECK(has(dir, "vpn", 100) && !has(dir, "vpn", 7) && !has(dir, "vpn", 12));
+    CHECK(tags_foreach(dir, seen, &tags) == 0 && tags == 1);
+    snprintf(path, sizeof(path), "%s/tags/vpn.log", dir);
+    CHECK(stat(path, &st) == 0 && st.st_size == 13 * (off_t)sizeof(struct tag_change));
+    bench_rmtree(dir);
+}
+
+/* A full log is folded into the bitmap; a torn record is dropped. */
+static void compacts_and_survives_torn_log(void)
+{
+    char dir[256], path[400];
+    struct stat st;
+    uint32_t ord;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-tags") != 0) {
+        CHECK(0);
+        return;
+    }
+    for (ord = 0; ord < TAGS_LOG_MAX + 5; ord++)
+        tags_update(dir, "db", &ord, 1, 1);
+    CHECK(count(dir, "db") == TAGS_LOG_MAX + 5);
+    snprintf(path, sizeof(path), "%s/tags/db.log", dir);
+    CHECK(stat(path, &st) == 0 && st.st_size < 8 * (off_t)sizeof(struct tag_change));
+
+    fd = open(path, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, "xyz", 3) == 3);
+    close(fd);
+    CHECK(count(dir, "db") == TAGS_LOG_MAX + 5);
+    ord = 1;
+    CHECK(tags_update(dir, "db", &ord, 1, 0) == 0);
+    CHECK(count(dir, "db") == TAGS_LOG_MAX + 4 && !has(dir, "db", 1));
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(logs_small_changes);
+    RUN(compacts_and_survives_torn_log);
+    return TEST_EXIT();
+}
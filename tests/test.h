@@ -0,0 +1,71 @@
+#ifndef TEST_H
+#define TEST_H
+
+/*
+ * Each tests/<module>_test.c is a program whose main() runs its cases with
+ * RUN(). CHECK() reports a failed condition and lets the case go on; the
+ * program exits non-zero if any case failed. Cases get scratch directories
+ * from bench_tmpdir() and remove them with bench_rmtree().
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+static int test_failed, test_failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            test_failed = 1;                                                \
+        }                                                                   \
+    } while (0)
+
+#define RUN(fn)                                                             \
+    do {                                                                    \
+        test_failed = 0;                                                    \
+        fn();                                                               \
+        printf("  %-40s %s\n", #fn, test_failed ? "FAIL" : "ok");           \
+        test_failures += test_failed;                                       \
+    } while (0)
+
+#define TEST_EXIT() (test_failures ? 1 : 0)
+
+static inline int test_write(const char *path, const char *data)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ssize_t len = (ssize_t)strlen(data);
+    int ok;
+
+    if (fd < 0)
+        return -1;
+    ok = write(fd, data, len) == len;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/* The file's contents as a string, or "" if it cannot be read. */
+static inline const char *test_read(const char *path, char *buf, size_t n)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t len = fd >= 0 ? read(fd, buf, n - 1) : -1;
+
+    if (fd >= 0)
+        close(fd);
+    buf[len > 0 ? len : 0] = '\0';
+    return buf;
+}
+
+static inline int test_exists(const char *path)
+{
+    struct stat st;
+
+    return lstat(path, &st) == 0;
+}
+
+#endif
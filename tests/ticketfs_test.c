@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "ticketfs.h"
+
+/* With nothing configured the library fails instead of asking on stdin. */
+static void no_base_no_prompt(void)
+{
+    char dir[256];
+    struct tfs_ctx *c = NULL;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-tfs") != 0) {
+        CHECK(0);
+        return;
+    }
+    setenv("XDG_CONFIG_HOME", dir, 1);
+    errno = 0;
+    CHECK(tfs_ctx_open(&c, NULL) != 0);
+    CHECK(errno == ENOENT);
+    CHECK(c == NULL);
+    unsetenv("XDG_CONFIG_HOME");
+    bench_rmtree(dir);
+}
+
+/* Only sanitized ticket names become folders. */
+static void creates_ticket_names_only(void)
+{
+    static const char *const names[] = { "INC0000001", "bad name", "INC 7", "notes", "INC_7" };
+    char dir[256], path[400];
+    struct tfs_ticket out[5];
+    struct tfs_ctx *c;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-tfs") != 0 || tfs_ctx_open(&c, dir) != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(tfs_create_many(c, names, 5, out) == 2);
+    CHECK(out[0].created && out[0].ord != TICKET_NONE);
+    CHECK(out[1].ord == TICKET_NONE && out[2].ord == TICKET_NONE);
+    CHECK(out[3].ord == TICKET_NONE);
+    CHECK(out[4].created);
+    snprintf(path, sizeof(path), "%s/bad name", dir);
+    CHECK(!test_exists(path));
+    snprintf(path, sizeof(path), "%s/INC 7", dir);
+    CHECK(!test_exists(path));
+    CHECK(tfs_lookup(c, "INC_7", NULL) == 0);
+    CHECK(tfs_lookup(c, "notes", NULL) != 0);
+    tfs_ctx_close(c);
+    bench_rmtree(dir);
+}
+
+/* A registry that cannot be opened fails the batch before any folder is made. */
+static void unreadable_registry_fails_batch(void)
+{
+    static const char *const names[] = { "INC0000001", "INC0000002" };
+    char dir[256], path[4200];
+    struct tfs_ticket out[2];
+    struct tfs_ctx *c;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-tfs") != 0 || tfs_ctx_open(&c, dir) != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/tickets", tfs_state_dir(c));
+    CHECK(mkdir(path, 0755) == 0);
+    CHECK(tfs_create_many(c, names, 2, out) == -1);
+    CHECK(out[0].ord == TICKET_NONE && !out[0].created);
+    CHECK(out[1].ord == TICKET_NONE && !out[1].created);
+    snprintf(path, sizeof(path), "%s/INC0000001", dir);
+    CHECK(!test_exists(path));
+    tfs_ctx_close(c);
+    bench_rmtree(dir);
+}
+
+static void sanitizes_like_the_cli(void)
+{
+    char out[64];
+
+    tfs_sanitize("INC 7 <fw>?", out, sizeof(out));
+    CHECK(!strcmp(out, "INC_7_fw"));
+    CHECK(tfs_valid_name("INC_7"));
+    CHECK(!tfs_valid_name("INC 7"));
+    CHECK(!tfs_valid_name("a:b"));
+    CHECK(!tfs_valid_name(".hidden"));
+}
+
+int main(void)
+{
+    RUN(no_base_no_prompt);
+    RUN(creates_ticket_names_only);
+    RUN(unreadable_registry_fails_batch);
+    RUN(sanitizes_like_the_cli);
+    return TEST_EXIT();
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "test.h"
+#include "ticket.h"
+#include "timelog.h"
+
+/* 10:00 local time on a weekday, so an hour-long session stays in its day. */
+static int64_t morning(void)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 2026 - 1900;
+    tm.tm_mon = 2;
+    tm.tm_mday = 10;
+    tm.tm_hour = 10;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static uint64_t seconds_for(const char *state, uint32_t day, uint32_t ord)
+{
+    struct time_row *rows;
+    uint64_t sum = 0;
+    size_t n, i;
+
+    if (timelog_rollup(state, TIME_DAY, day, day, &rows, &n) != 0)
+        return UINT64_MAX;
+    for (i = 0; i < n; i++)
+        if (rows[i].ord == ord)
+            sum += rows[i].seconds;
+    free(rows);
+    return sum;
+}
+
+/* Switching tickets closes the open session; leave closes the last one. */
+static void sessions_roll_up(void)
+{
+    char dir[256];
+    int64_t t = morning();
+    uint32_t ord, day = time_day(t);
+    int64_t since;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-timelog") != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(timelog_enter(dir, 4, t) == 0);
+    CHECK(timelog_enter(dir, 4, t + 600) == 0);
+    CHECK(timelog_enter(dir, 7, t + 1800) == 0);
+    CHECK(timelog_current(dir, &ord, &since) == 0 && ord == 7 && since == t + 1800);
+    CHECK(timelog_leave(dir, t + 3000) == 0);
+    CHECK(timelog_current(dir, &ord, &since) == 0 && ord == TICKET_NONE);
+    CHECK(seconds_for(dir, day, 4) == 1800);
+    CHECK(seconds_for(dir, day, 7) == 1200);
+    bench_rmtree(dir);
+}
+
+/*
+ * A crash after the log append but before the rollups: the header is left
+ * flagged and the rollups stale, and the next update replays the log.
+ */
+static void crash_after_append_replays(void)
+{
+    char dir[256], path[400];
+    int64_t t = morning();
+    uint32_t day = time_day(t), rolling = 1;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-timelog") != 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(timelog_enter(dir, 2, t) == 0);
+    CHECK(timelog_leave(dir, t + 900) == 0);
+    CHECK(seconds_for(dir, day, 2) == 900);
+
+    /* rolling follows magic, base, last, len and cur in the header. */
+    snprintf(path, sizeof(path), "%s/time/log", dir);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    CHECK(fd >= 0 && pwrite(fd, &rolling, sizeof(rolling), 36) == sizeof(rolling));
+    close(fd);
+    snprintf(path, sizeof(path), "%s/time/days", dir);
+    CHECK(truncate(path, 0) == 0);
+    snprintf(path, sizeof(path), "%s/time/weeks", dir);
+    CHECK(truncate(path, 0) == 0);
+
+    CHECK(timelog_enter(dir, 3, t + 1200) == 0);
+    CHECK(timelog_leave(dir, t + 1500) == 0);
+    CHECK(seconds_for(dir, day, 2) == 900);
+    CHECK(seconds_for(dir, day, 3) == 300);
+    bench_rmtree(dir);
+}
+
+/* A log that cannot be opened must not cost the caller its stdin. */
+static void failed_open_keeps_stdin(void)
+{
+    char dir[256], path[400];
+    int fd = open("/dev/null", O_RDONLY);
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-timelog") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/state", dir);
+    CHECK(test_write(path, "not a directory") == 0);
+    CHECK(timelog_enter(path, 1, morning()) != 0);
+    CHECK(timelog_leave(path, morning()) != 0);
+    CHECK(fcntl(0, F_GETFD) != -1);
+    if (fd > 0)
+        close(fd);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(sessions_roll_up);
+    RUN(crash_after_append_replays);
+    RUN(failed_open_keeps_stdin);
+    return TEST_EXIT();
+}
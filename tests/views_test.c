@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "journal.h"
+#include "tags.h"
+#include "test.h"
+#include "ticketfs.h"
+#include "views.h"
+
+static char base[256], state[4096];
+static uint32_t ords[3];
+
+static int setup(void)
+{
+    static const char *const names[] = { "INC0000001", "INC0000002", "INC0000003" };
+    struct tfs_ticket out[3];
+    struct tfs_ctx *c;
+    int i;
+
+    if (bench_tmpdir(base, sizeof(base), "test-views") != 0 || tfs_ctx_open(&c, base) != 0)
+        return -1;
+    snprintf(state, sizeof(state), "%s", tfs_state_dir(c));
+    if (tfs_create_many(c, names, 3, out) != 3) {
+        tfs_ctx_close(c);
+        return -1;
+    }
+    tfs_ctx_close(c);
+    for (i = 0; i < 3; i++)
+        ords[i] = out[i].ord;
+    return 0;
+}
+
+/* Tag or untag one ticket the way the CLI does: bitmap first, then the journal. */
+static int retag(const char *tag, uint32_t ord, int add)
+{
+    if (tags_update(state, tag, &ord, 1, add) != 0)
+        return -1;
+    return journal_append(state, add ? JOURNAL_TAG : JOURNAL_UNTAG, ord, time(NULL), 0);
+}
+
+/* Whether <base>/.views/<rel> is a relative link that reaches the ticket folder. */
+static int linked(const char *rel, const char *name)
+{
+    char path[4400], target[300], want[300];
+    struct stat st;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "%s/" VIEWS_DIR "/%s", base, rel);
+    n = readlink(path, target, sizeof(target) - 1);
+    if (n < 0)
+        return 0;
+    target[n] = '\0';
+    snprintf(want, sizeof(want), "../../../%s", name);
+    return !strcmp(target, want) && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int exists(const char *rel)
+{
+    char path[4400];
+
+    snprintf(path, sizeof(path), "%s/" VIEWS_DIR "/%s", base, rel);
+    return test_exists(path);
+}
+
+/* Creating tickets links them by month at once. */
+static void created_by_date(void)
+{
+    char rel[64], month[16];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    localtime_r(&now, &tm);
+    strftime(month, sizeof(month), "%Y-%m", &tm);
+    snprintf(rel, sizeof(rel), "by-date/%s/INC0000001", month);
+    CHECK(linked(rel, "INC0000001"));
+    snprintf(rel, sizeof(rel), "by-date/%s/INC0000003", month);
+    CHECK(linked(rel, "INC0000003"));
+}
+
+/* Journalled tag changes re-link only their tickets, without a rebuild. */
+static void tags_follow_journal(void)
+{
+    struct views_stats st;
+
+    CHECK(retag("vpn", ords[0], 1) == 0);
+    CHECK(retag("customer:acme", ords[1], 1) == 0);
+    CHECK(views_update(base, state, 0, &st) == 0);
+    CHECK(!st.rebuilt && st.events == 2 && st.tickets == 2);
+    CHECK(linked("by-tag/vpn/INC0000001", "INC0000001"));
+    CHECK(!exists("by-tag/vpn/INC0000002"));
+    CHECK(linked("by-customer/acme/INC0000002", "INC0000002"));
+    CHECK(!exists("by-tag/customer:acme"));
+
+    /* Nothing new in the journal: nothing to do. */
+    CHECK(views_update(base, state, 0, &st) == 0);
+    CHECK(st.events == 0 && st.tickets == 0);
+
+    /* The last link out of a group takes the group with it. */
+    CHECK(retag("vpn", ords[0], 0) == 0);
+    CHECK(views_update(base, state, 0, &st) == 0);
+    CHECK(!exists("by-tag/vpn/INC0000001"));
+    CHECK(!exists("by-tag/vpn"));
+}
+
+/* A deleted folder loses its links; a missing tree is rebuilt whole. */
+static void delete_and_rebuild(void)
+{
+    char path[400];
+    struct views_stats st;
+
+    snprintf(path, sizeof(path), "%s/INC0000002", base);
+    CHECK(rmdir(path) == 0);
+    CHECK(journal_append(state, JOURNAL_DELETE, ords[1], time(NULL), 0) == 0);
+    CHECK(views_update(base, state, 0, &st) == 0);
+    CHECK(!exists("by-customer/acme/INC0000002"));
+
+    CHECK(retag("vpn", ords[2], 1) == 0);
+    snprintf(path, sizeof(path), "%s/" VIEWS_DIR, base);
+    CHECK(bench_rmtree(path) == 0);
+    CHECK(views_update(base, state, 0, &st) == 0);
+    CHECK(st.rebuilt);
+    CHECK(linked("by-tag/vpn/INC0000003", "INC0000003"));
+    CHECK(!exists("by-customer/acme"));
+}
+
+int main(void)
+{
+    if (setup() != 0) {
+        fprintf(stderr, "views_test: could not set up a base\n");
+        return 1;
+    }
+    RUN(created_by_date);
+    RUN(tags_follow_journal);
+    RUN(delete_and_rebuild);
+    bench_rmtree(base);
+    return TEST_EXIT();
+}
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+
+#include "test.h"
+#include "wal.h"
+
+#define RECORDS 100
+
+struct seen {
+    uint64_t n;
+    int ok;
+};
+
+/* Record i has type i % 3, every byte set to i, and i + 1 bytes or a full page when i is odd. */
+static uint16_t rec_len(uint64_t i)
+{
+    return (uint16_t)(i % 2 ? WAL_MAX_PAYLOAD : i + 1);
+}
+
+static int check_record(uint8_t type, const void *data, size_t len, void *arg)
+{
+    struct seen *s = arg;
+    const unsigned char *p = data;
+    size_t i;
+
+    s->ok &= type == s->n % 3 && len == rec_len(s->n);
+    for (i = 0; i < len; i++)
+        s->ok &= p[i] == (unsigned char)s->n;
+    s->n++;
+    return 0;
+}
+
+static int append_records(struct wal *w, uint64_t from, uint64_t to)
+{
+    unsigned char buf[WAL_MAX_PAYLOAD];
+    uint64_t i;
+
+    for (i = from; i < to; i++) {
+        memset(buf, (unsigned char)i, sizeof(buf));
+        if (wal_append(w, (uint8_t)(i % 3), buf, rec_len(i)) != 0)
+            return -1;
+    }
+    return wal_sync(w);
+}
+
+/* Replays the whole log from the start; the number applied, or -1. */
+static int64_t replay_all(const char *path, uint64_t want_base, struct seen *s)
+{
+    uint64_t base, pos = WAL_HEADER, seq = 0;
+    int64_t n;
+    int fd = wal_open_read(path, &base);
+
+    if (fd < 0 || base != want_base) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    memset(s, 0, sizeof(*s));
+    s->ok = 1;
+    n = wal_replay(fd, &pos, &seq, 0, check_record, s);
+    close(fd);
+    return n;
+}
+
+static void crc32c_known_value(void)
+{
+    CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+    CHECK(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+}
+
+/* Records read back in order, across reads larger than the replay buffer. */
+static void records_round_trip(void)
+{
+    char dir[256], path[300];
+    struct seen s;
+    struct wal w;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-wal") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/log", dir);
+    CHECK(wal_create(path, 42) == 0);
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(w.base == 42 && w.records == 0 && w.len == WAL_HEADER);
+    CHECK(append_records(&w, 0, RECORDS) == 0);
+    wal_close(&w);
+    CHECK(replay_all(path, 42, &s) == RECORDS);
+    CHECK(s.ok && s.n == RECORDS);
+
+    /* Reopening finds every record and carries on the sequence. */
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(w.records == RECORDS && w.seq == RECORDS);
+    CHECK(append_records(&w, RECORDS, RECORDS + 5) == 0);
+    wal_close(&w);
+    CHECK(replay_all(path, 42, &s) == RECORDS + 5);
+    CHECK(s.ok);
+    bench_rmtree(dir);
+}
+
+/* A reader that stopped part way picks up just the records added since. */
+static void replay_resumes(void)
+{
+    char dir[256], path[300];
+    uint64_t base, pos = WAL_HEADER, seq = 0;
+    struct seen s;
+    struct wal w;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-wal") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/log", dir);
+    CHECK(wal_create(path, 1) == 0);
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(append_records(&w, 0, 10) == 0);
+    fd = wal_open_read(path, &base);
+    CHECK(fd >= 0);
+    memset(&s, 0, sizeof(s));
+    s.ok = 1;
+    CHECK(wal_replay(fd, &pos, &seq, 0, check_record, &s) == 10);
+    CHECK(pos == w.len && seq == 10);
+    CHECK(append_records(&w, 10, 13) == 0);
+    CHECK(wal_replay(fd, &pos, &seq, 0, check_record, &s) == 3);
+    CHECK(s.ok && s.n == 13 && pos == w.len);
+    close(fd);
+    wal_close(&w);
+    bench_rmtree(dir);
+}
+
+/* A torn last record is cut off on open, and new records follow the last good one. */
+static void torn_tail_cut(void)
+{
+    char dir[256], path[300];
+    struct seen s;
+    struct wal w;
+    uint64_t good;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-wal") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/log", dir);
+    CHECK(wal_create(path, 7) == 0);
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(append_records(&w, 0, 4) == 0);
+    good = w.len;
+    CHECK(append_records(&w, 4, 5) == 0);
+    wal_close(&w);
+    CHECK(truncate(path, (off_t)(good + WAL_RECORD_HEADER + 2)) == 0);
+
+    CHECK(replay_all(path, 7, &s) == 4);
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(w.records == 4 && w.len == good);
+    CHECK(append_records(&w, 4, 6) == 0);
+    wal_close(&w);
+    CHECK(replay_all(path, 7, &s) == 6);
+    CHECK(s.ok);
+    bench_rmtree(dir);
+}
+
+/* A flipped bit ends the log at the damaged record. */
+static void corrupt_record_ends_log(void)
+{
+    char dir[256], path[300];
+    unsigned char c;
+    uint64_t second;
+    struct seen s;
+    struct wal w;
+    int fd;
+
+    if (bench_tmpdir(dir, sizeof(dir), "test-wal") != 0) {
+        CHECK(0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/log", dir);
+    CHECK(wal_create(path, 7) == 0);
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(append_records(&w, 0, 1) == 0);
+    second = w.len;
+    CHECK(append_records(&w, 1, 3) == 0);
+    wal_close(&w);
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    CHECK(fd >= 0 && pread(fd, &c, 1, (off_t)(second + WAL_RECORD_HEADER + 10)) == 1);
+    c ^= 0x10;
+    CHECK(pwrite(fd, &c, 1, (off_t)(second + WAL_RECORD_HEADER + 10)) == 1);
+    close(fd);
+    CHECK(replay_all(path, 7, &s) == 1);
+    CHECK(wal_open(&w, path) == 0);
+    CHECK(w.records == 1 && w.len == second);
+    wal_close(&w);
+
+    /* Something else entirely is not a log. */
+    CHECK(test_write(path, "not a write-ahead log, just some text") == 0);
+    CHECK(wal_open(&w, path) != 0);
+    bench_rmtree(dir);
+}
+
+int main(void)
+{
+    RUN(crc32c_known_value);
+    RUN(records_round_trip);
+    RUN(replay_resumes);
+    RUN(torn_tail_cut);
+    RUN(corrupt_record_ends_log);
+    return TEST_EXIT();
+}
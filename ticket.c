@@ -0,0 +1,255 @@
+#include "ticket.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char *const state_names[] = {
+    "unknown", "open", "closed", "archived", "deleted"
+};
+
+const char *ticket_state_name(int state)
+{
+    if (state < 0 || state >= TICKET_NSTATES)
+        return "unknown";
+    return state_names[state];
+}
+
+int ticket_state_parse(const char *s)
+{
+    int i;
+
+    for (i = 0; i < TICKET_NSTATES; i++)
+        if (!strcmp(s, state_names[i]))
+            return i;
+    return -1;
+}
+
+int ticket_parse(const char *name, char *prefix, size_t n, uint64_t *number,
+                 int *width)
+{
+    size_t len = strlen(name), p = 0, i;
+    uint64_t v = 0;
+
+    while (p < len && !isdigit((unsigned char)name[p]))
+        p++;
+    if (p == len || len - p > 19 || p >= n)
+        return -1;
+    for (i = p; i < len; i++) {
+        if (!isdigit((unsigned char)name[i]))
+            return -1;
+        v = v * 10 + (uint64_t)(name[i] - '0');
+    }
+    memcpy(prefix, name, p);
+    prefix[p] = '\0';
+    *number = v;
+    *width = (int)(len - p);
+    return 0;
+}
+
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static int grow_slots(struct ordmap *m)
+{
+    uint32_t nslots = m->nslots ? m->nslots * 2 : 1024;
+    uint32_t *slots = calloc(nslots, sizeof(*slots));
+    uint32_t i;
+
+    if (!slots)
+        return -1;
+    for (i = 0; i < m->count; i++) {
+        uint32_t h = hash_name(m->names[i]) & (nslots - 1);
+
+        while (slots[h])
+            h = (h + 1) & (nslots - 1);
+        slots[h] = i + 1;
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->nslots = nslots;
+    return 0;
+}
+
+static int insert(struct ordmap *m, const char *name, size_t len)
+{
+    uint32_t h;
+    char *copy;
+
+    if (m->count == m->cap) {
+        uint32_t cap = m->cap ? m->cap * 2 : 1024;
+        char **names = realloc(m->names, cap * sizeof(*names));
+
+        if (!names)
+            return -1;
+        m->names = names;
+        m->cap = cap;
+    }
+    if ((m->count + 1) * 2 > m->nslots && grow_slots(m) != 0)
+        return -1;
+    copy = malloc(len + 1);
+    if (!copy)
+        return -1;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    m->names[m->count] = copy;
+    h = hash_name(copy) & (m->nslots - 1);
+    while (m->slots[h])
+        h = (h + 1) & (m->nslots - 1);
+    m->slots[h] = ++m->count;
+    return 0;
+}
+
+/* Consume whole lines past m->loaded; a torn final line is left alone. */
+static int load_from(struct ordmap *m, int fd)
+{
+    struct stat st;
+    char *buf, *p, *end;
+    size_t want;
+    ssize_t got;
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+    if ((size_t)st.st_size <= m->loaded)
+        return 0;
+    want = st.st_size - m->loaded;
+    buf = malloc(want);
+    if (!buf)
+        return -1;
+    got = pread(fd, buf, want, m->loaded);
+    if (got < 0) {
+        free(buf);
+        return -1;
+    }
+    p = buf;
+    end = buf + got;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+
+        if (!nl)
+            break;
+        if (nl > p && insert(m, p, nl - p) != 0) {
+            free(buf);
+            return -1;
+        }
+        m->loaded += nl - p + 1;
+        p = nl + 1;
+    }
+    free(buf);
+    return 0;
+}
+
+int ordmap_open(struct ordmap *m, const char *state_dir)
+{
+    int fd, rc;
+
+    memset(m, 0, sizeof(*m));
+    snprintf(m->path, sizeof(m->path), "%s/tickets", state_dir);
+    if (grow_slots(m) != 0)
+        return -1;
+    fd = open(m->path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    rc = load_from(m, fd);
+    close(fd);
+    return rc;
+}
+
+int ordmap_refresh(struct ordmap *m)
+{
+    int fd = open(m->path, O_RDONLY | O_CLOEXEC);
+    int rc;
+
+    if (fd < 0)
+        return -1;
+    rc = load_from(m, fd);
+    close(fd);
+    return rc;
+}
+
+void ordmap_close(struct ordmap *m)
+{
+    uint32_t i;
+
+    for (i = 0; i < m->count; i++)
+        free(m->names[i]);
+    free(m->names);
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+uint32_t ordmap_lookup(const struct ordmap *m, const char *name)
+{
+    uint32_t h = hash_name(name) & (m->nslots - 1);
+
+    while (m->slots[h]) {
+        uint32_t ord = m->slots[h] - 1;
+
+        if (!strcmp(m->names[ord], name))
+            return ord;
+        h = (h + 1) & (m->nslots - 1);
+    }
+    return TICKET_NONE;
+}
+
+uint32_t ordmap_add(struct ordmap *m, const char *name)
+{
+    char line[TICKET_NAME_MAX + 2];
+    uint32_t ord = ordmap_lookup(m, name);
+    size_t len = strlen(name);
+    int fd;
+
+    if (ord != TICKET_NONE)
+        return ord;
+    if (len == 0 || len > TICKET_NAME_MAX || strchr(name, '\n'))
+        return TICKET_NONE;
+
+    fd = open(m->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return TICKET_NONE;
+    flock(fd, LOCK_EX);
+    /* Another process may have registered it (or others) meanwhile. */
+    if (load_from(m, fd) != 0)
+        goto fail;
+    ord = ordmap_lookup(m, name);
+    if (ord == TICKET_NONE) {
+        struct stat st;
+
+        /* Cut any torn line a crashed writer left behind. */
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > m->loaded &&
+            ftruncate(fd, m->loaded) != 0)
+            goto fail;
+        memcpy(line, name, len);
+        line[len] = '\n';
+        if (write(fd, line, len + 1) != (ssize_t)(len + 1) || fdatasync(fd) != 0)
+            goto fail;
+        if (insert(m, name, len) != 0)
+            goto fail;
+        m->loaded += len + 1;
+        ord = m->count - 1;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return ord;
+
+fail:
+    flock(fd, LOCK_UN);
+    close(fd);
+    return TICKET_NONE;
+}
+
+const char *ordmap_name(const struct ordmap *m, uint32_t ord)
+{
+    return ord < m->count ? m->names[ord] : NULL;
+}
@@ -0,0 +1,50 @@
+#ifndef TICKET_H
+#define TICKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ticket names are an alphabetic prefix followed by digits (INC0012345).
+ * Every ticket the tool has seen gets a dense, permanent ordinal so that
+ * per-ticket data can live in flat arrays and bitmaps.
+ */
+
+#define TICKET_NAME_MAX 64
+#define TICKET_NONE UINT32_MAX
+
+/* Zero is "no row yet" so freshly grown metadata columns read as unknown. */
+enum ticket_state {
+    TICKET_UNKNOWN = 0,
+    TICKET_OPEN = 1,
+    TICKET_CLOSED = 2,
+    TICKET_ARCHIVED = 3,
+    TICKET_DELETED = 4,
+    TICKET_NSTATES
+};
+
+const char *ticket_state_name(int state);
+int ticket_state_parse(const char *s);
+
+int ticket_parse(const char *name, char *prefix, size_t n, uint64_t *number,
+                 int *width);
+
+struct ordmap {
+    char path[4096];
+    char **names;           /* ordinal -> name */
+    uint32_t count, cap;
+    uint32_t *slots;        /* open addressing, stores ordinal + 1 */
+    uint32_t nslots;
+    size_t loaded;          /* bytes of the registry file consumed */
+};
+
+int ordmap_open(struct ordmap *m, const char *state_dir);
+void ordmap_close(struct ordmap *m);
+/* Pick up ordinals appended by other processes since open. */
+int ordmap_refresh(struct ordmap *m);
+
+uint32_t ordmap_lookup(const struct ordmap *m, const char *name);
+uint32_t ordmap_add(struct ordmap *m, const char *name);
+const char *ordmap_name(const struct ordmap *m, uint32_t ord);
+
+#endif
@@ -0,0 +1,507 @@
+#include "ticketfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+#include "hooks.h"
+#include "index.h"
+#include "iosched.h"
+#include "journal.h"
+#include "merkle.h"
+#include "meta.h"
+#include "timelog.h"
+#include "views.h"
+
+struct tfs_ctx {
+    char base[4096], state[4096];
+    int basefd;
+    int base_id;
+    pthread_mutex_t lock;   /* guards everything below */
+    int have_names, have_meta, have_sched, have_hooks;
+    struct ordmap names;
+    struct meta meta;
+    struct iosched sched;   /* interactive sections, revisit rescans */
+    struct hooks hooks;
+};
+
+struct rescan_job {
+    struct tfs_ctx *c;
+    uint32_t ord;
+    char path[];
+};
+
+int tfs_ctx_open(struct tfs_ctx **out, const char *base)
+{
+    struct tfs_ctx *c = calloc(1, sizeof(*c));
+
+    *out = NULL;
+    if (!c)
+        return -1;
+    if (base)
+        snprintf(c->base, sizeof(c->base), "%s", base);
+    if ((!base && config_read_base(c->base, sizeof(c->base)) != 0) ||
+        config_state_dir(c->base, c->state, sizeof(c->state)) != 0 ||
+        (c->basefd = open(c->base, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        free(c);
+        return -1;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    *out = c;
+    return 0;
+}
+
+void tfs_ctx_close(struct tfs_ctx *c)
+{
+    if (!c)
+        return;
+    if (c->have_sched) {
+        iosched_drain(&c->sched);
+        iosched_shutdown(&c->sched);
+    }
+    if (c->have_hooks)
+        hooks_shutdown(&c->hooks);
+    if (c->have_meta)
+        meta_close(&c->meta);
+    if (c->have_names)
+        ordmap_close(&c->names);
+    pthread_mutex_destroy(&c->lock);
+    close(c->basefd);
+    free(c);
+}
+
+/*
+ * Everything past the base descriptor starts on first use, so a lookup
+ * never starts a thread or a hook helper. Called with the lock held.
+ */
+static int need_names(struct tfs_ctx *c)
+{
+    if (!c->have_names && ordmap_open(&c->names, c->state) == 0)
+        c->have_names = 1;
+    return c->have_names ? 0 : -1;
+}
+
+static int need_meta(struct tfs_ctx *c)
+{
+    if (!c->have_meta && meta_open(&c->meta, c->state) == 0) {
+        c->base_id = meta_base_id(&c->meta, c->base);
+        c->have_meta = 1;
+    }
+    return c->have_meta ? 0 : -1;
+}
+
+/* These two take the lock themselves. */
+static struct iosched *sched(struct tfs_ctx *c)
+{
+    pthread_mutex_lock(&c->lock);
+    if (!c->have_sched) {
+        iosched_init(&c->sched, c->state, 1, 0);
+        c->have_sched = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return &c->sched;
+}
+
+static struct hooks *hooks(struct tfs_ctx *c)
+{
+    pthread_mutex_lock(&c->lock);
+    if (!c->have_hooks) {
+        hooks_init(&c->hooks, c->base, c->state);
+        c->have_hooks = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return &c->hooks;
+}
+
+const char *tfs_base(const struct tfs_ctx *c)
+{
+    return c->base;
+}
+
+const char *tfs_state_dir(const struct tfs_ctx *c)
+{
+    return c->state;
+}
+
+void tfs_sanitize(const char *in, char *out, size_t n)
+{
+    size_t j = 0;
+
+    for (; *in && j + 1 < n; in++) {
+        if (strchr("<>:\"/\\|?*", *in))
+            continue;
+        out[j++] = *in == ' ' ? '_' : *in;
+    }
+    out[j] = '\0';
+}
+
+int tfs_valid_name(const char *name)
+{
+    char clean[TICKET_NAME_MAX + 1];
+    size_t len = strlen(name);
+
+    if (len == 0 || len > TICKET_NAME_MAX || name[0] == '.' || strchr(name, '\n'))
+        return 0;
+    tfs_sanitize(name, clean, sizeof(clean));
+    return !strcmp(clean, name);
+}
+
+int tfs_ticket_name(const char *name)
+{
+    char prefix[TICKET_NAME_MAX + 1];
+    uint64_t number;
+    int width;
+
+    return tfs_valid_name(name) &&
+           ticket_parse(name, prefix, sizeof(prefix), &number, &width) == 0;
+}
+
+int tfs_lookup(struct tfs_ctx *c, const char *name, struct tfs_info *info)
+{
+    uint32_t ord;
+
+    pthread_mutex_lock(&c->lock);
+    if (need_names(c) != 0) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    ord = ordmap_lookup(&c->names, name);
+    /* Another process may have registered it since the context was opened. */
+    if (ord == TICKET_NONE && ordmap_refresh(&c->names) == 0)
+        ord = ordmap_lookup(&c->names, name);
+    if (ord == TICKET_NONE) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    if (info) {
+        memset(info, 0, sizeof(*info));
+        info->ord = ord;
+        info->state = TICKET_UNKNOWN;
+        if (need_meta(c) == 0 && meta_reserve(&c->meta, ord + 1) == 0) {
+            info->state = c->meta.state[ord];
+            info->ctime = c->meta.ctime[ord];
+            info->mtime = c->meta.mtime[ord];
+            info->size = c->meta.size[ord];
+            info->files = c->meta.files[ord];
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* Follow the link a merge leaves in place of a duplicate, and fill in the path. */
+static void resolve(struct tfs_ctx *c, const char *name, struct tfs_ticket *t)
+{
+    char target[TICKET_NAME_MAX + 2];
+    ssize_t n = readlinkat(c->basefd, name, target, sizeof(target) - 1);
+
+    t->merged_from[0] = '\0';
+    if (n > 0 && n <= TICKET_NAME_MAX && !memchr(target, '/', n) && target[0] != '.') {
+        snprintf(t->merged_from, sizeof(t->merged_from), "%s", name);
+        snprintf(t->name, sizeof(t->name), "%.*s", (int)n, target);
+    } else {
+        snprintf(t->name, sizeof(t->name), "%s", name);
+    }
+    snprintf(t->path, sizeof(t->path), "%s/%s", c->base, t->name);
+}
+
+/* mkdir and register; called with the lock held. */
+static int make(struct tfs_ctx *c, struct tfs_ticket *t)
+{
+    struct stat st;
+
+    t->created = 0;
+    t->ord = TICKET_NONE;
+    if (need_names(c) != 0)
+        return -1;
+    if (mkdirat(c->basefd, t->name, 0755) == 0)
+        t->created = 1;
+    else if (errno != EEXIST)
+        return -1;
+    t->ord = ordmap_add(&c->names, t->name);
+    if (t->ord != TICKET_NONE && t->created && need_meta(c) == 0)
+        meta_on_create(&c->meta, t->ord, c->base_id,
+                       fstatat(c->basefd, t->name, &st, 0) == 0 ? st.st_ino : 0, time(NULL));
+    return 0;
+}
+
+int tfs_create_many(struct tfs_ctx *c, const char *const *names, size_t n,
+                    struct tfs_ticket *out)
+{
+    struct index_writer w;
+    int64_t now = time(NULL);
+    size_t i;
+    int created = 0;
+
+    for (i = 0; i < n; i++) {
+        memset(&out[i], 0, sizeof(out[i]));
+        out[i].ord = TICKET_NONE;
+    }
+    iosched_interactive_begin(sched(c));
+    pthread_mutex_lock(&c->lock);
+    /* Without the registry nothing can be recorded, so nothing is made. */
+    if (need_names(c) != 0) {
+        pthread_mutex_unlock(&c->lock);
+        iosched_interactive_end(sched(c));
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (!tfs_ticket_name(names[i]))
+            continue;
+        resolve(c, names[i], &out[i]);
+        if (make(c, &out[i]) == 0 && out[i].created)
+            created++;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* One writer session for the batch; it holds the index lock. */
+    if (created && index_writer_open(&w, c->state) == 0) {
+        for (i = 0; i < n; i++)
+            if (out[i].created)
+                index_add(&w, out[i].name);
+        index_writer_close(&w);
+    }
+    iosched_interactive_end(sched(c));
+    for (i = 0; i < n; i++) {
+        if (out[i].created && out[i].ord != TICKET_NONE) {
+            journal_append(c->state, JOURNAL_CREATE, out[i].ord, now, 0);
+            hooks_fire(hooks(c), HOOK_CREATE, out[i].ord, out[i].name, out[i].path);
+        }
+    }
+    if (created) {
+        struct views_stats vs;
+
+        views_update(c->base, c->state, 0, &vs);
+    }
+    return created;
+}
+
+static void rescan(void *arg)
+{
+    struct rescan_job *job = arg;
+    struct tfs_ctx *c = job->c;
+    int seen, changed = 0;
+    int64_t before, delta = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (need_meta(c) != 0) {
+        pthread_mutex_unlock(&c->lock);
+        free(job);
+        return;
+    }
+    seen = job->ord < c->meta.count && c->meta.mtime[job->ord] != 0;
+    before = seen ? c->meta.size[job->ord] : 0;
+    /* Journal size changes of folders already scanned; a first scan is not growth. */
+    if (meta_rescan(&c->meta, job->ord, job->path) == 0 && seen &&
+        c->meta.size[job->ord] != before) {
+        delta = c->meta.size[job->ord] - before;
+        changed = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (changed)
+        journal_append(c->state, JOURNAL_SIZE, job->ord, time(NULL), delta);
+    free(job);
+}
+
+int tfs_open(struct tfs_ctx *c, const char *name, uint32_t flags, FILE *out,
+             struct tfs_ticket *t)
+{
+    struct views_stats vs;
+    int64_t now = time(NULL);
+    int rc;
+
+    memset(t, 0, sizeof(*t));
+    t->ord = TICKET_NONE;
+    if (!tfs_valid_name(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    iosched_interactive_begin(sched(c));
+    resolve(c, name, t);
+    pthread_mutex_lock(&c->lock);
+    rc = make(c, t);
+    pthread_mutex_unlock(&c->lock);
+    if (rc == 0 && t->created) {
+        struct index_writer w;
+
+        if (index_writer_open(&w, c->state) == 0) {
+            index_add(&w, t->name);
+            index_writer_close(&w);
+        }
+    }
+    iosched_interactive_end(sched(c));
+    if (rc != 0 || t->ord == TICKET_NONE)
+        return rc;
+
+    timelog_enter(c->state, t->ord, now);
+    journal_append(c->state, t->created ? JOURNAL_CREATE : JOURNAL_OPEN, t->ord, now, 0);
+    hooks_fire(hooks(c), t->created ? HOOK_CREATE : HOOK_OPEN, t->ord, t->name, t->path);
+    if (flags & TFS_OPEN_PREFETCH)
+        prefetch_start(&t->pf, c->state, t->ord, t->path, 0);
+    if (flags & TFS_OPEN_CHANGES)
+        merkle_visit(c->state, t->ord, t->path, 0, 1, out);
+
+    /* A revisit rescans the folder in the background; a new one is empty. */
+    if (!t->created) {
+        size_t len = strlen(t->path);
+        struct rescan_job *job = malloc(sizeof(*job) + len + 1);
+
+        if (job) {
+            job->c = c;
+            job->ord = t->ord;
+            memcpy(job->path, t->path, len + 1);
+            if (iosched_submit(sched(c), rescan, job) != 0)
+                free(job);
+        }
+    }
+    if (views_update(c->base, c->state, 0, &vs) != 0 && out)
+        fprintf(out, "Could not update the views in %s/%s\n", c->base, VIEWS_DIR);
+    return 0;
+}
+
+void tfs_release(struct tfs_ticket *t)
+{
+    prefetch_wait(&t->pf);
+}
+
+/* Run this binary's create command once per ticket, as scripts do today. */
+static double exec_per_ticket(long n, long first)
+{
+    char name[32], exe[4096];
+    struct timespec t0;
+    ssize_t len;
+    long i;
+
+    len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len <= 0)
+        return -1;
+    exe[len] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++) {
+        pid_t pid;
+        int status;
+
+        snprintf(name, sizeof(name), "INC%07ld", first + i);
+        pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_RDWR);
+
+            if (null >= 0) {
+                dup2(null, 0);
+                dup2(null, 1);
+            }
+            execl(exe, exe, "create", name, (char *)NULL);
+            _exit(127);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            return -1;
+    }
+    return bench_ms_since(&t0);
+}
+
+int tfs_bench(int argc, char *argv[])
+{
+    long n = argc > 0 ? strtol(argv[0], NULL, 10) : 5000;
+    long nexec = argc > 1 ? strtol(argv[1], NULL, 10) : 200;
+    char home[256], base[300], name[32];
+    const char *old_home = getenv("HOME"), *old_profile = getenv("USERPROFILE");
+    char *saved_home = old_home ? strdup(old_home) : NULL;
+    char *saved_profile = old_profile ? strdup(old_profile) : NULL;
+    const char **names = NULL;
+    struct tfs_ticket *out = NULL, t;
+    struct tfs_info info;
+    struct tfs_ctx *c = NULL;
+    struct timespec t0;
+    double one_ms, batch_ms, lookup_ms, open_ms, exec_ms;
+    long i, found = 0;
+    int rc = 1;
+
+    if (n <= 0)
+        n = 5000;
+    if (nexec <= 0)
+        nexec = 200;
+    if (bench_tmpdir(home, sizeof(home), "lib") != 0)
+        return 1;
+    snprintf(base, sizeof(base), "%s/base", home);
+    names = calloc(2 * n, sizeof(*names));
+    out = calloc(n, sizeof(*out));
+    if (!names || !out || tfs_ctx_open(&c, base) != 0) {
+        printf("could not open a context\n");
+        goto out;
+    }
+    for (i = 0; i < 2 * n; i++) {
+        snprintf(name, sizeof(name), "INC%07ld", i);
+        names[i] = strdup(name);
+        if (!names[i])
+            goto out;
+    }
+
+    /* One call per ticket, then the same number in one batch. */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++)
+        tfs_create_many(c, &names[i], 1, &out[0]);
+    one_ms = bench_ms_since(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    tfs_create_many(c, &names[n], n, out);
+    batch_ms = bench_ms_since(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < 2 * n; i++)
+        found += tfs_lookup(c, names[i], &info) == 0;
+    lookup_ms = bench_ms_since(&t0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++) {
+        tfs_open(c, names[i], 0, NULL, &t);
+        tfs_release(&t);
+    }
+    open_ms = bench_ms_since(&t0);
+    tfs_ctx_close(c);
+    c = NULL;
+
+    /* The same creates through the CLI, pointed at the bench base. */
+    setenv("HOME", home, 1);
+    unsetenv("USERPROFILE");
+    if (config_save_base(base) != 0) {
+        printf("could not write the bench config\n");
+        goto out;
+    }
+    exec_ms = exec_per_ticket(nexec, 2 * n);
+    if (exec_ms < 0) {
+        printf("could not run the create command\n");
+        goto out;
+    }
+
+    printf("create, one call each:  %8.1f us/ticket\n", one_ms * 1e3 / n);
+    printf("create_many, batch:     %8.1f us/ticket\n", batch_ms * 1e3 / n);
+    printf("lookup:                 %8.2f us/ticket (%ld of %ld found)\n",
+           lookup_ms * 1e3 / (2 * n), found, 2 * n);
+    printf("open, revisit:          %8.1f us/ticket\n", open_ms * 1e3 / n);
+    printf("exec per ticket:        %8.1f us/ticket (%ld runs, %.0fx a library call)\n",
+           exec_ms * 1e3 / nexec, nexec, (exec_ms / nexec) / (one_ms / n));
+    rc = 0;
+out:
+    if (saved_home)
+        setenv("HOME", saved_home, 1);
+    if (saved_profile)
+        setenv("USERPROFILE", saved_profile, 1);
+    free(saved_home);
+    free(saved_profile);
+    tfs_ctx_close(c);
+    if (names)
+        for (i = 0; i < 2 * n; i++)
+            free((char *)names[i]);
+    free(names);
+    free(out);
+    bench_rmtree(home);
+    return rc;
+}
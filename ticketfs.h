@@ -0,0 +1,94 @@
+#ifndef TICKETFS_H
+#define TICKETFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "prefetch.h"
+#include "ticket.h"
+
+/*
+ * libticketfs: the ticket operations behind the CLI, for programs that
+ * would otherwise run it once per ticket. A context holds what every call
+ * needs (the base and state paths, a descriptor on the base, the registry,
+ * the metadata columns, a background scheduler and the hooks) so a batch
+ * pays that setup once. Opening a context only reads the config; the
+ * rest starts on first use. Calls on one context may come from any
+ * thread; they are serialised by its lock where they touch shared state.
+ * Separate contexts and separate processes coordinate through the same
+ * file locks the CLI uses.
+ *
+ * Nothing here prints unless given a stream, and nothing changes the
+ * working directory or starts a file manager; that is left to the caller.
+ */
+
+struct tfs_ctx;
+
+enum {
+    TFS_OPEN_PREFETCH = 1 << 0,     /* read the working set ahead; see tfs_release */
+    TFS_OPEN_CHANGES = 1 << 1,      /* print and record changes since the last visit */
+};
+
+struct tfs_ticket {
+    char name[TICKET_NAME_MAX + 1];     /* after following a merge */
+    char merged_from[TICKET_NAME_MAX + 1];  /* the name asked for, if merged */
+    char path[4096 + TICKET_NAME_MAX + 2];
+    uint32_t ord;           /* TICKET_NONE if it could not be registered */
+    int created;
+    struct prefetch pf;
+};
+
+struct tfs_info {
+    uint32_t ord;
+    int state;              /* enum ticket_state */
+    int64_t ctime, mtime, size, files;
+};
+
+/*
+ * Open a context on base, or on the configured base when base is NULL;
+ * fails (errno ENOENT) rather than asking when none is configured.
+ */
+int tfs_ctx_open(struct tfs_ctx **out, const char *base);
+/* Waits for background rescans, then frees the context. */
+void tfs_ctx_close(struct tfs_ctx *c);
+const char *tfs_base(const struct tfs_ctx *c);
+const char *tfs_state_dir(const struct tfs_ctx *c);
+
+/*
+ * The folder name the CLI makes of what was typed: characters Windows
+ * forbids dropped, spaces turned into underscores.
+ */
+void tfs_sanitize(const char *in, char *out, size_t n);
+/* Whether name is a usable folder name: already sanitized, not hidden, not too long. */
+int tfs_valid_name(const char *name);
+/* A valid name that is also a ticket (prefix and number), as scan and list see them. */
+int tfs_ticket_name(const char *name);
+
+/* Metadata of a registered ticket; -1 if there is none. */
+int tfs_lookup(struct tfs_ctx *c, const char *name, struct tfs_info *info);
+
+/*
+ * Create and register the named tickets; existing ones are left alone,
+ * and names that are not tfs_ticket_name() are skipped (ord TICKET_NONE).
+ * out[i] describes names[i]. The index is updated once for the batch and
+ * the views once at the end. Returns how many were created, or -1 if the
+ * batch could not start.
+ */
+int tfs_create_many(struct tfs_ctx *c, const char *const *names, size_t n,
+                    struct tfs_ticket *out);
+
+/*
+ * Everything opening a ticket does apart from showing it: create it if
+ * needed, register it, start its time tracking, journal the open and
+ * refresh its metadata (in the background for a revisit). Changes since
+ * the last visit go to out when TFS_OPEN_CHANGES is set.
+ */
+int tfs_open(struct tfs_ctx *c, const char *name, uint32_t flags, FILE *out,
+             struct tfs_ticket *t);
+/* Wait for anything tfs_open left running for t. */
+void tfs_release(struct tfs_ticket *t);
+
+int tfs_bench(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,503 @@
+#include "timelog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "ticket.h"
+
+#define TIME_MAGIC "TFSTIME1"
+
+struct log_header {
+    char magic[8];
+    int64_t base;           /* time the log was started */
+    int64_t last;           /* time of the last event */
+    uint64_t len;           /* bytes of events after the header */
+    uint32_t cur;           /* ordinal + 1 of the open session, 0 for none */
+    uint32_t rolling;       /* the last event's session may be missing from the rollups */
+    int64_t since;          /* when the open session began */
+};
+
+struct tl {
+    char dir[4200];
+    int fd, days, weeks;
+    struct log_header h;
+};
+
+uint32_t time_day(int64_t t)
+{
+    struct tm tm;
+    time_t tt = t;
+
+    localtime_r(&tt, &tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    return (uint32_t)(timegm(&tm) / 86400);
+}
+
+uint32_t time_week(uint32_t day)
+{
+    return (day + 3) / 7;   /* 1970-01-01 was a Thursday */
+}
+
+uint32_t time_week_day(uint32_t week)
+{
+    return week * 7 - 3;
+}
+
+static int64_t next_midnight(int64_t t)
+{
+    struct tm tm;
+    time_t tt = t;
+
+    localtime_r(&tt, &tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_mday++;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (*p < end && shift < 64) {
+        uint8_t b = *(*p)++;
+
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+        shift += 7;
+    }
+    return -1;
+}
+
+static int open_rollups(struct tl *t, const char *suffix)
+{
+    char path[4300];
+
+    snprintf(path, sizeof(path), "%s/days%s", t->dir, suffix);
+    t->days = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (*suffix ? O_TRUNC : 0), 0644);
+    snprintf(path, sizeof(path), "%s/weeks%s", t->dir, suffix);
+    t->weeks = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (*suffix ? O_TRUNC : 0), 0644);
+    return t->days >= 0 && t->weeks >= 0 ? 0 : -1;
+}
+
+static int rebuild(struct tl *t);
+
+/* Open and lock the log; every update holds the lock from here to tl_close. */
+static int tl_open(struct tl *t, const char *state_dir, int64_t now)
+{
+    char path[4300];
+
+    memset(t, 0, sizeof(*t));
+    t->fd = t->days = t->weeks = -1;
+    snprintf(t->dir, sizeof(t->dir), "%s/time", state_dir);
+    if (mkdir(t->dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s/log", t->dir);
+    t->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (t->fd < 0)
+        return -1;
+    flock(t->fd, LOCK_EX);
+    if (pread(t->fd, &t->h, sizeof(t->h), 0) != sizeof(t->h)) {
+        memset(&t->h, 0, sizeof(t->h));
+        memcpy(t->h.magic, TIME_MAGIC, 8);
+        t->h.base = t->h.last = now;
+        if (pwrite(t->fd, &t->h, sizeof(t->h), 0) != sizeof(t->h))
+            return -1;
+    }
+    if (memcmp(t->h.magic, TIME_MAGIC, 8)) {
+        fprintf(stderr, "timelog: %s is not a time log\n", path);
+        return -1;
+    }
+    /* A crash between an event and its rollup: the log has it, so replay. */
+    if (t->h.rolling && rebuild(t) != 0)
+        return -1;
+    return 0;
+}
+
+static void tl_close(struct tl *t)
+{
+    if (t->days >= 0)
+        close(t->days);
+    if (t->weeks >= 0)
+        close(t->weeks);
+    if (t->fd >= 0)
+        close(t->fd);
+}
+
+/* Add to (period, ord), which can only be among the rows of the last period. */
+static int add_row(int fd, uint32_t period, uint32_t ord, uint64_t seconds)
+{
+    struct time_row r;
+    struct stat st;
+    off_t pos;
+
+    if (fstat(fd, &st) != 0)
+        return -1;
+    pos = st.st_size - st.st_size % sizeof(r);
+    while (pos >= (off_t)sizeof(r)) {
+        if (pread(fd, &r, sizeof(r), pos - sizeof(r)) != sizeof(r))
+            return -1;
+        if (r.period != period)
+            break;
+        if (r.ord == ord) {
+            r.seconds += seconds;
+            return pwrite(fd, &r, sizeof(r), pos - sizeof(r)) == sizeof(r) ? 0 : -1;
+        }
+        pos -= sizeof(r);
+    }
+    r.period = period;
+    r.ord = ord;
+    r.seconds = seconds;
+    pos = st.st_size - st.st_size % sizeof(r);
+    return pwrite(fd, &r, sizeof(r), pos) == sizeof(r) ? 0 : -1;
+}
+
+static int add_span(struct tl *t, uint32_t ord, int64_t start, int64_t end)
+{
+    if (end > start + TIME_SESSION_MAX)
+        end = start + TIME_SESSION_MAX;
+    if (t->days < 0 && open_rollups(t, "") != 0)
+        return -1;
+    while (start < end) {
+        int64_t stop = next_midnight(start);
+        uint32_t day = time_day(start);
+
+        if (stop > end || stop <= start)
+            stop = end;
+        if (add_row(t->days, day, ord, stop - start) != 0 ||
+            add_row(t->weeks, time_week(day), ord, stop - start) != 0)
+            return -1;
+        start = stop;
+    }
+    return 0;
+}
+
+/*
+ * Append an event: enter ord when code is ord + 1, leave when it is 0.
+ * The log comes first; the session it closes is then added to the
+ * rollups, with h.rolling set in between so a crash there is replayed.
+ */
+static int append(struct tl *t, int64_t now, uint32_t code)
+{
+    uint32_t cur = t->h.cur;
+    int64_t since = t->h.since;
+    uint8_t buf[20];
+    size_t n;
+
+    if (now < t->h.last)
+        now = t->h.last;
+    n = put_varint(buf, now - t->h.last);
+    n += put_varint(buf + n, code);
+    if (pwrite(t->fd, buf, n, sizeof(t->h) + t->h.len) != (ssize_t)n)
+        return -1;
+    t->h.len += n;
+    t->h.last = now;
+    t->h.cur = code;
+    t->h.since = now;
+    t->h.rolling = cur != 0;
+    if (pwrite(t->fd, &t->h, sizeof(t->h), 0) != sizeof(t->h))
+        return -1;
+    if (!cur)
+        return 0;
+    if (add_span(t, cur - 1, since, now) != 0)
+        return -1;
+    t->h.rolling = 0;
+    return pwrite(t->fd, &t->h, sizeof(t->h), 0) == sizeof(t->h) ? 0 : -1;
+}
+
+int timelog_enter(const char *state_dir, uint32_t ord, int64_t now)
+{
+    struct tl t;
+    int rc = -1;
+
+    if (tl_open(&t, state_dir, now) != 0)
+        goto out;
+    /* Opening the same ticket again carries on the session. */
+    if (t.h.cur == ord + 1 && now - t.h.since < TIME_SESSION_MAX) {
+        rc = 0;
+        goto out;
+    }
+    rc = append(&t, now, ord + 1);
+out:
+    tl_close(&t);
+    return rc;
+}
+
+int timelog_leave(const char *state_dir, int64_t now)
+{
+    struct tl t;
+    int rc = -1;
+
+    if (tl_open(&t, state_dir, now) != 0)
+        goto out;
+    rc = t.h.cur ? append(&t, now, 0) : 0;
+out:
+    tl_close(&t);
+    return rc;
+}
+
+int timelog_current(const char *state_dir, uint32_t *ord, int64_t *since)
+{
+    struct log_header h;
+    char path[4200];
+    int fd;
+
+    *ord = TICKET_NONE;
+    *since = 0;
+    snprintf(path, sizeof(path), "%s/time/log", state_dir);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, TIME_MAGIC, 8) &&
+        h.cur) {
+        *ord = h.cur - 1;
+        *since = h.since;
+    }
+    close(fd);
+    return 0;
+}
+
+int timelog_rollup(const char *state_dir, int kind, uint32_t from, uint32_t to,
+                   struct time_row **rows, size_t *n)
+{
+    const struct time_row *r;
+    char path[4200];
+    struct stat st;
+    size_t count, lo = 0, hi, i;
+    void *p;
+    int fd;
+
+    *rows = NULL;
+    *n = 0;
+    snprintf(path, sizeof(path), "%s/time/%s", state_dir, kind == TIME_WEEK ? "weeks" : "days");
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) != 0 || (count = st.st_size / sizeof(*r)) == 0) {
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, count * sizeof(*r), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+    r = p;
+    /* Rows are in period order: find the range by binary search. */
+    hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (r[mid].period < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < count && r[i].period <= to; i++)
+        ;
+    if (i > lo && !(*rows = malloc((i - lo) * sizeof(**rows)))) {
+        munmap(p, count * sizeof(*r));
+        return -1;
+    }
+    if (i > lo)
+        memcpy(*rows, r + lo, (i - lo) * sizeof(**rows));
+    *n = i - lo;
+    munmap(p, count * sizeof(*r));
+    return 0;
+}
+
+typedef int (*session_fn)(uint32_t ord, int64_t start, int64_t end, void *arg);
+
+/* Replay the log, calling fn for every closed session. */
+static int replay(const struct tl *t, session_fn fn, void *arg)
+{
+    const uint8_t *p, *q, *end;
+    int64_t now = t->h.base, since = 0;
+    uint32_t cur = 0;
+    int rc = 0;
+
+    if (t->h.len == 0)
+        return 0;
+    p = mmap(NULL, sizeof(t->h) + t->h.len, PROT_READ, MAP_SHARED, t->fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    q = p + sizeof(t->h);
+    end = q + t->h.len;
+    while (rc == 0 && q < end) {
+        uint64_t dt, code;
+
+        if (get_varint(&q, end, &dt) != 0 || get_varint(&q, end, &code) != 0)
+            break;
+        now += dt;
+        if (cur)
+            rc = fn(cur - 1, since, now, arg);
+        cur = (uint32_t)code;
+        since = now;
+    }
+    munmap((void *)p, sizeof(t->h) + t->h.len);
+    return rc;
+}
+
+static int rebuild_one(uint32_t ord, int64_t start, int64_t end, void *arg)
+{
+    return add_span(arg, ord, start, end);
+}
+
+/* Replay the whole log into fresh rollups and rename them over the old. */
+static int rebuild(struct tl *t)
+{
+    char from[4300], to[4300];
+    int rc = -1;
+
+    if (t->days >= 0)
+        close(t->days);
+    if (t->weeks >= 0)
+        close(t->weeks);
+    if (open_rollups(t, ".tmp") != 0 || replay(t, rebuild_one, t) != 0)
+        goto out;
+    snprintf(from, sizeof(from), "%s/days.tmp", t->dir);
+    snprintf(to, sizeof(to), "%s/days", t->dir);
+    if (rename(from, to) != 0)
+        goto out;
+    snprintf(from, sizeof(from), "%s/weeks.tmp", t->dir);
+    snprintf(to, sizeof(to), "%s/weeks", t->dir);
+    if (rename(from, to) != 0)
+        goto out;
+    t->h.rolling = 0;
+    rc = pwrite(t->fd, &t->h, sizeof(t->h), 0) == sizeof(t->h) ? 0 : -1;
+out:
+    if (t->days >= 0)
+        close(t->days);
+    if (t->weeks >= 0)
+        close(t->weeks);
+    t->days = t->weeks = -1;
+    return rc;
+}
+
+int timelog_rebuild(const char *state_dir)
+{
+    struct tl t;
+    int rc = -1;
+
+    if (tl_open(&t, state_dir, time(NULL)) == 0)
+        rc = rebuild(&t);
+    tl_close(&t);
+    return rc;
+}
+
+struct weekly {
+    uint64_t *seconds;      /* by week */
+    uint32_t nweeks;
+};
+
+static int weekly_one(uint32_t ord, int64_t start, int64_t end, void *arg)
+{
+    struct weekly *w = arg;
+
+    (void)ord;
+    if (end > start + TIME_SESSION_MAX)
+        end = start + TIME_SESSION_MAX;
+    while (start < end) {
+        int64_t stop = next_midnight(start);
+        uint32_t week = time_week(time_day(start));
+
+        if (stop > end || stop <= start)
+            stop = end;
+        if (week < w->nweeks)
+            w->seconds[week] += stop - start;
+        start = stop;
+    }
+    return 0;
+}
+
+/* bench time [sessions]: weekly totals from the rollups against a log replay */
+int timelog_bench(int argc, char *argv[])
+{
+    long sessions = argc > 0 ? strtol(argv[0], NULL, 10) : 100000;
+    char root[256], path[320];
+    struct weekly a, b;
+    struct timespec t0;
+    struct time_row *rows;
+    struct stat st;
+    struct tl t;
+    uint64_t seed = 11;
+    int64_t now;
+    size_t n, i;
+    double load_ms, rollup_ms, replay_ms;
+    long s;
+
+    if (sessions <= 0)
+        sessions = 100000;
+    if (bench_tmpdir(root, sizeof(root), "time") != 0)
+        return 1;
+    /* Years of working days: a handful of tickets a day, minutes to hours each. */
+    now = time(NULL) - sessions * 3600LL * 24 / 20;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (s = 0; s < sessions; s++) {
+        now += 60 * (10 + bench_rnd(&seed) % 240);
+        if (timelog_enter(root, bench_rnd(&seed) % 2000, now) != 0)
+            break;
+        if (bench_rnd(&seed) % 4 == 0) {
+            now += 60 * (5 + bench_rnd(&seed) % 120);
+            timelog_leave(root, now);
+        }
+    }
+    timelog_leave(root, now + 600);
+    load_ms = bench_ms_since(&t0);
+    snprintf(path, sizeof(path), "%s/time/log", root);
+    stat(path, &st);
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.nweeks = b.nweeks = time_week(time_day(now)) + 2;
+    a.seconds = calloc(a.nweeks, sizeof(*a.seconds));
+    b.seconds = calloc(b.nweeks, sizeof(*b.seconds));
+    if (!a.seconds || !b.seconds)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (timelog_rollup(root, TIME_WEEK, 0, UINT32_MAX, &rows, &n) == 0) {
+        for (i = 0; i < n; i++)
+            if (rows[i].period < a.nweeks)
+                a.seconds[rows[i].period] += rows[i].seconds;
+        free(rows);
+    }
+    rollup_ms = bench_ms_since(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (tl_open(&t, root, now) == 0)
+        replay(&t, weekly_one, &b);
+    tl_close(&t);
+    replay_ms = bench_ms_since(&t0);
+
+    printf("%ld sessions logged in %.0f ms; log %lld bytes (%.1f per session), %zu week rows\n",
+           s, load_ms, (long long)st.st_size, (double)st.st_size / (s ? s : 1), n);
+    printf("weekly report: rollups %.2f ms, replaying the log %.2f ms (%.0fx), %s\n",
+           rollup_ms, replay_ms, replay_ms / (rollup_ms > 0 ? rollup_ms : 1e-3),
+           memcmp(a.seconds, b.seconds, a.nweeks * sizeof(*a.seconds)) ? "MISMATCH"
+                                                                        : "same totals");
+    free(a.seconds);
+    free(b.seconds);
+    bench_rmtree(root);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef TIMELOG_H
+#define TIMELOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Time spent per ticket. Opening a ticket enters it; opening another, or
+ * 'leave', leaves it. Events go to <state>/time/log as varints: the
+ * seconds since the previous event, then the ticket ordinal + 1 (0 for a
+ * leave), so a session costs about four bytes. The header holds the time
+ * of the last event and the session still open, and is rewritten after
+ * each append, so a torn append is never seen.
+ *
+ * Each closed session is split at local midnight and added to two
+ * rollups, <state>/time/days and <state>/time/weeks: rows of
+ * (period, ordinal, seconds) in period order. Sessions only ever close at
+ * the tail of time, so an update touches the last few rows, and reports
+ * read the rollups without replaying the log. The log is written first;
+ * the header flags a session not yet rolled up, and if a crash leaves the
+ * flag set the next update rebuilds the rollups from the log. A session
+ * is cut off after TIME_SESSION_MAX seconds, for the day the leave was
+ * forgotten.
+ */
+
+#define TIME_SESSION_MAX (4 * 3600)
+
+enum { TIME_DAY, TIME_WEEK };
+
+struct time_row {
+    uint32_t period;        /* local days since the epoch, or weeks (Monday first) */
+    uint32_t ord;
+    uint64_t seconds;
+};
+
+int timelog_enter(const char *state_dir, uint32_t ord, int64_t now);
+int timelog_leave(const char *state_dir, int64_t now);
+/* The session in progress; *ord is TICKET_NONE when there is none. */
+int timelog_current(const char *state_dir, uint32_t *ord, int64_t *since);
+
+/* Rollup rows with from <= period <= to, oldest first; free *rows. */
+int timelog_rollup(const char *state_dir, int kind, uint32_t from, uint32_t to,
+                   struct time_row **rows, size_t *n);
+/* Rebuild both rollups by replaying the log. */
+int timelog_rebuild(const char *state_dir);
+
+uint32_t time_day(int64_t t);
+uint32_t time_week(uint32_t day);
+/* First day of a week. */
+uint32_t time_week_day(uint32_t week);
+
+int timelog_bench(int argc, char *argv[]);
+
+#endif
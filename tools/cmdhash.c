@@ -0,0 +1,82 @@
+/*
+ * Generate cmdtab.h from commands.def: find a seed for cmd_hash() under
+ * which every command lands in its own slot of a power-of-two table at
+ * least twice the number of commands.
+ *
+ *   cc -O2 -o cmdhash tools/cmdhash.c && ./cmdhash commands.def > cmdtab.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cmd.h"
+
+#define MAX_COMMANDS 120
+
+int main(int argc, char *argv[])
+{
+    char line[256], names[MAX_COMMANDS][32];
+    signed char slots[4 * MAX_COMMANDS];
+    uint32_t seed, size = 8;
+    int n = 0, i;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s commands.def > cmdtab.h\n", argv[0]);
+        return 1;
+    }
+    f = fopen(argv[1], "r");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line, *end;
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (strncmp(p, "CMD(", 4) != 0)
+            continue;
+        p += 4;
+        end = strchr(p, ',');
+        if (!end || end - p >= (long)sizeof(names[0]) || n == MAX_COMMANDS) {
+            fprintf(stderr, "%s: bad or too many entries\n", argv[1]);
+            return 1;
+        }
+        memcpy(names[n], p, end - p);
+        names[n][end - p] = '\0';
+        n++;
+    }
+    fclose(f);
+    while (size < 2u * n)
+        size *= 2;
+
+    for (seed = 1; seed != 0; seed++) {
+        memset(slots, -1, size);
+        for (i = 0; i < n; i++) {
+            uint32_t s = cmd_hash(names[i], seed) & (size - 1);
+
+            if (slots[s] >= 0)
+                break;
+            slots[s] = (signed char)i;
+        }
+        if (i == n)
+            break;
+    }
+    if (seed == 0) {
+        fprintf(stderr, "no perfect seed for %d commands in %u slots\n", n, size);
+        return 1;
+    }
+
+    printf("/* Generated by tools/cmdhash.c from %s; do not edit. */\n", argv[1]);
+    printf("#ifndef CMDTAB_H\n#define CMDTAB_H\n\n");
+    printf("#define CMDTAB_COUNT %d\n", n);
+    printf("#define CMDTAB_SIZE %u\n", size);
+    printf("#define CMDTAB_SEED %uu\n\n", seed);
+    printf("/* Slot -> position in %s, or -1. */\n", argv[1]);
+    printf("static const signed char cmdtab_slots[CMDTAB_SIZE] = {");
+    for (i = 0; i < (int)size; i++)
+        printf("%s%d,", i % 16 ? " " : "\n    ", slots[i]);
+    printf("\n};\n\n#endif\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef VIEWS_H
+#define VIEWS_H
+
+#include <stdint.h>
+
+/*
+ * Browsable views of the ticket folders as symlink trees under
+ * <base>/.views (hidden, so scans of the base skip it):
+ *
+ *   by-date/2026-10/INC0001       month the ticket was created
+ *   by-tag/vpn/INC0001            every tag except customer:X
+ *   by-customer/acme/INC0001      from customer:acme tags
+ *
+ * Links are relative (../../../INC0001), so the trees survive the base
+ * moving. Only tickets whose folder is in the base are linked; the
+ * redirect a merge leaves behind is not.
+ *
+ * The trees follow the journal: <state>/views.cursor holds the journal
+ * position they reflect, and an update reads the records past it and
+ * re-links only the tickets they name, so it costs O(changed tickets).
+ * When the trees or the cursor are missing they are rebuilt from the
+ * registry and tag bitmaps on a thread pool into a fresh directory that
+ * is renamed into place.
+ */
+
+#define VIEWS_DIR ".views"
+
+struct views_stats {
+    uint64_t events, tickets;   /* journal records read, tickets re-linked */
+    uint64_t links;             /* links made */
+    int rebuilt;
+    double ms;
+};
+
+/* Bring the views up to date, rebuilding them if missing or if rebuild is set. */
+int views_update(const char *base, const char *state_dir, int rebuild,
+                 struct views_stats *st);
+
+int views_bench(int argc, char *argv[]);
+
+#endif
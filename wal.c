@@ -0,0 +1,220 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WAL_MAGIC "TFSWAL1"
+
+struct wal_header {
+    char magic[8];
+    uint64_t base;
+    uint64_t reserved[2];
+};
+
+static uint32_t crc_table[8][256];
+
+static void crc_init(void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+                              crc_table[0][crc_table[j - 1][i] & 0xff];
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t n)
+{
+    static int ready;
+    const unsigned char *p = data;
+
+    if (!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        crc_init();
+        __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+    }
+    crc = ~crc;
+    while (n >= 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^
+              crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff] ^
+              crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^
+              crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+int wal_create(const char *path, uint64_t base)
+{
+    struct wal_header h;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, WAL_MAGIC, sizeof(h.magic));
+    h.base = base;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write(fd, &h, sizeof(h)) != sizeof(h) || fsync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+int wal_open_read(const char *path, uint64_t *base)
+{
+    struct wal_header h;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, WAL_MAGIC, sizeof(h.magic)) != 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    *base = h.base;
+    return fd;
+}
+
+int64_t wal_replay(int fd, uint64_t *pos, uint64_t *seq, uint64_t limit,
+                   wal_fn fn, void *arg)
+{
+    unsigned char buf[64 * 1024];
+    uint64_t off = *pos, end = limit;
+    size_t have = 0, used = 0;
+    int64_t applied = 0;
+
+    if (end == 0) {
+        struct stat st;
+
+        if (fstat(fd, &st) != 0)
+            return -1;
+        end = st.st_size;
+    }
+    while (off < end) {
+        unsigned char *r;
+        uint32_t crc;
+        uint16_t len;
+        uint64_t rseq;
+
+        if (have - used < WAL_RECORD_HEADER + WAL_MAX_PAYLOAD && off + (have - used) < end) {
+            ssize_t got;
+            size_t want;
+
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            used = 0;
+            want = sizeof(buf) - have;
+            if (want > end - off - have)
+                want = end - off - have;
+            got = pread(fd, buf + have, want, off + have);
+            if (got < 0)
+                return -1;
+            have += got;
+        }
+        if (have - used < WAL_RECORD_HEADER)
+            break;
+        r = buf + used;
+        memcpy(&crc, r, 4);
+        memcpy(&len, r + 4, 2);
+        memcpy(&rseq, r + 8, 8);
+        if (len > WAL_MAX_PAYLOAD || have - used < WAL_RECORD_HEADER + (size_t)len)
+            break;
+        if (crc32c(0, r + 4, WAL_RECORD_HEADER - 4 + len) != crc || rseq != *seq)
+            break;
+        if (fn && fn(r[6], r + WAL_RECORD_HEADER, len, arg) != 0)
+            break;
+        used += WAL_RECORD_HEADER + len;
+        off += WAL_RECORD_HEADER + len;
+        (*seq)++;
+        applied++;
+    }
+    *pos = off;
+    return applied;
+}
+
+int wal_open(struct wal *w, const char *path)
+{
+    struct stat st;
+
+    memset(w, 0, sizeof(*w));
+    w->fd = wal_open_read(path, &w->base);
+    if (w->fd < 0)
+        return -1;
+    close(w->fd);
+    w->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (w->fd < 0)
+        return -1;
+    w->len = WAL_HEADER;
+    w->seq = 0;
+    if (wal_replay(w->fd, &w->len, &w->seq, 0, NULL, NULL) < 0)
+        goto fail;
+    w->records = w->seq;
+    /* Cut a torn or corrupt tail so new records follow the last good one. */
+    if (fstat(w->fd, &st) != 0)
+        goto fail;
+    if ((uint64_t)st.st_size != w->len &&
+        (ftruncate(w->fd, w->len) != 0 || fdatasync(w->fd) != 0))
+        goto fail;
+    return 0;
+
+fail:
+    close(w->fd);
+    w->fd = -1;
+    return -1;
+}
+
+void wal_close(struct wal *w)
+{
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+}
+
+int wal_append(struct wal *w, uint8_t type, const void *data, uint16_t len)
+{
+    unsigned char rec[WAL_RECORD_HEADER + WAL_MAX_PAYLOAD];
+    uint32_t crc;
+
+    if (len > WAL_MAX_PAYLOAD)
+        return -1;
+    memset(rec, 0, WAL_RECORD_HEADER);
+    memcpy(rec + 4, &len, 2);
+    rec[6] = type;
+    memcpy(rec + 8, &w->seq, 8);
+    memcpy(rec + WAL_RECORD_HEADER, data, len);
+    crc = crc32c(0, rec + 4, WAL_RECORD_HEADER - 4 + len);
+    memcpy(rec, &crc, 4);
+    if (pwrite(w->fd, rec, WAL_RECORD_HEADER + len, w->len) !=
+        (ssize_t)(WAL_RECORD_HEADER + len))
+        return -1;
+    w->len += WAL_RECORD_HEADER + len;
+    w->seq++;
+    w->records++;
+    return 0;
+}
+
+int wal_sync(struct wal *w)
+{
+    return fdatasync(w->fd);
+}
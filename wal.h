@@ -0,0 +1,55 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Append-only log of checksummed records. Each record is
+ *
+ *   u32 crc32c | u16 len | u8 type | u8 reserved | u64 seq | len bytes
+ *
+ * with the checksum covering everything after itself. A log starts with a
+ * WAL_HEADER-byte header naming the base (e.g. the image generation) the
+ * records apply on top of. Scanning stops at the first record that is
+ * short, fails its checksum or breaks the sequence, which is where a crash
+ * mid-append leaves the tail.
+ */
+
+#define WAL_HEADER 32
+#define WAL_RECORD_HEADER 16
+#define WAL_MAX_PAYLOAD 4096
+
+struct wal {
+    int fd;
+    uint64_t base;
+    uint64_t len;           /* bytes of valid log, header included */
+    uint64_t seq;           /* next sequence number */
+    uint64_t records;
+};
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t n);
+
+/* Write an empty log with the given base to path (no rename). */
+int wal_create(const char *path, uint64_t base);
+/* Open for appending; validates the tail and cuts off anything torn. */
+int wal_open(struct wal *w, const char *path);
+void wal_close(struct wal *w);
+int wal_append(struct wal *w, uint8_t type, const void *data, uint16_t len);
+/* fdatasync everything appended so far. */
+int wal_sync(struct wal *w);
+
+/* Read-only header check; returns the fd or -1. */
+int wal_open_read(const char *path, uint64_t *base);
+
+typedef int (*wal_fn)(uint8_t type, const void *data, size_t len, void *arg);
+
+/*
+ * Apply records between offset *pos and limit (0 for end of file), starting
+ * at sequence *seq. Advances *pos and *seq past every valid record; returns
+ * the number applied or -1 on I/O error.
+ */
+int64_t wal_replay(int fd, uint64_t *pos, uint64_t *seq, uint64_t limit,
+                   wal_fn fn, void *arg);
+
+#endif